@@ -6,24 +6,843 @@
  * Notes:
  *  - Uses C89-compatible declarations (no 'for (int i=...)' or mixed declarations)
  *  - Delay uses simple busy loops (adjust inner count to tune timing)
+ *  - Host (POSIX) builds get extra simulation services; Keil builds skip them
+ *
+ * Optional build flags:
+ *  - METRICS_HTTP        serve /metrics (Prometheus text) from a host thread;
+ *                        link with -lpthread. METRICS_UNIX_PATH selects a
+ *                        Unix socket instead of 127.0.0.1:METRICS_HTTP_PORT
+ *  - FP_CONTROLLER_MATCH match fingerprints on the controller (fixed-point,
+ *                        FPU-free) instead of on the sensor module; the
+ *                        gallery is kept in a template EEPROM, reloaded
+ *                        at start-up, and 1:N search covers only the
+ *                        users of the door's zone (DOOR_ZONE)
+ *  - FP_SLOT_CACHE       treat the sensor module's template slots as an LRU
+ *                        cache over the controller gallery
+ *  - RFID_WIEGAND        read cards from Wiegand D0/D1 readers (timer
+ *                        capture ISR + deferred decoder) instead of UART
+ *  - RFID_OSDP           read cards from OSDP readers multi-dropped on an
+ *                        RS-485 bus (UART1) instead of UART
+ *  - TOKEN_AUTH          also accept Ed25519-signed tokens (QR / mobile,
+ *                        relayed on UART0) as the first factor; needs
+ *                        TOKEN_ISSUER_KEY=0x..,0x.. (the issuer's 32-byte
+ *                        public key)
+ *  - MGMT_UART           binary management protocol on UART0 (passwords,
+ *                        enrollment, access log), served in the background;
+ *                        needs MGMT_KEY=0x..,0x.. (16-byte channel base key)
+ *  - FW_UPDATE           signed delta firmware updates over the management
+ *                        link into the inactive A/B flash bank (implies
+ *                        MGMT_UART); needs FW_VENDOR_KEY=0x..,0x.. (the
+ *                        vendor's 32-byte release signing public key)
+ *  - USER_FLASH          user table in internal flash, read in place;
+ *                        changes are written out between sessions
+ *  - CARD_MPH="file.h"   resolve cards through a minimal perfect hash
+ *                        generated by the cardmph tool (flash-resident)
+ *  - DOOR_POLICY=1       DOOR_POLICY_CONCURRENT: take PIN and finger in
+ *                        either order, both devices live after the card
+ *  - HOST_TOOLS          build the host command-line tools (benchmarks,
+ *                        generators, emulators) instead of the door loop;
+ *                        link with -lm
  */
 
+#if defined(__unix__) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 600
+#endif
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__unix__)
+#define HOST_POSIX 1
+#include <time.h>
+#endif
+#if defined(FW_UPDATE) && !defined(MGMT_UART)
+#define MGMT_UART 1
+#endif
+#if defined(TOKEN_AUTH) && !defined(TOKEN_ISSUER_KEY)
+#error "TOKEN_AUTH needs the issuer public key: -DTOKEN_ISSUER_KEY=0x..,0x.. (32 bytes)"
+#endif
+#if defined(MGMT_UART) && !defined(MGMT_KEY)
+#error "MGMT_UART needs the management channel key: -DMGMT_KEY=0x..,0x.. (16 bytes)"
+#endif
+#if defined(FW_UPDATE) && !defined(HOST_TOOLS) && !defined(FW_VENDOR_KEY)
+#error "FW_UPDATE needs the vendor's release key: -DFW_VENDOR_KEY=0x..,0x.. (32 bytes)"
+#endif
+#if defined(HOST_POSIX) && defined(METRICS_HTTP)
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#if defined(HOST_TOOLS)
+#include <math.h>
+#endif
+#if defined(HOST_TOOLS)
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#if defined(HOST_TOOLS) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <wmmintrin.h>
+#define AES_HAVE_NI 1
+#endif
+#if defined(HOST_TOOLS) && defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define BENCH_HAVE_PERF 1
+#endif
+
+/* ========================= METRICS ========================= */
+
+/*
+ * Counters are sharded per execution context so writers never share a cache
+ * line: the door loop writes METRICS_SHARD_MAIN, the Wiegand capture ISR
+ * METRICS_SHARD_ISR, and the rest are free for host tool threads. Readers
+ * (the UART dump, the HTTP thread) sum the shards without stopping the
+ * writers. Each word has one writer and is read whole (aligned word loads
+ * do not tear on ARM7 or x86), so every value read is one the counter
+ * really held, but a scrape is not a snapshot: a grant can show up before
+ * its latency sample. Rates over successive scrapes come out right.
+ *
+ * Gauges are queue depths, read from the queue's own indices on scrape by
+ * the function its owner attached; queues not in the build are left out.
+ */
+#define METRICS_SHARDS 4
+#define METRICS_SHARD_MAIN 0
+#define METRICS_SHARD_ISR 1
+#define METRICS_CACHE_LINE 64
+#define DOOR_ID 0
+
+enum {
+    MET_GRANTS,
+    MET_DENY_RFID,
+    MET_DENY_CARD,
+    MET_DENY_PASSWORD,
+    MET_DENY_FP,
+    MET_DENY_TOKEN,
+    MET_EEPROM_READ_BYTES,
+    MET_EEPROM_WRITE_BYTES,
+    MET_FP_SLOT_HITS,
+    MET_FP_SLOT_MISSES,
+    MET_FP_SLOT_UPLOADS,
+    MET_WIEGAND_FRAMES,
+    MET_WIEGAND_ERRORS,
+    MET_WIEGAND_OVERRUNS,
+    MET_OSDP_POLLS,
+    MET_OSDP_TIMEOUTS,
+    MET_OSDP_BAD_FRAMES,
+    MET_TOKEN_VERIFIES,
+    MET_TOKEN_CACHE_HITS,
+    MET_MGMT_REQUESTS,
+    MET_MGMT_BAD_FRAMES,
+    MET_FLASH_ERASES,
+    MET_FLASH_PAGES,
+    MET_COUNTERS
+};
+
+enum {
+    MET_STAGE_RFID,
+    MET_STAGE_PASSWORD,
+    MET_STAGE_FP,
+    MET_STAGE_DOOR,
+    MET_STAGE_FACTORS,
+    MET_STAGE_TOKEN,
+    MET_STAGES
+};
+
+enum {
+    MET_GAUGE_MGMT_RX,
+    MET_GAUGE_MGMT_TX,
+    MET_GAUGE_WIEGAND_EDGES,
+    MET_GAUGE_WIEGAND_FRAMES,
+    MET_GAUGE_OSDP_PENDING,
+    MET_GAUGES
+};
+
+#define MET_LAT_BUCKETS 7
+
+typedef struct {
+    unsigned long counter[MET_COUNTERS];
+    unsigned long lat_bucket[MET_STAGES][MET_LAT_BUCKETS + 1];
+    unsigned long lat_sum_us[MET_STAGES];
+} metrics_shard_data;
+
+/* Round every shard up to whole cache lines */
+typedef union {
+    metrics_shard_data d;
+    unsigned char pad[((sizeof(metrics_shard_data) + METRICS_CACHE_LINE - 1) / METRICS_CACHE_LINE) * METRICS_CACHE_LINE];
+} metrics_shard;
+
+static metrics_shard metrics_shards[METRICS_SHARDS];
+
+/* Also handed every stage observation (the simulation's latency profile) */
+static void (*metrics_observe_hook)(int stage, unsigned long us);
+
+static unsigned long (*metrics_gauge_read[MET_GAUGES])(void);
+
+static const char *const metric_counter_name[MET_COUNTERS] = {
+    "access_grants_total",
+    "access_denials_total",
+    "access_denials_total",
+    "access_denials_total",
+    "access_denials_total",
+    "access_denials_total",
+    "eeprom_read_bytes_total",
+    "eeprom_write_bytes_total",
+    "fp_slot_cache_hits_total",
+    "fp_slot_cache_misses_total",
+    "fp_slot_uploads_total",
+    "wiegand_frames_total",
+    "wiegand_frame_errors_total",
+    "wiegand_ring_overruns_total",
+    "osdp_polls_total",
+    "osdp_reply_timeouts_total",
+    "osdp_bad_frames_total",
+    "token_signature_checks_total",
+    "token_cache_hits_total",
+    "mgmt_requests_total",
+    "mgmt_bad_frames_total",
+    "flash_sector_erases_total",
+    "flash_page_programs_total"
+};
+static const char *const metric_counter_help[MET_COUNTERS] = {
+    "Doors opened after all factors passed.",
+    "Presentations rejected, by failing stage.",
+    0, 0, 0, 0,
+    "Bytes read from EEPROM.",
+    "Bytes written to EEPROM.",
+    "Verifications whose template was already in a sensor slot.",
+    "Verifications that had to upload the template first.",
+    "Templates uploaded into sensor slots.",
+    "Wiegand frames decoded with valid length and parity.",
+    "Wiegand frames rejected for length or parity.",
+    "Wiegand edges dropped because a reader ring was full.",
+    "OSDP polls sent on the reader bus.",
+    "OSDP commands that got no reply in time.",
+    "OSDP frames dropped for length, CRC or address.",
+    "Token signatures checked (a batch counts each token).",
+    "Tokens accepted from the verified-token cache without a signature check.",
+    "Management requests accepted on UART0.",
+    "Management frames dropped for length, CRC or seal.",
+    "Internal flash sectors erased through IAP.",
+    "Internal flash pages programmed through IAP."
+};
+/* door label is added for access_* metrics */
+static const char *const metric_counter_stage[MET_COUNTERS] = {
+    0, "rfid", "card", "password", "fingerprint", "token", 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+static const char *const metric_gauge_name[MET_GAUGES] = {
+    "mgmt_rx_ring_bytes",
+    "mgmt_tx_ring_bytes",
+    "wiegand_edge_ring_depth_max",
+    "wiegand_frame_queue_depth",
+    "osdp_commands_pending"
+};
+static const char *const metric_gauge_help[MET_GAUGES] = {
+    "Received management bytes not yet framed.",
+    "Management reply bytes not yet sent.",
+    "Edges waiting in the fullest Wiegand reader ring.",
+    "Decoded cards waiting for the door loop.",
+    "OSDP commands in flight or owed to readers (LED and buzzer output)."
+};
+static const char *const metric_stage_name[MET_STAGES] = {
+    "rfid", "password", "fingerprint", "door", "factors", "token"
+};
+static const unsigned long metric_lat_bounds_us[MET_LAT_BUCKETS] = {
+    100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 5000000UL, 20000000UL
+};
+
+void metrics_add_shard(int shard, int id, unsigned long n) {
+    metrics_shards[shard].d.counter[id] += n;
+}
+
+void metrics_add(int id, unsigned long n) {
+    metrics_add_shard(METRICS_SHARD_MAIN, id, n);
+}
+
+void metrics_observe_us(int stage, unsigned long us) {
+    metrics_shard_data *d;
+    int b;
+
+    d = &metrics_shards[METRICS_SHARD_MAIN].d;
+    for (b = 0; b < MET_LAT_BUCKETS && us > metric_lat_bounds_us[b]; b++) {
+        /* find first bucket holding us */
+    }
+    d->lat_bucket[stage][b]++;
+    d->lat_sum_us[stage] += us;
+    if (metrics_observe_hook) metrics_observe_hook(stage, us);
+}
+
+/* Owner of a queue: read its depth on every scrape */
+void metrics_gauge_attach(int id, unsigned long (*read)(void)) {
+    metrics_gauge_read[id] = read;
+}
+
+static unsigned long metrics_gauge(int id) {
+    return metrics_gauge_read[id] ? metrics_gauge_read[id]() : 0;
+}
+
+static unsigned long metrics_sum_counter(int id) {
+    unsigned long v;
+    int s;
+    v = 0;
+    for (s = 0; s < METRICS_SHARDS; s++) v += metrics_shards[s].d.counter[id];
+    return v;
+}
+
+static unsigned long metrics_sum_bucket(int stage, int b) {
+    unsigned long v;
+    int s;
+    v = 0;
+    for (s = 0; s < METRICS_SHARDS; s++) v += metrics_shards[s].d.lat_bucket[stage][b];
+    return v;
+}
+
+static unsigned long metrics_sum_latency(int stage) {
+    unsigned long v;
+    int s;
+    v = 0;
+    for (s = 0; s < METRICS_SHARDS; s++) v += metrics_shards[s].d.lat_sum_us[stage];
+    return v;
+}
+
+/* Append formatted text, tracking how much room is left */
+static unsigned int metrics_emit(char *out, unsigned int cap, unsigned int len, const char *line) {
+    unsigned int n;
+    n = (unsigned int)strlen(line);
+    if (len + n >= cap) return len;
+    memcpy(out + len, line, n);
+    out[len + n] = '\0';
+    return len + n;
+}
+
+/* Render all metrics in Prometheus text exposition format 0.0.4 */
+unsigned int metrics_format_prometheus(char *out, unsigned int cap) {
+    char line[160];
+    unsigned int len;
+    unsigned long cum;
+    int i, b;
+
+    len = 0;
+    if (cap == 0) return 0;
+    out[0] = '\0';
+    for (i = 0; i < MET_COUNTERS; i++) {
+        if (metric_counter_help[i]) {
+            sprintf(line, "# HELP %s %s\n# TYPE %s counter\n",
+                    metric_counter_name[i], metric_counter_help[i], metric_counter_name[i]);
+            len = metrics_emit(out, cap, len, line);
+        }
+        if (metric_counter_stage[i]) {
+            sprintf(line, "%s{door=\"%d\",stage=\"%s\"} %lu\n", metric_counter_name[i],
+                    DOOR_ID, metric_counter_stage[i], metrics_sum_counter(i));
+        } else if (i == MET_GRANTS) {
+            sprintf(line, "%s{door=\"%d\"} %lu\n", metric_counter_name[i], DOOR_ID, metrics_sum_counter(i));
+        } else {
+            sprintf(line, "%s %lu\n", metric_counter_name[i], metrics_sum_counter(i));
+        }
+        len = metrics_emit(out, cap, len, line);
+    }
+    for (i = 0; i < MET_GAUGES; i++) {
+        if (!metrics_gauge_read[i]) continue;
+        sprintf(line, "# HELP %s %s\n# TYPE %s gauge\n%s %lu\n", metric_gauge_name[i], metric_gauge_help[i],
+                metric_gauge_name[i], metric_gauge_name[i], metrics_gauge(i));
+        len = metrics_emit(out, cap, len, line);
+    }
+
+    len = metrics_emit(out, cap, len,
+                       "# HELP access_stage_latency_us Time spent in each authentication stage.\n"
+                       "# TYPE access_stage_latency_us histogram\n");
+    for (i = 0; i < MET_STAGES; i++) {
+        cum = 0;
+        for (b = 0; b < MET_LAT_BUCKETS; b++) {
+            cum += metrics_sum_bucket(i, b);
+            sprintf(line, "access_stage_latency_us_bucket{stage=\"%s\",le=\"%lu\"} %lu\n",
+                    metric_stage_name[i], metric_lat_bounds_us[b], cum);
+            len = metrics_emit(out, cap, len, line);
+        }
+        cum += metrics_sum_bucket(i, MET_LAT_BUCKETS);
+        sprintf(line, "access_stage_latency_us_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n",
+                metric_stage_name[i], cum);
+        len = metrics_emit(out, cap, len, line);
+        sprintf(line, "access_stage_latency_us_sum{stage=\"%s\"} %lu\n",
+                metric_stage_name[i], metrics_sum_latency(i));
+        len = metrics_emit(out, cap, len, line);
+        sprintf(line, "access_stage_latency_us_count{stage=\"%s\"} %lu\n", metric_stage_name[i], cum);
+        len = metrics_emit(out, cap, len, line);
+    }
+    return len;
+}
+
+static unsigned int metrics_put_varint(unsigned char *out, unsigned int pos, unsigned long v) {
+    while (v >= 0x80) {
+        out[pos++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[pos++] = (unsigned char)v;
+    return pos;
+}
+
+/*
+ * Compact binary dump for UART: 'M' '2' <counters> <stages> <buckets> <gauges>,
+ * then LEB128 counters, per stage the bucket counts (incl. +Inf) and the sum,
+ * then the gauges (0 for a queue not in the build). Worst case is 5 bytes
+ * per value; returns 0 if cap is too small.
+ */
+#define METRICS_DUMP_MAX (6 + 5 * (MET_COUNTERS + MET_STAGES * (MET_LAT_BUCKETS + 2) + MET_GAUGES))
+
+unsigned int metrics_dump_binary(unsigned char *out, unsigned int cap) {
+    unsigned int pos;
+    int i, b;
+
+    if (cap < METRICS_DUMP_MAX) return 0;
+    out[0] = 'M';
+    out[1] = '2';
+    out[2] = MET_COUNTERS;
+    out[3] = MET_STAGES;
+    out[4] = MET_LAT_BUCKETS + 1;
+    out[5] = MET_GAUGES;
+    pos = 6;
+    for (i = 0; i < MET_COUNTERS; i++) pos = metrics_put_varint(out, pos, metrics_sum_counter(i));
+    for (i = 0; i < MET_STAGES; i++) {
+        for (b = 0; b <= MET_LAT_BUCKETS; b++) pos = metrics_put_varint(out, pos, metrics_sum_bucket(i, b));
+        pos = metrics_put_varint(out, pos, metrics_sum_latency(i));
+    }
+    for (i = 0; i < MET_GAUGES; i++) pos = metrics_put_varint(out, pos, metrics_gauge(i));
+    return pos;
+}
+
+#if defined(HOST_POSIX) && defined(METRICS_HTTP)
+#ifndef METRICS_HTTP_PORT
+#define METRICS_HTTP_PORT 9101
+#endif
+#define METRICS_TEXT_MAX 8192
+
+static int metrics_listen_fd = -1;
+
+/* Tiny HTTP/1.0 responder: every request gets the current metrics page */
+static void *metrics_server_thread(void *arg) {
+    static char body[METRICS_TEXT_MAX];
+    char req[512];
+    char hdr[160];
+    unsigned int len;
+    int fd;
+
+    (void)arg;
+    for (;;) {
+        fd = accept(metrics_listen_fd, 0, 0);
+        if (fd < 0) continue;
+        (void)read(fd, req, sizeof(req));
+        len = metrics_format_prometheus(body, sizeof(body));
+        sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %u\r\nConnection: close\r\n\r\n", len);
+        (void)write(fd, hdr, strlen(hdr));
+        (void)write(fd, body, len);
+        close(fd);
+    }
+    return 0;
+}
+
+int metrics_server_start(void) {
+    pthread_t tid;
+#if defined(METRICS_UNIX_PATH)
+    struct sockaddr_un sa;
+
+    metrics_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (metrics_listen_fd < 0) return -1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, METRICS_UNIX_PATH, sizeof(sa.sun_path) - 1);
+    unlink(sa.sun_path);
+#else
+    struct sockaddr_in sa;
+    int one;
+
+    metrics_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_listen_fd < 0) return -1;
+    one = 1;
+    setsockopt(metrics_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(METRICS_HTTP_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#endif
+    if (bind(metrics_listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        listen(metrics_listen_fd, 4) != 0) {
+        close(metrics_listen_fd);
+        metrics_listen_fd = -1;
+        return -1;
+    }
+    if (pthread_create(&tid, 0, metrics_server_thread, 0) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
+#endif
+
+/* ========================= SIMULATION LATENCY PROFILE ========================= */
+
+/*
+ * MLSAS_PROFILE=file (or @lpc2124 for the built-in datasheet figures)
+ * makes each stub take the time its part would: one draw from the op's
+ * distribution, in microseconds, per call or per byte. Profile lines:
+ *
+ *   <op> fixed <us>
+ *   <op> uniform <lo> <hi>
+ *   <op> normal <mean> <sd>              (clamped at 0)
+ *   <op> quantiles <q0> <q1> ... <qn>    (2 to 9 evenly spaced points)
+ *
+ * and '#' comments. Ops not listed take no time. The time goes onto a
+ * virtual clock that timer_now_us adds in, so the stage latencies in the
+ * metrics are the ones the hardware would show. A replay runs its delays
+ * on that clock instead of skipping them, and ends with stage percentiles
+ * and back-to-back sessions per hour.
+ */
+enum {
+    PROF_LCD_CLEAR,
+    PROF_LCD_CHAR,
+    PROF_KEYPAD_KEY,
+    PROF_EEPROM_BYTE,
+    PROF_EEPROM_WRITE,
+    PROF_UART_BYTE,
+    PROF_RFID_FRAME,
+    PROF_FP_CAPTURE,
+    PROF_FP_SEARCH,
+    PROF_FP_VERIFY,
+    PROF_FP_UPLOAD_BYTE,
+    PROF_MOTOR_TRAVEL,
+    PROF_OPS
+};
+
+#define PROF_FIXED 1
+#define PROF_UNIFORM 2
+#define PROF_NORMAL 3
+#define PROF_QUANTILES 4
+#define PROF_POINTS 9
+#define PROF_SAMPLES 4096
+#define PROF_EEPROM_PAGE 32
+
+#if defined(HOST_POSIX)
+typedef struct {
+    int kind;
+    int n;
+    double v[PROF_POINTS];
+} prof_dist;
+
+static const char *const prof_op_name[PROF_OPS] = {
+    "lcd_clear", "lcd_char", "keypad_key", "eeprom_byte", "eeprom_write", "uart_byte",
+    "rfid_frame", "fp_capture", "fp_search", "fp_verify", "fp_upload_byte", "motor_travel"
+};
+
+static const char *const prof_lpc2124[] = {
+    "# HD44780: clear 1.52 ms at 270 kHz, 37 us per character plus the 4-bit bus transfer",
+    "lcd_clear fixed 1640",
+    "lcd_char uniform 40 50",
+    "# 24LC32 at 400 kHz, 9 clocks per byte; page write cycle 5 ms max",
+    "eeprom_byte fixed 22.5",
+    "eeprom_write uniform 2000 5000",
+    "# UART0 at 9600 baud, 8N1",
+    "uart_byte fixed 1042",
+    "# EM4100 frame at 125 kHz (64 bits, 32 ms), then 14 ASCII bytes at 9600 baud",
+    "rfid_frame uniform 45000 80000",
+    "# R307 module: image capture, 1:N over 1000 templates, 1:1 on one slot, upload at 57600 baud",
+    "fp_capture quantiles 280000 320000 380000 500000 900000",
+    "fp_search quantiles 60000 150000 300000 450000 800000",
+    "fp_verify normal 40000 8000",
+    "fp_upload_byte fixed 174",
+    "# strike motor, end stop to end stop",
+    "motor_travel normal 1200000 150000",
+    "# a person keying a PIN",
+    "keypad_key quantiles 180000 250000 350000 600000 1500000",
+    0
+};
+
+static prof_dist prof_table[PROF_OPS];
+static int prof_active;
+static unsigned long prof_virtual_us;
+static unsigned long prof_rng = 2463534242UL;
+static double prof_started_us;
+static unsigned long prof_samples[MET_STAGES][PROF_SAMPLES];
+static int prof_nsamples[MET_STAGES];
+
+static double prof_host_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* xorshift32 in [0, 1) */
+static double prof_uniform(void) {
+    prof_rng ^= (prof_rng << 13) & 0xFFFFFFFFUL;
+    prof_rng ^= prof_rng >> 17;
+    prof_rng ^= (prof_rng << 5) & 0xFFFFFFFFUL;
+    return (double)(prof_rng & 0xFFFFFFFFUL) / 4294967296.0;
+}
+
+static double prof_draw(const prof_dist *d) {
+    double u, x;
+    int i;
+    switch (d->kind) {
+    case PROF_FIXED:
+        return d->v[0];
+    case PROF_UNIFORM:
+        return d->v[0] + (d->v[1] - d->v[0]) * prof_uniform();
+    case PROF_NORMAL:
+        /* twelve uniforms less 6 are close enough to a unit normal, and need no libm */
+        x = -6.0;
+        for (i = 0; i < 12; i++) x += prof_uniform();
+        x = d->v[0] + d->v[1] * x;
+        return x > 0.0 ? x : 0.0;
+    case PROF_QUANTILES:
+        u = prof_uniform() * (d->n - 1);
+        i = (int)u;
+        return d->v[i] + (d->v[i + 1] - d->v[i]) * (u - i);
+    }
+    return 0.0;
+}
+
+/* One profile line into prof_table; 0 if it was fine or blank */
+static int prof_parse_line(char *line) {
+    static const char *const kinds[5] = { "", "fixed", "uniform", "normal", "quantiles" };
+    static const int min_n[5] = { 0, 1, 2, 2, 2 };
+    static const int max_n[5] = { 0, 1, 2, 2, PROF_POINTS };
+    char name[32], kind[16], *p;
+    prof_dist d;
+    int op, k, off, used;
+
+    p = strchr(line, '#');
+    if (p) *p = '\0';
+    if (sscanf(line, "%31s", name) != 1) return 0;
+    if (sscanf(line, "%31s %15s%n", name, kind, &off) != 2) return -1;
+    for (op = 0; op < PROF_OPS && strcmp(name, prof_op_name[op]) != 0; op++) {
+    }
+    memset(&d, 0, sizeof(d));
+    for (d.kind = 1; d.kind < 5 && strcmp(kind, kinds[d.kind]) != 0; d.kind++) {
+    }
+    if (op == PROF_OPS || d.kind == 5) return -1;
+    for (p = line + off; d.n < PROF_POINTS && sscanf(p, "%lf%n", &d.v[d.n], &used) == 1; p += used) d.n++;
+    if (sscanf(p, "%15s", kind) == 1 || d.n < min_n[d.kind] || d.n > max_n[d.kind]) return -1;
+    for (k = 0; k < d.n; k++) {
+        if (d.v[k] < 0.0) return -1;
+        if (k > 0 && d.kind != PROF_NORMAL && d.v[k] < d.v[k - 1]) return -1;
+    }
+    prof_table[op] = d;
+    return 0;
+}
+
+static void prof_observe(int stage, unsigned long us) {
+    if (prof_nsamples[stage] < PROF_SAMPLES) prof_samples[stage][prof_nsamples[stage]++] = us;
+}
+
+/* Load a profile file, or the built-in one named @lpc2124; 0 on success */
+int prof_load(const char *path) {
+    char line[256];
+    FILE *f;
+    int lineno, bad;
+
+    memset(prof_table, 0, sizeof(prof_table));
+    lineno = bad = 0;
+    if (strcmp(path, "@lpc2124") == 0) {
+        for (lineno = 0; prof_lpc2124[lineno]; lineno++) {
+            sprintf(line, "%.*s", (int)sizeof(line) - 1, prof_lpc2124[lineno]);
+            bad |= prof_parse_line(line) != 0;
+        }
+    } else {
+        f = fopen(path, "r");
+        if (!f) return -1;
+        while (fgets(line, sizeof(line), f)) {
+            lineno++;
+            if (prof_parse_line(line) == 0) continue;
+            fprintf(stderr, "%s:%d: bad profile line\n", path, lineno);
+            bad = 1;
+        }
+        fclose(f);
+    }
+    if (bad) return -1;
+    prof_active = 1;
+    prof_started_us = prof_host_us();
+    metrics_observe_hook = prof_observe;
+    return 0;
+}
+
+static int prof_cmp_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sessions per hour and stage percentiles over the run so far */
+static void prof_report(unsigned long sessions) {
+    double elapsed_us;
+    int s, n;
+
+    if (!prof_active) return;
+    elapsed_us = prof_host_us() - prof_started_us + (double)prof_virtual_us;
+    printf("[PROFILE] %lu presentations in %.1f s on the profile's clock: %.0f per hour back to back\n", sessions,
+           elapsed_us / 1e6, elapsed_us > 0.0 ? sessions * 3.6e9 / elapsed_us : 0.0);
+    for (s = 0; s < MET_STAGES; s++) {
+        n = prof_nsamples[s];
+        if (n == 0) continue;
+        qsort(prof_samples[s], (size_t)n, sizeof(unsigned long), prof_cmp_ulong);
+        printf("[PROFILE] %-12s n=%-5d p50 %8.1f ms  p99 %8.1f ms  max %8.1f ms\n", metric_stage_name[s], n,
+               prof_samples[s][n / 2] / 1e3, prof_samples[s][n * 99 / 100] / 1e3, prof_samples[s][n - 1] / 1e3);
+    }
+}
+#endif
+
+/* Charge n times one draw of op to the profile's clock */
+static void stub_cost(int op, unsigned long n) {
+#if defined(HOST_POSIX)
+    if (!prof_active || prof_table[op].kind == 0 || n == 0) return;
+    prof_virtual_us += (unsigned long)(prof_draw(&prof_table[op]) * (double)n + 0.5);
+#else
+    (void)op;
+    (void)n;
+#endif
+}
+
+/* ========================= SIMULATION REPLAY ========================= */
+
+/*
+ * Host builds can feed the peripheral stubs from a recorded trace instead of
+ * stdin (MLSAS_REPLAY=trace.txt). Trace lines:
+ *   P <uid> <password>                                  provision EEPROM
+ *   E <t_ms> <door> <card> <n> <pin>... <m> <fp>...     one presentation
+ * The stubs hand out the card, then each PIN attempt, then each finger
+ * result (1/0) of the current event; delays are skipped while replaying
+ * unless a latency profile is loaded. Gallery builds also enroll each
+ * provisioned user's finger, as the management link would.
+ */
+#if defined(HOST_POSIX)
+#define REPLAY_MAX_ATTEMPTS 3
+#define REPLAY_FIELD_LEN 16
+#define REPLAY_CARD_LEN 160     /* room for a T<hex> signed token */
+
+typedef struct {
+    unsigned long t_ms;
+    int door;
+    char card[REPLAY_CARD_LEN];
+    int n_pin;
+    char pin[REPLAY_MAX_ATTEMPTS][REPLAY_FIELD_LEN];
+    int n_fp;
+    unsigned char fp[REPLAY_MAX_ATTEMPTS];
+} replay_event;
+
+static FILE *replay_file;
+static replay_event replay_cur;
+static int replay_pin_next;
+static int replay_fp_next;
+static unsigned long replay_count;
+static int replay_held;         /* current event loaded but not yet presented */
+
+/* Copy one whitespace-separated token, bounded; returns the rest of the line */
+static char *replay_token(char *p, char *out, int cap) {
+    int n;
+    while (*p == ' ' || *p == '\t') p++;
+    n = 0;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+        if (n < cap - 1) out[n++] = *p;
+        p++;
+    }
+    out[n] = '\0';
+    return p;
+}
+
+/* Parse an 'E' line body into ev; 0 on success */
+int replay_parse_event(char *p, replay_event *ev) {
+    char tok[REPLAY_FIELD_LEN];
+    int k;
+
+    memset(ev, 0, sizeof(*ev));
+    p = replay_token(p, tok, sizeof(tok));
+    ev->t_ms = strtoul(tok, 0, 10);
+    p = replay_token(p, tok, sizeof(tok));
+    ev->door = atoi(tok);
+    p = replay_token(p, ev->card, sizeof(ev->card));
+    p = replay_token(p, tok, sizeof(tok));
+    ev->n_pin = atoi(tok);
+    if (ev->card[0] == '\0' || ev->n_pin < 0 || ev->n_pin > REPLAY_MAX_ATTEMPTS) return -1;
+    for (k = 0; k < ev->n_pin; k++) p = replay_token(p, ev->pin[k], sizeof(ev->pin[k]));
+    p = replay_token(p, tok, sizeof(tok));
+    ev->n_fp = atoi(tok);
+    if (ev->n_fp < 0 || ev->n_fp > REPLAY_MAX_ATTEMPTS) return -1;
+    for (k = 0; k < ev->n_fp; k++) {
+        p = replay_token(p, tok, sizeof(tok));
+        ev->fp[k] = (unsigned char)(tok[0] == '1');
+    }
+    return 0;
+}
+
+/* Advance to the next presentation; ends the simulation at end of trace */
+static void replay_next_event(void) {
+    char line[256];
+    while (fgets(line, sizeof(line), replay_file)) {
+        if (line[0] == 'E' && replay_parse_event(line + 1, &replay_cur) == 0) {
+            replay_pin_next = 0;
+            replay_fp_next = 0;
+            replay_count++;
+            return;
+        }
+    }
+    printf("[REPLAY] End of trace after %lu events\n", replay_count);
+    prof_report(replay_count);
+    fclose(replay_file);
+    exit(0);
+}
+
+/* Present the next event's card to a reader stub, bounded to cap */
+static void replay_take_card(char *out, int cap) {
+    if (replay_held) replay_held = 0;
+    else replay_next_event();
+    sprintf(out, "%.*s", cap - 1, replay_cur.card);
+}
+#endif
+
 /* ========================= STUB PERIPHERALS ========================= */
 
 /* LCD */
 void lcd_init(void) { printf("[LCD] Initialized\n"); }
-void lcd_clear(void) { printf("\n[LCD] CLEAR\n"); }
-void lcd_puts(const char *s) { printf("[LCD] %s\n", s); }
-void lcd_putc(char c) { printf("%c", c); }
+void lcd_clear(void) {
+    stub_cost(PROF_LCD_CLEAR, 1);
+    printf("\n[LCD] CLEAR\n");
+}
+void lcd_puts(const char *s) {
+    stub_cost(PROF_LCD_CHAR, (unsigned long)strlen(s));
+    printf("[LCD] %s\n", s);
+}
+void lcd_putc(char c) {
+    stub_cost(PROF_LCD_CHAR, 1);
+    printf("%c", c);
+}
+
+/* Host tools set this to silence the chattier stubs during simulations */
+static int stub_quiet;
+
+/* Background work run once per millisecond of every delay (management link) */
+static void (*delay_hook)(void);
 
 /* Delay (Keil-friendly busy loop) */
 void delay_ms(unsigned int ms) {
     unsigned int i, j;
+#if defined(HOST_POSIX)
+    if (replay_file) {
+        if (prof_active) prof_virtual_us += (unsigned long)ms * 1000UL;
+        ms = 0;
+    }
+#endif
     for (i = 0; i < ms; i++) {
+        if (delay_hook) delay_hook();
         for (j = 0; j < 6000; j++) {
             /* nop - adjust count for MCU clock */
         }
@@ -36,17 +855,110 @@ int keypad_wait_for_key(void) {
     char c;
     printf("[KEYPAD] Enter key: ");
     scanf(" %c", &c);
+    stub_cost(PROF_KEYPAD_KEY, 1);
     return (int)c;
 }
 int keypad_getstring_with_timeout(char *buf, int maxlen, unsigned int timeout_ms) {
     printf("[KEYPAD] Enter input (timeout %u ms): ", timeout_ms);
+#if defined(HOST_POSIX)
+    if (replay_file) {
+        /* running out of recorded attempts behaves like a keypad timeout */
+        buf[0] = '\0';
+        if (replay_pin_next < replay_cur.n_pin) {
+            strncpy(buf, replay_cur.pin[replay_pin_next++], (size_t)maxlen);
+            buf[maxlen] = '\0';
+        }
+        printf("%s\n", buf);
+        stub_cost(PROF_KEYPAD_KEY, strlen(buf) + 1);
+        return (int)strlen(buf);
+    }
+#endif
     scanf("%s", buf);
+    stub_cost(PROF_KEYPAD_KEY, strlen(buf) + 1);
     return (int)strlen(buf);
 }
 
+/*
+ * Non-blocking key poll: returns the next latched key or 0. The host stub
+ * reads a whole line when its buffer runs dry and hands it out one key
+ * per poll; replay feeds each recorded attempt followed by '#'.
+ */
+static char keypad_latched[40];
+static int keypad_latched_pos;
+
+void keypad_flush(void) {
+    keypad_latched[0] = '\0';
+    keypad_latched_pos = 0;
+}
+int keypad_poll_key(void) {
+    if (keypad_latched[keypad_latched_pos] == '\0') {
+        keypad_latched[0] = '\0';
+        keypad_latched_pos = 0;
+#if defined(HOST_POSIX)
+        if (replay_file) {
+            if (replay_pin_next >= replay_cur.n_pin) return 0;
+            sprintf(keypad_latched, "%.16s#", replay_cur.pin[replay_pin_next++]);
+            printf("[KEYPAD] Keys: %s\n", keypad_latched);
+        } else
+#endif
+        {
+            printf("[KEYPAD] Keys (# submits): ");
+            if (scanf("%38s", keypad_latched) != 1) return 0;
+        }
+    }
+    stub_cost(PROF_KEYPAD_KEY, 1);
+    return (int)keypad_latched[keypad_latched_pos++];
+}
+
 /* UART */
 void uart0_init(unsigned long baud) { printf("[UART0] Init at %lu baud\n", baud); }
-void uart0_send_string(const char *s) { printf("[UART0 TX] %s\n", s); }
+void uart0_send_string(const char *s) {
+    stub_cost(PROF_UART_BYTE, strlen(s) + 2);
+    printf("[UART0 TX] %s\n", s);
+}
+void uart0_send_bytes(const unsigned char *buf, unsigned int len) {
+    unsigned int p;
+    stub_cost(PROF_UART_BYTE, len);
+    printf("[UART0 TX] %u bytes:", len);
+    for (p = 0; p < len; p++) printf(" %02X", buf[p]);
+    printf("\n");
+}
+
+/*
+ * Token relay on UART0 (QR scanner or phone bridge), polled once per
+ * presentation: bytes of a pending token, 0 if none, -1 if garbled. The
+ * stub takes T<hex> ('-' for none); replay hands over events whose card
+ * field is a T<hex> token and leaves card events for the reader stub.
+ */
+int uart0_read_token(unsigned char *buf, int cap) {
+    char line[200];
+    unsigned int v;
+    int n;
+
+#if defined(HOST_POSIX)
+    if (replay_file) {
+        if (!replay_held) {
+            replay_next_event();
+            replay_held = 1;
+        }
+        if (replay_cur.card[0] != 'T') return 0;
+        replay_held = 0;
+        sprintf(line, "%.*s", (int)sizeof(line) - 1, replay_cur.card);
+        printf("[UART0 RX] token %.17s...\n", line);
+    } else
+#endif
+    {
+        printf("[UART0 RX] Token (T<hex>, - for none): ");
+        if (scanf("%199s", line) != 1) return 0;
+    }
+    if (line[0] != 'T') return 0;
+    for (n = 0; line[1 + 2 * n] && line[2 + 2 * n]; n++) {
+        if (n >= cap || sscanf(line + 1 + 2 * n, "%2x", &v) != 1) return -1;
+        buf[n] = (unsigned char)v;
+    }
+    stub_cost(PROF_UART_BYTE, (unsigned long)n);
+    return n;
+}
 
 /* I2C / EEPROM (in-memory simulation) */
 #define EEPROM_SIZE 4096
@@ -64,6 +976,8 @@ int eeprom_read_bytes(unsigned int addr, unsigned char *buf, unsigned int len) {
         unsigned int p;
         for (p = 0; p < len; p++) buf[p] = eeprom_memory[addr + p];
     }
+    stub_cost(PROF_EEPROM_BYTE, len + 3);
+    metrics_add(MET_EEPROM_READ_BYTES, len);
     return 0;
 }
 int eeprom_write_bytes(unsigned int addr, const unsigned char *buf, unsigned int len) {
@@ -72,8 +986,36 @@ int eeprom_write_bytes(unsigned int addr, const unsigned char *buf, unsigned int
         unsigned int p;
         for (p = 0; p < len; p++) eeprom_memory[addr + p] = buf[p];
     }
+    stub_cost(PROF_EEPROM_BYTE, len + 3);
+    if (len > 0) stub_cost(PROF_EEPROM_WRITE, (addr + len - 1) / PROF_EEPROM_PAGE - addr / PROF_EEPROM_PAGE + 1);
+    metrics_add(MET_EEPROM_WRITE_BYTES, len);
+    return 0;
+}
+
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE) || defined(HOST_TOOLS)
+/* Template EEPROM: a 24LC256 at I2C address 0x51 beside the password part (in-memory simulation) */
+#define FP_EEPROM_SIZE 32768
+static unsigned char fp_eeprom_memory[FP_EEPROM_SIZE];
+
+void fp_eeprom_init(void) {
+    memset(fp_eeprom_memory, 0xFF, FP_EEPROM_SIZE);
+}
+int fp_eeprom_read_bytes(unsigned int addr, unsigned char *buf, unsigned int len) {
+    if (addr + len > FP_EEPROM_SIZE) return -1;
+    memcpy(buf, fp_eeprom_memory + addr, len);
+    stub_cost(PROF_EEPROM_BYTE, len + 3);
+    metrics_add(MET_EEPROM_READ_BYTES, len);
+    return 0;
+}
+int fp_eeprom_write_bytes(unsigned int addr, const unsigned char *buf, unsigned int len) {
+    if (addr + len > FP_EEPROM_SIZE) return -1;
+    memcpy(fp_eeprom_memory + addr, buf, len);
+    stub_cost(PROF_EEPROM_BYTE, len + 3);
+    if (len > 0) stub_cost(PROF_EEPROM_WRITE, 1);
+    metrics_add(MET_EEPROM_WRITE_BYTES, len);
     return 0;
 }
+#endif
 
 /* RFID (stub) */
 void rfid_init(void) { printf("[RFID] Ready\n"); }
@@ -81,7 +1023,14 @@ int rfid_read_blocking(unsigned char *buf, int len, unsigned int timeout_ms) {
     char temp[32];
     int i;
     printf("[RFID] Enter card ID: ");
+#if defined(HOST_POSIX)
+    if (replay_file) {
+        replay_take_card(temp, sizeof(temp));
+        printf("%s\n", temp);
+    } else
+#endif
     scanf("%s", temp);
+    stub_cost(PROF_RFID_FRAME, 1);
     /* Build framed packet: STX ... ETX */
     if (len < 3) return -1;
     for (i = 0; i < len; i++) buf[i] = 0;
@@ -99,230 +1048,15181 @@ void fingerprint_init(void) { printf("[FP] Sensor Ready\n"); }
 int fp_search(void) {
     int matched;
     printf("[FP] Enter match result (1=match,0=fail): ");
+#if defined(HOST_POSIX)
+    if (replay_file) {
+        matched = replay_fp_next < replay_cur.n_fp ? replay_cur.fp[replay_fp_next++] : 0;
+        printf("%d\n", matched);
+    } else
+#endif
     scanf("%d", &matched);
+    stub_cost(PROF_FP_CAPTURE, 1);
+    stub_cost(PROF_FP_SEARCH, 1);
     return (matched ? 1 : -1);
 }
+/* Touch/image-ready poll; the host stub treats the sensor as touched while attempts remain */
+int fp_finger_present(void) {
+#if defined(HOST_POSIX)
+    if (replay_file) return replay_fp_next < replay_cur.n_fp;
+#endif
+    return 1;
+}
 int fp_enroll(int id) {
-    printf("[FP] Enroll user %d: Done\n", id);
+    stub_cost(PROF_FP_CAPTURE, 2);
+    if (!stub_quiet) printf("[FP] Enroll user %d: Done\n", id);
     return 0;
 }
 int fp_delete(int id) {
-    printf("[FP] Delete user %d: Done\n", id);
+    if (!stub_quiet) printf("[FP] Delete user %d: Done\n", id);
+    return 0;
+}
+/*
+ * Download a packed template into a module slot: DownChar announces len
+ * bytes for the char buffer, the data follows in packets of at most
+ * FP_UPLOAD_PACKET bytes, and Store writes the buffer to the slot.
+ */
+#define FP_UPLOAD_PACKET 128
+int fp_upload_begin(int len) {
+    (void)len;
+    stub_cost(PROF_FP_UPLOAD_BYTE, 12);
+    return 0;
+}
+int fp_upload_packet(const unsigned char *buf, int len) {
+    (void)buf;
+    stub_cost(PROF_FP_UPLOAD_BYTE, (unsigned long)len + 11);
+    return 0;
+}
+int fp_upload_store(int slot, int len) {
+    stub_cost(PROF_FP_UPLOAD_BYTE, 15);
+    if (!stub_quiet) printf("[FP] Upload %d bytes to slot %d: Done\n", len, slot);
     return 0;
 }
+/* Capture a finger and match it on-module against one slot (1:1) */
+int fp_verify_slot(int slot) {
+    int matched;
+    printf("[FP] Verify slot %d (1=match,0=fail): ", slot);
+#if defined(HOST_POSIX)
+    if (replay_file) {
+        matched = replay_fp_next < replay_cur.n_fp ? replay_cur.fp[replay_fp_next++] : 0;
+        printf("%d\n", matched);
+    } else
+#endif
+    scanf("%d", &matched);
+    stub_cost(PROF_FP_CAPTURE, 1);
+    stub_cost(PROF_FP_VERIFY, 1);
+    return matched ? 1 : 0;
+}
 
 /* Motor (stub) */
 void motor_init(void) { printf("[MOTOR] Ready\n"); }
-void motor_open(void) { printf("[MOTOR] Opening (CW)\n"); }
-void motor_close(void) { printf("[MOTOR] Closing (CCW)\n"); }
+void motor_open(void) {
+    stub_cost(PROF_MOTOR_TRAVEL, 1);
+    printf("[MOTOR] Opening (CW)\n");
+}
+void motor_close(void) {
+    stub_cost(PROF_MOTOR_TRAVEL, 1);
+    printf("[MOTOR] Closing (CCW)\n");
+}
 
-/* Timer (stub) */
-void timer_init(void) { printf("[TIMER] Started\n"); }
+/*
+ * Timer0 counts microseconds: the prescaler divides PCLK (CCLK / 4 at the
+ * VPBDIV reset value) down to 1 MHz and TC runs free, wrapping every 71
+ * minutes, which unsigned differences absorb. The Wiegand capture inputs
+ * latch the same TC, so edge times and poll times share one time base.
+ */
+#if !defined(HOST_POSIX)
+#define T0TCR (*(volatile unsigned long *)0xE0004004UL)
+#define T0TC (*(volatile unsigned long *)0xE0004008UL)
+#define T0PR (*(volatile unsigned long *)0xE000400CUL)
+#define TIMER_PCLK_HZ 15000000UL
+#endif
 
-/* ========================= APPLICATION LOGIC ========================= */
+void timer_init(void) {
+#if !defined(HOST_POSIX)
+    T0TCR = 2;                  /* hold the counters in reset */
+    T0PR = TIMER_PCLK_HZ / 1000000UL - 1;
+    T0TCR = 1;
+#endif
+    printf("[TIMER] Started\n");
+}
 
-/* Configuration */
-#define MAX_USERS 50
-#define PASSWORD_MAX_LEN 8
-#define CARD_ID_LEN 10
-#define EEPROM_PASSWORD_BASE_ADDR 0x0000
-#define PASSWORD_EEPROM_SLOT_SIZE 16
-#define USER_SLOT_ADDR(uid) (EEPROM_PASSWORD_BASE_ADDR + ((uid) * PASSWORD_EEPROM_SLOT_SIZE))
-#define PASSWORD_ENTRY_TIMEOUT_MS 15000
-#define MAX_PASSWORD_ATTEMPTS 3
-#define MAX_FP_ATTEMPTS 3
+/* Microsecond time stamp (T0TC on target, monotonic clock on host) */
+unsigned long timer_now_us(void) {
+#if defined(HOST_POSIX)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + (unsigned long)(ts.tv_nsec / 1000) + prof_virtual_us;
+#else
+    return T0TC;
+#endif
+}
 
-/* Globals */
-static char entered_password[PASSWORD_MAX_LEN + 1];
-static char stored_password[PASSWORD_MAX_LEN + 1];
-static char rfid_card_string[CARD_ID_LEN + 1];
+/*
+ * Wall clock in Unix seconds, for token expiry, validity windows and
+ * schedules. On the target it is the LPC2124 RTC, clocked from PCLK
+ * through its prescaler, so it stops with the power: it is trusted only
+ * once the management host has set it (MGMT_OP_SET_TIME), and a marker
+ * in the unused alarm registers carries that across a reset. Until then
+ * rtc_is_set is 0 and the door refuses tokens and every user with a
+ * validity window or a schedule. The host follows time(0), moved by
+ * whatever was set.
+ */
+#if !defined(HOST_POSIX)
+#define RTC_CCR (*(volatile unsigned long *)0xE0024008UL)
+#define RTC_AMR (*(volatile unsigned long *)0xE0024010UL)
+#define RTC_CTIME0 (*(volatile unsigned long *)0xE0024014UL) /* sec | min << 8 | hour << 16 | dow << 24 */
+#define RTC_CTIME1 (*(volatile unsigned long *)0xE0024018UL) /* dom | month << 8 | year << 16 */
+#define RTC_SEC (*(volatile unsigned long *)0xE0024020UL)
+#define RTC_MIN (*(volatile unsigned long *)0xE0024024UL)
+#define RTC_HOUR (*(volatile unsigned long *)0xE0024028UL)
+#define RTC_DOM (*(volatile unsigned long *)0xE002402CUL)
+#define RTC_DOW (*(volatile unsigned long *)0xE0024030UL)
+#define RTC_DOY (*(volatile unsigned long *)0xE0024034UL)
+#define RTC_MONTH (*(volatile unsigned long *)0xE0024038UL)
+#define RTC_YEAR (*(volatile unsigned long *)0xE002403CUL)
+#define RTC_ALDOY (*(volatile unsigned long *)0xE0024074UL)
+#define RTC_ALYEAR (*(volatile unsigned long *)0xE002407CUL)
+#define RTC_PREINT (*(volatile unsigned long *)0xE0024080UL)
+#define RTC_PREFRAC (*(volatile unsigned long *)0xE0024084UL)
+#define RTC_MARK_DOY 0x15AUL
+#define RTC_MARK_YEAR 0xA5CUL
+#endif
 
-/* Prototypes */
-static int check_rfid_and_get_userid(char *card_buf);
-static int verify_password_for_user(unsigned char user_id);
-static int do_fingerprint_search(unsigned char *matched_id);
-static void door_open_sequence(void);
+static int rtc_valid;
+#if defined(HOST_POSIX)
+static long rtc_offset;
+#endif
 
-/* Main */
-int main(void) {
-    unsigned char matched_fp_id = 0xFF;
+#if !defined(HOST_POSIX)
+/* Days from 1970-01-01 to y-m-d (proleptic Gregorian, March-based years) */
+static unsigned long rtc_days(unsigned long y, unsigned long m, unsigned long d) {
+    if (m <= 2) {
+        y--;
+        m += 12;
+    }
+    return 365UL * y + y / 4 - y / 100 + y / 400 + (153UL * (m - 3) + 2) / 5 + d - 719469UL;
+}
+#endif
 
-    /* Init */
-    lcd_init();
-    uart0_init(9600);
-    keypad_init();
-    i2c_init();
-    eeprom_init();
-    rfid_init();
-    fingerprint_init();
-    motor_init();
-    timer_init();
+void rtc_init(void) {
+#if defined(HOST_POSIX)
+    rtc_valid = 1;
+#else
+    RTC_PREINT = TIMER_PCLK_HZ / 32768UL - 1;
+    RTC_PREFRAC = TIMER_PCLK_HZ - (TIMER_PCLK_HZ / 32768UL) * 32768UL;
+    RTC_AMR = 0xFF;             /* no alarms: ALDOY and ALYEAR only hold the marker */
+    RTC_CCR = 1;
+    rtc_valid = (RTC_ALDOY & 0x1FF) == RTC_MARK_DOY && (RTC_ALYEAR & 0xFFF) == RTC_MARK_YEAR;
+#endif
+    printf("[RTC] %s\n", rtc_valid ? "Running" : "Not set: timed access refused until it is");
+}
 
-    lcd_clear();
-    lcd_puts("Multi-Level Security\nSystem Ready");
+/* Has the clock been set since it last lost power? */
+int rtc_is_set(void) {
+    return rtc_valid;
+}
 
-    while (1) {
-        int password_verified;
-        int fingerprint_verified;
-        int attempt;
+void rtc_set_seconds(unsigned long s) {
+#if defined(HOST_POSIX)
+    rtc_offset = (long)(s - (unsigned long)time(0));
+#else
+    unsigned long days, z, era, doe, yoe, y, doy, mp, m, d;
 
-        /* Clear card buffer */
-        {
-            int k;
-            for (k = 0; k < CARD_ID_LEN; k++) rfid_card_string[k] = '\0';
-        }
+    /* civil date from days since 1970, by 400-year eras from 0000-03-01 */
+    days = s / 86400UL;
+    z = days + 719468UL;
+    era = z / 146097UL;
+    doe = z - era * 146097UL;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = yoe + era * 400 + (m <= 2);
 
-        lcd_clear();
-        lcd_puts("Place RFID card...");
+    RTC_CCR = 2;                /* hold and reset the divider while the counters change */
+    RTC_SEC = s % 60UL;
+    RTC_MIN = s / 60UL % 60UL;
+    RTC_HOUR = s / 3600UL % 24UL;
+    RTC_DOM = d;
+    RTC_DOW = (days + 4) % 7;   /* 1970-01-01 was a Thursday */
+    RTC_DOY = days - rtc_days(y, 1, 1) + 1;
+    RTC_MONTH = m;
+    RTC_YEAR = y;
+    RTC_ALDOY = RTC_MARK_DOY;
+    RTC_ALYEAR = RTC_MARK_YEAR;
+    RTC_CCR = 1;
+#endif
+    rtc_valid = 1;
+}
 
-        if (check_rfid_and_get_userid(rfid_card_string) == 0) {
-            unsigned char user_id;
-            user_id = (unsigned char)atoi(rfid_card_string);
-            if (user_id >= MAX_USERS) {
-                lcd_clear();
-                lcd_puts("Card not registered\nAccess Denied");
-                delay_ms(1500);
-                continue;
-            }
+unsigned long rtc_now_seconds(void) {
+#if defined(HOST_POSIX)
+    return (unsigned long)((long)time(0) + rtc_offset);
+#else
+    unsigned long t0, t1;
 
-            /* PASSWORD: up to MAX_PASSWORD_ATTEMPTS */
-            password_verified = 0;
-            for (attempt = 1; attempt <= MAX_PASSWORD_ATTEMPTS; attempt++) {
-                char msg[32];
-                lcd_clear();
-                /* prepare message - use sprintf (ensure msg declared at top of block) */
-                sprintf(msg, "Enter Password\nAttempt %d/3", attempt);
-                lcd_puts(msg);
+    /* the consolidated registers are read again if a second ticked in between */
+    do {
+        t0 = RTC_CTIME0;
+        t1 = RTC_CTIME1;
+    } while (t0 != RTC_CTIME0);
+    return rtc_days((t1 >> 16) & 0xFFF, (t1 >> 8) & 0xF, t1 & 0x1F) * 86400UL + ((t0 >> 16) & 0x1F) * 3600UL +
+           ((t0 >> 8) & 0x3F) * 60UL + (t0 & 0x3F);
+#endif
+}
 
-                if (verify_password_for_user(user_id)) {
-                    password_verified = 1;
-                    break;
-                } else {
-                    if (attempt < MAX_PASSWORD_ATTEMPTS) {
-                        lcd_clear();
-                        lcd_puts("Wrong Password\nTry Again");
-                        delay_ms(1000);
-                    } else {
-                        lcd_clear();
-                        lcd_puts("Password Failed\nAccess Denied");
-                        delay_ms(1500);
-                    }
-                }
-            }
-            if (!password_verified) continue;
+/* ========================= FINGERPRINT TEMPLATES ========================= */
 
-            /* FINGERPRINT: up to MAX_FP_ATTEMPTS */
-            fingerprint_verified = 0;
-            for (attempt = 1; attempt <= MAX_FP_ATTEMPTS; attempt++) {
-                char msg[32];
-                lcd_clear();
-                sprintf(msg, "Place Finger\nAttempt %d/3", attempt);
-                lcd_puts(msg);
+/*
+ * Minutiae templates as held by the controller. Coordinates are pixels at
+ * 500 dpi, directions are in 1/256 of a turn so angle arithmetic wraps for
+ * free in an unsigned char.
+ */
+#define FP_MAX_MINUTIAE 40
+#define FP_ANGLE_STEPS 256
+#define FP_PACKED_MINUTIA 6
+#define FP_PACKED_MAX (1 + FP_MAX_MINUTIAE * FP_PACKED_MINUTIA)
+#define FP_TYPE_ENDING 0
+#define FP_TYPE_BIFURCATION 1
 
-                if (do_fingerprint_search(&matched_fp_id)) {
-                    fingerprint_verified = 1;
-                    break;
-                } else {
-                    if (attempt < MAX_FP_ATTEMPTS) {
-                        lcd_clear();
-                        lcd_puts("Fingerprint Fail\nTry Again");
-                        delay_ms(1000);
-                    } else {
-                        lcd_clear();
-                        lcd_puts("Access Denied");
-                        delay_ms(1500);
+/* Matcher tolerances and Hough alignment grid, shared by every matcher build */
+#define FP_MATCH_DIST 14
+#define FP_MATCH_ANGLE 16
+#define FP_HOUGH_ANGLE_BINS 32
+#define FP_ROT_CANDIDATES 3
+#define FP_HOUGH_XY_BIN 24
+#define FP_HOUGH_XY_CELLS 24
+#define FP_SCORE_MAX 1000
+#define FP_MATCH_THRESHOLD 80
+
+typedef struct {
+    short x;
+    short y;
+    unsigned char angle;
+    unsigned char type;
+} fp_minutia;
+
+typedef struct {
+    unsigned char count;
+    fp_minutia m[FP_MAX_MINUTIAE];
+} fp_template;
+
+/* Wire/storage form: count, then x(2) y(2) angle type per minutia, big endian */
+int fp_template_pack(const fp_template *t, unsigned char *out) {
+    int i, p;
+    out[0] = t->count;
+    p = 1;
+    for (i = 0; i < t->count; i++) {
+        out[p++] = (unsigned char)((unsigned short)t->m[i].x >> 8);
+        out[p++] = (unsigned char)t->m[i].x;
+        out[p++] = (unsigned char)((unsigned short)t->m[i].y >> 8);
+        out[p++] = (unsigned char)t->m[i].y;
+        out[p++] = t->m[i].angle;
+        out[p++] = t->m[i].type;
+    }
+    return p;
+}
+
+/* Returns bytes consumed, or -1 if the buffer is short or malformed */
+int fp_template_unpack(fp_template *t, const unsigned char *in, int len) {
+    int i, p;
+    if (len < 1 || in[0] > FP_MAX_MINUTIAE || len < 1 + in[0] * FP_PACKED_MINUTIA) return -1;
+    t->count = in[0];
+    p = 1;
+    for (i = 0; i < t->count; i++) {
+        t->m[i].x = (short)(((unsigned short)in[p] << 8) | in[p + 1]);
+        t->m[i].y = (short)(((unsigned short)in[p + 2] << 8) | in[p + 3]);
+        t->m[i].angle = in[p + 4];
+        t->m[i].type = in[p + 5];
+        p += FP_PACKED_MINUTIA;
+    }
+    return p;
+}
+
+/*
+ * Controller-side gallery: the store the enroll path writes templates into.
+ * Storage is attached by the caller (external memory on target, heap on host).
+ */
+static fp_template *fp_gallery;
+static unsigned char *fp_gallery_used;
+static int fp_gallery_cap;
+
+/*
+ * Zone partitions: per zone, the enrolled ids whose policy mask admits it.
+ * Kept in step with enroll/remove and policy edits so a door's 1:N search
+ * only scores users who could be let in there. Optional; without attached
+ * storage every search covers the whole gallery.
+ */
+#define FP_ZONES 8
+#define FP_ZONES_ALL 0xFF
+
+static unsigned char *fp_zone_mask;
+static int *fp_zone_ids;
+static int fp_zone_len[FP_ZONES];
+
+void fp_gallery_attach(fp_template *storage, unsigned char *used, int cap) {
+    fp_gallery = storage;
+    fp_gallery_used = used;
+    fp_gallery_cap = cap;
+    fp_zone_mask = 0;
+    fp_zone_ids = 0;
+    memset(used, 0, (size_t)cap);
+}
+
+static void fp_zone_update(int id, unsigned old_mask, unsigned new_mask) {
+    int z, i, *row;
+    for (z = 0; z < FP_ZONES; z++) {
+        if (!((old_mask ^ new_mask) & (1u << z))) continue;
+        row = fp_zone_ids + (long)z * fp_gallery_cap;
+        if (new_mask & (1u << z)) {
+            row[fp_zone_len[z]++] = id;
+            continue;
+        }
+        for (i = 0; i < fp_zone_len[z]; i++) {
+            if (row[i] == id) {
+                row[i] = row[--fp_zone_len[z]];
+                break;
+            }
+        }
+    }
+}
+
+/* ids: FP_ZONES * cap ints. Every id starts with access to all zones */
+void fp_gallery_attach_zones(unsigned char *mask, int *ids) {
+    int id;
+    fp_zone_mask = mask;
+    fp_zone_ids = ids;
+    memset(fp_zone_len, 0, sizeof(fp_zone_len));
+    memset(mask, FP_ZONES_ALL, (size_t)fp_gallery_cap);
+    for (id = 0; id < fp_gallery_cap; id++) {
+        if (fp_gallery_used[id]) fp_zone_update(id, 0, FP_ZONES_ALL);
+    }
+}
+
+/* Policy change for one user; only the zones whose bit flipped are touched */
+int fp_gallery_set_zones(int id, unsigned mask) {
+    if (id < 0 || id >= fp_gallery_cap || !fp_zone_ids) return -1;
+    mask &= FP_ZONES_ALL;
+    if (fp_gallery_used[id]) fp_zone_update(id, fp_zone_mask[id], mask);
+    fp_zone_mask[id] = (unsigned char)mask;
+    return 0;
+}
+
+int fp_gallery_enroll(int id, const fp_template *t) {
+    if (id < 0 || id >= fp_gallery_cap) return -1;
+    fp_gallery[id] = *t;
+    if (!fp_gallery_used[id] && fp_zone_ids) fp_zone_update(id, 0, fp_zone_mask[id]);
+    fp_gallery_used[id] = 1;
+    return 0;
+}
+
+int fp_gallery_remove(int id) {
+    if (id < 0 || id >= fp_gallery_cap) return -1;
+    if (fp_gallery_used[id] && fp_zone_ids) fp_zone_update(id, fp_zone_mask[id], 0);
+    fp_gallery_used[id] = 0;
+    return 0;
+}
+
+const fp_template *fp_gallery_get(int id) {
+    if (id < 0 || id >= fp_gallery_cap || !fp_gallery_used[id]) return 0;
+    return &fp_gallery[id];
+}
+
+/*
+ * What the stub sensor extracts from finger id: a fixed set of minutiae
+ * per finger, spread over the window, so a finger matches its own
+ * enrollment and no one else's. Negative ids are an unreadable touch.
+ * Enrollment and probe captures both come from here, so a controller-match
+ * build scores a real template pair through fp_match_score rather than
+ * comparing the gallery entry with itself.
+ */
+static int fp_stub_finger(int id, fp_template *t) {
+    unsigned long s;
+    int i;
+
+    t->count = 0;
+    if (id < 0) return -1;
+    s = ((unsigned long)id + 1) * 0x9E3779B1UL;
+    for (i = 0; i < 30; i++) {
+        s = (s * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+        t->m[i].x = (short)(16 + (s >> 8) % 320);
+        t->m[i].y = (short)(16 + (s >> 20) % 400);
+        s = (s * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+        t->m[i].angle = (unsigned char)(s >> 16);
+        t->m[i].type = (unsigned char)((s >> 28) & 1);
+    }
+    t->count = 30;
+    return 0;
+}
+
+/* Capture a probe template from the sensor (GenImg, Img2Tz, UpChar; stub: present a finger by id) */
+int fp_capture_template(fp_template *t) {
+    int id;
+
+    printf("[FP] Present finger id (-1=unknown): ");
+#if defined(HOST_POSIX)
+    if (replay_file) {
+        id = replay_fp_next < replay_cur.n_fp && replay_cur.fp[replay_fp_next++] ? atoi(replay_cur.card) : -1;
+        printf("%d\n", id);
+    } else
+#endif
+    if (scanf("%d", &id) != 1) id = -1;
+    stub_cost(PROF_FP_CAPTURE, 1);
+    return fp_stub_finger(id, t);
+}
+
+/* Capture the finger being enrolled for id, two presses merged on-module (stub: id's own finger) */
+int fp_capture_enroll(int id, fp_template *t) {
+    stub_cost(PROF_FP_CAPTURE, 2);
+    if (!stub_quiet) printf("[FP] Enroll capture for user %d: Done\n", id);
+    return fp_stub_finger(id, t);
+}
+
+/*
+ * Fixed-point matcher for the LPC2124 (no FPU). Same algorithm and
+ * tolerances as the host reference matcher, with Q14 sine/cosine from a
+ * quarter-wave table, Q4 coordinates and integer angle units. Most scores
+ * are identical to the float version's, but rounding can break a tie in the
+ * Hough vote the other way, and a pair aligned on a different rotation
+ * scores very differently; fpeval checks the agreement (FPEVAL_MIN_SAME_PCT
+ * and below) rather than a bound on any single score.
+ */
+#define FP_TRIG_SHIFT 14
+#define FP_COORD_SHIFT 4
+/*
+ * Hough cell of a non-negative Q4 offset without a divide (ARM7 has none):
+ * multiply by 2^24 / cell width, rounded up. Exact for offsets inside the
+ * grid; recheck if FP_HOUGH_XY_BIN or FP_HOUGH_XY_CELLS change.
+ */
+#define FP_CELL_RECIP ((((1L << 24) + ((long)FP_HOUGH_XY_BIN << FP_COORD_SHIFT) - 1)) / \
+                       ((long)FP_HOUGH_XY_BIN << FP_COORD_SHIFT))
+#define FP_CELL_OF(v) ((int)(((v) * FP_CELL_RECIP) >> 24))
+
+static const short fp_sin_q14_quarter[FP_ANGLE_STEPS / 4 + 1] = {
+    0, 402, 804, 1205, 1606, 2006, 2404, 2801, 3196, 3590, 3981, 4370, 4756,
+    5139, 5520, 5897, 6270, 6639, 7005, 7366, 7723, 8076, 8423, 8765, 9102,
+    9434, 9760, 10080, 10394, 10702, 11003, 11297, 11585, 11866, 12140, 12406,
+    12665, 12916, 13160, 13395, 13623, 13842, 14053, 14256, 14449, 14635,
+    14811, 14978, 15137, 15286, 15426, 15557, 15679, 15791, 15893, 15986,
+    16069, 16143, 16207, 16261, 16305, 16340, 16364, 16379, 16384
+};
+
+static long fp_sin_q14(int a) {
+    a &= FP_ANGLE_STEPS - 1;
+    if (a <= 64) return fp_sin_q14_quarter[a];
+    if (a <= 128) return fp_sin_q14_quarter[128 - a];
+    if (a <= 192) return -fp_sin_q14_quarter[a - 128];
+    return -fp_sin_q14_quarter[256 - a];
+}
+
+/* Floor division for b > 0 (C89 leaves negative quotients implementation-defined) */
+static long fp_div_floor(long a, long b) {
+    if (a >= 0) return a / b;
+    return -((-a + b - 1) / b);
+}
+
+static int fp_wrap_diff(int a, int b) {
+    int d;
+    d = (a - b) & (FP_ANGLE_STEPS - 1);
+    return d >= FP_ANGLE_STEPS / 2 ? d - FP_ANGLE_STEPS : d;
+}
+
+static int fp_abs(int v) {
+    return v < 0 ? -v : v;
+}
+
+int fp_match_score(const fp_template *p, const fp_template *g) {
+    unsigned short abins[FP_HOUGH_ANGLE_BINS];
+    unsigned short smooth[FP_HOUGH_ANGLE_BINS];
+    unsigned short cells[FP_HOUGH_XY_CELLS * FP_HOUGH_XY_CELLS];
+    unsigned char used[FP_MAX_MINUTIAE];
+    long qx[FP_MAX_MINUTIAE];
+    long qy[FP_MAX_MINUTIAE];
+    long c, s, tx, ty, sx, sy, spx, spy, sa, dx, dy, d2, best_d2;
+    int i, j, b, k, cand, best, vote, top, cx, cy, win_x, win_y, rot_units, matched, pick, n, da;
+    const long half = (long)FP_HOUGH_XY_CELLS * FP_HOUGH_XY_BIN / 2 << FP_COORD_SHIFT;
+    const int bin_w = FP_ANGLE_STEPS / FP_HOUGH_ANGLE_BINS;
+
+    if (p->count == 0 || g->count == 0) return 0;
+
+    memset(abins, 0, sizeof(abins));
+    for (i = 0; i < p->count; i++) {
+        for (j = 0; j < g->count; j++) abins[((g->m[j].angle - p->m[i].angle) & (FP_ANGLE_STEPS - 1)) / bin_w]++;
+    }
+    for (b = 0; b < FP_HOUGH_ANGLE_BINS; b++) {
+        smooth[b] = (unsigned short)(abins[(b + FP_HOUGH_ANGLE_BINS - 1) % FP_HOUGH_ANGLE_BINS] + 2 * abins[b] +
+                                     abins[(b + 1) % FP_HOUGH_ANGLE_BINS]);
+    }
+
+    top = -1;
+    rot_units = 0;
+    win_x = win_y = 0;
+    for (cand = 0; cand < FP_ROT_CANDIDATES; cand++) {
+        best = 0;
+        for (b = 1; b < FP_HOUGH_ANGLE_BINS; b++) {
+            if (smooth[b] > smooth[best]) best = b;
+        }
+        if (smooth[best] == 0) break;
+        for (k = -1; k <= 1; k++) smooth[(best + k + FP_HOUGH_ANGLE_BINS) % FP_HOUGH_ANGLE_BINS] = 0;
+
+        k = best * bin_w + bin_w / 2;
+        c = fp_sin_q14(k + FP_ANGLE_STEPS / 4);
+        s = fp_sin_q14(k);
+        for (i = 0; i < p->count; i++) {
+            qx[i] = fp_div_floor(c * p->m[i].x - s * p->m[i].y, 1L << (FP_TRIG_SHIFT - FP_COORD_SHIFT));
+            qy[i] = fp_div_floor(s * p->m[i].x + c * p->m[i].y, 1L << (FP_TRIG_SHIFT - FP_COORD_SHIFT));
+        }
+        memset(cells, 0, sizeof(cells));
+        for (i = 0; i < p->count; i++) {
+            for (j = 0; j < g->count; j++) {
+                if (fp_abs(fp_wrap_diff(g->m[j].angle, p->m[i].angle + k)) > FP_MATCH_ANGLE) continue;
+                dx = ((long)g->m[j].x << FP_COORD_SHIFT) - qx[i] + half;
+                dy = ((long)g->m[j].y << FP_COORD_SHIFT) - qy[i] + half;
+                if (dx < 0 || dy < 0 || dx >= 2 * half || dy >= 2 * half) continue;
+                cells[FP_CELL_OF(dy) * FP_HOUGH_XY_CELLS + FP_CELL_OF(dx)]++;
+            }
+        }
+        for (cy = 0; cy + 1 < FP_HOUGH_XY_CELLS; cy++) {
+            for (cx = 0; cx + 1 < FP_HOUGH_XY_CELLS; cx++) {
+                b = cy * FP_HOUGH_XY_CELLS + cx;
+                vote = cells[b] + cells[b + 1] + cells[b + FP_HOUGH_XY_CELLS] + cells[b + FP_HOUGH_XY_CELLS + 1];
+                if (vote > top) {
+                    top = vote;
+                    rot_units = k;
+                    win_x = cx;
+                    win_y = cy;
+                }
+            }
+        }
+    }
+    if (top <= 0) return 0;
+
+    c = fp_sin_q14(rot_units + FP_ANGLE_STEPS / 4);
+    s = fp_sin_q14(rot_units);
+    for (i = 0; i < p->count; i++) {
+        qx[i] = fp_div_floor(c * p->m[i].x - s * p->m[i].y, 1L << (FP_TRIG_SHIFT - FP_COORD_SHIFT));
+        qy[i] = fp_div_floor(s * p->m[i].x + c * p->m[i].y, 1L << (FP_TRIG_SHIFT - FP_COORD_SHIFT));
+    }
+    sx = sy = spx = spy = sa = 0;
+    n = 0;
+    for (i = 0; i < p->count; i++) {
+        for (j = 0; j < g->count; j++) {
+            da = fp_wrap_diff(g->m[j].angle, p->m[i].angle + rot_units);
+            if (fp_abs(da) > FP_MATCH_ANGLE) continue;
+            dx = ((long)g->m[j].x << FP_COORD_SHIFT) - qx[i] + half;
+            dy = ((long)g->m[j].y << FP_COORD_SHIFT) - qy[i] + half;
+            if (dx < 0 || dy < 0 || dx >= 2 * half || dy >= 2 * half) continue;
+            cx = (int)FP_CELL_OF(dx);
+            cy = (int)FP_CELL_OF(dy);
+            if (cx < win_x || cx > win_x + 1 || cy < win_y || cy > win_y + 1) continue;
+            sa += da;
+            sx += g->m[j].x;
+            sy += g->m[j].y;
+            spx += p->m[i].x;
+            spy += p->m[i].y;
+            n++;
+        }
+    }
+    /* refine: rounded mean rotation residual, then centroid translation (Q4) */
+    rot_units += (int)fp_div_floor(2 * sa + n, 2L * n);
+    c = fp_sin_q14(rot_units + FP_ANGLE_STEPS / 4);
+    s = fp_sin_q14(rot_units);
+    spx = (spx << FP_COORD_SHIFT) / n;
+    spy = (spy << FP_COORD_SHIFT) / n;
+    tx = (sx << FP_COORD_SHIFT) / n - fp_div_floor(c * spx - s * spy, 1L << FP_TRIG_SHIFT);
+    ty = (sy << FP_COORD_SHIFT) / n - fp_div_floor(s * spx + c * spy, 1L << FP_TRIG_SHIFT);
+
+    memset(used, 0, sizeof(used));
+    matched = 0;
+    for (i = 0; i < p->count; i++) {
+        qx[i] = fp_div_floor(c * p->m[i].x - s * p->m[i].y, 1L << (FP_TRIG_SHIFT - FP_COORD_SHIFT)) + tx;
+        qy[i] = fp_div_floor(s * p->m[i].x + c * p->m[i].y, 1L << (FP_TRIG_SHIFT - FP_COORD_SHIFT)) + ty;
+        pick = -1;
+        best_d2 = ((long)FP_MATCH_DIST * FP_MATCH_DIST << (2 * FP_COORD_SHIFT)) + (1L << (2 * FP_COORD_SHIFT - 1));
+        for (j = 0; j < g->count; j++) {
+            if (used[j]) continue;
+            if (fp_abs(fp_wrap_diff(g->m[j].angle, p->m[i].angle + rot_units)) > FP_MATCH_ANGLE) continue;
+            dx = ((long)g->m[j].x << FP_COORD_SHIFT) - qx[i];
+            dy = ((long)g->m[j].y << FP_COORD_SHIFT) - qy[i];
+            /* both legs bounded before squaring, so d2 stays well inside 32 bits */
+            if (dx > ((long)FP_MATCH_DIST << FP_COORD_SHIFT) || -dx > ((long)FP_MATCH_DIST << FP_COORD_SHIFT)) continue;
+            if (dy > ((long)FP_MATCH_DIST << FP_COORD_SHIFT) || -dy > ((long)FP_MATCH_DIST << FP_COORD_SHIFT)) continue;
+            d2 = dx * dx + dy * dy;
+            if (d2 < best_d2) {
+                best_d2 = d2;
+                pick = j;
+            }
+        }
+        if (pick >= 0) {
+            used[pick] = 1;
+            matched++;
+        }
+    }
+    return FP_SCORE_MAX * matched * matched / (p->count * g->count);
+}
+
+/* 1:N search of the controller gallery; best id or -1 below threshold */
+int fp_identify(const fp_template *probe, int threshold, int *score) {
+    int id, sc, best, best_id;
+    best = -1;
+    best_id = -1;
+    for (id = 0; id < fp_gallery_cap; id++) {
+        if (!fp_gallery_used[id]) continue;
+        sc = fp_match_score(probe, &fp_gallery[id]);
+        if (sc > best) {
+            best = sc;
+            best_id = id;
+        }
+    }
+    if (score) *score = best;
+    return best >= threshold ? best_id : -1;
+}
+
+/* 1:N restricted to the users the policy admits in zone */
+int fp_identify_zone(const fp_template *probe, int zone, int threshold, int *score) {
+    const int *row;
+    int i, sc, best, best_id;
+    if (!fp_zone_ids || zone < 0 || zone >= FP_ZONES) return fp_identify(probe, threshold, score);
+    row = fp_zone_ids + (long)zone * fp_gallery_cap;
+    best = -1;
+    best_id = -1;
+    for (i = 0; i < fp_zone_len[zone]; i++) {
+        sc = fp_match_score(probe, &fp_gallery[row[i]]);
+        if (sc > best || (sc == best && row[i] < best_id)) {
+            best = sc;
+            best_id = row[i];
+        }
+    }
+    if (score) *score = best;
+    return best >= threshold ? best_id : -1;
+}
+
+/* ========================= FINGERPRINT IMAGE STREAMING ========================= */
+
+/*
+ * Row-streaming minutiae extraction, fed one image row at a time while the
+ * sensor is still uploading. Each stage runs as soon as the rows it needs
+ * are in:
+ *   block stats (mean, variance mask, orientation)  rows 8b-1 .. 8b+8
+ *   ridge skeleton row y (darkest along the normal)  rows y-2 .. y+2
+ *   crossing-number minutiae on row y               skeleton y-1 .. y+1
+ * so only a band of rows is kept and little work is left after the last
+ * row arrives. Not on any capture path yet: the sensor module still hands
+ * over templates, not images, so only the fpstream tool drives this.
+ */
+#define FP_IMG_W 256
+#define FP_IMG_H 288
+#define FP_BLK 8
+#define FP_BLK_COLS (FP_IMG_W / FP_BLK)
+#define FP_BLK_ROWS (FP_IMG_H / FP_BLK)
+#define FP_RING_ROWS 16
+#define FP_STAT_RING 4
+#define FP_SKEL_RING 4
+#define FP_SEG_MIN_VAR 150
+#define FP_MINUTIA_SEP 10
+
+typedef struct {
+    unsigned char rows[FP_RING_ROWS][FP_IMG_W];
+    unsigned char skel[FP_SKEL_RING][FP_IMG_W];
+    unsigned char orient[FP_STAT_RING][FP_BLK_COLS]; /* ridge direction, half turn = 128 */
+    unsigned char mean[FP_STAT_RING][FP_BLK_COLS];
+    unsigned char fg[FP_STAT_RING][FP_BLK_COLS];
+    int rows_in;
+    int blk_done;
+    int skel_done;
+    int cn_done;
+    fp_template out;
+} fp_stream;
+
+#define FP_ROW(st, y) ((st)->rows[(y) & (FP_RING_ROWS - 1)])
+
+static const unsigned char fp_atan_units[65] = {
+    0, 1, 1, 2, 3, 3, 4, 4, 5, 6, 6, 7, 8, 8, 9, 9, 10, 11, 11, 12, 12, 13,
+    13, 14, 15, 15, 16, 16, 17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22,
+    23, 23, 24, 24, 25, 25, 25, 26, 26, 27, 27, 27, 28, 28, 29, 29, 29, 30,
+    30, 30, 31, 31, 31, 32, 32
+};
+
+/* atan2 in 1/256 turn from an octant-reduced table */
+int fp_atan2_units(long y, long x) {
+    long ax, ay;
+    int a;
+    ax = x < 0 ? -x : x;
+    ay = y < 0 ? -y : y;
+    if (ax == 0 && ay == 0) return 0;
+    if (ay <= ax) a = fp_atan_units[(ay * 64 + ax / 2) / ax];
+    else a = 64 - fp_atan_units[(ax * 64 + ay / 2) / ay];
+    if (x < 0) a = 128 - a;
+    if (y < 0) a = -a;
+    return a & (FP_ANGLE_STEPS - 1);
+}
+
+static int fp_clamp(int v, int lo, int hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static void fp_stream_block_row(fp_stream *st, int b) {
+    const unsigned char *row, *up, *dn;
+    long sum, sumsq, gxx, gyy, gxy, gx, gy, mean, var;
+    int bx, x, y, v, si;
+
+    si = b & (FP_STAT_RING - 1);
+    for (bx = 0; bx < FP_BLK_COLS; bx++) {
+        sum = sumsq = gxx = gyy = gxy = 0;
+        for (y = b * FP_BLK; y < (b + 1) * FP_BLK; y++) {
+            row = FP_ROW(st, y);
+            up = FP_ROW(st, fp_clamp(y - 1, 0, FP_IMG_H - 1));
+            dn = FP_ROW(st, fp_clamp(y + 1, 0, FP_IMG_H - 1));
+            for (x = bx * FP_BLK; x < (bx + 1) * FP_BLK; x++) {
+                v = row[x];
+                sum += v;
+                sumsq += (long)v * v;
+                gx = (long)row[fp_clamp(x + 1, 0, FP_IMG_W - 1)] - row[fp_clamp(x - 1, 0, FP_IMG_W - 1)];
+                gy = (long)dn[x] - up[x];
+                gxx += gx * gx;
+                gyy += gy * gy;
+                gxy += gx * gy;
+            }
+        }
+        mean = sum / (FP_BLK * FP_BLK);
+        var = sumsq / (FP_BLK * FP_BLK) - mean * mean;
+        st->mean[si][bx] = (unsigned char)mean;
+        st->fg[si][bx] = (unsigned char)(var >= FP_SEG_MIN_VAR);
+        /* doubled-angle gradient average; ridges run perpendicular to it */
+        st->orient[si][bx] = (unsigned char)(((fp_atan2_units(2 * gxy, gxx - gyy) >> 1) + 64) & 127);
+    }
+}
+
+static int fp_stream_pixel(fp_stream *st, int x, int y) {
+    return FP_ROW(st, fp_clamp(y, 0, FP_IMG_H - 1))[fp_clamp(x, 0, FP_IMG_W - 1)];
+}
+
+/* Ridge pixels that are darkest within +-2 px across the ridge */
+static void fp_stream_skeleton_row(fp_stream *st, int y) {
+    unsigned char *out;
+    long c, s;
+    int x, bx, si, v, dx1, dy1, dx2, dy2;
+
+    out = st->skel[y & (FP_SKEL_RING - 1)];
+    memset(out, 0, FP_IMG_W);
+    si = (y / FP_BLK) & (FP_STAT_RING - 1);
+    for (bx = 0; bx < FP_BLK_COLS; bx++) {
+        if (!st->fg[si][bx]) continue;
+        c = fp_sin_q14(st->orient[si][bx] + 64 + FP_ANGLE_STEPS / 4);
+        s = fp_sin_q14(st->orient[si][bx] + 64);
+        dx1 = (int)fp_div_floor(c + 8192, 16384);
+        dy1 = (int)fp_div_floor(s + 8192, 16384);
+        dx2 = (int)fp_div_floor(2 * c + 8192, 16384);
+        dy2 = (int)fp_div_floor(2 * s + 8192, 16384);
+        for (x = bx * FP_BLK; x < (bx + 1) * FP_BLK; x++) {
+            v = FP_ROW(st, y)[x];
+            if (v >= st->mean[si][bx]) continue;
+            if (v > fp_stream_pixel(st, x + dx1, y + dy1) || v >= fp_stream_pixel(st, x - dx1, y - dy1)) continue;
+            if (v > fp_stream_pixel(st, x + dx2, y + dy2) || v >= fp_stream_pixel(st, x - dx2, y - dy2)) continue;
+            out[x] = 1;
+        }
+    }
+}
+
+static void fp_stream_minutiae_row(fp_stream *st, int y) {
+    static const signed char nx[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+    static const signed char ny[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+    const unsigned char *r[3];
+    int x, k, cn, last, bx, si, sp, ok, o, a, i;
+    unsigned char p[8];
+    fp_template *t;
+
+    if (y < FP_BLK || y >= FP_IMG_H - FP_BLK) return;
+    t = &st->out;
+    for (k = 0; k < 3; k++) r[k] = st->skel[(y - 1 + k) & (FP_SKEL_RING - 1)];
+    si = (y / FP_BLK) & (FP_STAT_RING - 1);
+    sp = (y / FP_BLK - 1) & (FP_STAT_RING - 1);
+    for (x = FP_BLK; x < FP_IMG_W - FP_BLK && t->count < FP_MAX_MINUTIAE; x++) {
+        if (!r[1][x]) continue;
+        for (k = 0; k < 8; k++) p[k] = r[1 + ny[k]][x + nx[k]];
+        cn = 0;
+        for (k = 0; k < 8; k++) cn += p[k] != p[(k + 1) & 7];
+        cn /= 2;
+        if (cn != 1 && cn != 3) continue;
+        /* stay clear of the segmentation edge, where breaks are artefacts */
+        bx = x / FP_BLK;
+        ok = 1;
+        for (k = -1; k <= 1 && ok; k++) ok = st->fg[si][bx + k] && st->fg[sp][bx + k];
+        for (i = 0; i < t->count && ok; i++) {
+            ok = abs(t->m[i].x - x) + abs(t->m[i].y - y) > FP_MINUTIA_SEP;
+        }
+        if (!ok) continue;
+        o = st->orient[si][bx];
+        if (cn == 1) {
+            /* point the ending away from the ridge it terminates */
+            last = 0;
+            for (k = 0; k < 8; k++) {
+                if (p[k]) last = k;
+            }
+            a = fp_atan2_units(-ny[last], -nx[last]);
+            if (fp_abs(fp_wrap_diff(a, o)) > 64) o += 128;
+        }
+        t->m[t->count].x = (short)x;
+        t->m[t->count].y = (short)y;
+        t->m[t->count].angle = (unsigned char)o;
+        t->m[t->count].type = (unsigned char)(cn == 1 ? FP_TYPE_ENDING : FP_TYPE_BIFURCATION);
+        t->count++;
+    }
+}
+
+/* Run every stage whose inputs are complete; final flushes the bottom edge */
+static void fp_stream_advance(fp_stream *st, int final) {
+    int progress, b, y;
+    do {
+        progress = 0;
+        b = st->blk_done;
+        if (b < FP_BLK_ROWS && (final || st->rows_in >= fp_clamp(b * FP_BLK + FP_BLK + 1, 0, FP_IMG_H))) {
+            fp_stream_block_row(st, b);
+            st->blk_done++;
+            progress = 1;
+        }
+        y = st->skel_done;
+        if (y < FP_IMG_H && st->blk_done > y / FP_BLK && (final || st->rows_in >= fp_clamp(y + 3, 0, FP_IMG_H))) {
+            fp_stream_skeleton_row(st, y);
+            st->skel_done++;
+            progress = 1;
+        }
+        y = st->cn_done;
+        if (y < FP_IMG_H && (st->skel_done > y + 1 || st->skel_done == FP_IMG_H)) {
+            fp_stream_minutiae_row(st, y);
+            st->cn_done++;
+            progress = 1;
+        }
+    } while (progress);
+}
+
+void fp_stream_begin(fp_stream *st) {
+    memset(st, 0, sizeof(*st));
+}
+
+/* Called from the sensor upload path for every received row */
+void fp_stream_push_row(fp_stream *st, const unsigned char *row) {
+    if (st->rows_in >= FP_IMG_H) return;
+    memcpy(FP_ROW(st, st->rows_in), row, FP_IMG_W);
+    st->rows_in++;
+    fp_stream_advance(st, 0);
+}
+
+/* After the last row: flush the tail and return the minutiae count */
+int fp_stream_finish(fp_stream *st, fp_template *t) {
+    fp_stream_advance(st, 1);
+    *t = st->out;
+    return t->count;
+}
+
+/* ========================= WIEGAND READERS ========================= */
+
+/*
+ * Wiegand D0/D1 input. Each line goes to a timer capture input (CAP0.x /
+ * CAP1.x), so the edge time is latched by hardware; the capture ISR only
+ * pushes (time, bit) into that reader's ring. wiegand_poll() runs from the
+ * main loop, assembles bits into frames (a frame ends after
+ * WG_FRAME_GAP_US of silence), checks length and parity, and queues the
+ * decoded cards. Readers never share a ring, so each is single producer /
+ * single consumer and needs no locking.
+ */
+#ifndef WG_MAX_READERS
+#if defined(HOST_TOOLS)
+#define WG_MAX_READERS 64
+#else
+#define WG_MAX_READERS 4
+#endif
+#endif
+#define WG_RING 64              /* edges per reader, power of two */
+#define WG_MAX_BITS 40
+#define WG_FRAME_GAP_US 20000UL
+#define WG_MIN_BIT_US 200UL     /* closer edges are line noise */
+#define WG_FRAME_QUEUE (2 * WG_MAX_READERS) /* WG_MAX_READERS must be a power of two */
+#ifndef WG_SITE_FACILITY
+#define WG_SITE_FACILITY 1      /* badges with another facility code are foreign */
+#endif
+
+typedef struct {
+    unsigned char reader;
+    unsigned char bits;
+    unsigned char ok;           /* length and parity valid */
+    unsigned long facility;
+    unsigned long card;
+} wg_frame;
+
+typedef struct {
+    unsigned long t[WG_RING];
+    unsigned char bit[WG_RING];
+    volatile unsigned int head; /* written by the ISR */
+    volatile unsigned int tail; /* written by wiegand_poll */
+    /* deferred side */
+    unsigned char raw[WG_MAX_BITS / 8];
+    int nbits;
+    unsigned long last_t;
+} wg_reader;
+
+static wg_reader wg_readers[WG_MAX_READERS];
+static wg_frame wg_frames[WG_FRAME_QUEUE];
+static unsigned int wg_frame_head, wg_frame_tail;
+
+/* Card formats by length: parity spans are 1..half and bits-1-half..bits-2 */
+static const unsigned char wg_formats[][4] = {
+    /* bits, half, facility bits, card bits */
+    { 26, 12, 8, 16 },          /* H10301 */
+    { 34, 16, 16, 16 },         /* H10306 */
+    { 37, 18, 16, 19 }          /* H10304 */
+};
+#define WG_FORMATS ((int)(sizeof(wg_formats) / sizeof(wg_formats[0])))
+
+/* Capture ISR entry: line is 0 for D0, 1 for D1 */
+void wiegand_edge_isr(int reader, int line, unsigned long t_us) {
+    wg_reader *r;
+    unsigned int h;
+    r = &wg_readers[reader];
+    h = r->head;
+    if (h - r->tail == WG_RING) {
+        metrics_add_shard(METRICS_SHARD_ISR, MET_WIEGAND_OVERRUNS, 1);
+        return;
+    }
+    r->t[h & (WG_RING - 1)] = t_us;
+    r->bit[h & (WG_RING - 1)] = (unsigned char)line;
+    r->head = h + 1;
+}
+
+static int wg_raw_bit(const unsigned char *raw, int i) {
+    return (raw[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static unsigned long wg_field(const unsigned char *raw, int from, int len) {
+    unsigned long v;
+    int i;
+    v = 0;
+    for (i = 0; i < len; i++) v = (v << 1) | (unsigned long)wg_raw_bit(raw, from + i);
+    return v;
+}
+
+/* Check length and parity of a raw bit string and queue the decoded card */
+static void wg_queue_frame(const unsigned char *raw, int nbits, int reader) {
+    const unsigned char *fmt;
+    wg_frame *f;
+    int i, k, even, odd;
+
+    if (wg_frame_head - wg_frame_tail == WG_FRAME_QUEUE) wg_frame_tail++; /* keep the newest */
+    f = &wg_frames[wg_frame_head & (WG_FRAME_QUEUE - 1)];
+    f->reader = (unsigned char)reader;
+    f->bits = (unsigned char)nbits;
+    f->ok = 0;
+    f->facility = f->card = 0;
+    for (k = 0; k < WG_FORMATS; k++) {
+        fmt = wg_formats[k];
+        if (fmt[0] != nbits) continue;
+        even = odd = 0;
+        for (i = 0; i <= fmt[1]; i++) even ^= wg_raw_bit(raw, i);
+        for (i = fmt[0] - 1 - fmt[1]; i < fmt[0]; i++) odd ^= wg_raw_bit(raw, i);
+        f->ok = even == 0 && odd == 1;
+        f->facility = wg_field(raw, 1, fmt[2]);
+        f->card = wg_field(raw, 1 + fmt[2], fmt[3]);
+    }
+    metrics_add(f->ok ? MET_WIEGAND_FRAMES : MET_WIEGAND_ERRORS, 1);
+    wg_frame_head++;
+}
+
+static void wg_finish_frame(wg_reader *r, int reader) {
+    if (r->nbits == 0) return;
+    wg_queue_frame(r->raw, r->nbits, reader);
+    r->nbits = 0;
+    memset(r->raw, 0, sizeof(r->raw));
+}
+
+/* Deferred handler: drain every ring, close frames that have gone quiet */
+void wiegand_poll(unsigned long now_us) {
+    wg_reader *r;
+    unsigned int tail, head;
+    unsigned long t;
+    int i;
+
+    for (i = 0; i < WG_MAX_READERS; i++) {
+        r = &wg_readers[i];
+        head = r->head;
+        for (tail = r->tail; tail != head; tail++) {
+            t = r->t[tail & (WG_RING - 1)];
+            if (r->nbits > 0 && t - r->last_t > WG_FRAME_GAP_US) wg_finish_frame(r, i);
+            if (r->nbits > 0 && t - r->last_t < WG_MIN_BIT_US) continue;
+            if (r->nbits < WG_MAX_BITS) {
+                if (r->bit[tail & (WG_RING - 1)]) r->raw[r->nbits >> 3] |= (unsigned char)(0x80 >> (r->nbits & 7));
+                r->nbits++;
+            }
+            r->last_t = t;
+        }
+        r->tail = tail;
+        if (r->nbits > 0 && now_us - r->last_t > WG_FRAME_GAP_US) wg_finish_frame(r, i);
+    }
+}
+
+static unsigned long wg_edge_depth(void) {
+    unsigned int d, most;
+    int i;
+    most = 0;
+    for (i = 0; i < WG_MAX_READERS; i++) {
+        d = wg_readers[i].head - wg_readers[i].tail;
+        if (d > most) most = d;
+    }
+    return most;
+}
+
+static unsigned long wg_frame_depth(void) {
+    return wg_frame_head - wg_frame_tail;
+}
+
+/* Empty every ring and the frame queue */
+void wiegand_init(void) {
+    memset(wg_readers, 0, sizeof(wg_readers));
+    wg_frame_head = wg_frame_tail = 0;
+    metrics_gauge_attach(MET_GAUGE_WIEGAND_EDGES, wg_edge_depth);
+    metrics_gauge_attach(MET_GAUGE_WIEGAND_FRAMES, wg_frame_depth);
+}
+
+int wiegand_read_frame(wg_frame *out) {
+    if (wg_frame_tail == wg_frame_head) return 0;
+    *out = wg_frames[wg_frame_tail & (WG_FRAME_QUEUE - 1)];
+    wg_frame_tail++;
+    return 1;
+}
+
+/* Encode a card with correct parity; returns the bit count or -1 */
+int wiegand_encode(int bits, unsigned long facility, unsigned long card, unsigned char *raw) {
+    const unsigned char *fmt;
+    int i, k, p;
+
+    for (k = 0; k < WG_FORMATS && wg_formats[k][0] != bits; k++) {
+    }
+    if (k == WG_FORMATS) return -1;
+    fmt = wg_formats[k];
+    memset(raw, 0, WG_MAX_BITS / 8);
+    for (i = 0; i < fmt[2]; i++) {
+        if ((facility >> (fmt[2] - 1 - i)) & 1) raw[(1 + i) >> 3] |= (unsigned char)(0x80 >> ((1 + i) & 7));
+    }
+    for (i = 0; i < fmt[3]; i++) {
+        p = 1 + fmt[2] + i;
+        if ((card >> (fmt[3] - 1 - i)) & 1) raw[p >> 3] |= (unsigned char)(0x80 >> (p & 7));
+    }
+    p = 0;
+    for (i = 1; i <= fmt[1]; i++) p ^= wg_raw_bit(raw, i);
+    if (p) raw[0] |= 0x80;
+    p = 1;
+    for (i = bits - 1 - fmt[1]; i < bits - 1; i++) p ^= wg_raw_bit(raw, i);
+    if (p) raw[(bits - 1) >> 3] |= (unsigned char)(0x80 >> ((bits - 1) & 7));
+    return bits;
+}
+
+#if defined(HOST_POSIX)
+#define WG_STUB_BIT_US 2000UL
+
+/*
+ * Reader stub: ask for a card and play it into reader 0 as captured edges.
+ * Numbers that fit 16 bits are site badges (26-bit); larger ones go out as
+ * 37-bit frames under a foreign facility code.
+ */
+void wiegand_stub_present_card(void) {
+    char temp[32];
+    unsigned char raw[WG_MAX_BITS / 8];
+    unsigned long t, card;
+    int i, n;
+
+    printf("[WIEGAND] Enter card number: ");
+    if (replay_file) {
+        replay_take_card(temp, sizeof(temp));
+        printf("%s\n", temp);
+    } else if (scanf("%31s", temp) != 1) {
+        return;
+    }
+    card = strtoul(temp, 0, 10);
+    if (card <= 0xFFFFUL) n = wiegand_encode(26, WG_SITE_FACILITY, card, raw);
+    else n = wiegand_encode(37, 0x8000UL | ((card >> 19) & 0x7FFFUL), card & 0x7FFFFUL, raw);
+    t = timer_now_us() - WG_FRAME_GAP_US - (unsigned long)n * WG_STUB_BIT_US;
+    for (i = 0; i < n; i++) wiegand_edge_isr(0, wg_raw_bit(raw, i), t + (unsigned long)i * WG_STUB_BIT_US);
+}
+#endif
+
+/* ========================= OSDP READER BUS ========================= */
+
+/*
+ * OSDP control panel for readers multi-dropped on one RS-485 pair (UART1,
+ * half duplex). Only one frame is on the wire at a time, so the scheduler
+ * decides who gets the bus next:
+ *  - stride scheduling: a reader that produced a card within
+ *    OSDP_ACTIVE_US is polled every pass, an idle one every
+ *    osdp_idle_stride passes, an offline one every OSDP_OFFLINE_STRIDE
+ *  - the next command is built while the reply is on the wire and goes out
+ *    from the receive path as soon as the reply checks, so the bus does
+ *    not sit idle until the main loop comes round
+ *  - LED and buzzer requests are latched per reader and sent in that
+ *    reader's next slot; any number of updates in between cost one frame
+ *    each, and output frames do not push back the reader's next poll
+ * Card replies (osdp_RAW, Wiegand bit string) go through the Wiegand
+ * decoder and into its frame queue, tagged with the reader address.
+ */
+#ifndef OSDP_MAX_PD
+#define OSDP_MAX_PD 32
+#endif
+#define OSDP_SOM 0x53
+#define OSDP_REPLY_BIT 0x80
+#define OSDP_CTRL_CRC 0x04
+#define OSDP_HEADER 6           /* SOM, address, length (2), control, code */
+#define OSDP_MAX_PACKET 64
+#define OSDP_CMD_POLL 0x60
+#define OSDP_CMD_LED 0x69
+#define OSDP_CMD_BUZ 0x6A
+#define OSDP_REPLY_ACK 0x40
+#define OSDP_REPLY_NAK 0x41
+#define OSDP_REPLY_RAW 0x50
+#define OSDP_LED_RECORD 14
+#define OSDP_LEDS 2             /* LED records a reader can have pending */
+#define OSDP_REPLY_TIMEOUT_US 200000UL
+#define OSDP_ACTIVE_US 5000000UL
+#define OSDP_IDLE_STRIDE 3
+#define OSDP_OFFLINE_STRIDE 8
+#define OSDP_COLOR_RED 1
+#define OSDP_COLOR_GREEN 2
+
+typedef struct {
+    unsigned long pass;         /* stride scheduler virtual time */
+    unsigned long last_card_us;
+    unsigned char sqn;          /* 0 after reset, then 1..3 */
+    unsigned char online;
+    unsigned char has_card;     /* last_card_us is valid */
+    unsigned char led[OSDP_LEDS]; /* pending temporary colour + 1, 0 = none */
+    unsigned char beeps;        /* pending buzzer repeat count */
+} osdp_pd;
+
+static struct {
+    osdp_pd pd[OSDP_MAX_PD];
+    int count;
+    int adaptive;
+    int busy;                   /* address awaiting a reply, -1 when the bus is free */
+    int busy_poll;              /* that command was a poll */
+    unsigned long sent_us;
+    unsigned long vt;           /* pass of the last reader served */
+    unsigned char next[OSDP_MAX_PACKET];
+    int next_len, next_pd, next_poll;
+    unsigned char rx[OSDP_MAX_PACKET];
+    int rx_len;
+    void (*tx)(const unsigned char *buf, int len);
+} osdp;
+
+static int osdp_idle_stride = OSDP_IDLE_STRIDE;
+
+/* CRC-16/AUG-CCITT: poly 0x1021, seed 0x1D0F, sent low byte first */
+unsigned int osdp_crc16(const unsigned char *p, int n) {
+    unsigned int crc;
+    int i, k;
+    crc = 0x1D0F;
+    for (i = 0; i < n; i++) {
+        crc ^= (unsigned int)p[i] << 8;
+        for (k = 0; k < 8; k++) crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) & 0xFFFF : (crc << 1) & 0xFFFF;
+    }
+    return crc;
+}
+
+/* Frame a command or reply; returns its length */
+int osdp_build(int addr, int sqn, int code, const unsigned char *data, int dlen, unsigned char *out) {
+    unsigned int crc;
+    int n;
+    n = OSDP_HEADER + dlen + 2;
+    out[0] = OSDP_SOM;
+    out[1] = (unsigned char)addr;
+    out[2] = (unsigned char)(n & 0xFF);
+    out[3] = (unsigned char)(n >> 8);
+    out[4] = (unsigned char)((sqn & 3) | OSDP_CTRL_CRC);
+    out[5] = (unsigned char)code;
+    if (dlen > 0) memcpy(out + OSDP_HEADER, data, (size_t)dlen);
+    crc = osdp_crc16(out, n - 2);
+    out[n - 2] = (unsigned char)(crc & 0xFF);
+    out[n - 1] = (unsigned char)(crc >> 8);
+    return n;
+}
+
+/* Feed one received byte to a frame assembler; returns the frame length once complete */
+int osdp_frame_byte(unsigned char *buf, int *len, unsigned char b) {
+    int n;
+    if (*len == 0 && b != OSDP_SOM) return 0;
+    buf[(*len)++] = b;
+    if (*len < 4) return 0;
+    n = buf[2] | (buf[3] << 8);
+    if (n < OSDP_HEADER + 2 || n > OSDP_MAX_PACKET) {
+        *len = 0;
+        metrics_add(MET_OSDP_BAD_FRAMES, 1);
+        return 0;
+    }
+    if (*len < n) return 0;
+    *len = 0;
+    if (osdp_crc16(buf, n - 2) != (unsigned int)(buf[n - 2] | (buf[n - 1] << 8))) {
+        metrics_add(MET_OSDP_BAD_FRAMES, 1);
+        return 0;
+    }
+    return n;
+}
+
+static unsigned long osdp_stride(const osdp_pd *p, unsigned long now) {
+    if (!osdp.adaptive) return 1;
+    if (!p->online) return OSDP_OFFLINE_STRIDE;
+    if (p->has_card && now - p->last_card_us < OSDP_ACTIVE_US) return 1;
+    return (unsigned long)osdp_idle_stride;
+}
+
+/* Choose the next reader and build its command into osdp.next */
+static void osdp_prepare(unsigned long now) {
+    unsigned char data[OSDP_LEDS * OSDP_LED_RECORD];
+    unsigned char *rec;
+    osdp_pd *p;
+    int i, k, best, n;
+
+    best = 0;
+    for (i = 1; i < osdp.count; i++) {
+        if ((long)(osdp.pd[i].pass - osdp.pd[best].pass) < 0) best = i;
+    }
+    p = &osdp.pd[best];
+    n = 0;
+    for (k = 0; k < OSDP_LEDS; k++) {
+        if (!p->led[k]) continue;
+        /* temporary colour for 1 s, then back to the permanent off state */
+        rec = data + n;
+        memset(rec, 0, OSDP_LED_RECORD);
+        rec[1] = (unsigned char)k;
+        rec[2] = 2;
+        rec[3] = 5;
+        rec[5] = (unsigned char)(p->led[k] - 1);
+        rec[7] = 10;
+        rec[9] = 1;
+        n += OSDP_LED_RECORD;
+        p->led[k] = 0;
+    }
+    osdp.next_pd = best;
+    osdp.next_poll = 0;
+    if (n > 0) {
+        osdp.next_len = osdp_build(best, p->sqn, OSDP_CMD_LED, data, n, osdp.next);
+    } else if (p->beeps) {
+        data[0] = 0;
+        data[1] = 2;
+        data[2] = 1;
+        data[3] = 1;
+        data[4] = p->beeps;
+        p->beeps = 0;
+        osdp.next_len = osdp_build(best, p->sqn, OSDP_CMD_BUZ, data, 5, osdp.next);
+    } else {
+        osdp.next_len = osdp_build(best, p->sqn, OSDP_CMD_POLL, 0, 0, osdp.next);
+        osdp.next_poll = 1;
+        osdp.vt = p->pass;
+        p->pass += osdp_stride(p, now);
+    }
+}
+
+/* Put the prepared command on the bus and prepare the one after it */
+static void osdp_send(unsigned long now) {
+    unsigned char *f;
+    unsigned int crc;
+    int n;
+
+    /* the sequence number is only known once the previous reply is in */
+    f = osdp.next;
+    n = osdp.next_len;
+    if ((f[4] & 3) != osdp.pd[osdp.next_pd].sqn) {
+        f[4] = (unsigned char)((f[4] & ~3) | osdp.pd[osdp.next_pd].sqn);
+        crc = osdp_crc16(f, n - 2);
+        f[n - 2] = (unsigned char)(crc & 0xFF);
+        f[n - 1] = (unsigned char)(crc >> 8);
+    }
+    osdp.busy = osdp.next_pd;
+    osdp.busy_poll = osdp.next_poll;
+    osdp.sent_us = now;
+    if (osdp.next_poll) metrics_add(MET_OSDP_POLLS, 1);
+    osdp.tx(osdp.next, osdp.next_len);
+    osdp_prepare(now);
+}
+
+/* The command on the bus plus the LED and buzzer output readers are still owed */
+static unsigned long osdp_pending(void) {
+    unsigned long n;
+    int i, k;
+    n = osdp.busy >= 0;
+    for (i = 0; i < osdp.count; i++) {
+        for (k = 0; k < OSDP_LEDS; k++) n += osdp.pd[i].led[k] != 0;
+        n += osdp.pd[i].beeps != 0;
+    }
+    return n;
+}
+
+void osdp_init(int count, int adaptive, void (*tx)(const unsigned char *buf, int len)) {
+    memset(&osdp, 0, sizeof(osdp));
+    osdp.count = count < 1 ? 1 : (count > OSDP_MAX_PD ? OSDP_MAX_PD : count);
+    osdp.adaptive = adaptive;
+    osdp.busy = -1;
+    osdp.tx = tx;
+    osdp_prepare(0);
+    metrics_gauge_attach(MET_GAUGE_OSDP_PENDING, osdp_pending);
+}
+
+/* Latch feedback for a reader: green or red flash, one or three beeps */
+void osdp_feedback(int pd, int granted) {
+    if (pd < 0 || pd >= osdp.count) return;
+    osdp.pd[pd].led[0] = (unsigned char)((granted ? OSDP_COLOR_GREEN : OSDP_COLOR_RED) + 1);
+    osdp.pd[pd].beeps = (unsigned char)(granted ? 1 : 3);
+    if (osdp.next_poll && osdp.next_pd == pd) {
+        /* undo the pass charged for the prepared poll and build the output instead */
+        osdp.pd[pd].pass = osdp.vt;
+        osdp_prepare(timer_now_us());
+    }
+}
+
+static void osdp_reply(const unsigned char *f, int n, unsigned long now) {
+    osdp_pd *p;
+    int bits;
+
+    p = &osdp.pd[osdp.busy];
+    if (f[1] != (OSDP_REPLY_BIT | osdp.busy) || (f[4] & 3) != p->sqn) {
+        metrics_add(MET_OSDP_BAD_FRAMES, 1);
+        return;
+    }
+    if (!p->online) {
+        /* back from offline: due now rather than at its stale pass */
+        p->online = 1;
+        if ((long)(p->pass - osdp.vt) > 0) p->pass = osdp.vt + 1;
+    }
+    p->sqn = (unsigned char)(p->sqn % 3 + 1);
+    if (f[5] == OSDP_REPLY_RAW && n >= OSDP_HEADER + 4 + 2) {
+        bits = f[OSDP_HEADER + 2] | (f[OSDP_HEADER + 3] << 8);
+        if (bits > 0 && bits <= WG_MAX_BITS && (bits + 7) / 8 <= n - OSDP_HEADER - 4 - 2) {
+            wg_queue_frame(f + OSDP_HEADER + 4, bits, osdp.busy);
+            p->last_card_us = now;
+            p->has_card = 1;
+            /* a reader that just went active is due in the next pass */
+            if ((long)(p->pass - (osdp.vt + 1)) > 0) p->pass = osdp.vt + 1;
+        }
+    }
+    osdp.busy = -1;
+    osdp_send(now);
+}
+
+/* Receive path; on target this runs from the UART1 RX interrupt */
+void osdp_rx_byte(unsigned char b, unsigned long now) {
+    int n;
+    n = osdp_frame_byte(osdp.rx, &osdp.rx_len, b);
+    if (n > 0 && osdp.busy >= 0) osdp_reply(osdp.rx, n, now);
+}
+
+/* Start the bus if it is free and expire a reply that never came */
+void osdp_tick(unsigned long now) {
+    osdp_pd *p;
+    if (osdp.busy >= 0) {
+        if (now - osdp.sent_us < OSDP_REPLY_TIMEOUT_US) return;
+        p = &osdp.pd[osdp.busy];
+        p->online = 0;
+        p->sqn = 0;
+        osdp.rx_len = 0;
+        osdp.busy = -1;
+        metrics_add(MET_OSDP_TIMEOUTS, 1);
+    }
+    osdp_send(now);
+}
+
+#if defined(RFID_OSDP) && !defined(HOST_TOOLS)
+#define OSDP_READERS 1
+#define OSDP_BAUD 9600UL
+
+#if defined(HOST_POSIX)
+/*
+ * Reader stub: a single reader at address 0 answering on a loopback
+ * "bus". A poll asks for a card only while the door loop is waiting for
+ * one (osdp_stub_armed); everything else gets an ACK.
+ */
+static unsigned char osdp_stub_out[OSDP_MAX_PACKET];
+static int osdp_stub_out_len, osdp_stub_out_pos, osdp_stub_armed;
+
+static void uart1_rs485_send(const unsigned char *buf, int len) {
+    unsigned char data[4 + WG_MAX_BITS / 8];
+    char temp[32];
+    unsigned long card;
+    int bits;
+
+    if (buf[1] != 0) return;
+    if (buf[5] == OSDP_CMD_POLL && osdp_stub_armed) {
+        printf("[OSDP] Enter card number: ");
+        if (replay_file) {
+            replay_take_card(temp, sizeof(temp));
+            printf("%s\n", temp);
+        } else if (scanf("%31s", temp) != 1) {
+            return;
+        }
+        card = strtoul(temp, 0, 10);
+        if (card <= 0xFFFFUL) bits = wiegand_encode(26, WG_SITE_FACILITY, card, data + 4);
+        else bits = wiegand_encode(37, 0x8000UL | ((card >> 19) & 0x7FFFUL), card & 0x7FFFFUL, data + 4);
+        data[0] = 0;
+        data[1] = 1;
+        data[2] = (unsigned char)bits;
+        data[3] = 0;
+        osdp_stub_armed = 0;
+        osdp_stub_out_len = osdp_build(OSDP_REPLY_BIT, buf[4], OSDP_REPLY_RAW, data, 4 + (bits + 7) / 8, osdp_stub_out);
+    } else {
+        if (buf[5] == OSDP_CMD_LED) printf("[OSDP] Reader 0 LED colour %d\n", buf[OSDP_HEADER + 5]);
+        if (buf[5] == OSDP_CMD_BUZ) printf("[OSDP] Reader 0 beep x%d\n", buf[OSDP_HEADER + 4]);
+        osdp_stub_out_len = osdp_build(OSDP_REPLY_BIT, buf[4], OSDP_REPLY_ACK, 0, 0, osdp_stub_out);
+    }
+    (void)len;
+    osdp_stub_out_pos = 0;
+}
+
+static int uart1_rs485_read_byte(void) {
+    if (osdp_stub_out_pos >= osdp_stub_out_len) return -1;
+    return osdp_stub_out[osdp_stub_out_pos++];
+}
+#else
+/* UART1 in RS-485 mode; the driver raises DE for the frame and drops it after the stop bit */
+static void uart1_rs485_send(const unsigned char *buf, int len) {
+    (void)buf;
+    (void)len;
+}
+static int uart1_rs485_read_byte(void) { return -1; }
+#endif
+
+static void uart1_rs485_init(unsigned long baud) {
+    printf("[RS485] Init at %lu baud, %d reader(s)\n", baud, OSDP_READERS);
+    osdp_init(OSDP_READERS, 1, uart1_rs485_send);
+}
+
+/* Main-loop side: drain what has arrived (one frame's worth) and keep the bus moving */
+static void osdp_service(unsigned long now) {
+    int b, n;
+    for (n = 0; n < OSDP_MAX_PACKET && (b = uart1_rs485_read_byte()) >= 0; n++) osdp_rx_byte((unsigned char)b, now);
+    osdp_tick(now);
+}
+#endif
+
+/* ========================= AES-128 AND SECURE CHANNEL ========================= */
+
+/*
+ * AES-128 without lookup tables. The state is bitsliced into eight 32-bit
+ * planes (plane i holds bit i of every state byte) and two blocks, "lanes",
+ * share each pass, so timing does not depend on key or data and nothing
+ * is fetched from flash through the wait states. Inside a plane a byte
+ * sits at bit 8*row + 2*column + lane: the MixColumns row rotations become
+ * 32-bit rotates, which the ARM7 barrel shifter folds into the XOR, and
+ * ShiftRows becomes a rotate inside each byte. One column of a block is
+ * one little-endian word, so packing takes twelve SWAPMOVEs rather than
+ * a bit loop. The S-box is the Boyar-Peralta circuit (113 gates); the
+ * inverse S-box wraps it in the inverse affine map.
+ *
+ * Round keys are packed per lane, so one schedule can hold two keys; the
+ * secure channel runs encryption in lane 0 and its MAC in lane 1. The
+ * modes fill the second lane where they can: CTR and CBC decryption pair
+ * neighbouring blocks, CBC encryption and CMAC pair independent frames in
+ * the *_batch calls. Host tool builds switch to AES-NI when the CPU has it.
+ */
+#define AES_BLOCK 16
+#define AES_ROUNDS 10
+#define AES_W32 0xFFFFFFFFUL
+#define AES_ROTR(x, n) ((((x) >> (n)) | ((x) << (32 - (n)))) & AES_W32)
+
+typedef struct {
+    unsigned long rk[AES_ROUNDS + 1][8];
+    unsigned char k1[2][AES_BLOCK];     /* CMAC subkeys, per lane */
+    unsigned char k2[2][AES_BLOCK];
+#if defined(AES_HAVE_NI)
+    unsigned char rkb[2][AES_ROUNDS + 1][AES_BLOCK];
+#endif
+} aes128_key;
+
+/* One CBC or CMAC chain for the batch calls */
+typedef struct {
+    unsigned char *data;
+    int len;                    /* CBC: whole blocks only */
+    unsigned char iv[AES_BLOCK];  /* CBC: IV in, last ciphertext block out; CTR: counter */
+    unsigned char mac[AES_BLOCK]; /* CMAC out */
+} aes_job;
+
+static const unsigned char aes_zero_block[AES_BLOCK];
+
+static void aes_swapmove(unsigned long *a, unsigned long *b, unsigned long mask, int n) {
+    unsigned long t;
+    t = ((*b >> n) ^ *a) & mask;
+    *a ^= t;
+    *b ^= t << n;
+}
+
+/* 8x8 bit transpose inside every byte position of w[0..7]; its own inverse run backwards */
+static void aes_transpose(unsigned long *w, int inverse) {
+    int k, st;
+    for (k = 0; k < 3; k++) {
+        st = inverse ? 2 - k : k;
+        if (st == 0) {
+            aes_swapmove(&w[0], &w[1], 0x55555555UL, 1);
+            aes_swapmove(&w[2], &w[3], 0x55555555UL, 1);
+            aes_swapmove(&w[4], &w[5], 0x55555555UL, 1);
+            aes_swapmove(&w[6], &w[7], 0x55555555UL, 1);
+        } else if (st == 1) {
+            aes_swapmove(&w[0], &w[2], 0x33333333UL, 2);
+            aes_swapmove(&w[1], &w[3], 0x33333333UL, 2);
+            aes_swapmove(&w[4], &w[6], 0x33333333UL, 2);
+            aes_swapmove(&w[5], &w[7], 0x33333333UL, 2);
+        } else {
+            aes_swapmove(&w[0], &w[4], 0x0F0F0F0FUL, 4);
+            aes_swapmove(&w[1], &w[5], 0x0F0F0F0FUL, 4);
+            aes_swapmove(&w[2], &w[6], 0x0F0F0F0FUL, 4);
+            aes_swapmove(&w[3], &w[7], 0x0F0F0F0FUL, 4);
+        }
+    }
+}
+
+/* Word 7 - (2*column + lane) holds that column; after the transpose word k is plane 7 - k */
+static void aes_pack(unsigned long *s, const unsigned char *a, const unsigned char *b) {
+    unsigned long w[8];
+    const unsigned char *p;
+    int c, k;
+
+    for (c = 0; c < 4; c++) {
+        p = a + 4 * c;
+        w[7 - 2 * c] = p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+        p = b + 4 * c;
+        w[6 - 2 * c] = p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+    }
+    aes_transpose(w, 0);
+    for (k = 0; k < 8; k++) s[7 - k] = w[k];
+}
+
+static void aes_unpack(unsigned char *a, unsigned char *b, const unsigned long *s) {
+    unsigned long w[8], v;
+    int c, k, r;
+
+    for (k = 0; k < 8; k++) w[k] = s[7 - k] & AES_W32;
+    aes_transpose(w, 1);
+    for (c = 0; c < 4; c++) {
+        for (r = 0; r < 4; r++) {
+            v = w[7 - 2 * c] >> (8 * r);
+            if (a) a[4 * c + r] = (unsigned char)v;
+            v = w[6 - 2 * c] >> (8 * r);
+            if (b) b[4 * c + r] = (unsigned char)v;
+        }
+    }
+}
+
+/* S-box on every byte: Boyar-Peralta, U0/S0 are the most significant bits */
+static void aes_sub_bytes(unsigned long *s) {
+    unsigned long U0, U1, U2, U3, U4, U5, U6, U7;
+    unsigned long T1, T2, T3, T4, T5, T6, T7, T8, T9, T10, T11, T12, T13, T14, T15, T16;
+    unsigned long T17, T18, T19, T20, T21, T22, T23, T24, T25, T26, T27;
+    unsigned long M1, M2, M3, M4, M5, M6, M7, M8, M9, M10, M11, M12, M13, M14, M15, M16;
+    unsigned long M17, M18, M19, M20, M21, M22, M23, M24, M25, M26, M27, M28, M29, M30, M31, M32;
+    unsigned long M33, M34, M35, M36, M37, M38, M39, M40, M41, M42, M43, M44, M45, M46, M47, M48;
+    unsigned long M49, M50, M51, M52, M53, M54, M55, M56, M57, M58, M59, M60, M61, M62, M63;
+    unsigned long L0, L1, L2, L3, L4, L5, L6, L7, L8, L9, L10, L11, L12, L13, L14, L15;
+    unsigned long L16, L17, L18, L19, L20, L21, L22, L23, L24, L25, L26, L27, L28, L29;
+
+    U0 = s[7];
+    U1 = s[6];
+    U2 = s[5];
+    U3 = s[4];
+    U4 = s[3];
+    U5 = s[2];
+    U6 = s[1];
+    U7 = s[0];
+
+    /* top linear layer */
+    T1 = U0 ^ U3;
+    T2 = U0 ^ U5;
+    T3 = U0 ^ U6;
+    T4 = U3 ^ U5;
+    T5 = U4 ^ U6;
+    T6 = T1 ^ T5;
+    T7 = U1 ^ U2;
+    T8 = U7 ^ T6;
+    T9 = U7 ^ T7;
+    T10 = T6 ^ T7;
+    T11 = U1 ^ U5;
+    T12 = U2 ^ U5;
+    T13 = T3 ^ T4;
+    T14 = T6 ^ T11;
+    T15 = T5 ^ T11;
+    T16 = T5 ^ T12;
+    T17 = T9 ^ T16;
+    T18 = U3 ^ U7;
+    T19 = T7 ^ T18;
+    T20 = T1 ^ T19;
+    T21 = U6 ^ U7;
+    T22 = T7 ^ T21;
+    T23 = T2 ^ T22;
+    T24 = T2 ^ T10;
+    T25 = T20 ^ T17;
+    T26 = T3 ^ T16;
+    T27 = T1 ^ T12;
+
+    /* shared non-linear middle (GF(2^4) inversion) */
+    M1 = T13 & T6;
+    M2 = T23 & T8;
+    M3 = T14 ^ M1;
+    M4 = T19 & U7;
+    M5 = M4 ^ M1;
+    M6 = T3 & T16;
+    M7 = T22 & T9;
+    M8 = T26 ^ M6;
+    M9 = T20 & T17;
+    M10 = M9 ^ M6;
+    M11 = T1 & T15;
+    M12 = T4 & T27;
+    M13 = M12 ^ M11;
+    M14 = T2 & T10;
+    M15 = M14 ^ M11;
+    M16 = M3 ^ M2;
+    M17 = M5 ^ T24;
+    M18 = M8 ^ M7;
+    M19 = M10 ^ M15;
+    M20 = M16 ^ M13;
+    M21 = M17 ^ M15;
+    M22 = M18 ^ M13;
+    M23 = M19 ^ T25;
+    M24 = M22 ^ M23;
+    M25 = M22 & M20;
+    M26 = M21 ^ M25;
+    M27 = M20 ^ M21;
+    M28 = M23 ^ M25;
+    M29 = M28 & M27;
+    M30 = M26 & M24;
+    M31 = M20 & M23;
+    M32 = M27 & M31;
+    M33 = M27 ^ M25;
+    M34 = M21 & M22;
+    M35 = M24 & M34;
+    M36 = M24 ^ M25;
+    M37 = M21 ^ M29;
+    M38 = M32 ^ M33;
+    M39 = M23 ^ M30;
+    M40 = M35 ^ M36;
+    M41 = M38 ^ M40;
+    M42 = M37 ^ M39;
+    M43 = M37 ^ M38;
+    M44 = M39 ^ M40;
+    M45 = M42 ^ M41;
+    M46 = M44 & T6;
+    M47 = M40 & T8;
+    M48 = M39 & U7;
+    M49 = M43 & T16;
+    M50 = M38 & T9;
+    M51 = M37 & T17;
+    M52 = M42 & T15;
+    M53 = M45 & T27;
+    M54 = M41 & T10;
+    M55 = M44 & T13;
+    M56 = M40 & T23;
+    M57 = M39 & T19;
+    M58 = M43 & T3;
+    M59 = M38 & T22;
+    M60 = M37 & T20;
+    M61 = M42 & T1;
+    M62 = M45 & T4;
+    M63 = M41 & T2;
+
+    /* bottom linear layer, affine constant folded into the XNORs */
+    L0 = M61 ^ M62;
+    L1 = M50 ^ M56;
+    L2 = M46 ^ M48;
+    L3 = M47 ^ M55;
+    L4 = M54 ^ M58;
+    L5 = M49 ^ M61;
+    L6 = M62 ^ L5;
+    L7 = M46 ^ L3;
+    L8 = M51 ^ M59;
+    L9 = M52 ^ M53;
+    L10 = M53 ^ L4;
+    L11 = M60 ^ L2;
+    L12 = M48 ^ M51;
+    L13 = M50 ^ L0;
+    L14 = M52 ^ M61;
+    L15 = M55 ^ L1;
+    L16 = M56 ^ L0;
+    L17 = M57 ^ L1;
+    L18 = M58 ^ L8;
+    L19 = M63 ^ L4;
+    L20 = L0 ^ L1;
+    L21 = L1 ^ L7;
+    L22 = L3 ^ L12;
+    L23 = L18 ^ L2;
+    L24 = L15 ^ L9;
+    L25 = L6 ^ L10;
+    L26 = L7 ^ L9;
+    L27 = L8 ^ L10;
+    L28 = L11 ^ L14;
+    L29 = L11 ^ L17;
+    s[7] = L6 ^ L24;
+    s[6] = L16 ^ L26 ^ AES_W32;
+    s[5] = L19 ^ L28 ^ AES_W32;
+    s[4] = L6 ^ L21;
+    s[3] = L20 ^ L22;
+    s[2] = L25 ^ L29;
+    s[1] = L13 ^ L27 ^ AES_W32;
+    s[0] = L6 ^ L23 ^ AES_W32;
+}
+
+/* x = A^-1(y ^ 0x63): bit i = y(i-1) ^ y(i-3) ^ y(i-6) ^ bit i of 0x05 */
+static void aes_inv_affine(unsigned long *s) {
+    unsigned long y[8];
+    int i;
+    for (i = 0; i < 8; i++) y[i] = s[i];
+    for (i = 0; i < 8; i++) s[i] = y[(i + 7) & 7] ^ y[(i + 5) & 7] ^ y[(i + 2) & 7];
+    s[0] ^= AES_W32;
+    s[2] ^= AES_W32;
+}
+
+/* S^-1(y) = invaff(S(invaff(y))) since S(x) = A(x^-1) ^ 0x63 */
+static void aes_inv_sub_bytes(unsigned long *s) {
+    aes_inv_affine(s);
+    aes_sub_bytes(s);
+    aes_inv_affine(s);
+}
+
+/* Row r moves left by r columns: rotate byte r of each plane right by 2r bits */
+static void aes_shift_rows(unsigned long *s) {
+    unsigned long v;
+    int i;
+    for (i = 0; i < 8; i++) {
+        v = s[i];
+        s[i] = (v & 0x000000FFUL) |
+               ((v & 0x0000FC00UL) >> 2) | ((v & 0x00000300UL) << 6) |
+               ((v & 0x00F00000UL) >> 4) | ((v & 0x000F0000UL) << 4) |
+               ((v & 0xC0000000UL) >> 6) | ((v & 0x3F000000UL) << 2);
+    }
+}
+
+static void aes_inv_shift_rows(unsigned long *s) {
+    unsigned long v;
+    int i;
+    for (i = 0; i < 8; i++) {
+        v = s[i];
+        s[i] = (v & 0x000000FFUL) |
+               ((v & 0x00003F00UL) << 2) | ((v & 0x0000C000UL) >> 6) |
+               ((v & 0x00F00000UL) >> 4) | ((v & 0x000F0000UL) << 4) |
+               ((v & 0xFC000000UL) >> 2) | ((v & 0x03000000UL) << 6);
+    }
+}
+
+/*
+ * Columns times a(x) = {03}x^3 + {01}x^2 + {01}x + {02}, written as
+ * (x^3 + x^2 + x) + {02}(x^3 + 1); multiplying by x is a rotate by one
+ * row. The inverse multiplies further by {04}x^2 + {05}.
+ */
+static void aes_mix_columns(unsigned long *s, int inv) {
+    unsigned long a[8], b[8], t[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        a[i] = s[i] ^ AES_ROTR(s[i], 8);
+        b[i] = AES_ROTR(a[i], 8) ^ AES_ROTR(s[i], 24);
+    }
+    s[0] = a[7] ^ b[0];
+    s[1] = a[7] ^ a[0] ^ b[1];
+    s[2] = a[1] ^ b[2];
+    s[3] = a[7] ^ a[2] ^ b[3];
+    s[4] = a[7] ^ a[3] ^ b[4];
+    s[5] = a[4] ^ b[5];
+    s[6] = a[5] ^ b[6];
+    s[7] = a[6] ^ b[7];
+    if (!inv) return;
+    for (i = 0; i < 8; i++) t[i] = s[i] ^ AES_ROTR(s[i], 16);
+    s[0] ^= t[6];
+    s[1] ^= t[6] ^ t[7];
+    s[2] ^= t[0] ^ t[7];
+    s[3] ^= t[1] ^ t[6];
+    s[4] ^= t[2] ^ t[6] ^ t[7];
+    s[5] ^= t[3] ^ t[7];
+    s[6] ^= t[4];
+    s[7] ^= t[5];
+}
+
+static void aes_add_round_key(unsigned long *s, const unsigned long *rk) {
+    int i;
+    for (i = 0; i < 8; i++) s[i] ^= rk[i];
+}
+
+#if defined(AES_HAVE_NI)
+static int aes_ni_state = -1;   /* -1 unknown, 0 off, 1 on */
+
+/* Host tools may turn AES-NI off to compare against the portable code */
+int aes_ni_enabled(void) {
+    if (aes_ni_state < 0) aes_ni_state = __builtin_cpu_supports("aes") ? 1 : 0;
+    return aes_ni_state;
+}
+
+__attribute__((target("aes,sse2")))
+static void aes_ni_crypt2(const aes128_key *k, unsigned char *a, unsigned char *b, int dec) {
+    __m128i x, y, rk;
+    int r;
+
+    x = _mm_loadu_si128((const __m128i *)a);
+    y = _mm_loadu_si128((const __m128i *)(b ? b : aes_zero_block));
+    if (!dec) {
+        x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)k->rkb[0][0]));
+        y = _mm_xor_si128(y, _mm_loadu_si128((const __m128i *)k->rkb[1][0]));
+        for (r = 1; r < AES_ROUNDS; r++) {
+            x = _mm_aesenc_si128(x, _mm_loadu_si128((const __m128i *)k->rkb[0][r]));
+            y = _mm_aesenc_si128(y, _mm_loadu_si128((const __m128i *)k->rkb[1][r]));
+        }
+        x = _mm_aesenclast_si128(x, _mm_loadu_si128((const __m128i *)k->rkb[0][AES_ROUNDS]));
+        y = _mm_aesenclast_si128(y, _mm_loadu_si128((const __m128i *)k->rkb[1][AES_ROUNDS]));
+    } else {
+        x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)k->rkb[0][AES_ROUNDS]));
+        y = _mm_xor_si128(y, _mm_loadu_si128((const __m128i *)k->rkb[1][AES_ROUNDS]));
+        for (r = AES_ROUNDS - 1; r > 0; r--) {
+            rk = _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)k->rkb[0][r]));
+            x = _mm_aesdec_si128(x, rk);
+            rk = _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)k->rkb[1][r]));
+            y = _mm_aesdec_si128(y, rk);
+        }
+        x = _mm_aesdeclast_si128(x, _mm_loadu_si128((const __m128i *)k->rkb[0][0]));
+        y = _mm_aesdeclast_si128(y, _mm_loadu_si128((const __m128i *)k->rkb[1][0]));
+    }
+    _mm_storeu_si128((__m128i *)a, x);
+    if (b) _mm_storeu_si128((__m128i *)b, y);
+}
+#endif
+
+#if defined(HOST_TOOLS)
+static unsigned long aes_passes;   /* block invocations, for the aes tool */
+#endif
+
+/* Encrypt a (lane 0) and b (lane 1) in place; b may be 0 */
+void aes128_encrypt2(const aes128_key *k, unsigned char *a, unsigned char *b) {
+    unsigned long s[8];
+    int r;
+
+#if defined(HOST_TOOLS)
+    aes_passes++;
+#endif
+#if defined(AES_HAVE_NI)
+    if (aes_ni_enabled()) {
+        aes_ni_crypt2(k, a, b, 0);
+        return;
+    }
+#endif
+    aes_pack(s, a, b ? b : aes_zero_block);
+    aes_add_round_key(s, k->rk[0]);
+    for (r = 1; r < AES_ROUNDS; r++) {
+        aes_sub_bytes(s);
+        aes_shift_rows(s);
+        aes_mix_columns(s, 0);
+        aes_add_round_key(s, k->rk[r]);
+    }
+    aes_sub_bytes(s);
+    aes_shift_rows(s);
+    aes_add_round_key(s, k->rk[AES_ROUNDS]);
+    aes_unpack(a, b, s);
+}
+
+void aes128_decrypt2(const aes128_key *k, unsigned char *a, unsigned char *b) {
+    unsigned long s[8];
+    int r;
+
+#if defined(HOST_TOOLS)
+    aes_passes++;
+#endif
+#if defined(AES_HAVE_NI)
+    if (aes_ni_enabled()) {
+        aes_ni_crypt2(k, a, b, 1);
+        return;
+    }
+#endif
+    aes_pack(s, a, b ? b : aes_zero_block);
+    aes_add_round_key(s, k->rk[AES_ROUNDS]);
+    for (r = AES_ROUNDS - 1; r > 0; r--) {
+        aes_inv_shift_rows(s);
+        aes_inv_sub_bytes(s);
+        aes_add_round_key(s, k->rk[r]);
+        aes_mix_columns(s, 1);
+    }
+    aes_inv_shift_rows(s);
+    aes_inv_sub_bytes(s);
+    aes_add_round_key(s, k->rk[0]);
+    aes_unpack(a, b, s);
+}
+
+/* CMAC subkey: shift left one bit, reduce by x^128 + x^7 + x^2 + x + 1 */
+static void aes_cmac_double(unsigned char *out, const unsigned char *in) {
+    unsigned char carry;
+    int i;
+    carry = (unsigned char)(in[0] >> 7);
+    for (i = 0; i < AES_BLOCK - 1; i++) out[i] = (unsigned char)((in[i] << 1) | (in[i + 1] >> 7));
+    out[AES_BLOCK - 1] = (unsigned char)((in[AES_BLOCK - 1] << 1) ^ (0x87 & (0 - carry)));
+}
+
+/* Key schedule for two keys at once, key_a in lane 0 and key_b in lane 1 */
+void aes128_init_pair(aes128_key *k, const unsigned char *key_a, const unsigned char *key_b) {
+    static const unsigned char rcon[AES_ROUNDS] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36 };
+    unsigned char w[2][AES_ROUNDS + 1][AES_BLOCK];
+    unsigned char t[2][AES_BLOCK];
+    unsigned long s[8];
+    int r, i, lane;
+
+    memcpy(w[0][0], key_a, AES_BLOCK);
+    memcpy(w[1][0], key_b, AES_BLOCK);
+    for (r = 1; r <= AES_ROUNDS; r++) {
+        /* RotWord of the last column into column 0, both lanes through one S-box pass */
+        memset(t, 0, sizeof(t));
+        for (lane = 0; lane < 2; lane++) {
+            for (i = 0; i < 4; i++) t[lane][i] = w[lane][r - 1][12 + ((i + 1) & 3)];
+        }
+        aes_pack(s, t[0], t[1]);
+        aes_sub_bytes(s);
+        aes_unpack(t[0], t[1], s);
+        for (lane = 0; lane < 2; lane++) {
+            t[lane][0] ^= rcon[r - 1];
+            for (i = 0; i < 4; i++) w[lane][r][i] = (unsigned char)(w[lane][r - 1][i] ^ t[lane][i]);
+            for (i = 4; i < AES_BLOCK; i++) w[lane][r][i] = (unsigned char)(w[lane][r - 1][i] ^ w[lane][r][i - 4]);
+        }
+    }
+    for (r = 0; r <= AES_ROUNDS; r++) aes_pack(k->rk[r], w[0][r], w[1][r]);
+#if defined(AES_HAVE_NI)
+    memcpy(k->rkb, w, sizeof(w));
+#endif
+    memset(t, 0, sizeof(t));
+    aes128_encrypt2(k, t[0], t[1]);
+    for (lane = 0; lane < 2; lane++) {
+        aes_cmac_double(k->k1[lane], t[lane]);
+        aes_cmac_double(k->k2[lane], k->k1[lane]);
+    }
+    memset(w, 0, sizeof(w));
+}
+
+void aes128_init(aes128_key *k, const unsigned char *key) {
+    aes128_init_pair(k, key, key);
+}
+
+/* Big-endian increment of a whole counter block */
+static void aes_ctr_inc(unsigned char *ctr) {
+    int i;
+    for (i = AES_BLOCK - 1; i >= 0 && ++ctr[i] == 0; i--) {
+    }
+}
+
+static void aes_xor_block(unsigned char *dst, const unsigned char *src, int n) {
+    int i;
+    for (i = 0; i < n; i++) dst[i] ^= src[i];
+}
+
+/* CTR over several buffers; keystream blocks are paired across buffer boundaries */
+void aes128_ctr_batch(const aes128_key *k, aes_job *jobs, int n) {
+    unsigned char ks[2][AES_BLOCK];
+    unsigned char *dst[2];
+    int len[2], j, off, lane;
+
+    lane = 0;
+    for (j = 0; j < n; j++) {
+        for (off = 0; off < jobs[j].len; off += AES_BLOCK) {
+            memcpy(ks[lane], jobs[j].iv, AES_BLOCK);
+            aes_ctr_inc(jobs[j].iv);
+            dst[lane] = jobs[j].data + off;
+            len[lane] = jobs[j].len - off < AES_BLOCK ? jobs[j].len - off : AES_BLOCK;
+            if (++lane == 2) {
+                aes128_encrypt2(k, ks[0], ks[1]);
+                aes_xor_block(dst[0], ks[0], len[0]);
+                aes_xor_block(dst[1], ks[1], len[1]);
+                lane = 0;
+            }
+        }
+    }
+    if (lane) {
+        aes128_encrypt2(k, ks[0], 0);
+        aes_xor_block(dst[0], ks[0], len[0]);
+    }
+}
+
+void aes128_ctr(const aes128_key *k, unsigned char *ctr, unsigned char *buf, int len) {
+    aes_job j;
+    j.data = buf;
+    j.len = len;
+    memcpy(j.iv, ctr, AES_BLOCK);
+    aes128_ctr_batch(k, &j, 1);
+    memcpy(ctr, j.iv, AES_BLOCK);
+}
+
+/* XOR CMAC input block i of msg (last one padded and masked with K1/K2) into x */
+static void aes_cmac_absorb(const aes128_key *k, int lane, const unsigned char *msg, int len, int i, int nb,
+                            unsigned char *x) {
+    int n;
+    n = len - i * AES_BLOCK;
+    if (i < nb - 1) {
+        aes_xor_block(x, msg + i * AES_BLOCK, AES_BLOCK);
+    } else if (n == AES_BLOCK) {
+        aes_xor_block(x, msg + i * AES_BLOCK, AES_BLOCK);
+        aes_xor_block(x, k->k1[lane], AES_BLOCK);
+    } else {
+        aes_xor_block(x, msg + i * AES_BLOCK, n);
+        x[n] ^= 0x80;
+        aes_xor_block(x, k->k2[lane], AES_BLOCK);
+    }
+}
+
+static int aes_cmac_blocks(int len) {
+    return len == 0 ? 1 : (len + AES_BLOCK - 1) / AES_BLOCK;
+}
+
+/* Two independent chains per pass: CMAC (cbc = 0) or CBC encryption (cbc = 1); k from aes128_init */
+static void aes_chain_batch(const aes128_key *k, aes_job *jobs, int n, int cbc) {
+    unsigned char x[2][AES_BLOCK];
+    aes_job *j[2];
+    int i[2], nb[2], next, lane;
+
+    memset(x, 0, sizeof(x));
+    j[0] = j[1] = 0;
+    next = 0;
+    for (;;) {
+        for (lane = 0; lane < 2; lane++) {
+            while (!j[lane] && next < n) {
+                j[lane] = &jobs[next++];
+                i[lane] = 0;
+                nb[lane] = cbc ? j[lane]->len / AES_BLOCK : aes_cmac_blocks(j[lane]->len);
+                if (cbc) memcpy(x[lane], j[lane]->iv, AES_BLOCK);
+                else memset(x[lane], 0, AES_BLOCK);
+                if (nb[lane] == 0) j[lane] = 0;
+            }
+            if (!j[lane]) continue;
+            if (cbc) aes_xor_block(x[lane], j[lane]->data + i[lane] * AES_BLOCK, AES_BLOCK);
+            else aes_cmac_absorb(k, lane, j[lane]->data, j[lane]->len, i[lane], nb[lane], x[lane]);
+        }
+        if (!j[0] && !j[1]) break;
+        aes128_encrypt2(k, x[0], x[1]);
+        for (lane = 0; lane < 2; lane++) {
+            if (!j[lane]) continue;
+            if (cbc) memcpy(j[lane]->data + i[lane] * AES_BLOCK, x[lane], AES_BLOCK);
+            if (++i[lane] < nb[lane]) continue;
+            memcpy(cbc ? j[lane]->iv : j[lane]->mac, x[lane], AES_BLOCK);
+            j[lane] = 0;
+        }
+    }
+}
+
+void aes128_cbc_encrypt_batch(const aes128_key *k, aes_job *jobs, int n) {
+    aes_chain_batch(k, jobs, n, 1);
+}
+
+void aes128_cmac_batch(const aes128_key *k, aes_job *jobs, int n) {
+    aes_chain_batch(k, jobs, n, 0);
+}
+
+void aes128_cbc_encrypt(const aes128_key *k, unsigned char *iv, unsigned char *buf, int len) {
+    aes_job j;
+    j.data = buf;
+    j.len = len;
+    memcpy(j.iv, iv, AES_BLOCK);
+    aes_chain_batch(k, &j, 1, 1);
+    memcpy(iv, j.iv, AES_BLOCK);
+}
+
+void aes128_cmac(const aes128_key *k, const unsigned char *msg, int len, unsigned char *mac) {
+    aes_job j;
+    j.data = (unsigned char *)msg;
+    j.len = len;
+    aes_chain_batch(k, &j, 1, 0);
+    memcpy(mac, j.mac, AES_BLOCK);
+}
+
+/* CBC decryption has no chain dependency, so neighbouring blocks share a pass */
+void aes128_cbc_decrypt(const aes128_key *k, unsigned char *iv, unsigned char *buf, int len) {
+    unsigned char prev[AES_BLOCK], c[2][AES_BLOCK];
+    int off, two;
+
+    memcpy(prev, iv, AES_BLOCK);
+    for (off = 0; off + AES_BLOCK <= len; off += 2 * AES_BLOCK) {
+        two = off + 2 * AES_BLOCK <= len;
+        memcpy(c[0], buf + off, AES_BLOCK);
+        if (two) memcpy(c[1], buf + off + AES_BLOCK, AES_BLOCK);
+        aes128_decrypt2(k, buf + off, two ? buf + off + AES_BLOCK : 0);
+        aes_xor_block(buf + off, prev, AES_BLOCK);
+        if (two) aes_xor_block(buf + off + AES_BLOCK, c[0], AES_BLOCK);
+        memcpy(prev, c[two], AES_BLOCK);
+    }
+    memcpy(iv, prev, AES_BLOCK);
+}
+
+/*
+ * Secure channel for reader and management links. Session keys come from
+ * the base key and an 8-byte session nonce (AES of a label block); one
+ * schedule holds both, S-ENC in lane 0 and S-MAC in lane 1, so the
+ * keystream for block i and the MAC over block i-1 share one pass.
+ * Frame: seq (4, big-endian) | CTR ciphertext | CMAC tag, truncated to 8
+ * bytes. seq must increase, which also keeps counter blocks unique; each
+ * side's counters carry its direction byte. Both sides share S-MAC, so
+ * the tag covers a leading block holding the sender's direction byte,
+ * then seq and ciphertext: a frame reflected back to its sender fails.
+ */
+#define SC_SEQ 4
+#define SC_TAG 8
+#define SC_OVERHEAD (SC_SEQ + SC_TAG)
+
+typedef struct {
+    aes128_key keys;            /* lane 0 S-ENC, lane 1 S-MAC */
+    unsigned char dir;          /* direction byte of frames this side sends */
+    unsigned long tx_seq;
+    unsigned long rx_seq;
+} sc_channel;
+
+void sc_init(sc_channel *c, const unsigned char *base_key, const unsigned char *nonce, int initiator) {
+    aes128_key base;
+    unsigned char enc[AES_BLOCK], mac[AES_BLOCK];
+
+    aes128_init(&base, base_key);
+    memset(enc, 0, AES_BLOCK);
+    enc[0] = 0x01;
+    memcpy(enc + 2, nonce, 8);
+    memcpy(mac, enc, AES_BLOCK);
+    mac[1] = 0x01;
+    enc[1] = 0x82;
+    aes128_encrypt2(&base, enc, mac);
+    aes128_init_pair(&c->keys, enc, mac);
+    c->dir = (unsigned char)(initiator ? 0x01 : 0x02);
+    c->tx_seq = c->rx_seq = 0;
+    memset(&base, 0, sizeof(base));
+    memset(enc, 0, AES_BLOCK);
+    memset(mac, 0, AES_BLOCK);
+}
+
+static void sc_counter(unsigned char *ctr, unsigned char dir, const unsigned char *seq) {
+    memset(ctr, 0, AES_BLOCK);
+    ctr[0] = dir;
+    memcpy(ctr + 1, seq, SC_SEQ);
+}
+
+/*
+ * The passes: lane 0 makes keystream for the next ciphertext block, lane 1
+ * absorbs the next MAC block once its bytes exist (or idles). The
+ * direction block is ready at once and fills the first pass, where the
+ * MAC would otherwise wait for ciphertext, so n bytes of payload take
+ * max(blocks, MAC blocks) + 1 passes instead of their sum. buf holds
+ * seq | data on entry; ks_out 0 means encrypt in place (seal), otherwise
+ * the keystream is left there for open to apply after the tag checks.
+ */
+static void sc_crypt_mac(sc_channel *c, unsigned char dir, unsigned char *buf, int len, int seal,
+                         unsigned char *ks_out, unsigned char *tag) {
+    unsigned char ctr[AES_BLOCK], ks[AES_BLOCK], x[AES_BLOCK];
+    int nks, nmac, ks_done, mi, n, end, ready, more, take;
+
+    sc_counter(ctr, dir, buf);
+    nks = (len + AES_BLOCK - 1) / AES_BLOCK;
+    n = SC_SEQ + len;
+    nmac = aes_cmac_blocks(n);
+    memset(x, 0, AES_BLOCK);
+    x[0] = dir;                 /* MAC block 0: the direction block */
+    ks_done = 0;
+    mi = -1;
+    while (mi < nmac) {
+        more = ks_done < nks;
+        end = (mi + 1) * AES_BLOCK < n ? (mi + 1) * AES_BLOCK : n;
+        ready = mi < 0 || !seal || end <= SC_SEQ + ks_done * AES_BLOCK;
+        if (more) memcpy(ks, ctr, AES_BLOCK);
+        else memset(ks, 0, AES_BLOCK);
+        if (ready && mi >= 0) aes_cmac_absorb(&c->keys, 1, buf, n, mi, nmac, x);
+        aes128_encrypt2(&c->keys, ks, ready ? x : 0);
+        if (more) {
+            take = len - ks_done * AES_BLOCK < AES_BLOCK ? len - ks_done * AES_BLOCK : AES_BLOCK;
+            if (seal) aes_xor_block(buf + SC_SEQ + ks_done * AES_BLOCK, ks, take);
+            else memcpy(ks_out + ks_done * AES_BLOCK, ks, (size_t)take);
+            aes_ctr_inc(ctr);
+            ks_done++;
+        }
+        if (ready) mi++;
+    }
+    memcpy(tag, x, SC_TAG);
+}
+
+/* Seal len bytes into out (len + SC_OVERHEAD bytes); in and out must not overlap */
+int sc_seal(sc_channel *c, const unsigned char *in, int len, unsigned char *out) {
+    c->tx_seq++;
+    out[0] = (unsigned char)(c->tx_seq >> 24);
+    out[1] = (unsigned char)(c->tx_seq >> 16);
+    out[2] = (unsigned char)(c->tx_seq >> 8);
+    out[3] = (unsigned char)c->tx_seq;
+    memcpy(out + SC_SEQ, in, (size_t)len);
+    sc_crypt_mac(c, c->dir, out, len, 1, 0, out + SC_SEQ + len);
+    return len + SC_OVERHEAD;
+}
+
+/* Check and open a sealed frame into out; payload length, or -1 (bad tag, replay, short) */
+int sc_open(sc_channel *c, const unsigned char *in, int len, unsigned char *out) {
+    unsigned char tag[SC_TAG];
+    unsigned long seq;
+    int plen, i, diff;
+
+    if (len < SC_OVERHEAD) return -1;
+    plen = len - SC_OVERHEAD;
+    seq = ((unsigned long)in[0] << 24) | ((unsigned long)in[1] << 16) | ((unsigned long)in[2] << 8) | in[3];
+    if (seq <= c->rx_seq) return -1;
+    sc_crypt_mac(c, (unsigned char)(c->dir ^ 0x03), (unsigned char *)in, plen, 0, out, tag);
+    diff = 0;
+    for (i = 0; i < SC_TAG; i++) diff |= tag[i] ^ in[SC_SEQ + plen + i];
+    if (diff) {
+        memset(out, 0, (size_t)plen);
+        return -1;
+    }
+    aes_xor_block(out, in + SC_SEQ, plen);
+    c->rx_seq = seq;
+    return plen;
+}
+
+/* ========================= SHA-512 ========================= */
+
+/*
+ * FIPS 180-4 SHA-512 for Ed25519 and token digests. C89 has no 64-bit
+ * integer, so each word is a (hi, lo) pair of 32-bit halves in unsigned
+ * long; the pair helpers below are the only place that knows.
+ */
+#define SHA512_BLOCK 128
+#define SHA512_DIGEST 64
+#define SHA_W32 0xFFFFFFFFUL
+
+typedef struct {
+    unsigned long h[16];        /* eight words, hi then lo */
+    unsigned char buf[SHA512_BLOCK];
+    unsigned long len;          /* bytes hashed so far */
+} sha512_ctx;
+
+static const unsigned long sha512_k[160] = {
+    0x428a2f98UL, 0xd728ae22UL, 0x71374491UL, 0x23ef65cdUL,
+    0xb5c0fbcfUL, 0xec4d3b2fUL, 0xe9b5dba5UL, 0x8189dbbcUL,
+    0x3956c25bUL, 0xf348b538UL, 0x59f111f1UL, 0xb605d019UL,
+    0x923f82a4UL, 0xaf194f9bUL, 0xab1c5ed5UL, 0xda6d8118UL,
+    0xd807aa98UL, 0xa3030242UL, 0x12835b01UL, 0x45706fbeUL,
+    0x243185beUL, 0x4ee4b28cUL, 0x550c7dc3UL, 0xd5ffb4e2UL,
+    0x72be5d74UL, 0xf27b896fUL, 0x80deb1feUL, 0x3b1696b1UL,
+    0x9bdc06a7UL, 0x25c71235UL, 0xc19bf174UL, 0xcf692694UL,
+    0xe49b69c1UL, 0x9ef14ad2UL, 0xefbe4786UL, 0x384f25e3UL,
+    0x0fc19dc6UL, 0x8b8cd5b5UL, 0x240ca1ccUL, 0x77ac9c65UL,
+    0x2de92c6fUL, 0x592b0275UL, 0x4a7484aaUL, 0x6ea6e483UL,
+    0x5cb0a9dcUL, 0xbd41fbd4UL, 0x76f988daUL, 0x831153b5UL,
+    0x983e5152UL, 0xee66dfabUL, 0xa831c66dUL, 0x2db43210UL,
+    0xb00327c8UL, 0x98fb213fUL, 0xbf597fc7UL, 0xbeef0ee4UL,
+    0xc6e00bf3UL, 0x3da88fc2UL, 0xd5a79147UL, 0x930aa725UL,
+    0x06ca6351UL, 0xe003826fUL, 0x14292967UL, 0x0a0e6e70UL,
+    0x27b70a85UL, 0x46d22ffcUL, 0x2e1b2138UL, 0x5c26c926UL,
+    0x4d2c6dfcUL, 0x5ac42aedUL, 0x53380d13UL, 0x9d95b3dfUL,
+    0x650a7354UL, 0x8baf63deUL, 0x766a0abbUL, 0x3c77b2a8UL,
+    0x81c2c92eUL, 0x47edaee6UL, 0x92722c85UL, 0x1482353bUL,
+    0xa2bfe8a1UL, 0x4cf10364UL, 0xa81a664bUL, 0xbc423001UL,
+    0xc24b8b70UL, 0xd0f89791UL, 0xc76c51a3UL, 0x0654be30UL,
+    0xd192e819UL, 0xd6ef5218UL, 0xd6990624UL, 0x5565a910UL,
+    0xf40e3585UL, 0x5771202aUL, 0x106aa070UL, 0x32bbd1b8UL,
+    0x19a4c116UL, 0xb8d2d0c8UL, 0x1e376c08UL, 0x5141ab53UL,
+    0x2748774cUL, 0xdf8eeb99UL, 0x34b0bcb5UL, 0xe19b48a8UL,
+    0x391c0cb3UL, 0xc5c95a63UL, 0x4ed8aa4aUL, 0xe3418acbUL,
+    0x5b9cca4fUL, 0x7763e373UL, 0x682e6ff3UL, 0xd6b2b8a3UL,
+    0x748f82eeUL, 0x5defb2fcUL, 0x78a5636fUL, 0x43172f60UL,
+    0x84c87814UL, 0xa1f0ab72UL, 0x8cc70208UL, 0x1a6439ecUL,
+    0x90befffaUL, 0x23631e28UL, 0xa4506cebUL, 0xde82bde9UL,
+    0xbef9a3f7UL, 0xb2c67915UL, 0xc67178f2UL, 0xe372532bUL,
+    0xca273eceUL, 0xea26619cUL, 0xd186b8c7UL, 0x21c0c207UL,
+    0xeada7dd6UL, 0xcde0eb1eUL, 0xf57d4f7fUL, 0xee6ed178UL,
+    0x06f067aaUL, 0x72176fbaUL, 0x0a637dc5UL, 0xa2c898a6UL,
+    0x113f9804UL, 0xbef90daeUL, 0x1b710b35UL, 0x131c471bUL,
+    0x28db77f5UL, 0x23047d84UL, 0x32caab7bUL, 0x40c72493UL,
+    0x3c9ebe0aUL, 0x15c9bebcUL, 0x431d67c4UL, 0x9c100d4cUL,
+    0x4cc5d4beUL, 0xcb3e42b6UL, 0x597f299cUL, 0xfc657e2aUL,
+    0x5fcb6fabUL, 0x3ad6faecUL, 0x6c44198cUL, 0x4a475817UL
+};
+
+/* o = x rotated right by n (0 < n < 64), as pairs */
+static void sha_rotr(unsigned long *o, const unsigned long *x, int n) {
+    unsigned long hi, lo;
+    hi = x[0];
+    lo = x[1];
+    if (n >= 32) {
+        hi = x[1];
+        lo = x[0];
+        n -= 32;
+    }
+    if (n == 0) {
+        o[0] = hi;
+        o[1] = lo;
+        return;
+    }
+    o[0] = ((hi >> n) | (lo << (32 - n))) & SHA_W32;
+    o[1] = ((lo >> n) | (hi << (32 - n))) & SHA_W32;
+}
+
+/* o = rotr(x, a) ^ rotr(x, b) ^ (c_shift ? x >> c : rotr(x, c)) */
+static void sha_sigma(unsigned long *o, const unsigned long *x, int a, int b, int c, int c_shift) {
+    unsigned long r[2], s[2];
+    sha_rotr(r, x, a);
+    sha_rotr(s, x, b);
+    o[0] = r[0] ^ s[0];
+    o[1] = r[1] ^ s[1];
+    if (c_shift) {
+        o[0] ^= x[0] >> c;
+        o[1] ^= ((x[1] >> c) | (x[0] << (32 - c))) & SHA_W32;
+    } else {
+        sha_rotr(r, x, c);
+        o[0] ^= r[0];
+        o[1] ^= r[1];
+    }
+}
+
+/* o += a, as pairs */
+static void sha_add(unsigned long *o, const unsigned long *a) {
+    unsigned long lo;
+    lo = (o[1] + a[1]) & SHA_W32;
+    o[0] = (o[0] + a[0] + (lo < a[1])) & SHA_W32;
+    o[1] = lo;
+}
+
+static unsigned long sha_be32(const unsigned char *p) {
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+static void sha512_block(unsigned long *h, const unsigned char *p) {
+    unsigned long w[160], v[16], t1[2], t2[2], s[2];
+    int i, j;
+
+    for (i = 0; i < 32; i++) w[i] = sha_be32(p + 4 * i);
+    for (i = 16; i < 80; i++) {
+        sha_sigma(w + 2 * i, w + 2 * (i - 2), 19, 61, 6, 1);
+        sha_add(w + 2 * i, w + 2 * (i - 7));
+        sha_sigma(s, w + 2 * (i - 15), 1, 8, 7, 1);
+        sha_add(w + 2 * i, s);
+        sha_add(w + 2 * i, w + 2 * (i - 16));
+    }
+    for (i = 0; i < 16; i++) v[i] = h[i];
+    /* v: a b c d e f g h at pair offsets 0 2 4 ... 14 */
+    for (i = 0; i < 80; i++) {
+        sha_sigma(t1, v + 8, 14, 18, 41, 0);
+        sha_add(t1, v + 14);
+        for (j = 0; j < 2; j++) s[j] = (v[8 + j] & v[10 + j]) ^ (~v[8 + j] & v[12 + j] & SHA_W32);
+        sha_add(t1, s);
+        sha_add(t1, sha512_k + 2 * i);
+        sha_add(t1, w + 2 * i);
+        sha_sigma(t2, v, 28, 34, 39, 0);
+        for (j = 0; j < 2; j++) s[j] = (v[j] & v[2 + j]) ^ (v[j] & v[4 + j]) ^ (v[2 + j] & v[4 + j]);
+        sha_add(t2, s);
+        for (j = 15; j >= 2; j--) v[j] = v[j - 2];
+        sha_add(v + 8, t1);
+        v[0] = t1[0];
+        v[1] = t1[1];
+        sha_add(v, t2);
+    }
+    for (i = 0; i < 16; i += 2) sha_add(h + i, v + i);
+}
+
+void sha512_init(sha512_ctx *c) {
+    static const unsigned long iv[16] = {
+        0x6a09e667UL, 0xf3bcc908UL, 0xbb67ae85UL, 0x84caa73bUL, 0x3c6ef372UL, 0xfe94f82bUL,
+        0xa54ff53aUL, 0x5f1d36f1UL, 0x510e527fUL, 0xade682d1UL, 0x9b05688cUL, 0x2b3e6c1fUL,
+        0x1f83d9abUL, 0xfb41bd6bUL, 0x5be0cd19UL, 0x137e2179UL
+    };
+    memcpy(c->h, iv, sizeof(iv));
+    c->len = 0;
+}
+
+void sha512_update(sha512_ctx *c, const unsigned char *p, unsigned long n) {
+    unsigned long fill, take;
+    while (n > 0) {
+        fill = c->len % SHA512_BLOCK;
+        take = SHA512_BLOCK - fill < n ? SHA512_BLOCK - fill : n;
+        memcpy(c->buf + fill, p, (size_t)take);
+        c->len += take;
+        p += take;
+        n -= take;
+        if (c->len % SHA512_BLOCK == 0) sha512_block(c->h, c->buf);
+    }
+}
+
+void sha512_final(sha512_ctx *c, unsigned char *out) {
+    unsigned long fill;
+    int i;
+
+    fill = c->len % SHA512_BLOCK;
+    c->buf[fill++] = 0x80;
+    if (fill > SHA512_BLOCK - 16) {
+        memset(c->buf + fill, 0, (size_t)(SHA512_BLOCK - fill));
+        sha512_block(c->h, c->buf);
+        fill = 0;
+    }
+    memset(c->buf + fill, 0, (size_t)(SHA512_BLOCK - fill));
+    /* bit length, big-endian; messages here stay far below 2^32 bytes */
+    c->buf[SHA512_BLOCK - 5] = (unsigned char)(c->len >> 29);
+    for (i = 0; i < 4; i++) c->buf[SHA512_BLOCK - 1 - i] = (unsigned char)((c->len << 3) >> (8 * i));
+    sha512_block(c->h, c->buf);
+    for (i = 0; i < SHA512_DIGEST; i++) out[i] = (unsigned char)(c->h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+/* ========================= ED25519 ========================= */
+
+/*
+ * Ed25519 signature checks (RFC 8032) for offline credentials.
+ *
+ * Field elements mod p = 2^255 - 19 are sixteen 16-bit limbs in unsigned
+ * long. A limb product fits in 32 bits and column sums keep its low and
+ * high halves apart, so nothing needs a 64-bit type. Limbs stay below
+ * 2^16 between operations. Values become canonical only when packed.
+ *
+ * Points are in extended coordinates. Scalar multiplication is Straus:
+ * each scalar is recoded into signed width-5 windows over eight odd
+ * multiples of its point, and one doubling chain serves every point in
+ * the check. The base point's multiples are built once.
+ *
+ * The check is cofactored, [8]([S]B - R - [k]A) == 0, so a single check
+ * and a batch check accept exactly the same signatures. Inputs are
+ * public, so the code runs in variable time. Key generation and signing
+ * are host-tool only.
+ */
+#define ED_KEY 32
+#define ED_SIG 64
+#define ED_WINDOWS 8            /* odd multiples 1P, 3P, ... 15P */
+
+typedef unsigned long ed_fe[16];
+
+typedef struct {
+    ed_fe x, y, z, t;
+} ed_point;
+
+/* Y+X, Y-X, 2Z, 2dT: a point ready to be added into an accumulator */
+typedef struct {
+    ed_fe yplusx, yminusx, z2, t2d;
+} ed_cached;
+
+static const ed_fe ed_d = {
+    0x78a3, 0x1359, 0x4dca, 0x75eb, 0xd8ab, 0x4141, 0x0a4d, 0x0070,
+    0xe898, 0x7779, 0x4079, 0x8cc7, 0xfe73, 0x2b6f, 0x6cee, 0x5203
+};
+static const ed_fe ed_d2 = {
+    0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+    0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406
+};
+static const ed_fe ed_sqrtm1 = {
+    0xa0b0, 0x4a0e, 0x1b27, 0xc4ee, 0xe478, 0xad2f, 0x1806, 0x2f43,
+    0xd7a7, 0x3dfb, 0x0099, 0x2b4d, 0xdf0b, 0x4fc1, 0x2480, 0x2b83
+};
+static const ed_fe ed_base_x = {
+    0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+    0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169
+};
+static const ed_fe ed_base_y = {
+    0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+    0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666
+};
+/* 4p with every limb at least 0xFFFF, so a + 4p - b never goes negative */
+static const ed_fe ed_4p = {
+    0x1FFB4, 0x1FFFE, 0x1FFFE, 0x1FFFE, 0x1FFFE, 0x1FFFE, 0x1FFFE, 0x1FFFE,
+    0x1FFFE, 0x1FFFE, 0x1FFFE, 0x1FFFE, 0x1FFFE, 0x1FFFE, 0x1FFFE, 0x1FFFE
+};
+/* group order L = 2^252 + 27742317777372353535851937790883648493, little-endian */
+static const unsigned char ed_order[32] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10
+};
+
+static void ed_fe_set(ed_fe o, unsigned long v) {
+    int i;
+    o[0] = v;
+    for (i = 1; i < 16; i++) o[i] = 0;
+}
+
+/* Bring every limb below 2^16, folding 2^256 = 38 (mod p) */
+static void ed_carry(ed_fe o) {
+    unsigned long c;
+    int i;
+    do {
+        for (i = 0; i < 15; i++) {
+            o[i + 1] += o[i] >> 16;
+            o[i] &= 0xFFFF;
+        }
+        c = o[15] >> 16;
+        o[15] &= 0xFFFF;
+        o[0] += 38 * c;
+    } while (c);
+}
+
+static void ed_add(ed_fe o, const ed_fe a, const ed_fe b) {
+    int i;
+    for (i = 0; i < 16; i++) o[i] = a[i] + b[i];
+    ed_carry(o);
+}
+
+static void ed_sub(ed_fe o, const ed_fe a, const ed_fe b) {
+    int i;
+    for (i = 0; i < 16; i++) o[i] = a[i] + ed_4p[i] - b[i];
+    ed_carry(o);
+}
+
+/* o may alias a or b */
+static void ed_mul(ed_fe o, const ed_fe a, const ed_fe b) {
+    unsigned long t[32], p;
+    int i, j;
+    for (i = 0; i < 32; i++) t[i] = 0;
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 16; j++) {
+            p = a[i] * b[j];
+            t[i + j] += p & 0xFFFF;
+            t[i + j + 1] += p >> 16;
+        }
+    }
+    for (i = 0; i < 16; i++) o[i] = t[i] + 38 * t[i + 16];
+    ed_carry(o);
+}
+
+/* Cross products once, doubled, then the squares: 136 limb products instead of 256 */
+static void ed_sq(ed_fe o, const ed_fe a) {
+    unsigned long t[32], p;
+    int i, j;
+    for (i = 0; i < 32; i++) t[i] = 0;
+    for (i = 0; i < 16; i++) {
+        for (j = i + 1; j < 16; j++) {
+            p = a[i] * a[j];
+            t[i + j] += p & 0xFFFF;
+            t[i + j + 1] += p >> 16;
+        }
+    }
+    for (i = 0; i < 32; i++) t[i] <<= 1;
+    for (i = 0; i < 16; i++) {
+        p = a[i] * a[i];
+        t[2 * i] += p & 0xFFFF;
+        t[2 * i + 1] += p >> 16;
+    }
+    for (i = 0; i < 16; i++) o[i] = t[i] + 38 * t[i + 16];
+    ed_carry(o);
+}
+
+static void ed_sqn(ed_fe o, const ed_fe a, int n) {
+    ed_sq(o, a);
+    while (--n > 0) ed_sq(o, o);
+}
+
+/* o = a^(2^250 - 1) and a11 = a^11: the shared prefix of both exponent chains */
+static void ed_pow250(ed_fe o, ed_fe a11, const ed_fe a) {
+    ed_fe t0, t1, t2;
+    ed_sq(t0, a);
+    ed_sqn(t1, t0, 2);
+    ed_mul(t1, a, t1);          /* 9 */
+    ed_mul(a11, t0, t1);        /* 11 */
+    ed_sq(t0, a11);
+    ed_mul(t0, t1, t0);         /* 2^5 - 1 */
+    ed_sqn(t1, t0, 5);
+    ed_mul(t0, t1, t0);         /* 2^10 - 1 */
+    ed_sqn(t1, t0, 10);
+    ed_mul(t1, t1, t0);         /* 2^20 - 1 */
+    ed_sqn(t2, t1, 20);
+    ed_mul(t1, t2, t1);         /* 2^40 - 1 */
+    ed_sqn(t1, t1, 10);
+    ed_mul(t0, t1, t0);         /* 2^50 - 1 */
+    ed_sqn(t1, t0, 50);
+    ed_mul(t1, t1, t0);         /* 2^100 - 1 */
+    ed_sqn(t2, t1, 100);
+    ed_mul(t1, t2, t1);         /* 2^200 - 1 */
+    ed_sqn(t1, t1, 50);
+    ed_mul(o, t1, t0);          /* 2^250 - 1 */
+}
+
+/* o = a^((p-5)/8) = a^(2^252 - 3), the square root step of point decoding */
+static void ed_pow2523(ed_fe o, const ed_fe a) {
+    ed_fe t, a11;
+    ed_pow250(t, a11, a);
+    ed_sqn(t, t, 2);
+    ed_mul(o, t, a);
+}
+
+/* Canonical little-endian encoding: subtract p while the value is at least p */
+static void ed_pack(unsigned char *out, const ed_fe a) {
+    ed_fe t, m;
+    unsigned long borrow;
+    int i, pass;
+
+    memcpy(t, a, sizeof(ed_fe));
+    for (pass = 0; pass < 2; pass++) {
+        m[0] = t[0] - 0xFFED;
+        for (i = 1; i < 15; i++) {
+            m[i] = t[i] - 0xFFFF - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xFFFF;
+        }
+        m[15] = t[15] - 0x7FFF - ((m[14] >> 16) & 1);
+        m[14] &= 0xFFFF;
+        borrow = (m[15] >> 16) & 1;
+        m[15] &= 0xFFFF;
+        if (!borrow) memcpy(t, m, sizeof(ed_fe));
+    }
+    for (i = 0; i < 16; i++) {
+        out[2 * i] = (unsigned char)t[i];
+        out[2 * i + 1] = (unsigned char)(t[i] >> 8);
+    }
+}
+
+static void ed_unpack(ed_fe o, const unsigned char *in) {
+    int i;
+    for (i = 0; i < 16; i++) o[i] = in[2 * i] | ((unsigned long)in[2 * i + 1] << 8);
+    o[15] &= 0x7FFF;
+}
+
+static int ed_fe_iszero(const ed_fe a) {
+    unsigned char b[32];
+    int i, acc;
+    ed_pack(b, a);
+    acc = 0;
+    for (i = 0; i < 32; i++) acc |= b[i];
+    return acc == 0;
+}
+
+static int ed_fe_parity(const ed_fe a) {
+    unsigned char b[32];
+    ed_pack(b, a);
+    return b[0] & 1;
+}
+
+static void ed_fe_neg(ed_fe o, const ed_fe a) {
+    ed_fe zero;
+    ed_fe_set(zero, 0);
+    ed_sub(o, zero, a);
+}
+
+static void ed_identity(ed_point *p) {
+    ed_fe_set(p->x, 0);
+    ed_fe_set(p->y, 1);
+    ed_fe_set(p->z, 1);
+    ed_fe_set(p->t, 0);
+}
+
+static void ed_point_neg(ed_point *p) {
+    ed_fe_neg(p->x, p->x);
+    ed_fe_neg(p->t, p->t);
+}
+
+/* dbl-2008-hwcd with a = -1, signs folded; r may alias p */
+static void ed_dbl(ed_point *r, const ed_point *p) {
+    ed_fe a, b, c, e, f, g, h;
+    ed_sq(a, p->x);
+    ed_sq(b, p->y);
+    ed_sq(c, p->z);
+    ed_add(c, c, c);
+    ed_add(h, a, b);
+    ed_add(e, p->x, p->y);
+    ed_sq(e, e);
+    ed_sub(e, h, e);
+    ed_sub(g, a, b);
+    ed_add(f, c, g);
+    ed_mul(r->x, e, f);
+    ed_mul(r->y, g, h);
+    ed_mul(r->t, e, h);
+    ed_mul(r->z, f, g);
+}
+
+static void ed_to_cached(ed_cached *c, const ed_point *p) {
+    ed_add(c->yplusx, p->y, p->x);
+    ed_sub(c->yminusx, p->y, p->x);
+    ed_add(c->z2, p->z, p->z);
+    ed_mul(c->t2d, p->t, ed_d2);
+}
+
+/* r = p + q, or p - q with neg; add-2008-hwcd-3; r may alias p */
+static void ed_add_cached(ed_point *r, const ed_point *p, const ed_cached *q, int neg) {
+    ed_fe a, b, c, d, e, f, g, h;
+    ed_sub(a, p->y, p->x);
+    ed_mul(a, a, neg ? q->yplusx : q->yminusx);
+    ed_add(b, p->y, p->x);
+    ed_mul(b, b, neg ? q->yminusx : q->yplusx);
+    ed_mul(c, p->t, q->t2d);
+    ed_mul(d, p->z, q->z2);
+    ed_sub(e, b, a);
+    ed_add(h, b, a);
+    if (neg) {
+        ed_add(f, d, c);
+        ed_sub(g, d, c);
+    } else {
+        ed_sub(f, d, c);
+        ed_add(g, d, c);
+    }
+    ed_mul(r->x, e, f);
+    ed_mul(r->y, g, h);
+    ed_mul(r->t, e, h);
+    ed_mul(r->z, f, g);
+}
+
+/* t[i] = (2i+1)P */
+static void ed_table(ed_cached *t, const ed_point *p) {
+    ed_point q, p2;
+    ed_cached c2;
+    int i;
+    ed_to_cached(&t[0], p);
+    ed_dbl(&p2, p);
+    ed_to_cached(&c2, &p2);
+    q = *p;
+    for (i = 1; i < ED_WINDOWS; i++) {
+        ed_add_cached(&q, &q, &c2, 0);
+        ed_to_cached(&t[i], &q);
+    }
+}
+
+static ed_cached ed_base_table[ED_WINDOWS];
+static int ed_base_ready;
+
+static const ed_cached *ed_base(void) {
+    ed_point b;
+    if (!ed_base_ready) {
+        memcpy(b.x, ed_base_x, sizeof(ed_fe));
+        memcpy(b.y, ed_base_y, sizeof(ed_fe));
+        ed_fe_set(b.z, 1);
+        ed_mul(b.t, b.x, b.y);
+        ed_table(ed_base_table, &b);
+        ed_base_ready = 1;
+    }
+    return ed_base_table;
+}
+
+/*
+ * Signed sliding windows: 256 digits, each 0 or odd in [-15, 15], with
+ * nonzero digits at least five apart. a must be below 2^255.
+ */
+static void ed_slide(signed char *r, const unsigned char *a) {
+    int i, b, k;
+    for (i = 0; i < 256; i++) r[i] = (signed char)((a[i >> 3] >> (i & 7)) & 1);
+    for (i = 0; i < 256; i++) {
+        if (!r[i]) continue;
+        for (b = 1; b <= 6 && i + b < 256; b++) {
+            if (!r[i + b]) continue;
+            if (r[i] + (r[i + b] << b) <= 15) {
+                r[i] = (signed char)(r[i] + (r[i + b] << b));
+                r[i + b] = 0;
+            } else if (r[i] - (r[i + b] << b) >= -15) {
+                r[i] = (signed char)(r[i] - (r[i + b] << b));
+                for (k = i + b; k < 256; k++) {
+                    if (!r[k]) {
+                        r[k] = 1;
+                        break;
+                    }
+                    r[k] = 0;
+                }
+            } else {
+                break;
+            }
+        }
+    }
+}
+
+/* r = sum over k of digits[256k ..] times the point whose odd multiples are tables[k] */
+static void ed_straus(ed_point *r, int n, const signed char *digits, const ed_cached *const *tables) {
+    int i, k, d, top;
+
+    top = -1;
+    for (k = 0; k < n; k++) {
+        for (i = 255; i > top; i--) {
+            if (digits[256 * k + i]) {
+                top = i;
+                break;
+            }
+        }
+    }
+    ed_identity(r);
+    for (i = top; i >= 0; i--) {
+        ed_dbl(r, r);
+        for (k = 0; k < n; k++) {
+            d = digits[256 * k + i];
+            if (d > 0) ed_add_cached(r, r, &tables[k][d >> 1], 0);
+            else if (d < 0) ed_add_cached(r, r, &tables[k][(-d) >> 1], 1);
+        }
+    }
+}
+
+/* [8]p is the identity */
+static int ed_is_small_order(const ed_point *p) {
+    ed_point q;
+    ed_fe t;
+    ed_dbl(&q, p);
+    ed_dbl(&q, &q);
+    ed_dbl(&q, &q);
+    ed_sub(t, q.y, q.z);
+    return ed_fe_iszero(q.x) && ed_fe_iszero(t);
+}
+
+/* RFC 8032 5.1.3; rejects non-canonical y and points off the curve */
+static int ed_decode(ed_point *p, const unsigned char *s) {
+    unsigned char b[32];
+    ed_fe u, v, v3, chk;
+
+    ed_unpack(p->y, s);
+    ed_pack(b, p->y);
+    if (memcmp(b, s, 31) != 0 || b[31] != (s[31] & 0x7F)) return -1;
+    ed_fe_set(p->z, 1);
+    ed_sq(u, p->y);
+    ed_mul(v, u, ed_d);
+    ed_sub(u, u, p->z);         /* y^2 - 1 */
+    ed_add(v, v, p->z);         /* d y^2 + 1 */
+    ed_sq(v3, v);
+    ed_mul(v3, v3, v);
+    ed_sq(p->x, v3);
+    ed_mul(p->x, p->x, v);
+    ed_mul(p->x, p->x, u);      /* u v^7 */
+    ed_pow2523(p->x, p->x);
+    ed_mul(p->x, p->x, v3);
+    ed_mul(p->x, p->x, u);      /* u v^3 (u v^7)^((p-5)/8) */
+    ed_sq(chk, p->x);
+    ed_mul(chk, chk, v);
+    ed_sub(v, chk, u);
+    if (!ed_fe_iszero(v)) {
+        ed_add(v, chk, u);
+        if (!ed_fe_iszero(v)) return -1;
+        ed_mul(p->x, p->x, ed_sqrtm1);
+    }
+    if (ed_fe_parity(p->x) != (s[31] >> 7)) {
+        if (ed_fe_iszero(p->x)) return -1;
+        ed_fe_neg(p->x, p->x);
+    }
+    ed_mul(p->t, p->x, p->y);
+    return 0;
+}
+
+/* Scalars are 32-byte little-endian */
+static int ed_sc_below_order(const unsigned char *s) {
+    int i;
+    for (i = 31; i >= 0; i--) {
+        if (s[i] != ed_order[i]) return s[i] < ed_order[i];
+    }
+    return 0;
+}
+
+/*
+ * out = x mod L, a byte at a time from the top in 16-bit limbs: r = 256r +
+ * byte, then subtract q L with q = r >> 252. L is just above 2^252, so q
+ * is never more than one too large, and one add-back fixes that.
+ */
+static void ed_sc_reduce(unsigned char *out, const unsigned char *x, int xlen) {
+    unsigned long r[17], l[16], q, sub, borrow, carry;
+    int i, k;
+
+    for (k = 0; k < 16; k++) l[k] = ed_order[2 * k] | ((unsigned long)ed_order[2 * k + 1] << 8);
+    for (k = 0; k < 17; k++) r[k] = 0;
+    for (i = xlen - 1; i >= 0; i--) {
+        carry = x[i];
+        for (k = 0; k < 17; k++) {
+            r[k] = (r[k] << 8) | carry;
+            carry = r[k] >> 16;
+            r[k] &= 0xFFFF;
+        }
+        q = (r[15] >> 12) | (r[16] << 4);
+        borrow = 0;
+        for (k = 0; k < 17; k++) {
+            sub = (k < 16 ? q * l[k] : 0) + borrow;
+            borrow = (sub + 0xFFFF - r[k]) >> 16;
+            if (sub <= r[k]) borrow = 0;
+            r[k] = (r[k] + (borrow << 16) - sub) & 0xFFFF;
+        }
+        if (borrow) {
+            carry = 0;
+            for (k = 0; k < 17; k++) {
+                r[k] += (k < 16 ? l[k] : 0) + carry;
+                carry = r[k] >> 16;
+                r[k] &= 0xFFFF;
+            }
+        }
+    }
+    for (k = 0; k < 16; k++) {
+        out[2 * k] = (unsigned char)r[k];
+        out[2 * k + 1] = (unsigned char)(r[k] >> 8);
+    }
+}
+
+#if defined(HOST_POSIX)
+/* out = a b + c mod L; c may be 0 (batch checks and signing) */
+static void ed_sc_muladd(unsigned char *out, const unsigned char *a, const unsigned char *b, const unsigned char *c) {
+    unsigned long t[64];
+    unsigned char wide[64];
+    int i, j;
+
+    for (i = 0; i < 64; i++) t[i] = i < 32 && c ? c[i] : 0;
+    for (i = 0; i < 32; i++) {
+        for (j = 0; j < 32; j++) t[i + j] += (unsigned long)a[i] * b[j];
+    }
+    for (i = 0; i < 63; i++) {
+        t[i + 1] += t[i] >> 8;
+        wide[i] = (unsigned char)t[i];
+    }
+    wide[63] = (unsigned char)t[63];
+    ed_sc_reduce(out, wide, 64);
+}
+#endif
+
+/* k = SHA-512(R || A || msg) mod L */
+static void ed_challenge(unsigned char *k, const unsigned char *r, const unsigned char *pub,
+                         const unsigned char *msg, unsigned long len) {
+    sha512_ctx c;
+    unsigned char h[SHA512_DIGEST];
+    sha512_init(&c);
+    sha512_update(&c, r, 32);
+    sha512_update(&c, pub, ED_KEY);
+    sha512_update(&c, msg, len);
+    sha512_final(&c, h);
+    ed_sc_reduce(k, h, SHA512_DIGEST);
+}
+
+/*
+ * 1 if sig is a valid signature of msg under pub. The odd multiples of -A
+ * live in a static table: 2 KB that would otherwise sit on the ARM7 stack.
+ */
+int ed25519_verify(const unsigned char *sig, const unsigned char *msg, unsigned long len, const unsigned char *pub) {
+    static ed_cached ta[ED_WINDOWS];
+    static signed char digits[2 * 256];
+    const ed_cached *tables[2];
+    ed_point a, r, acc;
+    ed_cached cr;
+    unsigned char k[32];
+
+    if (!ed_sc_below_order(sig + 32)) return 0;
+    if (ed_decode(&a, pub) != 0 || ed_decode(&r, sig) != 0) return 0;
+    ed_challenge(k, sig, pub, msg, len);
+    ed_point_neg(&a);
+    ed_table(ta, &a);
+    ed_slide(digits, sig + 32);
+    ed_slide(digits + 256, k);
+    tables[0] = ed_base();
+    tables[1] = ta;
+    ed_straus(&acc, 2, digits, tables);
+    ed_to_cached(&cr, &r);
+    ed_add_cached(&acc, &acc, &cr, 1);
+    return ed_is_small_order(&acc);
+}
+
+#if defined(HOST_POSIX)
+/*
+ * Batch check for busy gates: with random 128-bit z_i,
+ *   [8]([-sum z_i S_i]B + sum [z_i]R_i + sum [z_i k_i]A_i) == 0
+ * holds for all-valid input and fails otherwise except with chance about
+ * 2^-128. All 2n+1 points share one doubling chain, and the z_i windows
+ * are half as long as full scalars, so the cost per signature falls to
+ * less than half a single check. 1 only if every signature is valid; the
+ * caller checks one at a time to find the bad ones.
+ */
+#define ED_BATCH_MAX 64
+
+static unsigned char ed_batch_key[32];
+static unsigned long ed_batch_count;
+
+static void ed_batch_seed(void) {
+    FILE *f;
+    unsigned long t;
+    int i;
+
+    f = fopen("/dev/urandom", "rb");
+    if (f) {
+        i = (int)fread(ed_batch_key, 1, sizeof(ed_batch_key), f);
+        fclose(f);
+        if (i == (int)sizeof(ed_batch_key)) return;
+    }
+    t = (unsigned long)time(0) ^ timer_now_us();
+    for (i = 0; i < (int)sizeof(ed_batch_key); i++) ed_batch_key[i] ^= (unsigned char)(t >> (8 * (i % 4)));
+}
+
+int ed25519_verify_batch(int n, const unsigned char *const *sigs, const unsigned char *const *msgs,
+                         const unsigned long *lens, const unsigned char *const *pubs) {
+    static ed_cached tab[(2 * ED_BATCH_MAX + 1) * ED_WINDOWS];
+    static signed char digits[(2 * ED_BATCH_MAX + 1) * 256];
+    static const ed_cached *tables[2 * ED_BATCH_MAX + 1];
+    unsigned char k[32], z[32], sum[32], h[SHA512_DIGEST], cnt[4];
+    sha512_ctx c;
+    ed_point p, acc;
+    int i, m;
+
+    if (n <= 0) return 1;
+    if (n == 1) return ed25519_verify(sigs[0], msgs[0], lens[0], pubs[0]);
+    if (n > ED_BATCH_MAX) {
+        m = n / 2;
+        return ed25519_verify_batch(m, sigs, msgs, lens, pubs) &&
+               ed25519_verify_batch(n - m, sigs + m, msgs + m, lens + m, pubs + m);
+    }
+    if (ed_batch_count++ == 0) ed_batch_seed();
+    memset(sum, 0, sizeof(sum));
+    memset(z, 0, sizeof(z));
+    tables[0] = ed_base();
+    for (i = 0; i < n; i++) {
+        if (!ed_sc_below_order(sigs[i] + 32)) return 0;
+        ed_challenge(k, sigs[i], pubs[i], msgs[i], lens[i]);
+        /* z_i from a keyed hash of the signature: unpredictable, never reused */
+        cnt[0] = (unsigned char)(ed_batch_count >> 24);
+        cnt[1] = (unsigned char)(ed_batch_count >> 16);
+        cnt[2] = (unsigned char)(ed_batch_count >> 8);
+        cnt[3] = (unsigned char)i;
+        sha512_init(&c);
+        sha512_update(&c, ed_batch_key, sizeof(ed_batch_key));
+        sha512_update(&c, cnt, 4);
+        sha512_update(&c, sigs[i], ED_SIG);
+        sha512_update(&c, k, 32);
+        sha512_final(&c, h);
+        memcpy(z, h, 16);
+        ed_sc_muladd(sum, z, sigs[i] + 32, sum);
+
+        if (ed_decode(&p, sigs[i]) != 0) return 0;
+        ed_point_neg(&p);
+        ed_table(tab + (1 + 2 * i) * ED_WINDOWS, &p);
+        tables[1 + 2 * i] = tab + (1 + 2 * i) * ED_WINDOWS;
+        ed_slide(digits + 256 * (1 + 2 * i), z);
+
+        if (ed_decode(&p, pubs[i]) != 0) return 0;
+        ed_point_neg(&p);
+        ed_table(tab + (2 + 2 * i) * ED_WINDOWS, &p);
+        tables[2 + 2 * i] = tab + (2 + 2 * i) * ED_WINDOWS;
+        ed_sc_muladd(k, z, k, 0);
+        ed_slide(digits + 256 * (2 + 2 * i), k);
+    }
+    ed_slide(digits, sum);
+    ed_straus(&acc, 2 * n + 1, digits, tables);
+    return ed_is_small_order(&acc);
+}
+#endif
+
+#if defined(HOST_TOOLS)
+/* o = a^(p-2) = a^(2^255 - 21) */
+static void ed_invert(ed_fe o, const ed_fe a) {
+    ed_fe t, a11;
+    ed_pow250(t, a11, a);
+    ed_sqn(t, t, 5);
+    ed_mul(o, t, a11);
+}
+
+static void ed_encode(unsigned char *out, const ed_point *p) {
+    ed_fe zi, x, y;
+    ed_invert(zi, p->z);
+    ed_mul(x, p->x, zi);
+    ed_mul(y, p->y, zi);
+    ed_pack(out, y);
+    out[31] ^= (unsigned char)(ed_fe_parity(x) << 7);
+}
+
+/* [s]B for a scalar below L */
+static void ed_base_mul(ed_point *r, const unsigned char *s) {
+    static signed char digits[256];
+    const ed_cached *tables[1];
+    ed_slide(digits, s);
+    tables[0] = ed_base();
+    ed_straus(r, 1, digits, tables);
+}
+
+/* Secret scalar a (reduced mod L) and nonce prefix from a 32-byte seed */
+static void ed_expand_seed(unsigned char *a, unsigned char *prefix, const unsigned char *seed) {
+    sha512_ctx c;
+    unsigned char h[SHA512_DIGEST];
+    sha512_init(&c);
+    sha512_update(&c, seed, 32);
+    sha512_final(&c, h);
+    h[0] &= 248;
+    h[31] &= 127;
+    h[31] |= 64;
+    ed_sc_reduce(a, h, 32);
+    if (prefix) memcpy(prefix, h + 32, 32);
+}
+
+void ed25519_public_key(unsigned char *pub, const unsigned char *seed) {
+    unsigned char a[32];
+    ed_point p;
+    ed_expand_seed(a, 0, seed);
+    ed_base_mul(&p, a);
+    ed_encode(pub, &p);
+}
+
+void ed25519_sign(unsigned char *sig, const unsigned char *msg, unsigned long len, const unsigned char *seed,
+                  const unsigned char *pub) {
+    unsigned char a[32], prefix[32], r[32], k[32], h[SHA512_DIGEST];
+    sha512_ctx c;
+    ed_point p;
+
+    ed_expand_seed(a, prefix, seed);
+    sha512_init(&c);
+    sha512_update(&c, prefix, 32);
+    sha512_update(&c, msg, len);
+    sha512_final(&c, h);
+    ed_sc_reduce(r, h, SHA512_DIGEST);
+    ed_base_mul(&p, r);
+    ed_encode(sig, &p);
+    ed_challenge(k, sig, pub, msg, len);
+    ed_sc_muladd(sig + 32, k, a, r);
+}
+#endif
+
+/* ========================= SIGNED TOKENS ========================= */
+
+/*
+ * Offline credentials (visitor QR codes, mobile passes relayed over UART)
+ * that the door accepts as its first factor with no database lookup:
+ *
+ *   version | issuer | user (2) | zone mask (2) | expiry (4) | serial (4) | Ed25519 signature (64)
+ *
+ * Multi-byte fields are big-endian and expiry is in Unix seconds. The
+ * signature covers the first TOKEN_BODY bytes under the issuer's key.
+ * Tokens that passed are remembered by a 16-byte digest, so presenting
+ * the same pass again, or retrying it at the same door, skips the
+ * signature check. Expiry and zone are re-checked every time.
+ */
+#define TOKEN_VERSION 1
+#define TOKEN_BODY 14
+#define TOKEN_LEN (TOKEN_BODY + ED_SIG)
+#define TOKEN_ISSUERS 4
+#define TOKEN_CACHE_MAX 32
+#define TOKEN_CACHE_DEFAULT 8
+#define TOKEN_DIGEST 16
+
+#define TOKEN_OK 0
+#define TOKEN_BAD_FORMAT (-1)
+#define TOKEN_EXPIRED (-2)
+#define TOKEN_WRONG_ZONE (-3)
+#define TOKEN_BAD_SIGNATURE (-4)
+
+typedef struct {
+    int issuer;
+    int user;
+    unsigned int zones;
+    unsigned long expires;
+    unsigned long serial;
+} token_body;
+
+typedef struct {
+    unsigned char digest[TOKEN_DIGEST];
+    unsigned char used;
+} token_cache_entry;
+
+#if defined(TOKEN_AUTH)
+/* issuer 0, fixed when the door is built */
+static const unsigned char token_build_issuer[ED_KEY] = { TOKEN_ISSUER_KEY };
+#endif
+#if defined(HOST_TOOLS)
+/* development issuer (seed 00 01 .. 1f, see the tokens tool); never built into a door */
+static const unsigned char token_dev_issuer[ED_KEY] = {
+    0x03, 0xa1, 0x07, 0xbf, 0xf3, 0xce, 0x10, 0xbe, 0x1d, 0x70, 0xdd, 0x18, 0xe7, 0x4b, 0xc0, 0x99,
+    0x67, 0xe4, 0xd6, 0x30, 0x9b, 0xa5, 0x0d, 0x5f, 0x1d, 0xdc, 0x86, 0x64, 0x12, 0x55, 0x31, 0xb8
+};
+#endif
+
+static unsigned char token_issuer_key[TOKEN_ISSUERS][ED_KEY];
+static unsigned char token_issuer_set[TOKEN_ISSUERS];
+static token_cache_entry token_cache[TOKEN_CACHE_MAX];
+static int token_cache_entries = TOKEN_CACHE_DEFAULT;
+static int token_cache_next;
+
+/* Forget every verified token, e.g. when an issuer key changes */
+void token_cache_init(int entries) {
+    if (entries < 0 || entries > TOKEN_CACHE_MAX) entries = TOKEN_CACHE_DEFAULT;
+    token_cache_entries = entries;
+    token_cache_next = 0;
+    memset(token_cache, 0, sizeof(token_cache));
+}
+
+/* Install or replace an issuer public key */
+int token_set_issuer(int id, const unsigned char *pub) {
+    if (id < 0 || id >= TOKEN_ISSUERS) return -1;
+    memcpy(token_issuer_key[id], pub, ED_KEY);
+    token_issuer_set[id] = 1;
+    token_cache_init(token_cache_entries);
+    return 0;
+}
+
+static unsigned long token_be32(const unsigned char *p) {
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+/* Decode the body; TOKEN_OK or TOKEN_BAD_FORMAT (length, version, unknown issuer) */
+int token_parse(const unsigned char *tok, int len, token_body *b) {
+    if (len != TOKEN_LEN || tok[0] != TOKEN_VERSION) return TOKEN_BAD_FORMAT;
+    b->issuer = tok[1];
+    if (b->issuer >= TOKEN_ISSUERS || !token_issuer_set[b->issuer]) return TOKEN_BAD_FORMAT;
+    b->user = (tok[2] << 8) | tok[3];
+    b->zones = (unsigned int)((tok[4] << 8) | tok[5]);
+    b->expires = token_be32(tok + 6);
+    b->serial = token_be32(tok + 10);
+    return TOKEN_OK;
+}
+
+static void token_digest(unsigned char *d, const unsigned char *tok) {
+    sha512_ctx c;
+    unsigned char h[SHA512_DIGEST];
+    sha512_init(&c);
+    sha512_update(&c, tok, TOKEN_LEN);
+    sha512_final(&c, h);
+    memcpy(d, h, TOKEN_DIGEST);
+}
+
+static int token_cache_find(const unsigned char *d) {
+    int i;
+    for (i = 0; i < token_cache_entries; i++) {
+        if (token_cache[i].used && memcmp(token_cache[i].digest, d, TOKEN_DIGEST) == 0) return 1;
+    }
+    return 0;
+}
+
+static void token_cache_add(const unsigned char *d) {
+    if (token_cache_entries == 0) return;
+    memcpy(token_cache[token_cache_next].digest, d, TOKEN_DIGEST);
+    token_cache[token_cache_next].used = 1;
+    token_cache_next = (token_cache_next + 1) % token_cache_entries;
+}
+
+/* Everything but the signature; fills b and the cache digest */
+static int token_precheck(const unsigned char *tok, int len, int zone, unsigned long now_s, token_body *b,
+                          unsigned char *digest) {
+    int rc;
+    rc = token_parse(tok, len, b);
+    if (rc != TOKEN_OK) return rc;
+    if (now_s > b->expires) return TOKEN_EXPIRED;
+    if (zone < 0 || zone > 15 || !(b->zones & (1u << zone))) return TOKEN_WRONG_ZONE;
+    token_digest(digest, tok);
+    return TOKEN_OK;
+}
+
+/* Check a token for a door in zone at now_s; TOKEN_OK fills b */
+int token_check(const unsigned char *tok, int len, int zone, unsigned long now_s, token_body *b) {
+    unsigned char d[TOKEN_DIGEST];
+    int rc;
+
+    rc = token_precheck(tok, len, zone, now_s, b, d);
+    if (rc != TOKEN_OK) return rc;
+    if (token_cache_find(d)) {
+        metrics_add(MET_TOKEN_CACHE_HITS, 1);
+        return TOKEN_OK;
+    }
+    metrics_add(MET_TOKEN_VERIFIES, 1);
+    if (!ed25519_verify(tok + TOKEN_BODY, tok, TOKEN_BODY, token_issuer_key[b->issuer])) return TOKEN_BAD_SIGNATURE;
+    token_cache_add(d);
+    return TOKEN_OK;
+}
+
+#if defined(HOST_POSIX)
+/*
+ * n tokens at once, for gates that queue presentations faster than
+ * single checks keep up with: cache hits and body failures are settled
+ * first, the rest share one batch check, and only a failed batch falls
+ * back to single checks to find the culprits. rc[i] as token_check;
+ * returns how many passed.
+ */
+int token_check_batch(const unsigned char *const *toks, int n, int zone, unsigned long now_s, token_body *b,
+                      int *rc) {
+    static const unsigned char *sigs[ED_BATCH_MAX], *msgs[ED_BATCH_MAX], *pubs[ED_BATCH_MAX];
+    static unsigned long lens[ED_BATCH_MAX];
+    static unsigned char digests[ED_BATCH_MAX][TOKEN_DIGEST];
+    static int idx[ED_BATCH_MAX];
+    int i, m, base, ok, passed;
+
+    passed = 0;
+    for (base = 0; base < n; base += ED_BATCH_MAX) {
+        m = 0;
+        for (i = base; i < n && i < base + ED_BATCH_MAX; i++) {
+            rc[i] = token_precheck(toks[i], TOKEN_LEN, zone, now_s, &b[i], digests[m]);
+            if (rc[i] != TOKEN_OK) continue;
+            if (token_cache_find(digests[m])) {
+                metrics_add(MET_TOKEN_CACHE_HITS, 1);
+                continue;
+            }
+            sigs[m] = toks[i] + TOKEN_BODY;
+            msgs[m] = toks[i];
+            pubs[m] = token_issuer_key[b[i].issuer];
+            lens[m] = TOKEN_BODY;
+            idx[m++] = i;
+        }
+        metrics_add(MET_TOKEN_VERIFIES, (unsigned long)m);
+        ok = ed25519_verify_batch(m, sigs, msgs, lens, pubs);
+        for (i = 0; i < m; i++) {
+            if (!ok && !ed25519_verify(sigs[i], msgs[i], TOKEN_BODY, pubs[i])) {
+                rc[idx[i]] = TOKEN_BAD_SIGNATURE;
+                continue;
+            }
+            token_cache_add(digests[i]);
+        }
+    }
+    for (i = 0; i < n; i++) passed += rc[i] == TOKEN_OK;
+    return passed;
+}
+#endif
+
+#if defined(HOST_TOOLS)
+/* Build and sign a token for body b with the issuer's seed */
+void token_issue(unsigned char *tok, const token_body *b, const unsigned char *seed, const unsigned char *pub) {
+    int i;
+    tok[0] = TOKEN_VERSION;
+    tok[1] = (unsigned char)b->issuer;
+    tok[2] = (unsigned char)(b->user >> 8);
+    tok[3] = (unsigned char)b->user;
+    tok[4] = (unsigned char)(b->zones >> 8);
+    tok[5] = (unsigned char)b->zones;
+    for (i = 0; i < 4; i++) {
+        tok[6 + i] = (unsigned char)(b->expires >> (24 - 8 * i));
+        tok[10 + i] = (unsigned char)(b->serial >> (24 - 8 * i));
+    }
+    ed25519_sign(tok + TOKEN_BODY, tok, TOKEN_BODY, seed, pub);
+}
+#endif
+
+/* ========================= INTERNAL FLASH ========================= */
+
+#if defined(FW_UPDATE) || defined(USER_FLASH) || defined(HOST_TOOLS)
+/*
+ * LPC2124 on-chip flash: 17 usable sectors (8 KB, except two of 64 KB)
+ * below the boot block. Reads are plain memory accesses. Erase and
+ * program go through the IAP entry in the boot ROM, a 256-byte page at a
+ * time. Flash cannot be read while IAP runs, so the caller keeps
+ * interrupts off for the duration. The host emulates the array: programming
+ * can only clear bits, and a page that would need a 0 -> 1 change fails like
+ * an unerased write on the part.
+ *
+ * Both sides keep flash_busy_ms, the time spent inside IAP at the
+ * datasheet figures (400 ms per sector erase, 1 ms per page). Host models
+ * advance their clocks by it, and on the target it is the estimate of how
+ * long the main loop was held off.
+ */
+#define FLASH_SECTORS 17
+#define FLASH_PAGE 256
+#define FLASH_SIZE 0x3E000UL
+#define IAP_ENTRY 0x7FFFFFF1UL
+#define IAP_PREPARE 50
+#define IAP_COPY 51
+#define IAP_ERASE 52
+#define IAP_CCLK_KHZ 60000UL
+#define FLASH_ERASE_MS 400
+#define FLASH_PROGRAM_MS 1
+
+static const unsigned long flash_sector_base[FLASH_SECTORS + 1] = {
+    0x00000UL, 0x02000UL, 0x04000UL, 0x06000UL, 0x08000UL, 0x0A000UL, 0x0C000UL, 0x0E000UL, 0x10000UL,
+    0x20000UL, 0x30000UL, 0x32000UL, 0x34000UL, 0x36000UL, 0x38000UL, 0x3A000UL, 0x3C000UL, FLASH_SIZE
+};
+
+static unsigned long flash_erases, flash_pages, flash_busy_ms;
+
+#if defined(HOST_POSIX)
+static unsigned char flash_mem[FLASH_SIZE];
+#else
+typedef void (*iap_entry_fn)(unsigned long *cmd, unsigned long *result);
+static unsigned long iap_page[FLASH_PAGE / 4]; /* IAP copies from word-aligned RAM */
+
+static unsigned long iap_call(unsigned long code, unsigned long a, unsigned long b, unsigned long c,
+                              unsigned long d) {
+    unsigned long cmd[5], res[3];
+    cmd[0] = code;
+    cmd[1] = a;
+    cmd[2] = b;
+    cmd[3] = c;
+    cmd[4] = d;
+    ((iap_entry_fn)IAP_ENTRY)(cmd, res);
+    return res[0];
+}
+#endif
+
+const unsigned char *flash_at(unsigned long addr) {
+#if defined(HOST_POSIX)
+    return flash_mem + addr;
+#else
+    return (const unsigned char *)addr;
+#endif
+}
+
+/* Sector holding addr, or -1 past the end */
+int flash_sector_of(unsigned long addr) {
+    int s;
+    for (s = 0; s < FLASH_SECTORS; s++) {
+        if (addr < flash_sector_base[s + 1]) return s;
+    }
+    return -1;
+}
+
+int flash_erase(int sector) {
+    if (sector < 0 || sector >= FLASH_SECTORS) return -1;
+    flash_erases++;
+    flash_busy_ms += FLASH_ERASE_MS;
+    metrics_add(MET_FLASH_ERASES, 1);
+#if defined(HOST_POSIX)
+    memset(flash_mem + flash_sector_base[sector], 0xFF,
+           (size_t)(flash_sector_base[sector + 1] - flash_sector_base[sector]));
+    return 0;
+#else
+    if (iap_call(IAP_PREPARE, (unsigned long)sector, (unsigned long)sector, 0, 0) != 0) return -1;
+    return iap_call(IAP_ERASE, (unsigned long)sector, (unsigned long)sector, IAP_CCLK_KHZ, 0) == 0 ? 0 : -1;
+#endif
+}
+
+/* Program one page at a page-aligned address */
+int flash_program(unsigned long addr, const unsigned char *page) {
+    int s;
+    s = flash_sector_of(addr);
+    if (s < 0 || addr % FLASH_PAGE) return -1;
+    flash_pages++;
+    flash_busy_ms += FLASH_PROGRAM_MS;
+    metrics_add(MET_FLASH_PAGES, 1);
+#if defined(HOST_POSIX)
+    {
+        int i;
+        for (i = 0; i < FLASH_PAGE; i++) {
+            if ((flash_mem[addr + i] & page[i]) != page[i]) return -1;
+        }
+        for (i = 0; i < FLASH_PAGE; i++) flash_mem[addr + i] &= page[i];
+    }
+    return 0;
+#else
+    memcpy(iap_page, page, FLASH_PAGE);
+    if (iap_call(IAP_PREPARE, (unsigned long)s, (unsigned long)s, 0, 0) != 0) return -1;
+    return iap_call(IAP_COPY, addr, (unsigned long)iap_page, FLASH_PAGE, IAP_CCLK_KHZ) == 0 ? 0 : -1;
+#endif
+}
+#endif
+
+/* ========================= STORAGE ========================= */
+
+/*
+ * Byte-addressed persistent stores behind one interface, so the user
+ * table and the tools can sit on whichever device a build has:
+ *
+ *   ram     static array (host), nothing survives a reset
+ *   eeprom  the I2C EEPROM: 32-byte write pages, 5 ms write cycle
+ *   fp-eeprom  the template EEPROM of gallery builds, 64-byte pages
+ *           (host tools open it by name for the backend matrix)
+ *   flash   internal flash sectors 14-15 through IAP; bytes must be
+ *           erased (8 KB at a time) before they are written again
+ *   file    an mmap'd file (host tools), made durable by store_sync
+ *   remote  a forked server on a socket pair (host tools), standing in
+ *           for a store across the network: every call is a round trip
+ *
+ * Each device states its write page, its erase unit (0 when bytes can be
+ * rewritten) and a latency class, and store_batch turns those into how
+ * many records a caller should gather per write. busy_us adds up device
+ * time at the datasheet figures for the parts the host only emulates
+ * (EEPROM, flash); the host backends leave it at 0, their cost is real.
+ */
+#define STORE_LAT_RAM 0
+#define STORE_LAT_BUS 1
+#define STORE_LAT_FLASH 2
+#define STORE_LAT_DISK 3
+#define STORE_LAT_NET 4
+
+#define STORE_OK 0
+#define STORE_ERR_RANGE (-1)
+#define STORE_ERR_ERASE (-2) /* flash bytes not erased */
+#define STORE_ERR_IO (-3)
+
+#define STORE_EEPROM_PAGE 32
+#define STORE_EEPROM_WRITE_US 5000.0
+#define STORE_I2C_KHZ 400
+#define STORE_FLASH_SECTOR 14
+#define STORE_HOST_SIZE 65536UL
+#define STORE_HOST_PAGE 4096
+#define STORE_NET_BATCH 1024 /* bytes worth one round trip */
+
+typedef struct store_dev store_dev;
+struct store_dev {
+    const char *name;
+    unsigned long size;
+    unsigned int page;
+    unsigned long erase_unit;
+    int latency;
+    int (*read)(store_dev *s, unsigned long addr, unsigned char *buf, unsigned int len);
+    int (*write)(store_dev *s, unsigned long addr, const unsigned char *buf, unsigned int len);
+    int (*erase)(store_dev *s, unsigned long addr);
+    int (*sync)(store_dev *s);
+    double busy_us;
+    unsigned char *mem; /* ram, file */
+    int fd;             /* file, remote */
+    long pid;           /* remote server */
+};
+
+int store_read(store_dev *s, unsigned long addr, unsigned char *buf, unsigned int len) {
+    if (addr > s->size || len > s->size - addr) return STORE_ERR_RANGE;
+    return s->read(s, addr, buf, len);
+}
+
+int store_write(store_dev *s, unsigned long addr, const unsigned char *buf, unsigned int len) {
+    if (addr > s->size || len > s->size - addr) return STORE_ERR_RANGE;
+    return s->write(s, addr, buf, len);
+}
+
+/* Erase the unit holding addr; a no-op where bytes can be rewritten */
+int store_erase(store_dev *s, unsigned long addr) {
+    if (addr >= s->size) return STORE_ERR_RANGE;
+    return s->erase ? s->erase(s, addr) : STORE_OK;
+}
+
+/* Wait until every write so far would survive a power cut */
+int store_sync(store_dev *s) {
+    return s->sync ? s->sync(s) : STORE_OK;
+}
+
+/*
+ * Records of rec bytes to gather per write: a write page at a time for
+ * appends, and for rewrites a whole erase unit where the device has one,
+ * since every rewrite there costs an erase. RAM gains nothing from
+ * batching; a network store wants a round trip's worth.
+ */
+unsigned int store_batch(const store_dev *s, unsigned int rec, int rewrite) {
+    unsigned long unit;
+    if (s->latency == STORE_LAT_RAM || rec == 0) return 1;
+    unit = s->latency == STORE_LAT_NET ? STORE_NET_BATCH : s->page;
+    if (rewrite && s->erase_unit) unit = s->erase_unit;
+    return unit > rec ? (unsigned int)(unit / rec) : 1;
+}
+
+/*
+ * Overwrite bytes in place whatever the device: where there is an erase
+ * unit, each unit touched is read, patched, erased and written back
+ * whole. Only the host has the RAM to hold a unit; on the target this is
+ * store_write, and flash is left to the user store.
+ */
+int store_rewrite(store_dev *s, unsigned long addr, const unsigned char *buf, unsigned int len) {
+#if defined(HOST_POSIX)
+    unsigned char *unit;
+    unsigned long base, end, from, to;
+    int rc;
+
+    if (!s->erase_unit) return store_write(s, addr, buf, len);
+    if (addr > s->size || len > s->size - addr) return STORE_ERR_RANGE;
+    unit = (unsigned char *)malloc((size_t)s->erase_unit);
+    if (!unit) return STORE_ERR_IO;
+    rc = STORE_OK;
+    end = addr + len;
+    for (base = addr - addr % s->erase_unit; rc == STORE_OK && base < end; base += s->erase_unit) {
+        rc = store_read(s, base, unit, (unsigned int)s->erase_unit);
+        if (rc != STORE_OK) break;
+        from = addr > base ? addr : base;
+        to = end < base + s->erase_unit ? end : base + s->erase_unit;
+        memcpy(unit + (from - base), buf + (from - addr), (size_t)(to - from));
+        rc = store_erase(s, base);
+        if (rc == STORE_OK) rc = store_write(s, base, unit, (unsigned int)s->erase_unit);
+    }
+    free(unit);
+    return rc;
+#else
+    return store_write(s, addr, buf, len);
+#endif
+}
+
+#if defined(HOST_POSIX)
+static unsigned char store_ram_mem[EEPROM_SIZE];
+
+static int store_ram_read(store_dev *s, unsigned long addr, unsigned char *buf, unsigned int len) {
+    memcpy(buf, s->mem + addr, len);
+    return STORE_OK;
+}
+
+static int store_ram_write(store_dev *s, unsigned long addr, const unsigned char *buf, unsigned int len) {
+    memcpy(s->mem + addr, buf, len);
+    return STORE_OK;
+}
+
+store_dev store_ram = { "ram", EEPROM_SIZE, 1, 0, STORE_LAT_RAM, store_ram_read, store_ram_write, 0, 0, 0.0,
+                        store_ram_mem, -1, 0 };
+#endif
+
+/* Bus time for n bytes plus the device address and word address, 9 clocks per byte */
+static double store_i2c_us(unsigned int n) {
+    return (3 + n) * 9 * 1000.0 / STORE_I2C_KHZ;
+}
+
+static int store_eeprom_read(store_dev *s, unsigned long addr, unsigned char *buf, unsigned int len) {
+    s->busy_us += store_i2c_us(len);
+    return eeprom_read_bytes((unsigned int)addr, buf, len) == 0 ? STORE_OK : STORE_ERR_IO;
+}
+
+/* The part wraps within a page, so a write is split at page boundaries, one write cycle each */
+static int store_eeprom_write(store_dev *s, unsigned long addr, const unsigned char *buf, unsigned int len) {
+    unsigned int n;
+    while (len > 0) {
+        n = STORE_EEPROM_PAGE - (unsigned int)(addr % STORE_EEPROM_PAGE);
+        if (n > len) n = len;
+        s->busy_us += store_i2c_us(n) + STORE_EEPROM_WRITE_US;
+        if (eeprom_write_bytes((unsigned int)addr, buf, n) != 0) return STORE_ERR_IO;
+        addr += n;
+        buf += n;
+        len -= n;
+    }
+    return STORE_OK;
+}
+
+store_dev store_eeprom = { "eeprom", EEPROM_SIZE, STORE_EEPROM_PAGE, 0, STORE_LAT_BUS, store_eeprom_read,
+                           store_eeprom_write, 0, 0, 0.0, 0, -1, 0 };
+
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE) || defined(HOST_TOOLS)
+/* The template EEPROM: same bus and write cycle, 64-byte pages */
+#define STORE_FP_EEPROM_PAGE 64
+
+static int store_fp_eeprom_read(store_dev *s, unsigned long addr, unsigned char *buf, unsigned int len) {
+    s->busy_us += store_i2c_us(len);
+    return fp_eeprom_read_bytes((unsigned int)addr, buf, len) == 0 ? STORE_OK : STORE_ERR_IO;
+}
+
+static int store_fp_eeprom_write(store_dev *s, unsigned long addr, const unsigned char *buf, unsigned int len) {
+    unsigned int n;
+    while (len > 0) {
+        n = STORE_FP_EEPROM_PAGE - (unsigned int)(addr % STORE_FP_EEPROM_PAGE);
+        if (n > len) n = len;
+        s->busy_us += store_i2c_us(n) + STORE_EEPROM_WRITE_US;
+        if (fp_eeprom_write_bytes((unsigned int)addr, buf, n) != 0) return STORE_ERR_IO;
+        addr += n;
+        buf += n;
+        len -= n;
+    }
+    return STORE_OK;
+}
+
+store_dev store_fp_eeprom = { "fp-eeprom", FP_EEPROM_SIZE, STORE_FP_EEPROM_PAGE, 0, STORE_LAT_BUS,
+                              store_fp_eeprom_read, store_fp_eeprom_write, 0, 0, 0.0, 0, -1, 0 };
+#endif
+
+#if defined(FW_UPDATE) || defined(USER_FLASH) || defined(HOST_TOOLS)
+/*
+ * Sectors 14 and 15 (8 KB each), which -DUSER_FLASH gives to the user
+ * store, so store_open keeps "flash" out of those builds. Writes go a
+ * page at a time, the rest of the page reprogrammed with what it holds,
+ * and fail unless every target byte is erased.
+ */
+static unsigned long store_flash_base(void) {
+    return flash_sector_base[STORE_FLASH_SECTOR];
+}
+
+static int store_flash_read(store_dev *s, unsigned long addr, unsigned char *buf, unsigned int len) {
+    (void)s;
+    memcpy(buf, flash_at(store_flash_base() + addr), len);
+    return STORE_OK;
+}
+
+static int store_flash_write(store_dev *s, unsigned long addr, const unsigned char *buf, unsigned int len) {
+    unsigned char page[FLASH_PAGE];
+    const unsigned char *cur;
+    unsigned long at, busy;
+    unsigned int k, off, n;
+
+    cur = flash_at(store_flash_base() + addr);
+    for (k = 0; k < len; k++) {
+        if (cur[k] != 0xFF) return STORE_ERR_ERASE;
+    }
+    busy = flash_busy_ms;
+    at = store_flash_base() + addr;
+    while (len > 0) {
+        off = (unsigned int)(at % FLASH_PAGE);
+        n = FLASH_PAGE - off < len ? FLASH_PAGE - off : len;
+        memcpy(page, flash_at(at - off), FLASH_PAGE);
+        memcpy(page + off, buf, n);
+        if (flash_program(at - off, page) != 0) return STORE_ERR_IO;
+        at += n;
+        buf += n;
+        len -= n;
+    }
+    s->busy_us += (flash_busy_ms - busy) * 1000.0;
+    return STORE_OK;
+}
+
+static int store_flash_erase(store_dev *s, unsigned long addr) {
+    s->busy_us += FLASH_ERASE_MS * 1000.0;
+    return flash_erase(flash_sector_of(store_flash_base() + addr)) == 0 ? STORE_OK : STORE_ERR_IO;
+}
+
+store_dev store_flash = { "flash", 0x4000UL, FLASH_PAGE, 0x2000UL, STORE_LAT_FLASH, store_flash_read,
+                          store_flash_write, store_flash_erase, 0, 0.0, 0, -1, 0 };
+#endif
+
+#if defined(HOST_TOOLS)
+static int store_file_read(store_dev *s, unsigned long addr, unsigned char *buf, unsigned int len) {
+    memcpy(buf, s->mem + addr, len);
+    return STORE_OK;
+}
+
+static int store_file_write(store_dev *s, unsigned long addr, const unsigned char *buf, unsigned int len) {
+    memcpy(s->mem + addr, buf, len);
+    return STORE_OK;
+}
+
+static int store_file_sync(store_dev *s) {
+    return msync(s->mem, (size_t)s->size, MS_SYNC) == 0 ? STORE_OK : STORE_ERR_IO;
+}
+
+store_dev store_file = { "file", STORE_HOST_SIZE, STORE_HOST_PAGE, 0, STORE_LAT_DISK, store_file_read,
+                         store_file_write, 0, store_file_sync, 0.0, 0, -1, 0 };
+
+/* Map path (created blank, 0xFF like the EEPROM, if shorter than the store; refused if longer) */
+static int store_file_open(store_dev *s, const char *path) {
+    void *p;
+    off_t had;
+
+    s->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (s->fd < 0) return STORE_ERR_IO;
+    had = lseek(s->fd, 0, SEEK_END);
+    /* a new or short file is extended; a longer one is some other image and is left alone */
+    if (had < 0 || (unsigned long)had > s->size ||
+        ((unsigned long)had < s->size && ftruncate(s->fd, (off_t)s->size) != 0)) {
+        close(s->fd);
+        return STORE_ERR_IO;
+    }
+    p = mmap(0, (size_t)s->size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (p == MAP_FAILED) {
+        close(s->fd);
+        return STORE_ERR_IO;
+    }
+    s->mem = (unsigned char *)p;
+    if ((unsigned long)had < s->size) memset(s->mem + had, 0xFF, (size_t)(s->size - (unsigned long)had));
+    return STORE_OK;
+}
+
+/*
+ * Remote requests: op | addr (4) | len (2) | data for 'W', answered by
+ * status | data for 'R'. The server holds its own copy and exits when the
+ * socket closes.
+ */
+static int store_io(int fd, unsigned char *buf, unsigned int len, int out) {
+    ssize_t n;
+    while (len > 0) {
+        n = out ? write(fd, buf, len) : read(fd, buf, len);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (unsigned int)n;
+    }
+    return 0;
+}
+
+static void store_remote_serve(int fd, unsigned long size) {
+    unsigned char hdr[7], *mem;
+    unsigned long addr;
+    unsigned int len;
+    unsigned char st;
+
+    mem = (unsigned char *)malloc((size_t)size);
+    if (!mem) _exit(1);
+    memset(mem, 0xFF, (size_t)size);
+    while (store_io(fd, hdr, sizeof(hdr), 0) == 0) {
+        addr = ((unsigned long)hdr[1] << 24) | ((unsigned long)hdr[2] << 16) | ((unsigned long)hdr[3] << 8) | hdr[4];
+        len = (unsigned int)((hdr[5] << 8) | hdr[6]);
+        st = addr <= size && len <= size - addr ? STORE_OK : (unsigned char)-STORE_ERR_RANGE;
+        if (hdr[0] == 'W' && (st != STORE_OK || store_io(fd, mem + addr, len, 0) != 0)) break;
+        if (store_io(fd, &st, 1, 1) != 0) break;
+        if (hdr[0] == 'R' && st == STORE_OK && store_io(fd, mem + addr, len, 1) != 0) break;
+    }
+    _exit(0);
+}
+
+static int store_remote_call(store_dev *s, int op, unsigned long addr, unsigned char *buf, unsigned int len) {
+    unsigned char hdr[7], st;
+    hdr[0] = (unsigned char)op;
+    hdr[1] = (unsigned char)(addr >> 24);
+    hdr[2] = (unsigned char)(addr >> 16);
+    hdr[3] = (unsigned char)(addr >> 8);
+    hdr[4] = (unsigned char)addr;
+    hdr[5] = (unsigned char)(len >> 8);
+    hdr[6] = (unsigned char)len;
+    if (store_io(s->fd, hdr, sizeof(hdr), 1) != 0) return STORE_ERR_IO;
+    if (op == 'W' && store_io(s->fd, buf, len, 1) != 0) return STORE_ERR_IO;
+    if (store_io(s->fd, &st, 1, 0) != 0 || st != STORE_OK) return STORE_ERR_IO;
+    if (op == 'R' && store_io(s->fd, buf, len, 0) != 0) return STORE_ERR_IO;
+    return STORE_OK;
+}
+
+static int store_remote_read(store_dev *s, unsigned long addr, unsigned char *buf, unsigned int len) {
+    return store_remote_call(s, 'R', addr, buf, len);
+}
+
+static int store_remote_write(store_dev *s, unsigned long addr, const unsigned char *buf, unsigned int len) {
+    return store_remote_call(s, 'W', addr, (unsigned char *)buf, len);
+}
+
+static int store_remote_sync(store_dev *s) {
+    return store_remote_call(s, 'S', 0, 0, 0);
+}
+
+store_dev store_remote = { "remote", STORE_HOST_SIZE, STORE_HOST_PAGE, 0, STORE_LAT_NET, store_remote_read,
+                           store_remote_write, 0, store_remote_sync, 0.0, 0, -1, 0 };
+
+static int store_remote_open(store_dev *s) {
+    int sv[2];
+    pid_t pid;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return STORE_ERR_IO;
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        store_remote_serve(sv[1], s->size);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return STORE_ERR_IO;
+    }
+    s->fd = sv[0];
+    s->pid = (long)pid;
+    return STORE_OK;
+}
+
+/* Unmap the file or stop the server */
+void store_close(store_dev *s) {
+    if (s->mem && s->fd >= 0) {
+        munmap(s->mem, (size_t)s->size);
+        s->mem = 0;
+    }
+    if (s->fd >= 0) close(s->fd);
+    s->fd = -1;
+    if (s->pid > 0) waitpid((pid_t)s->pid, 0, 0);
+    s->pid = 0;
+}
+#endif
+
+#if defined(HOST_POSIX)
+/*
+ * "ram", "eeprom", "flash", "file:PATH", "remote" or "fp-eeprom" (the last
+ * four as built); 0 if unknown or it failed. Door builds do not offer the
+ * template EEPROM: its records would overlap the password slots. Nor does
+ * a USER_FLASH build offer "flash", whose sectors hold the user table.
+ */
+store_dev *store_open(const char *spec) {
+    if (strcmp(spec, "ram") == 0) return &store_ram;
+    if (strcmp(spec, "eeprom") == 0) return &store_eeprom;
+#if (defined(FW_UPDATE) || defined(HOST_TOOLS)) && !defined(USER_FLASH)
+    if (strcmp(spec, "flash") == 0) return &store_flash;
+#endif
+#if defined(HOST_TOOLS)
+    if (strncmp(spec, "file:", 5) == 0) return store_file_open(&store_file, spec + 5) == STORE_OK ? &store_file : 0;
+    if (strcmp(spec, "remote") == 0) return store_remote_open(&store_remote) == STORE_OK ? &store_remote : 0;
+    if (strcmp(spec, "fp-eeprom") == 0) return &store_fp_eeprom;
+#endif
+    return 0;
+}
+#endif
+
+/* ========================= FIRMWARE UPDATE ========================= */
+
+#if defined(FW_UPDATE) || defined(HOST_TOOLS)
+/*
+ * A/B images with the boot loader in sector 0:
+ *   sector 0        boot loader (runs fw_boot_select, jumps to the bank)
+ *   sectors 1, 16   boot records, appended a page at a time
+ *   sectors 2..8    bank A, 96 KB used
+ *   sectors 9..13   bank B, 96 KB
+ *   sectors 14, 15  user store (USER_FLASH), untouched by updates
+ * Images are built position-independent so one image runs from either
+ * bank, and an update is a delta against whatever is running.
+ *
+ * An update starts by erasing the sectors of the other bank that the new
+ * image needs, one at a time and only while no session is running. An
+ * erase keeps the main loop off flash for 400 ms. The interrupt handlers
+ * run from RAM (MEMMAP user mode), so the UARTs stay live, and the host
+ * waits for this step to finish before it sends any delta.
+ * The delta then streams in over the management link and is applied
+ * straight into the other bank while doors keep working. It is a list of ops, each
+ * a byte of type (2 bits) and length (6 bits; 63 means a varint with the
+ * rest follows):
+ *   COPY n   n bytes from the running image at the cursor
+ *   LIT n    n literal bytes; the cursor skips n as well, so patched
+ *            words keep the old and new images in step
+ *   SEEK n   move the cursor by n (zigzag), for inserted or removed code
+ * Output is hashed from flash after each page is programmed. A signed
+ * manifest names the running image's digest and the new one's. The new
+ * bank only becomes bootable once its digest matches: commit appends a
+ * PENDING record.
+ *
+ * Switching happens at the next reset. The boot loader marks a PENDING
+ * image TRIED and starts it, and the application confirms it once it is up.
+ * A TRIED image still unconfirmed at the following reset is abandoned for
+ * the last CONFIRMED one. Records carry a sequence number and a CRC, so a
+ * torn write is just ignored. When a record sector fills, the other one is
+ * erased and takes over, so the sector with the newest record is never
+ * erased.
+ */
+#define FW_BANKS 2
+#define FW_BANK_SIZE 0x18000UL
+#define FW_DIGEST 32
+#define FW_MAGIC 0x4D4C4657UL  /* "MLFW" */
+#define FW_RECORD_LEN 52
+#define FW_REC_PENDING 1
+#define FW_REC_TRIED 2
+#define FW_REC_CONFIRMED 3
+#define FW_MANIFEST_BODY 72     /* version | length | base digest | new digest */
+#define FW_MANIFEST_LEN (FW_MANIFEST_BODY + ED_SIG)
+#define FW_OP_COPY 0
+#define FW_OP_LIT 1
+#define FW_OP_SEEK 2
+#define FW_OP_SHORT 63
+
+#define FW_OK 0
+#define FW_ERR_STATE (-1)       /* no update in progress, or not running a confirmed image */
+#define FW_ERR_BASE (-2)        /* delta is for a different running image */
+#define FW_ERR_AUTH (-3)        /* manifest signature */
+#define FW_ERR_DELTA (-4)       /* malformed op or out of range */
+#define FW_ERR_FLASH (-5)
+#define FW_ERR_DIGEST (-6)      /* new image does not hash to the manifest */
+
+static const unsigned long fw_bank_base[FW_BANKS] = { 0x04000UL, 0x20000UL };
+static const int fw_record_sector[2] = { 1, 16 };
+
+#if defined(HOST_TOOLS)
+/* development firmware key (seed 40 41 .. 5f, see the fwupdate tool); never built into a door */
+static const unsigned char fw_key[ED_KEY] = {
+    0x25, 0x43, 0xb9, 0x2f, 0xf1, 0x09, 0x55, 0x11, 0x47, 0x6a, 0xdc, 0x83, 0x69, 0xdb, 0x6d, 0xdc,
+    0x93, 0x36, 0x65, 0xa1, 0x19, 0x78, 0xdd, 0xa1, 0x40, 0x4e, 0xe1, 0x06, 0x6c, 0xa9, 0x55, 0x9d
+};
+#else
+/* the vendor's release signing key, fixed when the door is built */
+static const unsigned char fw_key[ED_KEY] = { FW_VENDOR_KEY };
+#endif
+
+typedef struct {
+    unsigned long seq;
+    unsigned long length;
+    unsigned long version;
+    int bank;
+    int state;
+    unsigned char digest[FW_DIGEST];
+} fw_record;
+
+typedef struct {
+    int active;
+    int bank;                   /* bank being written */
+    unsigned long length;
+    unsigned long version;
+    unsigned char digest[FW_DIGEST];
+    unsigned long base_len;     /* running image the delta reads from */
+    unsigned long consumed;     /* delta bytes taken */
+    unsigned long out;          /* image bytes produced */
+    unsigned long cur;          /* cursor into the running image */
+    unsigned long left;         /* bytes still due from the current op */
+    unsigned long arg;
+    int op;
+    int shift;                  /* -1 between ops, else varint bits so far */
+    int erased;                 /* sectors of the bank erased so far */
+    int sectors;                /* ... out of the ones the new image needs */
+    unsigned char page[FLASH_PAGE];
+    sha512_ctx sha;
+} fw_update;
+
+static int fw_running = -1;     /* bank the boot loader started, -1 before fw_boot_select */
+
+static unsigned long fw_be32(const unsigned char *p) {
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+static void fw_put32(unsigned char *p, unsigned long v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+/* Scan both record sectors; newest valid record and newest CONFIRMED one (seq 0 if none) */
+static void fw_scan(fw_record *newest, fw_record *confirmed, int *newest_sector) {
+    const unsigned char *p;
+    fw_record r;
+    unsigned long a;
+    int k;
+
+    newest->seq = confirmed->seq = 0;
+    *newest_sector = 0;
+    for (k = 0; k < 2; k++) {
+        for (a = flash_sector_base[fw_record_sector[k]]; a < flash_sector_base[fw_record_sector[k] + 1];
+             a += FLASH_PAGE) {
+            p = flash_at(a);
+            if (fw_be32(p) != FW_MAGIC) continue;
+            if (osdp_crc16(p, FW_RECORD_LEN - 2) != (unsigned int)((p[FW_RECORD_LEN - 2] << 8) | p[FW_RECORD_LEN - 1])) {
+                continue;
+            }
+            r.seq = fw_be32(p + 4);
+            r.bank = p[8];
+            r.state = p[9];
+            r.length = fw_be32(p + 10);
+            r.version = fw_be32(p + 14);
+            memcpy(r.digest, p + 18, FW_DIGEST);
+            if (r.bank >= FW_BANKS) continue;
+            if (r.seq > newest->seq) {
+                *newest = r;
+                *newest_sector = k;
+            }
+            if (r.state == FW_REC_CONFIRMED && r.seq > confirmed->seq) *confirmed = r;
+        }
+    }
+}
+
+static int fw_write_record(unsigned long addr, const fw_record *r) {
+    unsigned char page[FLASH_PAGE];
+    unsigned int crc;
+    memset(page, 0xFF, sizeof(page));
+    fw_put32(page, FW_MAGIC);
+    fw_put32(page + 4, r->seq);
+    page[8] = (unsigned char)r->bank;
+    page[9] = (unsigned char)r->state;
+    fw_put32(page + 10, r->length);
+    fw_put32(page + 14, r->version);
+    memcpy(page + 18, r->digest, FW_DIGEST);
+    crc = osdp_crc16(page, FW_RECORD_LEN - 2);
+    page[FW_RECORD_LEN - 2] = (unsigned char)(crc >> 8);
+    page[FW_RECORD_LEN - 1] = (unsigned char)crc;
+    return flash_program(addr, page);
+}
+
+/* Append r as the newest record (its seq is assigned here) */
+static int fw_append(fw_record *r) {
+    fw_record newest, confirmed;
+    unsigned long a, end;
+    int k, other;
+
+    fw_scan(&newest, &confirmed, &k);
+    a = flash_sector_base[fw_record_sector[k]];
+    end = flash_sector_base[fw_record_sector[k] + 1];
+    while (a < end && *flash_at(a) != 0xFF) a += FLASH_PAGE;
+    r->seq = newest.seq + 1;
+    if (a < end) return fw_write_record(a, r);
+    /* full: restart in the other sector with the fallback image's record */
+    other = fw_record_sector[k ^ 1];
+    if (flash_erase(other) != 0) return -1;
+    a = flash_sector_base[other];
+    if (confirmed.seq && r->state != FW_REC_CONFIRMED) {
+        confirmed.seq = r->seq++;
+        if (fw_write_record(a, &confirmed) != 0) return -1;
+        a += FLASH_PAGE;
+    }
+    return fw_write_record(a, r);
+}
+
+/*
+ * Boot loader decision: the bank to start. A PENDING image gets its one
+ * trial; a TRIED one that never confirmed falls back to the last
+ * CONFIRMED image. With no records at all the factory image in bank A runs.
+ */
+int fw_boot_select(void) {
+    fw_record newest, confirmed, r;
+    int k;
+
+    fw_scan(&newest, &confirmed, &k);
+    fw_running = 0;
+    if (newest.seq == 0) return fw_running;
+    r = newest;
+    if (newest.state == FW_REC_PENDING) {
+        r.state = FW_REC_TRIED;
+    } else if (newest.state == FW_REC_TRIED) {
+        if (confirmed.seq == 0) return fw_running;
+        r = confirmed;
+    } else {
+        fw_running = newest.bank;
+        return fw_running;
+    }
+    fw_append(&r);
+    fw_running = r.bank;
+    return fw_running;
+}
+
+/* Application start-up: the running image works, keep it */
+int fw_confirm(void) {
+    fw_record newest, confirmed;
+    int k;
+    fw_scan(&newest, &confirmed, &k);
+    if (newest.seq == 0 || newest.state != FW_REC_TRIED || newest.bank != fw_running) return 0;
+    newest.state = FW_REC_CONFIRMED;
+    return fw_append(&newest);
+}
+
+/* Check a signed manifest against the running image and get ready to write the other bank */
+int fw_begin(fw_update *u, const unsigned char *m, int len) {
+    fw_record newest, confirmed;
+    int k;
+
+    u->active = 0;
+    if (len != FW_MANIFEST_LEN) return FW_ERR_DELTA;
+    fw_scan(&newest, &confirmed, &k);
+    if (newest.seq == 0 || newest.state != FW_REC_CONFIRMED || newest.bank != fw_running) return FW_ERR_STATE;
+    if (memcmp(m + 8, newest.digest, FW_DIGEST) != 0) return FW_ERR_BASE;
+    if (!ed25519_verify(m + FW_MANIFEST_BODY, m, FW_MANIFEST_BODY, fw_key)) return FW_ERR_AUTH;
+    u->version = fw_be32(m);
+    u->length = fw_be32(m + 4);
+    if (u->length == 0 || u->length > FW_BANK_SIZE) return FW_ERR_DELTA;
+    memcpy(u->digest, m + 8 + FW_DIGEST, FW_DIGEST);
+    u->bank = fw_running ^ 1;
+    u->base_len = newest.length;
+    u->consumed = u->out = u->cur = u->left = 0;
+    u->shift = -1;
+    u->erased = 0;
+    u->sectors = flash_sector_of(fw_bank_base[u->bank] + u->length - 1) - flash_sector_of(fw_bank_base[u->bank]) + 1;
+    sha512_init(&u->sha);
+    u->active = 1;
+    return FW_OK;
+}
+
+/* Erase the next sector the new image needs: 1 if one was erased, 0 once all are, or FW_ERR_FLASH */
+int fw_prepare(fw_update *u) {
+    if (!u->active) return FW_ERR_STATE;
+    if (u->erased == u->sectors) return 0;
+    if (flash_erase(flash_sector_of(fw_bank_base[u->bank]) + u->erased) != 0) {
+        u->active = 0;
+        return FW_ERR_FLASH;
+    }
+    u->erased++;
+    return 1;
+}
+
+static int fw_start_op(fw_update *u) {
+    unsigned long off;
+    u->shift = -1;
+    if (u->op == FW_OP_SEEK) {
+        off = u->arg >> 1;
+        if (u->arg & 1) {
+            if (off + 1 > u->cur) return FW_ERR_DELTA;
+            u->cur -= off + 1;
+        } else {
+            if (u->cur + off > u->base_len) return FW_ERR_DELTA;
+            u->cur += off;
+        }
+        return FW_OK;
+    }
+    if (u->op > FW_OP_LIT || u->arg > u->length - u->out) return FW_ERR_DELTA;
+    if (u->op == FW_OP_COPY && (u->cur > u->base_len || u->arg > u->base_len - u->cur)) return FW_ERR_DELTA;
+    u->left = u->arg;
+    return FW_OK;
+}
+
+/* Program the page buffer (pad with 0xFF) and hash what landed in flash */
+static int fw_flush_page(fw_update *u) {
+    unsigned long a;
+    int n;
+    n = (int)(u->out % FLASH_PAGE);
+    if (n == 0) n = FLASH_PAGE;
+    a = fw_bank_base[u->bank] + ((u->out - 1) / FLASH_PAGE) * FLASH_PAGE;
+    memset(u->page + n, 0xFF, (size_t)(FLASH_PAGE - n));
+    if (flash_program(a, u->page) != 0) return FW_ERR_FLASH;
+    sha512_update(&u->sha, flash_at(a), (unsigned long)n);
+    return FW_OK;
+}
+
+/*
+ * Feed delta bytes once the bank is prepared; returns how many were
+ * taken, or an FW_ERR_*. Stops after max_pages page programs. n may be 0
+ * to let a COPY run on past the end of the input.
+ */
+int fw_apply(fw_update *u, const unsigned char *in, int n, int max_pages) {
+    const unsigned char *old;
+    int i, pages, b, rc;
+
+    if (!u->active || u->erased < u->sectors) return FW_ERR_STATE;
+    old = flash_at(fw_bank_base[fw_running]);
+    i = 0;
+    pages = 0;
+    while (pages < max_pages && u->out < u->length) {
+        if (u->left == 0) {
+            if (i == n) break;
+            b = in[i++];
+            u->consumed++;
+            if (u->shift < 0) {
+                u->op = b >> 6;
+                u->arg = (unsigned long)(b & FW_OP_SHORT);
+                if (u->arg < FW_OP_SHORT) {
+                    rc = fw_start_op(u);
+                } else {
+                    u->shift = 0;
+                    continue;
+                }
+            } else {
+                if (u->shift > 28) return FW_ERR_DELTA;
+                u->arg += (unsigned long)(b & 0x7F) << u->shift;
+                u->shift += 7;
+                if (b & 0x80) continue;
+                rc = fw_start_op(u);
+            }
+            if (rc != FW_OK) {
+                u->active = 0;
+                return rc;
+            }
+            continue;
+        }
+        if (u->op == FW_OP_LIT) {
+            if (i == n) break;
+            b = in[i++];
+            u->consumed++;
+        } else {
+            b = old[u->cur];
+        }
+        u->cur++;
+        u->left--;
+        u->page[u->out % FLASH_PAGE] = (unsigned char)b;
+        u->out++;
+        if (u->out % FLASH_PAGE == 0 || u->out == u->length) {
+            if (fw_flush_page(u) != FW_OK) {
+                u->active = 0;
+                return FW_ERR_FLASH;
+            }
+            pages++;
+        }
+    }
+    return i;
+}
+
+/* All of the image written: check the digest and make the bank bootable at the next reset */
+int fw_commit(fw_update *u) {
+    unsigned char h[SHA512_DIGEST];
+    fw_record r;
+
+    if (!u->active || u->out != u->length || u->left != 0 || u->shift >= 0) return FW_ERR_STATE;
+    u->active = 0;
+    sha512_final(&u->sha, h);
+    if (memcmp(h, u->digest, FW_DIGEST) != 0) return FW_ERR_DIGEST;
+    r.bank = u->bank;
+    r.state = FW_REC_PENDING;
+    r.length = u->length;
+    r.version = u->version;
+    memcpy(r.digest, u->digest, FW_DIGEST);
+    return fw_append(&r) == 0 ? FW_OK : FW_ERR_FLASH;
+}
+#endif
+
+/* ========================= APPLICATION LOGIC ========================= */
+
+/* Configuration */
+#define MAX_USERS 50
+#define PASSWORD_MAX_LEN 8
+#define CARD_ID_LEN 10
+#define EEPROM_PASSWORD_BASE_ADDR 0x0000
+#define PASSWORD_EEPROM_SLOT_SIZE 16
+#define USER_SLOT_ADDR(uid) (EEPROM_PASSWORD_BASE_ADDR + ((uid) * PASSWORD_EEPROM_SLOT_SIZE))
+#define FP_STORE_RECORD 256     /* per user in the template EEPROM (gallery builds) */
+#define FP_STORE_ADDR(uid) ((unsigned long)(uid) * FP_STORE_RECORD)
+#define PASSWORD_ENTRY_TIMEOUT_MS 15000
+#define MAX_PASSWORD_ATTEMPTS 3
+#define MAX_FP_ATTEMPTS 3
+#define METRICS_DUMP_EVERY 16
+#ifndef DOOR_CLEARANCE
+#define DOOR_CLEARANCE 0        /* lowest user clearance this door admits */
+#endif
+#ifndef DOOR_ZONE               /* policy zone of this door: zone z is the doors needing clearance z */
+#define DOOR_ZONE (DOOR_CLEARANCE < FP_ZONES ? DOOR_CLEARANCE : FP_ZONES - 1)
+#endif
+#if DOOR_ZONE < 0 || DOOR_ZONE >= FP_ZONES || DOOR_ZONE > DOOR_CLEARANCE
+#error "DOOR_ZONE must be 0..FP_ZONES-1 and no higher than DOOR_CLEARANCE"
+#endif
+#define FACTOR_POLL_MS 20
+#define WG_POLL_MS 5
+#define MGMT_BUDGET_IDLE 8      /* management work units per super-loop pass */
+#define MGMT_BUDGET_SESSION 1   /* ... and per millisecond of delay */
+
+/* Door policy bits */
+#define DOOR_POLICY_CONCURRENT 0x01 /* PIN and finger may be given in either order */
+#ifndef DOOR_POLICY
+#define DOOR_POLICY 0
+#endif
+
+/* ========================= USER STORE ========================= */
+
+#if defined(USER_FLASH) || defined(HOST_TOOLS)
+/*
+ * The user table (one PASSWORD_EEPROM_SLOT_SIZE slot per user) kept in
+ * two 8 KB internal flash sectors, 14 and 15, instead of the I2C EEPROM. A lookup returns a
+ * pointer straight into flash: no bus transfer and no copy.
+ *
+ * Each sector holds as many copies of the table as fit. A copy is
+ * USTORE_TABLE_PAGES pages of slots and then a commit page:
+ *   magic "MLUS" | seq (4) | table CRC-16 | header CRC-16
+ * A copy only counts once its commit page checks, so a write cut short
+ * leaves the previous copy in charge. At start-up the newest copy wins.
+ *
+ * Changes are staged in RAM, where lookups see them at once, and go out
+ * as the next copy, a page per ustore_service call. The caller only calls
+ * it while no session is open. When the active sector is full the next
+ * copy goes to the other sector, which has to be blank. Erasing it stalls
+ * for 400 ms, and a card that arrives meanwhile waits, so the erase is
+ * done ahead of need once the door has been quiet for
+ * USTORE_QUIET_AHEAD_MS. A long gap is what marks the slack hours, while
+ * a short one says little about the next arrival. Only when the active
+ * sector is down to its last copy, or writes are waiting for the room,
+ * does USTORE_QUIET_MS do.
+ */
+#define USTORE_SECTOR 14        /* and 15, 8 KB each; 16 holds FW_UPDATE boot records */
+#define USTORE_SLOT PASSWORD_EEPROM_SLOT_SIZE
+#define USTORE_TABLE (MAX_USERS * USTORE_SLOT)
+#define USTORE_TABLE_PAGES ((USTORE_TABLE + FLASH_PAGE - 1) / FLASH_PAGE)
+#define USTORE_COPY_BYTES ((USTORE_TABLE_PAGES + 1) * FLASH_PAGE)
+#define USTORE_MAGIC 0x4D4C5553UL  /* "MLUS" */
+#define USTORE_QUIET_MS 2000UL
+#define USTORE_QUIET_AHEAD_MS 60000UL
+#define USTORE_STEPS_IDLE 8     /* page programs per super-loop pass */
+
+#define USTORE_CLEAN 0
+#define USTORE_DIRTY 1
+#define USTORE_WRITTEN 2        /* in a page of the copy being written */
+
+#define USTORE_IDLE 0           /* ustore_service: nothing to do yet */
+#define USTORE_PAGE 1           /* ... programmed a page */
+#define USTORE_ERASE 2          /* ... erased a sector */
+
+typedef struct {
+    int active;                 /* sector (0, 1) of the newest copy, -1 for none */
+    unsigned long table;        /* flash address of its slots */
+    unsigned long seq;
+    int next[2];                /* copies used per sector; 0 means blank */
+    int target;                 /* sector being written */
+    int page;                   /* next page of that copy, -1 when not writing */
+    int pending;                /* slots not CLEAN */
+    unsigned char state[MAX_USERS];
+    unsigned char stage[MAX_USERS][USTORE_SLOT];
+} user_store;
+
+static user_store ustore;
+static const unsigned char ustore_blank[USTORE_SLOT] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static int ustore_copies(void) {
+    return (int)((flash_sector_base[USTORE_SECTOR + 1] - flash_sector_base[USTORE_SECTOR]) / USTORE_COPY_BYTES);
+}
+
+static unsigned long ustore_copy_addr(int sector, int copy) {
+    return flash_sector_base[USTORE_SECTOR + sector] + (unsigned long)copy * USTORE_COPY_BYTES;
+}
+
+static unsigned long ustore_be32(const unsigned char *p) {
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+/* Commit page of the copy at a checks out; its seq, or 0 */
+static unsigned long ustore_check(unsigned long a) {
+    const unsigned char *h;
+    h = flash_at(a + USTORE_TABLE_PAGES * FLASH_PAGE);
+    if (ustore_be32(h) != USTORE_MAGIC) return 0;
+    if (osdp_crc16(h, 10) != (unsigned int)((h[10] << 8) | h[11])) return 0;
+    if (osdp_crc16(flash_at(a), USTORE_TABLE) != (unsigned int)((h[8] << 8) | h[9])) return 0;
+    return ustore_be32(h + 4);
+}
+
+static int ustore_blank_at(unsigned long a, unsigned long n) {
+    const unsigned char *p;
+    unsigned long i;
+    p = flash_at(a);
+    for (i = 0; i < n; i++) {
+        if (p[i] != 0xFF) return 0;
+    }
+    return 1;
+}
+
+/* The user's slot: staged if it has changed, else in flash */
+const unsigned char *ustore_slot(int uid) {
+    if (ustore.state[uid] != USTORE_CLEAN) return ustore.stage[uid];
+    if (ustore.active < 0) return ustore_blank;
+    return flash_at(ustore.table + (unsigned long)uid * USTORE_SLOT);
+}
+
+/* Stage a new slot for uid; written out from idle time */
+int ustore_write(int uid, const unsigned char *slot) {
+    if (uid < 0 || uid >= MAX_USERS) return -1;
+    memcpy(ustore.stage[uid], slot, USTORE_SLOT);
+    if (ustore.state[uid] == USTORE_CLEAN) ustore.pending++;
+    ustore.state[uid] = USTORE_DIRTY;
+    return 0;
+}
+
+/* Find the newest copy; with none at all, stage what the EEPROM holds */
+void ustore_mount(void) {
+    unsigned char slot[USTORE_SLOT];
+    unsigned long a, seq;
+    int k, c, uid;
+
+    memset(&ustore, 0, sizeof(ustore));
+    ustore.active = -1;
+    ustore.page = -1;
+    for (k = 0; k < 2; k++) {
+        for (c = 0; c < ustore_copies(); c++) {
+            a = ustore_copy_addr(k, c);
+            if (!ustore_blank_at(a, USTORE_COPY_BYTES)) ustore.next[k] = c + 1;
+            seq = ustore_check(a);
+            if (seq > ustore.seq) {
+                ustore.seq = seq;
+                ustore.active = k;
+                ustore.table = a;
+            }
+        }
+    }
+    if (ustore.active >= 0) return;
+    for (uid = 0; uid < MAX_USERS; uid++) {
+        if (eeprom_read_bytes(USER_SLOT_ADDR(uid), slot, USTORE_SLOT) == 0 && slot[0] != 0xFF) ustore_write(uid, slot);
+    }
+}
+
+/* Sector the next sector change goes to */
+static int ustore_spare(void) {
+    if (ustore.active >= 0) return ustore.active ^ 1;
+    return ustore.next[0] == 0 ? 0 : 1;
+}
+
+/* A copy failed to program: skip its space, and stage its slots again */
+static void ustore_abandon(void) {
+    int uid;
+    ustore.next[ustore.target]++;
+    ustore.page = -1;
+    for (uid = 0; uid < MAX_USERS; uid++) {
+        if (ustore.state[uid] == USTORE_WRITTEN) ustore.state[uid] = USTORE_DIRTY;
+    }
+}
+
+static int ustore_program_table(unsigned long a) {
+    unsigned char page[FLASH_PAGE];
+    int i, uid;
+    memset(page, 0xFF, sizeof(page));
+    for (i = 0; i < FLASH_PAGE / USTORE_SLOT; i++) {
+        uid = ustore.page * (FLASH_PAGE / USTORE_SLOT) + i;
+        if (uid >= MAX_USERS) break;
+        memcpy(page + i * USTORE_SLOT, ustore_slot(uid), USTORE_SLOT);
+        if (ustore.state[uid] == USTORE_DIRTY) ustore.state[uid] = USTORE_WRITTEN;
+    }
+    return flash_program(a + (unsigned long)ustore.page * FLASH_PAGE, page);
+}
+
+static int ustore_program_commit(unsigned long a) {
+    unsigned char page[FLASH_PAGE];
+    unsigned int crc;
+    int uid;
+
+    memset(page, 0xFF, sizeof(page));
+    page[0] = (unsigned char)(USTORE_MAGIC >> 24);
+    page[1] = (unsigned char)(USTORE_MAGIC >> 16);
+    page[2] = (unsigned char)(USTORE_MAGIC >> 8);
+    page[3] = (unsigned char)USTORE_MAGIC;
+    page[4] = (unsigned char)((ustore.seq + 1) >> 24);
+    page[5] = (unsigned char)((ustore.seq + 1) >> 16);
+    page[6] = (unsigned char)((ustore.seq + 1) >> 8);
+    page[7] = (unsigned char)(ustore.seq + 1);
+    crc = osdp_crc16(flash_at(a), USTORE_TABLE);
+    page[8] = (unsigned char)(crc >> 8);
+    page[9] = (unsigned char)crc;
+    crc = osdp_crc16(page, 10);
+    page[10] = (unsigned char)(crc >> 8);
+    page[11] = (unsigned char)crc;
+    if (flash_program(a + USTORE_TABLE_PAGES * FLASH_PAGE, page) != 0) return -1;
+    ustore.seq++;
+    ustore.active = ustore.target;
+    ustore.table = a;
+    ustore.next[ustore.target]++;
+    ustore.page = -1;
+    for (uid = 0; uid < MAX_USERS; uid++) {
+        if (ustore.state[uid] == USTORE_WRITTEN) {
+            ustore.state[uid] = USTORE_CLEAN;
+            ustore.pending--;
+        }
+    }
+    return 0;
+}
+
+/* Quiet time an erase of the spare needs now */
+static unsigned long ustore_erase_quiet(void) {
+    if (ustore.pending > 0 || ustore.active < 0 || ustore.next[ustore.active] >= ustore_copies() - 1) {
+        return USTORE_QUIET_MS;
+    }
+    return USTORE_QUIET_AHEAD_MS;
+}
+
+/*
+ * One flash operation of background work, for a door with no session
+ * open that has been quiet for quiet_ms: the next page of a copy, or an
+ * erase of the spare sector. USTORE_IDLE if there is nothing it may do.
+ */
+int ustore_service(unsigned long quiet_ms) {
+    unsigned long a;
+    int spare;
+
+    spare = ustore_spare();
+    if (ustore.page < 0 && ustore.pending > 0) {
+        if (ustore.active >= 0 && ustore.next[ustore.active] < ustore_copies()) {
+            ustore.target = ustore.active;
+            ustore.page = 0;
+        } else if (ustore.next[spare] == 0) {
+            ustore.target = spare;
+            ustore.page = 0;
+        }
+    }
+    if (ustore.page < 0) {
+        if (ustore.next[spare] == 0 || quiet_ms < ustore_erase_quiet()) return USTORE_IDLE;
+        if (flash_erase(USTORE_SECTOR + spare) == 0) ustore.next[spare] = 0;
+        return USTORE_ERASE;
+    }
+    a = ustore_copy_addr(ustore.target, ustore.next[ustore.target]);
+    if (ustore.page < USTORE_TABLE_PAGES) {
+        if (ustore_program_table(a) != 0) ustore_abandon();
+        else ustore.page++;
+    } else if (ustore_program_commit(a) != 0) {
+        ustore_abandon();
+    }
+    return USTORE_PAGE;
+}
+#endif
+
+/* ========================= CARD INDEX ========================= */
+
+#if defined(CARD_MPH) || defined(HOST_TOOLS)
+/*
+ * Enrolled cards for sites whose population rarely changes: a minimal
+ * perfect hash built offline over every card number and shipped as const
+ * tables in flash (./mlsas cardmph writes them as a header for
+ * -DCARD_MPH="card_mph.h"). A card hashes to a bucket of about
+ * CARD_MPH_LAMBDA keys, whose 16-bit pilot picks the slot: one read for
+ * the pilot, one for the entry holding card and user, then a compare.
+ * As in PTHash, 60% of the keys share the first 30% of the buckets, so
+ * the crowded buckets are placed while the table is still empty. The
+ * table has CARD_MPH_SLACK slots per 100 keys spare so the last buckets
+ * place quickly; the few keys that land there go through remap[] to the
+ * holes below n. That is about 2.8 bits of index per key.
+ *
+ * Cards added since the build go in an overflow table of up to
+ * CARD_OVERFLOW_MAX entries in EEPROM, checked first so it can also
+ * move or withdraw a shipped card. Everything is 32-bit arithmetic: the
+ * ARM7 has no divide, so ranges are taken by multiplying in 16-bit halves.
+ */
+#define CARD_MPH_LAMBDA 6
+#define CARD_MPH_SLACK 1
+#define CARD_MPH_PILOTS 65536UL
+#define CARD_MPH_MAX 65535U
+#define CARD_OVERFLOW_MAX 32
+#define CARD_OVERFLOW_ADDR 0x0C00 /* EEPROM: count (2) | entries, card (4) | uid (2) */
+#define CARD_OVERFLOW_RECORD 6
+#define CARD_WITHDRAWN 0xFFFF
+
+#define CARD_OK 0
+#define CARD_ERR_FULL (-1)
+#define CARD_ERR_DEVICE (-2)
+
+typedef struct {
+    unsigned long card;
+    unsigned short uid;
+} card_entry;
+
+typedef struct {
+    unsigned int n;              /* keys, and entries in table */
+    unsigned int m;              /* slots the pilots address */
+    unsigned int buckets;
+    unsigned long seed;
+    const unsigned short *pilot; /* per bucket */
+    const unsigned short *remap; /* slot - n for slots past n */
+    const card_entry *table;
+} card_mph;
+
+static card_entry card_overflow[CARD_OVERFLOW_MAX];
+static int card_overflow_n;
+static const card_mph *card_shipped;
+
+static unsigned long card_mix(unsigned long x) {
+    x &= 0xFFFFFFFFUL;
+    x ^= x >> 16;
+    x = (x * 0x85EBCA6BUL) & 0xFFFFFFFFUL;
+    x ^= x >> 13;
+    x = (x * 0xC2B2AE35UL) & 0xFFFFFFFFUL;
+    x ^= x >> 16;
+    return x;
+}
+
+/* floor(h * n / 2^32) for n < 65536, without a 64-bit product */
+static unsigned int card_range(unsigned long h, unsigned int n) {
+    return (unsigned int)(((h >> 16 & 0xFFFFUL) * n + ((h & 0xFFFFUL) * n >> 16)) >> 16);
+}
+
+static unsigned int card_bucket(unsigned long x, unsigned int buckets) {
+    unsigned long r;
+    unsigned int dense;
+    dense = buckets * 3 / 10;
+    r = (x << 16 | x >> 16) & 0xFFFFFFFFUL;
+    if (x < 0x9999999AUL) return card_range(r, dense);
+    return dense + card_range(r, buckets - dense);
+}
+
+static unsigned int card_slot(unsigned long x2, unsigned long pilot, unsigned int m) {
+    return card_range(card_mix(x2 ^ ((pilot * 0x9E3779B1UL) & 0xFFFFFFFFUL)), m);
+}
+
+/* Entry index of card in h, or -1 */
+int card_mph_find(const card_mph *h, unsigned long card) {
+    unsigned long x;
+    unsigned int pos;
+
+    if (h->n == 0) return -1;
+    x = card_mix(card ^ h->seed);
+    pos = card_slot(card_mix(x + 1), h->pilot[card_bucket(x, h->buckets)], h->m);
+    if (pos >= h->n) pos = h->remap[pos - h->n];
+    return h->table[pos].card == card ? (int)pos : -1;
+}
+
+/* User for a card, -1 if it is not enrolled */
+int card_lookup(unsigned long card) {
+    int i;
+    for (i = 0; i < card_overflow_n; i++) {
+        if (card_overflow[i].card == card) {
+            return card_overflow[i].uid == CARD_WITHDRAWN ? -1 : (int)card_overflow[i].uid;
+        }
+    }
+    if (!card_shipped) return -1;
+    i = card_mph_find(card_shipped, card);
+    return i < 0 ? -1 : (int)card_shipped->table[i].uid;
+}
+
+static void card_overflow_pack(unsigned char *p, const card_entry *e) {
+    p[0] = (unsigned char)(e->card >> 24);
+    p[1] = (unsigned char)(e->card >> 16);
+    p[2] = (unsigned char)(e->card >> 8);
+    p[3] = (unsigned char)e->card;
+    p[4] = (unsigned char)(e->uid >> 8);
+    p[5] = (unsigned char)e->uid;
+}
+
+/* Attach the shipped index (0 for none) and read back the overflow */
+void card_index_init(const card_mph *shipped) {
+    unsigned char rec[CARD_OVERFLOW_RECORD];
+    int n, i;
+
+    card_shipped = shipped;
+    card_overflow_n = 0;
+    if (store_read(&store_eeprom, CARD_OVERFLOW_ADDR, rec, 2) != STORE_OK) return;
+    n = (rec[0] << 8) | rec[1];
+    if (n > CARD_OVERFLOW_MAX) return; /* blank */
+    for (i = 0; i < n; i++) {
+        if (store_read(&store_eeprom, CARD_OVERFLOW_ADDR + 2 + i * CARD_OVERFLOW_RECORD, rec, CARD_OVERFLOW_RECORD) !=
+            STORE_OK) {
+            break;
+        }
+        card_overflow[i].card = ((unsigned long)rec[0] << 24) | ((unsigned long)rec[1] << 16) |
+                                ((unsigned long)rec[2] << 8) | rec[3];
+        card_overflow[i].uid = (unsigned short)((rec[4] << 8) | rec[5]);
+    }
+    card_overflow_n = i;
+}
+
+/*
+ * Enroll card for uid, or withdraw it (uid < 0), without rebuilding the
+ * shipped index. CARD_ERR_FULL means it is time to regenerate.
+ */
+int card_set(unsigned long card, int uid) {
+    unsigned char rec[CARD_OVERFLOW_RECORD];
+    card_entry e;
+    int i;
+
+    e.card = card;
+    e.uid = (unsigned short)(uid < 0 ? CARD_WITHDRAWN : uid);
+    for (i = 0; i < card_overflow_n && card_overflow[i].card != card; i++) {
+    }
+    if (i == card_overflow_n) {
+        /* a shipped card that already says this needs no entry */
+        if (card_lookup(card) == (uid < 0 ? -1 : uid)) return CARD_OK;
+        if (card_overflow_n == CARD_OVERFLOW_MAX) return CARD_ERR_FULL;
+    }
+    card_overflow_pack(rec, &e);
+    if (store_write(&store_eeprom, CARD_OVERFLOW_ADDR + 2 + i * CARD_OVERFLOW_RECORD, rec, CARD_OVERFLOW_RECORD) !=
+        STORE_OK) {
+        return CARD_ERR_DEVICE;
+    }
+    card_overflow[i] = e;
+    if (i < card_overflow_n) return CARD_OK;
+    card_overflow_n++;
+    rec[0] = (unsigned char)(card_overflow_n >> 8);
+    rec[1] = (unsigned char)card_overflow_n;
+    return store_write(&store_eeprom, CARD_OVERFLOW_ADDR, rec, 2) == STORE_OK ? CARD_OK : CARD_ERR_DEVICE;
+}
+#endif
+
+#if defined(HOST_TOOLS)
+/*
+ * Build h over n distinct cards (uids[i] for cards[i]); the tables are
+ * malloc'd, card_mph_free releases them. Buckets go largest first, each
+ * taking the first pilot that puts all its keys on free slots. 0 on
+ * success, -1 if n is out of range, a card repeats or a bucket found no
+ * pilot (try another seed; a repeated card never finds one).
+ */
+int card_mph_build(card_mph *h, const unsigned long *cards, const unsigned short *uids, unsigned int n,
+                   unsigned long seed) {
+    unsigned long *x2, p;
+    unsigned int *bucket, *order, *start, *slot, i, j, b, k, size, biggest, hole;
+    unsigned char *taken;
+    unsigned short *pilot, *remap;
+    card_entry *table;
+    int rc;
+
+    memset(h, 0, sizeof(*h));
+    if (n == 0 || n + n * CARD_MPH_SLACK / 100 + 1 > CARD_MPH_MAX) return -1;
+    h->n = n;
+    h->m = n + n * CARD_MPH_SLACK / 100 + 1;
+    h->buckets = (n + CARD_MPH_LAMBDA - 1) / CARD_MPH_LAMBDA;
+    h->seed = seed & 0xFFFFFFFFUL;
+    x2 = (unsigned long *)malloc(sizeof(unsigned long) * n);
+    bucket = (unsigned int *)malloc(sizeof(unsigned int) * n);
+    order = (unsigned int *)malloc(sizeof(unsigned int) * n);
+    start = (unsigned int *)calloc(h->buckets + 2, sizeof(unsigned int));
+    slot = (unsigned int *)malloc(sizeof(unsigned int) * n);
+    taken = (unsigned char *)calloc(h->m, 1);
+    pilot = (unsigned short *)calloc(h->buckets, sizeof(unsigned short));
+    remap = (unsigned short *)calloc(h->m - n, sizeof(unsigned short));
+    table = (card_entry *)malloc(sizeof(card_entry) * n);
+    rc = x2 && bucket && order && start && slot && taken && pilot && remap && table ? 0 : -1;
+
+    /* keys grouped by bucket (counting sort) */
+    for (i = 0; rc == 0 && i < n; i++) {
+        x2[i] = card_mix(cards[i] ^ h->seed);
+        bucket[i] = card_bucket(x2[i], h->buckets);
+        x2[i] = card_mix(x2[i] + 1);
+        start[bucket[i] + 2]++;
+    }
+    for (b = 0; rc == 0 && b < h->buckets; b++) start[b + 2] += start[b + 1];
+    for (i = 0; rc == 0 && i < n; i++) order[start[bucket[i] + 1]++] = i;
+    /* start[b]..start[b + 1] now spans bucket b; place the biggest buckets first */
+    biggest = 0;
+    for (b = 0; rc == 0 && b < h->buckets; b++) {
+        if (start[b + 1] - start[b] > biggest) biggest = start[b + 1] - start[b];
+    }
+    for (size = biggest; rc == 0 && size > 0; size--) {
+        for (b = 0; rc == 0 && b < h->buckets; b++) {
+            if (start[b + 1] - start[b] != size) continue;
+            for (p = 0; p < CARD_MPH_PILOTS; p++) {
+                for (k = start[b]; k < start[b + 1]; k++) {
+                    slot[k] = card_slot(x2[order[k]], p, h->m);
+                    if (taken[slot[k]]) break;
+                    for (j = start[b]; j < k && slot[j] != slot[k]; j++) {
+                    }
+                    if (j < k) break;
+                }
+                if (k == start[b + 1]) break;
+            }
+            if (p == CARD_MPH_PILOTS) {
+                rc = -1;
+                break;
+            }
+            pilot[b] = (unsigned short)p;
+            for (k = start[b]; k < start[b + 1]; k++) taken[slot[k]] = 1;
+        }
+    }
+    /* slots past n move into the holes below n */
+    hole = 0;
+    for (j = n; rc == 0 && j < h->m; j++) {
+        if (!taken[j]) continue;
+        while (taken[hole]) hole++;
+        remap[j - n] = (unsigned short)hole++;
+    }
+    for (k = 0; rc == 0 && k < n; k++) {
+        i = order[k];
+        j = slot[k] < n ? slot[k] : remap[slot[k] - n];
+        table[j].card = cards[i];
+        table[j].uid = uids[i];
+    }
+    h->pilot = pilot;
+    h->remap = remap;
+    h->table = table;
+    /* every key must find itself */
+    for (i = 0; rc == 0 && i < n; i++) {
+        if (card_mph_find(h, cards[i]) < 0) rc = -1;
+    }
+    free(x2);
+    free(bucket);
+    free(order);
+    free(start);
+    free(slot);
+    free(taken);
+    if (rc != 0) {
+        free(pilot);
+        free(remap);
+        free(table);
+        memset(h, 0, sizeof(*h));
+    }
+    return rc;
+}
+
+void card_mph_free(card_mph *h) {
+    free((void *)h->pilot);
+    free((void *)h->remap);
+    free((void *)h->table);
+    memset(h, 0, sizeof(*h));
+}
+#endif
+
+#if defined(CARD_MPH)
+#include CARD_MPH
+#endif
+
+/* ========================= FINGERPRINT SLOT CACHE ========================= */
+
+/*
+ * The sensor module holds only a few hundred templates, addressed by slot.
+ * With FP_SLOT_CACHE the controller gallery is the master copy and the
+ * slots act as an LRU cache over it: the resolved RFID user's template is
+ * uploaded while the PIN is being typed, frequent users are kept resident
+ * from idle time, and verification runs 1:1 on-module against the slot.
+ * Enrollment only ever writes the gallery, so the module's slots hold
+ * nothing but cached copies.
+ *
+ * One upload is in flight at a time. fp_cache_begin claims the slot and
+ * announces the template, and each fp_cache_pump sends one data packet,
+ * so the PIN loop can call it between key scans; fp_cache_load finishes
+ * whatever is left when the finger is due.
+ */
+#define FP_MODULE_SLOTS 32
+#define FP_HEAT_DECAY_EVERY 256
+#define FP_PREFETCH_PER_IDLE 2
+
+static int fp_slot_owner[FP_MODULE_SLOTS];
+static unsigned long fp_slot_last_use[FP_MODULE_SLOTS];
+static signed char fp_user_slot[MAX_USERS];
+static unsigned short fp_user_heat[MAX_USERS];
+static unsigned long fp_cache_tick;
+static int fp_cache_slots;
+
+static struct {
+    int uid;                    /* -1 when no upload is in flight */
+    int slot;
+    int len;
+    int sent;
+    unsigned char packed[FP_PACKED_MAX];
+} fp_upload;
+
+void fp_cache_init(int slots) {
+    int k;
+    if (slots < 1 || slots > FP_MODULE_SLOTS) slots = FP_MODULE_SLOTS;
+    fp_cache_slots = slots;
+    fp_cache_tick = 0;
+    fp_upload.uid = -1;
+    for (k = 0; k < FP_MODULE_SLOTS; k++) {
+        fp_slot_owner[k] = -1;
+        fp_slot_last_use[k] = 0;
+    }
+    for (k = 0; k < MAX_USERS; k++) {
+        fp_user_slot[k] = -1;
+        fp_user_heat[k] = 0;
+    }
+}
+
+/* Count a presentation; heat halves every FP_HEAT_DECAY_EVERY badges */
+void fp_cache_note_badge(int uid) {
+    int k;
+    if (uid < 0 || uid >= MAX_USERS) return;
+    if (fp_user_heat[uid] < 0xFFFF) fp_user_heat[uid]++;
+    if (++fp_cache_tick % FP_HEAT_DECAY_EVERY == 0) {
+        for (k = 0; k < MAX_USERS; k++) fp_user_heat[k] >>= 1;
+    }
+}
+
+/* Least recently used slot; the one an upload is filling is never picked */
+static int fp_cache_victim(void) {
+    int k, v;
+    v = -1;
+    for (k = 0; k < fp_cache_slots; k++) {
+        if (fp_upload.uid >= 0 && k == fp_upload.slot) continue;
+        if (fp_slot_owner[k] < 0) return k;
+        if (v < 0 || fp_slot_last_use[k] < fp_slot_last_use[v]) v = k;
+    }
+    return v;
+}
+
+/* Send the next data packet of the upload in flight, storing the slot after the last; 1 if there was work */
+int fp_cache_pump(void) {
+    int n, uid;
+
+    uid = fp_upload.uid;
+    if (uid < 0) return 0;
+    if (fp_upload.sent < fp_upload.len) {
+        n = fp_upload.len - fp_upload.sent < FP_UPLOAD_PACKET ? fp_upload.len - fp_upload.sent : FP_UPLOAD_PACKET;
+        if (fp_upload_packet(fp_upload.packed + fp_upload.sent, n) != 0) {
+            fp_upload.uid = -1;
+            return 1;
+        }
+        fp_upload.sent += n;
+        return 1;
+    }
+    fp_upload.uid = -1;
+    if (fp_upload_store(fp_upload.slot, fp_upload.len) != 0) return 1;
+    metrics_add(MET_FP_SLOT_UPLOADS, 1);
+    fp_slot_owner[fp_upload.slot] = uid;
+    fp_user_slot[uid] = (signed char)fp_upload.slot;
+    fp_slot_last_use[fp_upload.slot] = ++fp_cache_tick;
+    return 1;
+}
+
+/*
+ * Start making uid's template resident: 0 if it already is or its upload
+ * is under way, -1 if it has no template. An upload still in flight for
+ * someone else is finished first.
+ */
+int fp_cache_begin(int uid) {
+    const fp_template *t;
+    int slot;
+
+    if (uid < 0 || uid >= MAX_USERS) return -1;
+    if (fp_user_slot[uid] >= 0) {
+        fp_slot_last_use[fp_user_slot[uid]] = ++fp_cache_tick;
+        return 0;
+    }
+    if (fp_upload.uid == uid) return 0;
+    while (fp_cache_pump()) {
+    }
+    t = fp_gallery_get(uid);
+    if (!t) return -1;
+    slot = fp_cache_victim();
+    if (fp_slot_owner[slot] >= 0) {
+        fp_delete(slot);
+        fp_user_slot[fp_slot_owner[slot]] = -1;
+        fp_slot_owner[slot] = -1;
+    }
+    fp_upload.len = fp_template_pack(t, fp_upload.packed);
+    if (fp_upload_begin(fp_upload.len) != 0) return -1;
+    fp_upload.uid = uid;
+    fp_upload.slot = slot;
+    fp_upload.sent = 0;
+    return 0;
+}
+
+/* Make uid's template resident now; slot number, or -1 if it has no template */
+int fp_cache_load(int uid) {
+    if (fp_cache_begin(uid) != 0) return -1;
+    while (fp_upload.uid == uid) fp_cache_pump();
+    return fp_user_slot[uid];
+}
+
+int fp_cache_resident(int uid) {
+    return uid >= 0 && uid < MAX_USERS && fp_user_slot[uid] >= 0;
+}
+
+/*
+ * Drop a user's slot (and an upload in flight for it) once the gallery
+ * entry changes: management re-enrollment or deletion. The heat stays, so
+ * a hot user's new template comes back with the next idle prefetch.
+ */
+void fp_cache_invalidate(int uid) {
+    int slot;
+    if (uid >= 0 && fp_upload.uid == uid) fp_upload.uid = -1;
+    if (!fp_cache_resident(uid)) return;
+    slot = fp_user_slot[uid];
+    fp_delete(slot);
+    fp_slot_owner[slot] = -1;
+    fp_user_slot[uid] = -1;
+}
+
+/*
+ * Idle-time warm-up: upload the hottest non-resident users while they are
+ * hotter than whoever the LRU would evict. Bounded per call so the loop
+ * returns to the reader quickly.
+ */
+void fp_cache_prefetch_hot(void) {
+    int n, k, hot, victim;
+    while (fp_cache_pump()) {
+    }
+    for (n = 0; n < FP_PREFETCH_PER_IDLE; n++) {
+        hot = -1;
+        for (k = 0; k < MAX_USERS; k++) {
+            if (fp_user_slot[k] >= 0 || !fp_gallery_get(k) || fp_user_heat[k] == 0) continue;
+            if (hot < 0 || fp_user_heat[k] > fp_user_heat[hot]) hot = k;
+        }
+        if (hot < 0) return;
+        victim = fp_cache_victim();
+        if (fp_slot_owner[victim] >= 0 && fp_user_heat[fp_slot_owner[victim]] >= fp_user_heat[hot]) return;
+        if (fp_cache_load(hot) < 0) return;
+    }
+}
+
+/* ========================= ACCESS LOG ========================= */
+
+/*
+ * The last ACCESS_LOG_LEN decisions, kept in RAM and numbered from 1 so a
+ * reader can resume from the sequence number after the last one it saw.
+ * A reader that fell more than a ring behind restarts at the oldest entry
+ * still held. Wire record: seq (4) | time (4) | uid (2, 0xFFFF if none) |
+ * outcome (MET_GRANTS or the MET_DENY_* stage) | source, big-endian.
+ */
+#define ACCESS_LOG_LEN 64
+#define ACCESS_LOG_RECORD 12
+#define ACCESS_SRC_CARD 0
+#define ACCESS_SRC_TOKEN 1
+#define ACCESS_NO_USER 0xFFFF
+
+typedef struct {
+    unsigned long seq;
+    unsigned long time_s;
+    unsigned short uid;
+    unsigned char outcome;
+    unsigned char source;
+} access_log_entry;
+
+static access_log_entry access_log[ACCESS_LOG_LEN];
+static unsigned long access_log_next = 1;
+
+static void access_log_append(int uid, int outcome, int source) {
+    access_log_entry *e;
+    e = &access_log[access_log_next % ACCESS_LOG_LEN];
+    e->seq = access_log_next++;
+    e->time_s = rtc_now_seconds();
+    e->uid = (unsigned short)(uid < 0 ? ACCESS_NO_USER : uid);
+    e->outcome = (unsigned char)outcome;
+    e->source = (unsigned char)source;
+}
+
+static void access_put32(unsigned char *p, unsigned long v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+/* Pack up to max records from *seq on into out; *seq moves past them. Returns the count */
+int access_log_read(unsigned long *seq, unsigned char *out, int max) {
+    const access_log_entry *e;
+    unsigned long oldest;
+    int n;
+
+    oldest = access_log_next > ACCESS_LOG_LEN ? access_log_next - ACCESS_LOG_LEN : 1;
+    if (*seq < oldest) *seq = oldest;
+    for (n = 0; n < max && *seq < access_log_next; n++, (*seq)++) {
+        e = &access_log[*seq % ACCESS_LOG_LEN];
+        access_put32(out, e->seq);
+        access_put32(out + 4, e->time_s);
+        out[8] = (unsigned char)(e->uid >> 8);
+        out[9] = (unsigned char)e->uid;
+        out[10] = e->outcome;
+        out[11] = e->source;
+        out += ACCESS_LOG_RECORD;
+    }
+    return n;
+}
+
+/* ========================= USER RECORDS ========================= */
+
+/*
+ * What the door knows about a user besides the password slot, split by
+ * how often it is read. A badge only reads user_hot: card, clearance,
+ * flags and schedule, 8 bytes on the target, so a decision touches one
+ * cache line (or one external-RAM burst) however large the cold side
+ * grows. Names, department, validity window and statistics live in
+ * user_cold at the same index and are read by management, the access
+ * statistics after a decision, and the expiry sweep.
+ *
+ * Validity is turned into USER_F_EXPIRED by user_sweep, which runs when
+ * the earliest pending valid-from or expiry time has passed, and the hour
+ * of day is worked out once an hour (the ARM7 has no divider), so the
+ * check at the door is one compare and a few flag tests.
+ *
+ * Every change to a user bumps its 8-bit generation in user_hot, and a
+ * change that can affect anyone (schedules, attaching other tables, a
+ * user generation wrapping) bumps user_generation, so a decision
+ * remembered with both can be checked for staleness in O(1).
+ */
+#define USER_NAME_LEN 16
+#define USER_DEPT_LEN 12
+#define USER_SCHEDULES 8        /* schedule 0 admits at any hour */
+#define USER_F_REVOKED 0x01
+#define USER_F_EXPIRED 0x02     /* outside the validity window; set by user_sweep */
+#define USER_NEVER 0xFFFFFFFFUL
+
+#define USER_OK 0
+#define USER_DENY_UNKNOWN (-1)
+#define USER_DENY_REVOKED (-2)
+#define USER_DENY_EXPIRED (-3)
+#define USER_DENY_CLEARANCE (-4)
+#define USER_DENY_SCHEDULE (-5)
+#define USER_DENY_CLOCK (-6)    /* the door's clock has not been set */
+
+typedef struct {
+    unsigned long card;
+    unsigned char clearance;
+    unsigned char flags;        /* USER_F_* */
+    unsigned char schedule;
+    unsigned char gen;          /* bumped by user_touch on every change */
+} user_hot;
+
+typedef struct {
+    char name[USER_NAME_LEN];
+    char department[USER_DEPT_LEN];
+    unsigned long valid_from;   /* Unix seconds, 0 for no limit */
+    unsigned long expires;      /* Unix seconds, 0 for no limit */
+    unsigned long last_seen;
+    unsigned short grants;
+    unsigned short denials;
+} user_cold;
+
+static user_hot user_hot_store[MAX_USERS];
+static user_cold user_cold_store[MAX_USERS];
+static user_hot *user_hot_tab = user_hot_store;
+static user_cold *user_cold_tab = user_cold_store;
+static int user_count = MAX_USERS;
+static unsigned long user_next_change; /* sweep once rtc passes this */
+static unsigned long user_hour_from;   /* start of the hour user_hour_bit is for */
+static unsigned long user_recheck;     /* next hour or user_next_change, whichever comes first */
+static unsigned long user_hour_bit;
+static unsigned long user_now;         /* time of the last decision */
+static unsigned long user_schedule_hours[USER_SCHEDULES] = { 0xFFFFFFUL }; /* bit h: hour h of the day */
+static unsigned long user_generation;  /* changes that affect every user */
+
+/* Use other tables (host tools); both are cleared */
+void user_records_attach(user_hot *hot, user_cold *cold, int n) {
+    user_hot_tab = hot;
+    user_cold_tab = cold;
+    user_count = n;
+    user_next_change = 0;
+    user_recheck = 0;
+    user_generation++;
+    memset(hot, 0, sizeof(user_hot) * (size_t)n);
+    memset(cold, 0, sizeof(user_cold) * (size_t)n);
+}
+
+/* Something about uid changed: its record, validity or group membership */
+void user_touch(int uid) {
+    if (uid < 0 || uid >= user_count) return;
+    if (++user_hot_tab[uid].gen == 0) user_generation++;
+}
+
+int user_set(int uid, unsigned long card, int clearance, int schedule) {
+    user_hot *h;
+    if (uid < 0 || uid >= user_count || schedule < 0 || schedule >= USER_SCHEDULES) return -1;
+    h = &user_hot_tab[uid];
+    h->card = card;
+    h->clearance = (unsigned char)clearance;
+    h->schedule = (unsigned char)schedule;
+    user_touch(uid);
+    return 0;
+}
+
+int user_set_name(int uid, const char *name, const char *dept) {
+    user_cold *c;
+    if (uid < 0 || uid >= user_count) return -1;
+    c = &user_cold_tab[uid];
+    strncpy(c->name, name, USER_NAME_LEN - 1);
+    c->name[USER_NAME_LEN - 1] = '\0';
+    strncpy(c->department, dept, USER_DEPT_LEN - 1);
+    c->department[USER_DEPT_LEN - 1] = '\0';
+    return 0;
+}
+
+/*
+ * The user's flag is settled against the last time the door saw and the
+ * window's next edge joins user_next_change, so one change costs no sweep
+ * of the whole table.
+ */
+int user_set_validity(int uid, unsigned long from, unsigned long until) {
+    user_hot *h;
+    if (uid < 0 || uid >= user_count) return -1;
+    user_cold_tab[uid].valid_from = from;
+    user_cold_tab[uid].expires = until;
+    h = &user_hot_tab[uid];
+    if ((from != 0 && user_now < from) || (until != 0 && user_now >= until)) h->flags |= USER_F_EXPIRED;
+    else h->flags &= (unsigned char)~USER_F_EXPIRED;
+    if (from > user_now && from < user_next_change) user_next_change = from;
+    if (until > user_now && until < user_next_change) user_next_change = until;
+    if (user_next_change < user_recheck) user_recheck = user_next_change;
+    user_touch(uid);
+    return 0;
+}
+
+int user_revoke(int uid, int revoked) {
+    if (uid < 0 || uid >= user_count) return -1;
+    if (revoked) user_hot_tab[uid].flags |= USER_F_REVOKED;
+    else user_hot_tab[uid].flags &= (unsigned char)~USER_F_REVOKED;
+    user_touch(uid);
+    return 0;
+}
+
+int user_set_schedule(int id, unsigned long hours) {
+    if (id <= 0 || id >= USER_SCHEDULES) return -1;
+    user_schedule_hours[id] = hours & 0xFFFFFFUL;
+    user_generation++;
+    return 0;
+}
+
+/* Recompute USER_F_EXPIRED from the cold validity windows */
+void user_sweep(unsigned long now_s) {
+    const user_cold *c;
+    unsigned long next;
+    unsigned char was;
+    int uid, out;
+
+    next = USER_NEVER;
+    for (uid = 0; uid < user_count; uid++) {
+        c = &user_cold_tab[uid];
+        out = 0;
+        if (c->valid_from != 0) {
+            if (now_s < c->valid_from) {
+                out = 1;
+                if (c->valid_from < next) next = c->valid_from;
+            }
+        }
+        if (c->expires != 0) {
+            if (now_s >= c->expires) out = 1;
+            else if (c->expires < next) next = c->expires;
+        }
+        was = user_hot_tab[uid].flags;
+        if (out) user_hot_tab[uid].flags |= USER_F_EXPIRED;
+        else user_hot_tab[uid].flags &= (unsigned char)~USER_F_EXPIRED;
+        if (user_hot_tab[uid].flags != was) user_touch(uid);
+    }
+    user_next_change = next;
+}
+
+/* New hour, a validity boundary passed, or the clock was set back */
+static void user_tick(unsigned long now_s) {
+    if (now_s >= user_next_change || now_s < user_hour_from) user_sweep(now_s);
+    user_hour_from = now_s - now_s % 3600UL;
+    user_hour_bit = 1UL << (now_s / 3600UL % 24UL);
+    user_recheck = user_hour_from + 3600UL;
+    if (user_next_change < user_recheck) user_recheck = user_next_change;
+}
+
+/* Bring the expired flags and the hour up to now_s */
+void user_refresh(unsigned long now_s) {
+    if (now_s >= user_recheck || now_s < user_hour_from) user_tick(now_s);
+    user_now = now_s;
+}
+
+/* May uid pass a door needing clearance at now_s? USER_OK or USER_DENY_* */
+int user_admit(int uid, int clearance, unsigned long now_s) {
+    const user_hot *h;
+    if (uid < 0 || uid >= user_count) return USER_DENY_UNKNOWN;
+    user_refresh(now_s);
+    h = &user_hot_tab[uid];
+    if (h->flags & USER_F_REVOKED) return USER_DENY_REVOKED;
+    if (h->flags & USER_F_EXPIRED) return USER_DENY_EXPIRED;
+    if (h->clearance < clearance) return USER_DENY_CLEARANCE;
+    if (!(user_schedule_hours[h->schedule] & user_hour_bit)) return USER_DENY_SCHEDULE;
+    return USER_OK;
+}
+
+/* Does a decision for uid depend on the time (a validity window or a schedule)? */
+int user_needs_clock(int uid) {
+    if (uid < 0 || uid >= user_count) return 0;
+    return user_hot_tab[uid].schedule != 0 || user_cold_tab[uid].valid_from != 0 || user_cold_tab[uid].expires != 0;
+}
+
+/* User holding card, by scanning the hot array; -1 if none */
+int user_find_card(unsigned long card) {
+    int uid;
+    for (uid = 0; uid < user_count; uid++) {
+        if (user_hot_tab[uid].card == card) return uid;
+    }
+    return -1;
+}
+
+/* Statistics, once the decision is made */
+void user_note(int uid, int granted, unsigned long now_s) {
+    user_cold *c;
+    if (uid < 0 || uid >= user_count) return;
+    c = &user_cold_tab[uid];
+    c->last_seen = now_s;
+    if (granted) {
+        if (c->grants != 0xFFFF) c->grants++;
+    } else if (c->denials != 0xFFFF) {
+        c->denials++;
+    }
+}
+
+/* ========================= USER DIRECTORY ========================= */
+
+#if defined(HOST_TOOLS)
+/*
+ * Identities for a central host, which may hold millions of them, in a
+ * B+tree file: one tree keyed by user id holding the record, and
+ * secondary trees by card, employee number, (department, uid) and
+ * (expiry, uid). Card and employee trees map to the user id; the other two
+ * carry it at the end of the key and have no value.
+ *
+ * Pages are UD_PAGE bytes. Page 0 is the meta page:
+ *   magic "MLUD" | pages (4) | users (4) | root (4) x UD_INDEXES
+ * and a tree page is
+ *   type | 0 | count (2) | link (4) | prefix length (2) | prefix | offsets (2) x count | cells
+ * Every key in a page starts with the prefix, which is stored once. A leaf
+ * cell is suffix length | value length | suffix | value and the link is
+ * the next leaf. A branch cell is suffix length | child (4) | suffix, the
+ * child holding keys from that one on; the link is the child for keys
+ * below the first. Separators pushed up from leaves are cut to the
+ * shortest prefix that still divides them.
+ *
+ * Pages are read through a buffer pool (clock replacement) and lookups
+ * binary-search the page image in place. Changes decode a page, edit and
+ * re-encode it, splitting when it no longer fits; pages are not merged
+ * after deletes, a bulk load compacts.
+ *
+ * A change to a user, across all five trees, is one transaction. Dirty
+ * pages stay in the pool until commit, which writes them to PATH-journal
+ * with a checksum, syncs, and only then writes them home. ud_open replays
+ * a complete journal and drops a torn one, so a crash leaves all of a
+ * change or none of it.
+ */
+#define UD_PAGE 4096
+#define UD_INDEXES 5
+#define UD_KEY_MAX 40
+#define UD_VAL_MAX 64
+#define UD_NODE_MAX 1024        /* entries a page can hold, with room for one more */
+#define UD_DEPTH 12
+#define UD_HEAD 10
+#define UD_FILL (UD_PAGE * 9 / 10) /* bulk load leaves room for later inserts */
+#define UD_EMPLOYEE_LEN 12
+#define UD_RECORD (4 + 4 + UD_EMPLOYEE_LEN + USER_NAME_LEN + USER_DEPT_LEN + 4 + 4 + 3)
+#define UD_LEAF 1
+#define UD_BRANCH 2
+#define UD_NO_PAGE 0xFFFFFFFFUL
+
+#define UD_BY_UID 0
+#define UD_BY_CARD 1
+#define UD_BY_EMPLOYEE 2
+#define UD_BY_DEPARTMENT 3
+#define UD_BY_EXPIRY 4
+
+#define UD_OK 0
+#define UD_ERR_IO (-1)
+#define UD_ERR_NOT_FOUND (-2)
+#define UD_ERR_DUPLICATE (-3)   /* card or employee number held by another user */
+#define UD_ERR_POOL (-4)        /* the transaction dirtied more pages than the pool holds */
+#define UD_ERR_CORRUPT (-5)
+
+typedef struct {
+    unsigned long uid;
+    unsigned long card;
+    char employee[UD_EMPLOYEE_LEN];
+    char name[USER_NAME_LEN];
+    char department[USER_DEPT_LEN];
+    unsigned long valid_from;
+    unsigned long expires;      /* 0 for no limit */
+    unsigned char clearance;
+    unsigned char schedule;
+    unsigned char flags;
+} ud_user;
+
+typedef struct {
+    unsigned long page;
+    int pins;
+    int dirty;
+    int ref;
+    int next;                   /* hash chain */
+    unsigned char *data;
+} ud_frame;
+
+/* A page decoded for editing */
+typedef struct {
+    int type;
+    int n;
+    unsigned long link;
+    unsigned char klen[UD_NODE_MAX + 1];
+    unsigned char key[UD_NODE_MAX + 1][UD_KEY_MAX];
+    unsigned char vlen[UD_NODE_MAX + 1];
+    unsigned char val[UD_NODE_MAX + 1][UD_VAL_MAX];
+    unsigned long child[UD_NODE_MAX + 1];
+} ud_node;
+
+typedef struct {
+    int fd;
+    int jfd;
+    unsigned long pages;
+    unsigned long users;
+    unsigned long root[UD_INDEXES];
+    unsigned long saved_pages, saved_users, saved_root[UD_INDEXES]; /* at ud_begin */
+    ud_frame *frames;
+    int nframes;
+    int hand;
+    int *buckets;
+    unsigned int hmask;
+    int dirty;
+    ud_node *node;
+    unsigned long hits, misses, commits, journal_pages;
+    int crash_torn;             /* testing: the next commit stops half-way through the journal */
+    long crash_home;            /* testing: ... or after this many home pages; -1 never */
+} ud_db;
+
+typedef struct {
+    ud_db *db;
+    unsigned long page;
+    int slot;
+} ud_cursor;
+
+static unsigned long ud_get32(const unsigned char *p) {
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+static void ud_put32(unsigned char *p, unsigned long v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static int ud_cmp(const unsigned char *a, int alen, const unsigned char *b, int blen) {
+    int d;
+    d = memcmp(a, b, (size_t)(alen < blen ? alen : blen));
+    return d != 0 ? d : alen - blen;
+}
+
+static int ud_lcp(const unsigned char *a, int alen, const unsigned char *b, int blen) {
+    int i;
+    for (i = 0; i < alen && i < blen && a[i] == b[i]; i++) {
+    }
+    return i;
+}
+
+/* ---------- buffer pool ---------- */
+
+static unsigned int ud_hash(const ud_db *db, unsigned long page) {
+    return (unsigned int)((page * 2654435761UL) >> 7) & db->hmask;
+}
+
+static int ud_lookup_frame(const ud_db *db, unsigned long page) {
+    int f;
+    for (f = db->buckets[ud_hash(db, page)]; f >= 0; f = db->frames[f].next) {
+        if (db->frames[f].page == page) return f;
+    }
+    return -1;
+}
+
+static void ud_unhash(ud_db *db, int f) {
+    int *p;
+    for (p = &db->buckets[ud_hash(db, db->frames[f].page)]; *p != f; p = &db->frames[*p].next) {
+    }
+    *p = db->frames[f].next;
+    db->frames[f].page = UD_NO_PAGE;
+}
+
+/* A clean, unpinned frame to reuse, second chance for recently used ones */
+static int ud_victim(ud_db *db) {
+    ud_frame *fr;
+    int k, f;
+    for (k = 0; k < 2 * db->nframes; k++) {
+        f = db->hand;
+        db->hand = (db->hand + 1) % db->nframes;
+        fr = &db->frames[f];
+        if (fr->pins || fr->dirty) continue;
+        if (fr->ref) {
+            fr->ref = 0;
+            continue;
+        }
+        if (fr->page != UD_NO_PAGE) ud_unhash(db, f);
+        return f;
+    }
+    return UD_ERR_POOL;
+}
+
+/* Pin page in the pool and return its frame; a fresh page starts zeroed instead of being read */
+static int ud_pin(ud_db *db, unsigned long page, int fresh) {
+    int f;
+    unsigned int h;
+    f = ud_lookup_frame(db, page);
+    if (f >= 0) {
+        db->hits++;
+        db->frames[f].pins++;
+        db->frames[f].ref = 1;
+        return f;
+    }
+    f = ud_victim(db);
+    if (f < 0) return f;
+    db->misses++;
+    if (fresh) {
+        memset(db->frames[f].data, 0, UD_PAGE);
+    } else if (pread(db->fd, db->frames[f].data, UD_PAGE, (off_t)page * UD_PAGE) != UD_PAGE) {
+        return UD_ERR_IO;
+    }
+    h = ud_hash(db, page);
+    db->frames[f].page = page;
+    db->frames[f].next = db->buckets[h];
+    db->buckets[h] = f;
+    db->frames[f].pins = 1;
+    db->frames[f].ref = 1;
+    return f;
+}
+
+static void ud_unpin(ud_db *db, int f, int dirty) {
+    db->frames[f].pins--;
+    if (dirty && !db->frames[f].dirty) {
+        db->frames[f].dirty = 1;
+        db->dirty++;
+    }
+}
+
+/* Drop every frame, e.g. after pages were written around the pool */
+static void ud_pool_clear(ud_db *db) {
+    int f;
+    for (f = 0; f < db->nframes; f++) {
+        if (db->frames[f].page != UD_NO_PAGE) ud_unhash(db, f);
+        db->frames[f].dirty = 0;
+    }
+    db->dirty = 0;
+}
+
+/* ---------- page images ---------- */
+
+#define UD_COUNT(p) (((p)[2] << 8) | (p)[3])
+#define UD_PLEN(p) (((p)[8] << 8) | (p)[9])
+#define UD_CELL(p, i) ((p) + (((p)[UD_HEAD + UD_PLEN(p) + 2 * (i)] << 8) | (p)[UD_HEAD + UD_PLEN(p) + 2 * (i) + 1]))
+
+/* Compare key with entry i of page p (prefix and suffix) */
+static int ud_page_cmp(const unsigned char *p, int i, const unsigned char *key, int klen) {
+    const unsigned char *c;
+    int plen, d;
+    plen = UD_PLEN(p);
+    d = memcmp(key, p + UD_HEAD, (size_t)(klen < plen ? klen : plen));
+    if (d != 0 || klen < plen) return d != 0 ? d : -1;
+    c = UD_CELL(p, i);
+    return ud_cmp(key + plen, klen - plen, c + (p[0] == UD_LEAF ? 2 : 5), c[0]);
+}
+
+/* First entry of p not below key; *exact when it equals key */
+static int ud_page_lower(const unsigned char *p, const unsigned char *key, int klen, int *exact) {
+    int lo, hi, mid, d;
+    lo = 0;
+    hi = UD_COUNT(p);
+    *exact = 0;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        d = ud_page_cmp(p, mid, key, klen);
+        if (d > 0) {
+            lo = mid + 1;
+        } else {
+            if (d == 0) *exact = 1;
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Child of branch page p that covers key */
+static unsigned long ud_page_child(const unsigned char *p, const unsigned char *key, int klen) {
+    int i, exact;
+    i = ud_page_lower(p, key, klen, &exact);
+    if (!exact) i--;
+    return i < 0 ? ud_get32(p + 4) : ud_get32(UD_CELL(p, i) + 1);
+}
+
+static void ud_decode(const unsigned char *p, ud_node *nd) {
+    const unsigned char *c;
+    int i, plen, s;
+    nd->type = p[0];
+    nd->n = UD_COUNT(p);
+    nd->link = ud_get32(p + 4);
+    plen = UD_PLEN(p);
+    for (i = 0; i < nd->n; i++) {
+        c = UD_CELL(p, i);
+        s = c[0];
+        memcpy(nd->key[i], p + UD_HEAD, (size_t)plen);
+        nd->klen[i] = (unsigned char)(plen + s);
+        if (nd->type == UD_LEAF) {
+            memcpy(nd->key[i] + plen, c + 2, (size_t)s);
+            nd->vlen[i] = c[1];
+            memcpy(nd->val[i], c + 2 + s, c[1]);
+        } else {
+            memcpy(nd->key[i] + plen, c + 5, (size_t)s);
+            nd->child[i] = ud_get32(c + 1);
+        }
+    }
+}
+
+static int ud_range_plen(const ud_node *nd, int lo, int hi) {
+    return hi - lo < 2 ? (hi > lo ? nd->klen[lo] : 0) : ud_lcp(nd->key[lo], nd->klen[lo], nd->key[hi - 1], nd->klen[hi - 1]);
+}
+
+/* Page bytes for entries lo..hi-1 */
+static int ud_encoded_size(const ud_node *nd, int lo, int hi) {
+    int i, plen, size;
+    plen = ud_range_plen(nd, lo, hi);
+    size = UD_HEAD + plen;
+    for (i = lo; i < hi; i++) size += 2 + (nd->type == UD_LEAF ? 2 + nd->vlen[i] : 5) + nd->klen[i] - plen;
+    return size;
+}
+
+static void ud_encode(const ud_node *nd, int lo, int hi, unsigned long link, unsigned char *p) {
+    unsigned char *c;
+    int i, plen, at, s;
+    plen = ud_range_plen(nd, lo, hi);
+    memset(p, 0, UD_PAGE);
+    p[0] = (unsigned char)nd->type;
+    p[2] = (unsigned char)((hi - lo) >> 8);
+    p[3] = (unsigned char)(hi - lo);
+    ud_put32(p + 4, link);
+    p[8] = (unsigned char)(plen >> 8);
+    p[9] = (unsigned char)plen;
+    if (hi > lo) memcpy(p + UD_HEAD, nd->key[lo], (size_t)plen);
+    at = UD_PAGE;
+    for (i = lo; i < hi; i++) {
+        s = nd->klen[i] - plen;
+        at -= (nd->type == UD_LEAF ? 2 + nd->vlen[i] : 5) + s;
+        c = p + at;
+        c[0] = (unsigned char)s;
+        if (nd->type == UD_LEAF) {
+            c[1] = nd->vlen[i];
+            memcpy(c + 2, nd->key[i] + plen, (size_t)s);
+            memcpy(c + 2 + s, nd->val[i], nd->vlen[i]);
+        } else {
+            ud_put32(c + 1, nd->child[i]);
+            memcpy(c + 5, nd->key[i] + plen, (size_t)s);
+        }
+        p[UD_HEAD + plen + 2 * (i - lo)] = (unsigned char)(at >> 8);
+        p[UD_HEAD + plen + 2 * (i - lo) + 1] = (unsigned char)at;
+    }
+}
+
+static void ud_node_insert(ud_node *nd, int i, const unsigned char *key, int klen) {
+    memmove(nd->klen + i + 1, nd->klen + i, (size_t)(nd->n - i));
+    memmove(nd->key[i + 1], nd->key[i], (size_t)(nd->n - i) * UD_KEY_MAX);
+    memmove(nd->vlen + i + 1, nd->vlen + i, (size_t)(nd->n - i));
+    memmove(nd->val[i + 1], nd->val[i], (size_t)(nd->n - i) * UD_VAL_MAX);
+    memmove(nd->child + i + 1, nd->child + i, (size_t)(nd->n - i) * sizeof(unsigned long));
+    memcpy(nd->key[i], key, (size_t)klen);
+    nd->klen[i] = (unsigned char)klen;
+    nd->n++;
+}
+
+/* ---------- trees ---------- */
+
+static int ud_alloc(ud_db *db) {
+    return ud_pin(db, db->pages++, 1);
+}
+
+/* Leaf for key, with the pages above it in path[0..*depth-1] */
+static int ud_descend(ud_db *db, int index, const unsigned char *key, int klen, unsigned long *path, int *depth) {
+    unsigned long page, child;
+    int f, d;
+    page = db->root[index];
+    for (d = 0; d < UD_DEPTH; d++) {
+        if (path) path[d] = page;
+        f = ud_pin(db, page, 0);
+        if (f < 0) return f;
+        if (db->frames[f].data[0] == UD_LEAF) {
+            if (depth) *depth = d;
+            return f;
+        }
+        if (db->frames[f].data[0] != UD_BRANCH) {
+            ud_unpin(db, f, 0);
+            return UD_ERR_CORRUPT;
+        }
+        child = ud_page_child(db->frames[f].data, key, klen);
+        ud_unpin(db, f, 0);
+        page = child;
+    }
+    return UD_ERR_CORRUPT;
+}
+
+/* Value stored under key; its length, or UD_ERR_* */
+static int ud_find(ud_db *db, int index, const unsigned char *key, int klen, unsigned char *val) {
+    const unsigned char *p, *c;
+    int f, i, exact, n;
+    f = ud_descend(db, index, key, klen, 0, 0);
+    if (f < 0) return f;
+    p = db->frames[f].data;
+    i = ud_page_lower(p, key, klen, &exact);
+    n = UD_ERR_NOT_FOUND;
+    if (exact) {
+        c = UD_CELL(p, i);
+        n = c[1];
+        memcpy(val, c + 2 + c[0], (size_t)n);
+    }
+    ud_unpin(db, f, 0);
+    return n;
+}
+
+/* Write db->node back to path[d], splitting upwards as needed */
+static int ud_store(ud_db *db, int index, unsigned long *path, int d) {
+    ud_node *nd;
+    unsigned char sep[UD_KEY_MAX];
+    unsigned long right_page, right_link;
+    int f, r, s, total, acc, seplen, i;
+
+    nd = db->node;
+    for (;;) {
+        f = ud_pin(db, path[d], 0);
+        if (f < 0) return f;
+        total = ud_encoded_size(nd, 0, nd->n);
+        if (total <= UD_PAGE) {
+            ud_encode(nd, 0, nd->n, nd->link, db->frames[f].data);
+            ud_unpin(db, f, 1);
+            return UD_OK;
+        }
+        /* split by bytes; a branch gives its middle key to the parent */
+        acc = UD_HEAD;
+        for (s = 0; s < nd->n - 1 && acc < total / 2; s++) acc += ud_encoded_size(nd, s, s + 1) - UD_HEAD;
+        if (s < 1) s = 1;
+        r = ud_alloc(db);
+        if (r < 0) {
+            ud_unpin(db, f, 0);
+            return r;
+        }
+        right_page = db->pages - 1;
+        if (nd->type == UD_LEAF) {
+            seplen = ud_lcp(nd->key[s - 1], nd->klen[s - 1], nd->key[s], nd->klen[s]) + 1;
+            if (seplen > nd->klen[s]) seplen = nd->klen[s];
+            memcpy(sep, nd->key[s], (size_t)seplen);
+            ud_encode(nd, s, nd->n, nd->link, db->frames[r].data);
+            ud_encode(nd, 0, s, right_page, db->frames[f].data);
+        } else {
+            seplen = nd->klen[s];
+            memcpy(sep, nd->key[s], (size_t)seplen);
+            right_link = nd->child[s];
+            ud_encode(nd, s + 1, nd->n, right_link, db->frames[r].data);
+            ud_encode(nd, 0, s, nd->link, db->frames[f].data);
+        }
+        ud_unpin(db, r, 1);
+        ud_unpin(db, f, 1);
+
+        if (d == 0) {
+            r = ud_alloc(db);
+            if (r < 0) return r;
+            nd->type = UD_BRANCH;
+            nd->n = 0;
+            nd->link = path[0];
+            ud_node_insert(nd, 0, sep, seplen);
+            nd->child[0] = right_page;
+            ud_encode(nd, 0, 1, nd->link, db->frames[r].data);
+            ud_unpin(db, r, 1);
+            db->root[index] = db->pages - 1;
+            return UD_OK;
+        }
+        d--;
+        f = ud_pin(db, path[d], 0);
+        if (f < 0) return f;
+        ud_decode(db->frames[f].data, nd);
+        ud_unpin(db, f, 0);
+        for (i = 0; i < nd->n && ud_cmp(nd->key[i], nd->klen[i], sep, seplen) < 0; i++) {
+        }
+        ud_node_insert(nd, i, sep, seplen);
+        nd->child[i] = right_page;
+    }
+}
+
+/* Insert key, or replace its value */
+static int ud_insert(ud_db *db, int index, const unsigned char *key, int klen, const unsigned char *val, int vlen) {
+    unsigned long path[UD_DEPTH];
+    ud_node *nd;
+    int f, d, i, exact;
+
+    f = ud_descend(db, index, key, klen, path, &d);
+    if (f < 0) return f;
+    nd = db->node;
+    i = ud_page_lower(db->frames[f].data, key, klen, &exact);
+    ud_decode(db->frames[f].data, nd);
+    ud_unpin(db, f, 0);
+    if (!exact) ud_node_insert(nd, i, key, klen);
+    memcpy(nd->val[i], val, (size_t)vlen);
+    nd->vlen[i] = (unsigned char)vlen;
+    return ud_store(db, index, path, d);
+}
+
+static int ud_delete(ud_db *db, int index, const unsigned char *key, int klen) {
+    ud_node *nd;
+    int f, i, exact;
+
+    f = ud_descend(db, index, key, klen, 0, 0);
+    if (f < 0) return f;
+    i = ud_page_lower(db->frames[f].data, key, klen, &exact);
+    if (!exact) {
+        ud_unpin(db, f, 0);
+        return UD_ERR_NOT_FOUND;
+    }
+    nd = db->node;
+    ud_decode(db->frames[f].data, nd);
+    nd->n--;
+    memmove(nd->klen + i, nd->klen + i + 1, (size_t)(nd->n - i));
+    memmove(nd->key[i], nd->key[i + 1], (size_t)(nd->n - i) * UD_KEY_MAX);
+    memmove(nd->vlen + i, nd->vlen + i + 1, (size_t)(nd->n - i));
+    memmove(nd->val[i], nd->val[i + 1], (size_t)(nd->n - i) * UD_VAL_MAX);
+    ud_encode(nd, 0, nd->n, nd->link, db->frames[f].data);
+    ud_unpin(db, f, 1);
+    return UD_OK;
+}
+
+/* Position c at the first entry of index not below key */
+static int ud_seek(ud_db *db, int index, const unsigned char *key, int klen, ud_cursor *c) {
+    int f, exact;
+    f = ud_descend(db, index, key, klen, 0, 0);
+    if (f < 0) return f;
+    c->db = db;
+    c->page = db->frames[f].page;
+    c->slot = ud_page_lower(db->frames[f].data, key, klen, &exact);
+    ud_unpin(db, f, 0);
+    return UD_OK;
+}
+
+/* Entry under the cursor, then step past it; 0 at the end of the index */
+static int ud_next(ud_cursor *c, unsigned char *key, int *klen, unsigned char *val, int *vlen) {
+    const unsigned char *p, *cell;
+    unsigned long link;
+    int f, plen;
+
+    while (c->page != 0) {
+        f = ud_pin(c->db, c->page, 0);
+        if (f < 0) return f;
+        p = c->db->frames[f].data;
+        if (c->slot < UD_COUNT(p)) {
+            cell = UD_CELL(p, c->slot);
+            plen = UD_PLEN(p);
+            memcpy(key, p + UD_HEAD, (size_t)plen);
+            memcpy(key + plen, cell + 2, cell[0]);
+            *klen = plen + cell[0];
+            if (val) memcpy(val, cell + 2 + cell[0], cell[1]);
+            if (vlen) *vlen = cell[1];
+            c->slot++;
+            ud_unpin(c->db, f, 0);
+            return 1;
+        }
+        link = ud_get32(p + 4);
+        ud_unpin(c->db, f, 0);
+        c->page = link;
+        c->slot = 0;
+    }
+    return 0;
+}
+
+/* ---------- records and keys ---------- */
+
+static void ud_pack(const ud_user *u, unsigned char *r) {
+    ud_put32(r, u->uid);
+    ud_put32(r + 4, u->card);
+    memcpy(r + 8, u->employee, UD_EMPLOYEE_LEN);
+    memcpy(r + 8 + UD_EMPLOYEE_LEN, u->name, USER_NAME_LEN);
+    r += 8 + UD_EMPLOYEE_LEN + USER_NAME_LEN;
+    memcpy(r, u->department, USER_DEPT_LEN);
+    ud_put32(r + USER_DEPT_LEN, u->valid_from);
+    ud_put32(r + USER_DEPT_LEN + 4, u->expires);
+    r[USER_DEPT_LEN + 8] = u->clearance;
+    r[USER_DEPT_LEN + 9] = u->schedule;
+    r[USER_DEPT_LEN + 10] = u->flags;
+}
+
+static void ud_unpack(const unsigned char *r, ud_user *u) {
+    u->uid = ud_get32(r);
+    u->card = ud_get32(r + 4);
+    memcpy(u->employee, r + 8, UD_EMPLOYEE_LEN);
+    memcpy(u->name, r + 8 + UD_EMPLOYEE_LEN, USER_NAME_LEN);
+    r += 8 + UD_EMPLOYEE_LEN + USER_NAME_LEN;
+    memcpy(u->department, r, USER_DEPT_LEN);
+    u->valid_from = ud_get32(r + USER_DEPT_LEN);
+    u->expires = ud_get32(r + USER_DEPT_LEN + 4);
+    u->clearance = r[USER_DEPT_LEN + 8];
+    u->schedule = r[USER_DEPT_LEN + 9];
+    u->flags = r[USER_DEPT_LEN + 10];
+}
+
+static int ud_strlen(const char *s, int max) {
+    int n;
+    for (n = 0; n < max && s[n] != '\0'; n++) {
+    }
+    return n;
+}
+
+/* Key of u in index, and its length */
+static int ud_key(int index, const ud_user *u, unsigned char *k) {
+    int n;
+    switch (index) {
+    case UD_BY_UID:
+        ud_put32(k, u->uid);
+        return 4;
+    case UD_BY_CARD:
+        ud_put32(k, u->card);
+        return 4;
+    case UD_BY_EMPLOYEE:
+        n = ud_strlen(u->employee, UD_EMPLOYEE_LEN);
+        memcpy(k, u->employee, (size_t)n);
+        return n;
+    case UD_BY_DEPARTMENT:
+        n = ud_strlen(u->department, USER_DEPT_LEN);
+        memcpy(k, u->department, (size_t)n);
+        k[n] = '\0';
+        ud_put32(k + n + 1, u->uid);
+        return n + 5;
+    default:
+        ud_put32(k, u->expires);
+        ud_put32(k + 4, u->uid);
+        return 8;
+    }
+}
+
+/* Value of u in index: the record, the user id, or nothing */
+static int ud_value(int index, const ud_user *u, unsigned char *v) {
+    if (index == UD_BY_UID) {
+        ud_pack(u, v);
+        return UD_RECORD;
+    }
+    if (index == UD_BY_CARD || index == UD_BY_EMPLOYEE) {
+        ud_put32(v, u->uid);
+        return 4;
+    }
+    return 0;
+}
+
+/* ---------- transactions ---------- */
+
+static unsigned long ud_fnv(unsigned long h, const unsigned char *p, unsigned long n) {
+    unsigned long i;
+    for (i = 0; i < n; i++) h = ((h ^ p[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    return h;
+}
+
+static int ud_meta_store(ud_db *db) {
+    unsigned char *p;
+    int f, k;
+    f = ud_pin(db, 0, 0);
+    if (f < 0) return f;
+    p = db->frames[f].data;
+    memcpy(p, "MLUD", 4);
+    ud_put32(p + 4, db->pages);
+    ud_put32(p + 8, db->users);
+    for (k = 0; k < UD_INDEXES; k++) ud_put32(p + 12 + 4 * k, db->root[k]);
+    ud_unpin(db, f, 1);
+    return UD_OK;
+}
+
+static void ud_begin(ud_db *db) {
+    db->saved_pages = db->pages;
+    db->saved_users = db->users;
+    memcpy(db->saved_root, db->root, sizeof(db->root));
+}
+
+/* Forget every change since ud_begin */
+static void ud_abort(ud_db *db) {
+    int f;
+    for (f = 0; f < db->nframes; f++) {
+        if (!db->frames[f].dirty) continue;
+        ud_unhash(db, f);
+        db->frames[f].dirty = 0;
+    }
+    db->dirty = 0;
+    db->pages = db->saved_pages;
+    db->users = db->saved_users;
+    memcpy(db->root, db->saved_root, sizeof(db->root));
+}
+
+/* Journal: "MLUJ" | pages (4) | (page number (4) | image) x pages | FNV-1a of all that (4) */
+static int ud_commit(ud_db *db) {
+    unsigned char head[8], tail[4];
+    unsigned long h, off;
+    long home;
+    int f, n, rc;
+
+    rc = ud_meta_store(db);
+    if (rc != UD_OK) return rc;
+    if (ftruncate(db->jfd, 0) != 0) return UD_ERR_IO; /* what a failed commit left */
+    memcpy(head, "MLUJ", 4);
+    ud_put32(head + 4, (unsigned long)db->dirty);
+    h = ud_fnv(2166136261UL, head, 8);
+    if (pwrite(db->jfd, head, 8, 0) != 8) return UD_ERR_IO;
+    off = 8;
+    n = 0;
+    for (f = 0; f < db->nframes; f++) {
+        if (!db->frames[f].dirty) continue;
+        if (db->crash_torn && ++n > db->dirty / 2) return UD_ERR_IO;
+        ud_put32(tail, db->frames[f].page);
+        h = ud_fnv(ud_fnv(h, tail, 4), db->frames[f].data, UD_PAGE);
+        if (pwrite(db->jfd, tail, 4, (off_t)off) != 4 ||
+            pwrite(db->jfd, db->frames[f].data, UD_PAGE, (off_t)off + 4) != UD_PAGE) {
+            return UD_ERR_IO;
+        }
+        off += 4 + UD_PAGE;
+    }
+    ud_put32(tail, h);
+    if (pwrite(db->jfd, tail, 4, (off_t)off) != 4 || fsync(db->jfd) != 0) return UD_ERR_IO;
+
+    home = 0;
+    for (f = 0; f < db->nframes; f++) {
+        if (!db->frames[f].dirty) continue;
+        if (db->crash_home >= 0 && home++ >= db->crash_home) return UD_ERR_IO;
+        if (pwrite(db->fd, db->frames[f].data, UD_PAGE, (off_t)db->frames[f].page * UD_PAGE) != UD_PAGE) {
+            return UD_ERR_IO;
+        }
+    }
+    if (fsync(db->fd) != 0 || ftruncate(db->jfd, 0) != 0) return UD_ERR_IO;
+    db->journal_pages += (unsigned long)db->dirty;
+    db->commits++;
+    for (f = 0; f < db->nframes; f++) db->frames[f].dirty = 0;
+    db->dirty = 0;
+    return UD_OK;
+}
+
+/* Replay a complete journal into the file; a torn one is dropped */
+static int ud_recover(ud_db *db) {
+    unsigned char head[8], tail[4], *page;
+    unsigned long h, n, i, pg;
+    off_t size;
+    int ok;
+
+    size = lseek(db->jfd, 0, SEEK_END);
+    if (size <= 0) return UD_OK;
+    ok = 0;
+    page = (unsigned char *)malloc(UD_PAGE);
+    if (!page) return UD_ERR_IO;
+    if (pread(db->jfd, head, 8, 0) == 8 && memcmp(head, "MLUJ", 4) == 0) {
+        n = ud_get32(head + 4);
+        if ((unsigned long)size == 8 + n * (4 + UD_PAGE) + 4) {
+            h = ud_fnv(2166136261UL, head, 8);
+            for (i = 0; i < n; i++) {
+                if (pread(db->jfd, tail, 4, (off_t)(8 + i * (4 + UD_PAGE))) != 4 ||
+                    pread(db->jfd, page, UD_PAGE, (off_t)(12 + i * (4 + UD_PAGE))) != UD_PAGE) {
+                    break;
+                }
+                h = ud_fnv(ud_fnv(h, tail, 4), page, UD_PAGE);
+            }
+            ok = i == n && pread(db->jfd, tail, 4, (off_t)(8 + n * (4 + UD_PAGE))) == 4 && ud_get32(tail) == h;
+        }
+        for (i = 0; ok && i < n; i++) {
+            pread(db->jfd, tail, 4, (off_t)(8 + i * (4 + UD_PAGE)));
+            pg = ud_get32(tail);
+            ok = pread(db->jfd, page, UD_PAGE, (off_t)(12 + i * (4 + UD_PAGE))) == UD_PAGE &&
+                 pwrite(db->fd, page, UD_PAGE, (off_t)pg * UD_PAGE) == UD_PAGE;
+        }
+        if (ok && fsync(db->fd) != 0) ok = 0;
+    }
+    free(page);
+    return ftruncate(db->jfd, 0) == 0 ? UD_OK : UD_ERR_IO;
+}
+
+/* ---------- the directory ---------- */
+
+void ud_close(ud_db *db) {
+    int f;
+    if (db->frames) {
+        for (f = 0; f < db->nframes; f++) free(db->frames[f].data);
+    }
+    free(db->frames);
+    free(db->buckets);
+    free(db->node);
+    if (db->fd >= 0) close(db->fd);
+    if (db->jfd >= 0) close(db->jfd);
+    db->frames = 0;
+    db->buckets = 0;
+    db->node = 0;
+    db->fd = db->jfd = -1;
+}
+
+/* Open or create the directory at path with a pool of pool_pages pages */
+int ud_open(ud_db *db, const char *path, int pool_pages) {
+    char jpath[512];
+    unsigned char meta[UD_PAGE];
+    unsigned int size;
+    int f, k, rc;
+
+    memset(db, 0, sizeof(*db));
+    db->fd = db->jfd = -1;
+    db->crash_home = -1;
+    if (strlen(path) + 9 > sizeof(jpath) || pool_pages < 16) return UD_ERR_IO;
+    sprintf(jpath, "%s-journal", path);
+    db->fd = open(path, O_RDWR | O_CREAT, 0600);
+    db->jfd = open(jpath, O_RDWR | O_CREAT, 0600);
+    for (size = 1; size < 2U * (unsigned int)pool_pages; size <<= 1) {
+    }
+    db->nframes = pool_pages;
+    db->hmask = size - 1;
+    db->frames = (ud_frame *)calloc((size_t)pool_pages, sizeof(ud_frame));
+    db->buckets = (int *)malloc(sizeof(int) * size);
+    db->node = (ud_node *)malloc(sizeof(ud_node));
+    if (db->fd < 0 || db->jfd < 0 || !db->frames || !db->buckets || !db->node) {
+        ud_close(db);
+        return UD_ERR_IO;
+    }
+    for (k = 0; k < (int)size; k++) db->buckets[k] = -1;
+    for (f = 0; f < pool_pages; f++) {
+        db->frames[f].page = UD_NO_PAGE;
+        db->frames[f].data = (unsigned char *)malloc(UD_PAGE);
+        if (!db->frames[f].data) {
+            ud_close(db);
+            return UD_ERR_IO;
+        }
+    }
+    rc = ud_recover(db);
+    if (rc == UD_OK && pread(db->fd, meta, UD_PAGE, 0) == UD_PAGE) {
+        if (memcmp(meta, "MLUD", 4) != 0) rc = UD_ERR_CORRUPT;
+        db->pages = ud_get32(meta + 4);
+        db->users = ud_get32(meta + 8);
+        for (k = 0; k < UD_INDEXES; k++) db->root[k] = ud_get32(meta + 12 + 4 * k);
+    } else if (rc == UD_OK) {
+        /* new file: the meta page and an empty leaf per index */
+        ud_begin(db);
+        db->pages = 1;
+        for (k = 0; k < UD_INDEXES && rc == UD_OK; k++) {
+            f = ud_alloc(db);
+            if (f < 0) {
+                rc = f;
+                break;
+            }
+            db->frames[f].data[0] = UD_LEAF;
+            db->root[k] = db->pages - 1;
+            ud_unpin(db, f, 1);
+        }
+        f = rc == UD_OK ? ud_pin(db, 0, 1) : rc;
+        if (f >= 0) ud_unpin(db, f, 1);
+        rc = f < 0 ? f : ud_commit(db);
+    }
+    if (rc != UD_OK) ud_close(db);
+    return rc;
+}
+
+int ud_get(ud_db *db, unsigned long uid, ud_user *u) {
+    unsigned char k[4], v[UD_VAL_MAX];
+    int n;
+    ud_put32(k, uid);
+    n = ud_find(db, UD_BY_UID, k, 4, v);
+    if (n < 0) return n;
+    if (n != UD_RECORD) return UD_ERR_CORRUPT;
+    ud_unpack(v, u);
+    return UD_OK;
+}
+
+static int ud_get_via(ud_db *db, int index, const unsigned char *k, int klen, ud_user *u) {
+    unsigned char v[UD_VAL_MAX];
+    int n;
+    n = ud_find(db, index, k, klen, v);
+    if (n < 0) return n;
+    return ud_get(db, ud_get32(v), u);
+}
+
+int ud_find_card(ud_db *db, unsigned long card, ud_user *u) {
+    unsigned char k[4];
+    ud_put32(k, card);
+    return ud_get_via(db, UD_BY_CARD, k, 4, u);
+}
+
+int ud_find_employee(ud_db *db, const char *employee, ud_user *u) {
+    return ud_get_via(db, UD_BY_EMPLOYEE, (const unsigned char *)employee, ud_strlen(employee, UD_EMPLOYEE_LEN), u);
+}
+
+/* Add or change a user, all indexes in one transaction */
+int ud_put(ud_db *db, const ud_user *u) {
+    unsigned char k[UD_KEY_MAX], ok[UD_KEY_MAX], v[UD_VAL_MAX];
+    ud_user old;
+    int had, idx, klen, oklen, rc;
+
+    ud_begin(db);
+    rc = ud_get(db, u->uid, &old);
+    had = rc == UD_OK;
+    if (rc != UD_OK && rc != UD_ERR_NOT_FOUND) return rc;
+    for (idx = UD_BY_CARD; idx <= UD_BY_EMPLOYEE; idx++) {
+        klen = ud_key(idx, u, k);
+        rc = ud_find(db, idx, k, klen, v);
+        if (rc == 4 && ud_get32(v) != u->uid) rc = UD_ERR_DUPLICATE;
+        if (rc < 0 && rc != UD_ERR_NOT_FOUND) {
+            ud_abort(db);
+            return rc;
+        }
+    }
+    rc = UD_OK;
+    for (idx = 0; idx < UD_INDEXES && rc == UD_OK; idx++) {
+        klen = ud_key(idx, u, k);
+        if (had && idx != UD_BY_UID) {
+            oklen = ud_key(idx, &old, ok);
+            if (ud_cmp(k, klen, ok, oklen) == 0) continue; /* secondary key unchanged */
+            rc = ud_delete(db, idx, ok, oklen);
+            if (rc != UD_OK) break;
+        }
+        rc = ud_insert(db, idx, k, klen, v, ud_value(idx, u, v));
+    }
+    if (rc == UD_OK) {
+        if (!had) db->users++;
+        rc = ud_commit(db);
+    }
+    if (rc != UD_OK) ud_abort(db);
+    return rc;
+}
+
+int ud_remove(ud_db *db, unsigned long uid) {
+    unsigned char k[UD_KEY_MAX];
+    ud_user old;
+    int idx, rc;
+
+    ud_begin(db);
+    rc = ud_get(db, uid, &old);
+    for (idx = 0; idx < UD_INDEXES && rc == UD_OK; idx++) rc = ud_delete(db, idx, k, ud_key(idx, &old, k));
+    if (rc == UD_OK) {
+        db->users--;
+        rc = ud_commit(db);
+    }
+    if (rc != UD_OK) ud_abort(db);
+    return rc;
+}
+
+/* Users whose access ends in [from, until), by date; fn gets each user id. Returns the count */
+long ud_scan_expiring(ud_db *db, unsigned long from, unsigned long until, void (*fn)(void *, unsigned long),
+                      void *arg) {
+    unsigned char k[UD_KEY_MAX];
+    ud_cursor c;
+    long n;
+    int klen;
+
+    ud_put32(k, from);
+    ud_put32(k + 4, 0);
+    if (ud_seek(db, UD_BY_EXPIRY, k, 8, &c) != UD_OK) return -1;
+    for (n = 0; ud_next(&c, k, &klen, 0, 0) == 1 && ud_get32(k) < until; n++) {
+        if (fn) fn(arg, ud_get32(k + 4));
+    }
+    return n;
+}
+
+/* Users of a department, by user id */
+long ud_scan_department(ud_db *db, const char *dept, void (*fn)(void *, unsigned long), void *arg) {
+    unsigned char k[UD_KEY_MAX], start[UD_KEY_MAX];
+    ud_cursor c;
+    long n;
+    int klen, slen;
+
+    slen = ud_strlen(dept, USER_DEPT_LEN);
+    memcpy(start, dept, (size_t)slen);
+    start[slen++] = '\0';
+    if (ud_seek(db, UD_BY_DEPARTMENT, start, slen, &c) != UD_OK) return -1;
+    for (n = 0; ud_next(&c, k, &klen, 0, 0) == 1 && klen == slen + 4 && memcmp(k, start, (size_t)slen) == 0; n++) {
+        if (fn) fn(arg, ud_get32(k + slen));
+    }
+    return n;
+}
+
+/* ---------- bulk load ---------- */
+
+typedef struct {
+    unsigned char key[UD_KEY_MAX];
+    unsigned char klen;
+    unsigned long ref;          /* user index, or child page on branch levels */
+} ud_sorted;
+
+static int ud_sorted_cmp(const void *a, const void *b) {
+    const ud_sorted *x = (const ud_sorted *)a, *y = (const ud_sorted *)b;
+    return ud_cmp(x->key, x->klen, y->key, y->klen);
+}
+
+static int ud_write_page(ud_db *db, unsigned long page, const unsigned char *p) {
+    return pwrite(db->fd, p, UD_PAGE, (off_t)page * UD_PAGE) == UD_PAGE ? UD_OK : UD_ERR_IO;
+}
+
+/*
+ * One level of a tree from sorted entries, packed to UD_FILL, pages
+ * written in order from db->pages. Leaves take their values from users;
+ * branches take child pages from e[].ref, the first child of each page
+ * becoming its link. Fills up[] with each page's first key and page
+ * number and returns how many pages were written.
+ */
+static long ud_bulk_level(ud_db *db, int index, int leaf, const ud_sorted *e, long n, const ud_user *users,
+                          ud_sorted *up, unsigned char *buf) {
+    ud_node *nd;
+    long i, pages;
+    int cost, plen, raw;
+
+    nd = db->node;
+    pages = 0;
+    i = 0;
+    while (i < n) {
+        nd->type = leaf ? UD_LEAF : UD_BRANCH;
+        nd->n = 0;
+        raw = 0;
+        up[pages].klen = e[i].klen;
+        memcpy(up[pages].key, e[i].key, e[i].klen);
+        up[pages].ref = db->pages;
+        if (!leaf) nd->link = e[i++].ref;
+        for (; i < n && nd->n < UD_NODE_MAX; i++) {
+            memcpy(nd->key[nd->n], e[i].key, e[i].klen);
+            nd->klen[nd->n] = e[i].klen;
+            if (leaf) nd->vlen[nd->n] = (unsigned char)ud_value(index, &users[e[i].ref], nd->val[nd->n]);
+            else nd->child[nd->n] = e[i].ref;
+            cost = 2 + (leaf ? 2 + nd->vlen[nd->n] : 5) + e[i].klen;
+            plen = ud_range_plen(nd, 0, nd->n + 1);
+            if (nd->n > 0 && UD_HEAD + plen + raw + cost - (nd->n + 1) * plen > UD_FILL) break;
+            raw += cost;
+            nd->n++;
+        }
+        /* a leaf's separator only has to clear the previous leaf's last key */
+        if (leaf && pages > 0) {
+            plen = ud_lcp(e[i - nd->n - 1].key, e[i - nd->n - 1].klen, up[pages].key, up[pages].klen) + 1;
+            if (plen < up[pages].klen) up[pages].klen = (unsigned char)plen;
+        }
+        ud_encode(nd, 0, nd->n, leaf && i < n ? db->pages + 1 : (leaf ? 0 : nd->link), buf);
+        if (ud_write_page(db, db->pages++, buf) != UD_OK) return -1;
+        pages++;
+    }
+    return pages;
+}
+
+/* Fill an empty directory with n users, sorted per index and built bottom-up past the pages in use */
+int ud_bulk_load(ud_db *db, const ud_user *users, long n) {
+    ud_sorted *e, *up;
+    unsigned char *buf;
+    long i, m;
+    int idx, rc;
+
+    if (db->users != 0) return UD_ERR_CORRUPT;
+    if (n == 0) return UD_OK;
+    e = (ud_sorted *)malloc(sizeof(ud_sorted) * (size_t)(n + 1));
+    up = (ud_sorted *)malloc(sizeof(ud_sorted) * (size_t)(n + 1));
+    buf = (unsigned char *)malloc(UD_PAGE);
+    if (!e || !up || !buf) return UD_ERR_IO;
+    ud_pool_clear(db);
+    rc = UD_OK;
+    for (idx = 0; idx < UD_INDEXES && rc == UD_OK; idx++) {
+        for (i = 0; i < n; i++) {
+            e[i].klen = (unsigned char)ud_key(idx, &users[i], e[i].key);
+            e[i].ref = (unsigned long)i;
+        }
+        qsort(e, (size_t)n, sizeof(ud_sorted), ud_sorted_cmp);
+        for (i = 1; i < n; i++) {
+            if (ud_sorted_cmp(&e[i - 1], &e[i]) == 0) rc = UD_ERR_DUPLICATE;
+        }
+        if (rc != UD_OK) break;
+        m = ud_bulk_level(db, idx, 1, e, n, users, up, buf);
+        while (m > 1) {
+            memcpy(e, up, sizeof(ud_sorted) * (size_t)m);
+            m = ud_bulk_level(db, idx, 0, e, m, users, up, buf);
+        }
+        if (m < 0) rc = UD_ERR_IO;
+        else if (m == 0) rc = UD_ERR_CORRUPT;
+        db->root[idx] = db->pages - 1;
+    }
+    free(e);
+    free(up);
+    free(buf);
+    if (rc == UD_OK && fsync(db->fd) != 0) rc = UD_ERR_IO;
+    if (rc != UD_OK) return rc;
+    /* the meta page goes last, so a crash before here leaves the empty directory */
+    db->users = (unsigned long)n;
+    ud_begin(db);
+    rc = ud_commit(db);
+    return rc;
+}
+#endif
+
+/* ========================= DOOR ACCESS SETS ========================= */
+
+#if defined(HOST_TOOLS)
+/*
+ * Who may open which door, on the central host: one set of user ids per
+ * group and per door, a door's set being the union of the groups it
+ * admits. Sets are compressed bitmaps in the Roaring layout. Ids are split
+ * by their high 16 bits into containers, kept sorted by that key, and
+ * each container holds the low 16 bits of its members as whichever
+ * takes least room:
+ *   - an array of sorted values, up to RB_ARRAY_MAX (2 bytes each)
+ *   - a bitmap of 65536 bits (8 KB)
+ *   - runs of consecutive values, start and length - 1 (4 bytes a run)
+ * Sparse sets (a role held by a few hundred people) stay arrays, whole
+ * departments enrolled in one batch become a handful of runs, and only
+ * scattered sets with thousands of members per container take bitmaps.
+ *
+ * A check is a binary search over the keys and one probe into the
+ * container. Intersection and union work container by container: arrays
+ * merge, runs merge, an array against anything else is intersected by
+ * lookups, and other pairs are done as 8 KB of bitmap words. rb_optimize
+ * picks the smallest form again afterwards.
+ */
+#define RB_ARRAY 1
+#define RB_BITMAP 2
+#define RB_RUN 3
+#define RB_ARRAY_MAX 4096
+#define RB_WORD_BITS ((int)(sizeof(unsigned long) * 8))
+#define RB_WORDS (65536 / RB_WORD_BITS)
+#define RB_BITMAP_BYTES 8192
+#define RB_FENCES 32            /* one cache line of fence keys per large container */
+
+typedef struct {
+    unsigned char type;         /* RB_ARRAY, RB_BITMAP, RB_RUN */
+    int card;
+    int n;                      /* array values, or runs */
+    int cap;
+    unsigned short *v;          /* array values, or start / length - 1 pairs */
+    unsigned long *w;           /* bitmap words */
+    int step;                   /* entries between fences, 0 when there are none */
+    unsigned short fence[RB_FENCES];
+} rb_container;
+
+typedef struct {
+    int n;
+    int cap;
+    unsigned short *keys;       /* high 16 bits of each container's members, ascending */
+    rb_container *c;
+} rb_set;
+
+static int rb_popcount(unsigned long w) {
+#if defined(__GNUC__)
+    return __builtin_popcountl(w);
+#else
+    int n;
+    for (n = 0; w; n++) w &= w - 1;
+    return n;
+#endif
+}
+
+/* Position of the lowest set bit of a non-zero word */
+static int rb_lowest(unsigned long w) {
+#if defined(__GNUC__)
+    return __builtin_ctzl(w);
+#else
+    int b;
+    for (b = 0; !(w & 1UL); b++) w >>= 1;
+    return b;
+#endif
+}
+
+void rb_init(rb_set *s) {
+    s->n = s->cap = 0;
+    s->keys = 0;
+    s->c = 0;
+}
+
+static void rb_container_free(rb_container *c) {
+    free(c->v);
+    free(c->w);
+    c->v = 0;
+    c->w = 0;
+}
+
+void rb_free(rb_set *s) {
+    int i;
+    for (i = 0; i < s->n; i++) rb_container_free(&s->c[i]);
+    free(s->keys);
+    free(s->c);
+    rb_init(s);
+}
+
+/* Index of the container for key, or -(insertion point) - 1 */
+static int rb_find(const rb_set *s, unsigned int key) {
+    int lo, hi, mid;
+    lo = 0;
+    hi = s->n - 1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (s->keys[mid] < key) lo = mid + 1;
+        else if (s->keys[mid] > key) hi = mid - 1;
+        else return mid;
+    }
+    return -lo - 1;
+}
+
+/* A new empty container at position i; NULL when out of memory */
+static rb_container *rb_insert_container(rb_set *s, int i, unsigned int key) {
+    rb_container *c;
+    unsigned short *k;
+    if (s->n == s->cap) {
+        k = (unsigned short *)realloc(s->keys, sizeof(unsigned short) * (size_t)(s->cap ? 2 * s->cap : 4));
+        if (!k) return 0;
+        s->keys = k;
+        c = (rb_container *)realloc(s->c, sizeof(rb_container) * (size_t)(s->cap ? 2 * s->cap : 4));
+        if (!c) return 0;
+        s->c = c;
+        s->cap = s->cap ? 2 * s->cap : 4;
+    }
+    memmove(s->keys + i + 1, s->keys + i, sizeof(unsigned short) * (size_t)(s->n - i));
+    memmove(s->c + i + 1, s->c + i, sizeof(rb_container) * (size_t)(s->n - i));
+    s->n++;
+    s->keys[i] = (unsigned short)key;
+    c = &s->c[i];
+    memset(c, 0, sizeof(*c));
+    c->type = RB_ARRAY;
+    return c;
+}
+
+static int rb_reserve(rb_container *c, int n) {
+    unsigned short *v;
+    int cap;
+    if (n <= c->cap) return 0;
+    cap = c->cap ? c->cap : 4;
+    while (cap < n) cap *= 2;
+    v = (unsigned short *)realloc(c->v, sizeof(unsigned short) * (size_t)cap);
+    if (!v) return -1;
+    c->v = v;
+    c->cap = cap;
+    return 0;
+}
+
+/* Index of the last of len entries (stride shorts apart) at or below low, 0 if none */
+static int rb_search(const unsigned short *v, int len, int stride, unsigned int low) {
+    const unsigned short *p;
+    int half;
+    p = v;
+    while (len > 1) {
+        half = len / 2;
+#if defined(__GNUC__)
+        __builtin_prefetch(p + stride * (half / 2));
+        __builtin_prefetch(p + stride * (half + half / 2));
+#endif
+        p = p[stride * half] <= low ? p + stride * half : p;
+        len -= half;
+    }
+    return (int)(p - v) / stride;
+}
+
+/*
+ * Arrays and runs are searched without a data-dependent branch (the step
+ * becomes a conditional move, both next probes are prefetched), and a
+ * container with fences first looks in its own line of fence keys so the
+ * search through v covers one short segment: two or three dependent cache
+ * misses for a badge check instead of one per level.
+ */
+static int rb_container_contains(const rb_container *c, unsigned int low) {
+    const unsigned short *p;
+    int len, i, stride;
+    if (c->type == RB_BITMAP) return (int)((c->w[low / RB_WORD_BITS] >> (low % RB_WORD_BITS)) & 1UL);
+    if (c->n == 0) return 0;
+    stride = c->type == RB_RUN ? 2 : 1;
+    p = c->v;
+    len = c->n;
+    if (c->step) {
+        i = rb_search(c->fence, (c->n + c->step - 1) / c->step, 1, low);
+        p += stride * i * c->step;
+        len = c->n - i * c->step < c->step ? c->n - i * c->step : c->step;
+    }
+    p += stride * rb_search(p, len, stride, low);
+    if (c->type == RB_ARRAY) return *p == low;
+    return p[0] <= low && low <= (unsigned int)p[0] + p[1];
+}
+
+/* Fence keys for a large array or run container: every step-th first value */
+static void rb_fence(rb_container *c) {
+    int i;
+    c->step = 0;
+    if (c->type == RB_BITMAP || c->n <= RB_FENCES) return;
+    c->step = (c->n + RB_FENCES - 1) / RB_FENCES;
+    for (i = 0; i * c->step < c->n; i++) c->fence[i] = c->v[(c->type == RB_RUN ? 2 : 1) * i * c->step];
+}
+
+int rb_contains(const rb_set *s, unsigned long x) {
+    int i;
+    i = rb_find(s, (unsigned int)(x >> 16));
+    return i >= 0 && rb_container_contains(&s->c[i], (unsigned int)(x & 0xFFFF));
+}
+
+/* The container as 65536 bits */
+static void rb_to_words(const rb_container *c, unsigned long *w) {
+    unsigned int v, end;
+    int i;
+    if (c->type == RB_BITMAP) {
+        memcpy(w, c->w, RB_BITMAP_BYTES);
+        return;
+    }
+    memset(w, 0, RB_BITMAP_BYTES);
+    if (c->type == RB_ARRAY) {
+        for (i = 0; i < c->n; i++) w[c->v[i] / RB_WORD_BITS] |= 1UL << (c->v[i] % RB_WORD_BITS);
+        return;
+    }
+    for (i = 0; i < c->n; i++) {
+        end = (unsigned int)c->v[2 * i] + c->v[2 * i + 1];
+        for (v = c->v[2 * i]; v <= end; v++) {
+            if (v % RB_WORD_BITS == 0 && v + RB_WORD_BITS - 1 <= end) {
+                w[v / RB_WORD_BITS] = ~0UL;
+                v += RB_WORD_BITS - 1;
+            } else {
+                w[v / RB_WORD_BITS] |= 1UL << (v % RB_WORD_BITS);
+            }
+        }
+    }
+}
+
+/* Fill c (emptied first) from bits, as an array or a bitmap by cardinality */
+static int rb_from_words(rb_container *c, const unsigned long *w) {
+    unsigned long x;
+    int i, card;
+    card = 0;
+    for (i = 0; i < RB_WORDS; i++) card += rb_popcount(w[i]);
+    free(c->v);
+    free(c->w);
+    c->v = 0;
+    c->w = 0;
+    c->n = c->cap = 0;
+    c->card = card;
+    c->step = 0;
+    if (card > RB_ARRAY_MAX) {
+        c->type = RB_BITMAP;
+        c->w = (unsigned long *)malloc(RB_BITMAP_BYTES);
+        if (!c->w) return -1;
+        memcpy(c->w, w, RB_BITMAP_BYTES);
+        return 0;
+    }
+    c->type = RB_ARRAY;
+    if (rb_reserve(c, card > 0 ? card : 1) != 0) return -1;
+    for (i = 0; i < RB_WORDS; i++) {
+        for (x = w[i]; x != 0; x &= x - 1) c->v[c->n++] = (unsigned short)(i * RB_WORD_BITS + rb_lowest(x));
+    }
+    return 0;
+}
+
+int rb_add(rb_set *s, unsigned long x) {
+    static unsigned long w[RB_WORDS];
+    rb_container *c;
+    unsigned int low;
+    int i, j;
+
+    i = rb_find(s, (unsigned int)(x >> 16));
+    if (i < 0) {
+        c = rb_insert_container(s, -i - 1, (unsigned int)(x >> 16));
+        if (!c) return -1;
+    } else {
+        c = &s->c[i];
+    }
+    low = (unsigned int)(x & 0xFFFF);
+    if (rb_container_contains(c, low)) return 0;
+    c->step = 0;
+    if (c->type == RB_ARRAY && c->n < RB_ARRAY_MAX) {
+        if (rb_reserve(c, c->n + 1) != 0) return -1;
+        /* ids mostly arrive in order: look from the end */
+        for (j = c->n; j > 0 && c->v[j - 1] > low; j--) {
+        }
+        memmove(c->v + j + 1, c->v + j, sizeof(unsigned short) * (size_t)(c->n - j));
+        c->v[j] = (unsigned short)low;
+        c->n++;
+        c->card++;
+        return 0;
+    }
+    if (c->type != RB_BITMAP) {
+        rb_to_words(c, w);
+        w[low / RB_WORD_BITS] |= 1UL << (low % RB_WORD_BITS);
+        return rb_from_words(c, w);
+    }
+    c->w[low / RB_WORD_BITS] |= 1UL << (low % RB_WORD_BITS);
+    c->card++;
+    return 0;
+}
+
+long rb_cardinality(const rb_set *s) {
+    long n;
+    int i;
+    for (n = 0, i = 0; i < s->n; i++) n += s->c[i].card;
+    return n;
+}
+
+/* Heap bytes held by the set */
+unsigned long rb_bytes(const rb_set *s) {
+    unsigned long b;
+    int i;
+    b = (sizeof(rb_container) + sizeof(unsigned short)) * (unsigned long)s->cap;
+    for (i = 0; i < s->n; i++) {
+        if (s->c[i].type == RB_BITMAP) b += RB_BITMAP_BYTES;
+        else b += sizeof(unsigned short) * (unsigned long)s->c[i].cap;
+    }
+    return b;
+}
+
+static int rb_count_runs(const unsigned long *w) {
+    unsigned long carry;
+    int i, runs;
+    runs = 0;
+    carry = 0;
+    for (i = 0; i < RB_WORDS; i++) {
+        runs += rb_popcount(w[i] & ~((w[i] << 1) | carry));
+        carry = w[i] >> (RB_WORD_BITS - 1);
+    }
+    return runs;
+}
+
+/* Store every container in its smallest form */
+int rb_optimize(rb_set *s) {
+    static unsigned long w[RB_WORDS];
+    rb_container *c;
+    const unsigned long *bits;
+    unsigned short *p;
+    unsigned int v;
+    int i, k, b, runs, in;
+
+    for (i = 0; i < s->n; i++) {
+        c = &s->c[i];
+        if (c->type == RB_RUN) {
+            runs = c->n;
+        } else if (c->type == RB_ARRAY) {
+            for (runs = c->n > 0, k = 1; k < c->n; k++) runs += c->v[k] != c->v[k - 1] + 1;
+        } else {
+            runs = rb_count_runs(c->w);
+        }
+        if (4 * runs >= (c->card <= RB_ARRAY_MAX ? 2 * c->card : RB_BITMAP_BYTES)) {
+            if (c->type == RB_RUN) {
+                rb_to_words(c, w);
+                if (rb_from_words(c, w) != 0) return -1;
+            }
+        } else if (c->type == RB_ARRAY) {
+            p = (unsigned short *)malloc(sizeof(unsigned short) * (size_t)(2 * runs));
+            if (!p) return -1;
+            for (b = 0, k = 0; k < c->n; k++) {
+                if (k > 0 && c->v[k] == c->v[k - 1] + 1) {
+                    p[2 * b - 1]++;
+                } else {
+                    p[2 * b] = c->v[k];
+                    p[2 * b + 1] = 0;
+                    b++;
+                }
+            }
+            free(c->v);
+            c->v = p;
+            c->cap = 2 * runs;
+            c->n = runs;
+            c->type = RB_RUN;
+        } else if (c->type == RB_BITMAP) {
+            bits = c->w;
+            c->n = c->cap = 0;
+            c->v = 0;
+            if (rb_reserve(c, 2 * runs) != 0) return -1;
+            in = 0;
+            for (k = 0; k < RB_WORDS; k++) {
+                /* whole words of zeros outside a run, or ones inside one */
+                if (bits[k] == (in ? ~0UL : 0UL)) {
+                    if (in) c->v[2 * c->n + 1] = (unsigned short)((k + 1) * RB_WORD_BITS - 1 - c->v[2 * c->n]);
+                    continue;
+                }
+                for (b = 0; b < RB_WORD_BITS; b++) {
+                    v = (unsigned int)(k * RB_WORD_BITS + b);
+                    if ((bits[k] >> b) & 1UL) {
+                        if (!in) {
+                            c->v[2 * c->n] = (unsigned short)v;
+                            in = 1;
+                        }
+                        c->v[2 * c->n + 1] = (unsigned short)(v - c->v[2 * c->n]);
+                    } else if (in) {
+                        c->n++;
+                        in = 0;
+                    }
+                }
+            }
+            if (in) c->n++;
+            free(c->w);
+            c->w = 0;
+            c->type = RB_RUN;
+        }
+        /* give back the slack left by growth and merges */
+        k = c->type == RB_RUN ? 2 * c->n : c->type == RB_ARRAY ? c->n : 0;
+        if (c->v && k > 0 && k < c->cap) {
+            p = (unsigned short *)realloc(c->v, sizeof(unsigned short) * (size_t)k);
+            if (p) {
+                c->v = p;
+                c->cap = k;
+            }
+        }
+        rb_fence(c);
+    }
+    return 0;
+}
+
+static int rb_copy_container(rb_container *to, const rb_container *from) {
+    *to = *from;
+    to->v = 0;
+    to->w = 0;
+    to->cap = 0;
+    if (from->type == RB_BITMAP) {
+        to->w = (unsigned long *)malloc(RB_BITMAP_BYTES);
+        if (!to->w) return -1;
+        memcpy(to->w, from->w, RB_BITMAP_BYTES);
+        return 0;
+    }
+    if (rb_reserve(to, from->type == RB_RUN ? 2 * from->n : from->n) != 0) return -1;
+    memcpy(to->v, from->v, sizeof(unsigned short) * (size_t)(from->type == RB_RUN ? 2 * from->n : from->n));
+    return 0;
+}
+
+/* Runs of a and b intersected (op 0) or joined (op 1) into c, reserved for both */
+static void rb_run_merge(rb_container *c, const rb_container *a, const rb_container *b, int op) {
+    unsigned int as, ae, bs, be, last;
+    int i, j;
+    c->type = RB_RUN;
+    c->n = c->card = 0;
+    for (i = j = 0; i < a->n || j < b->n;) {
+        if (!op && (i >= a->n || j >= b->n)) break;
+        as = ae = bs = be = 0;
+        if (i < a->n) {
+            as = a->v[2 * i];
+            ae = as + a->v[2 * i + 1];
+        }
+        if (j < b->n) {
+            bs = b->v[2 * j];
+            be = bs + b->v[2 * j + 1];
+        }
+        if (!op) {
+            /* the overlap, then step past whichever run ends first */
+            if ((as > bs ? as : bs) <= (ae < be ? ae : be)) {
+                c->v[2 * c->n] = (unsigned short)(as > bs ? as : bs);
+                c->v[2 * c->n + 1] = (unsigned short)((ae < be ? ae : be) - c->v[2 * c->n]);
+                c->card += c->v[2 * c->n + 1] + 1;
+                c->n++;
+            }
+            if (ae < be) i++;
+            else j++;
+            continue;
+        }
+        if (j >= b->n || (i < a->n && as <= bs)) {
+            i++;
+        } else {
+            as = bs;
+            ae = be;
+            j++;
+        }
+        last = c->n > 0 ? (unsigned int)c->v[2 * c->n - 2] + c->v[2 * c->n - 1] : 0;
+        if (c->n > 0 && as <= last + 1) {
+            if (ae > last) {
+                c->card += (int)(ae - last);
+                c->v[2 * c->n - 1] = (unsigned short)(ae - c->v[2 * c->n - 2]);
+            }
+        } else {
+            c->v[2 * c->n] = (unsigned short)as;
+            c->v[2 * c->n + 1] = (unsigned short)(ae - as);
+            c->card += (int)(ae - as) + 1;
+            c->n++;
+        }
+    }
+}
+
+/* Append a container for key to out, built by op (0 and, 1 or) of a and b */
+static int rb_combine(rb_set *out, unsigned int key, const rb_container *a, const rb_container *b, int op) {
+    static unsigned long wa[RB_WORDS], wb[RB_WORDS];
+    const rb_container *t;
+    rb_container *c;
+    int i, j, k;
+
+    c = rb_insert_container(out, out->n, key);
+    if (!c) return -1;
+    if (a->type == RB_ARRAY && b->type == RB_ARRAY && (op == 0 || a->n + b->n <= RB_ARRAY_MAX)) {
+        if (rb_reserve(c, op == 0 ? (a->n < b->n ? a->n : b->n) + 1 : a->n + b->n) != 0) return -1;
+        for (i = j = k = 0; i < a->n && j < b->n;) {
+            if (a->v[i] == b->v[j]) {
+                c->v[k++] = a->v[i++];
+                j++;
+            } else if (a->v[i] < b->v[j]) {
+                if (op) c->v[k++] = a->v[i];
+                i++;
+            } else {
+                if (op) c->v[k++] = b->v[j];
+                j++;
+            }
+        }
+        for (; op && i < a->n; i++) c->v[k++] = a->v[i];
+        for (; op && j < b->n; j++) c->v[k++] = b->v[j];
+        c->n = c->card = k;
+    } else if (a->type == RB_RUN && b->type == RB_RUN) {
+        if (rb_reserve(c, 2 * (a->n + b->n)) != 0) return -1;
+        rb_run_merge(c, a, b, op);
+    } else if (op == 0 && (a->type == RB_ARRAY || b->type == RB_ARRAY)) {
+        if (b->type == RB_ARRAY) {
+            t = a;
+            a = b;
+            b = t;
+        }
+        if (rb_reserve(c, a->n + 1) != 0) return -1;
+        for (i = k = 0; i < a->n; i++) {
+            if (rb_container_contains(b, a->v[i])) c->v[k++] = a->v[i];
+        }
+        c->n = c->card = k;
+    } else {
+        rb_to_words(a, wa);
+        rb_to_words(b, wb);
+        for (i = 0; i < RB_WORDS; i++) wa[i] = op ? wa[i] | wb[i] : wa[i] & wb[i];
+        if (rb_from_words(c, wa) != 0) return -1;
+    }
+    if (c->card == 0) {
+        rb_container_free(c);
+        out->n--;
+    }
+    return 0;
+}
+
+/* out = a AND b (op 0) or a OR b (op 1); out must be empty */
+static int rb_merge(rb_set *out, const rb_set *a, const rb_set *b, int op) {
+    rb_container *c;
+    int i, j;
+    i = j = 0;
+    while (i < a->n || j < b->n) {
+        if (i < a->n && j < b->n && a->keys[i] == b->keys[j]) {
+            if (rb_combine(out, a->keys[i], &a->c[i], &b->c[j], op) != 0) return -1;
+            i++;
+            j++;
+            continue;
+        }
+        if (j >= b->n || (i < a->n && a->keys[i] < b->keys[j])) {
+            if (op) {
+                c = rb_insert_container(out, out->n, a->keys[i]);
+                if (!c || rb_copy_container(c, &a->c[i]) != 0) return -1;
+            }
+            i++;
+        } else {
+            if (op) {
+                c = rb_insert_container(out, out->n, b->keys[j]);
+                if (!c || rb_copy_container(c, &b->c[j]) != 0) return -1;
+            }
+            j++;
+        }
+    }
+    return 0;
+}
+
+int rb_and(rb_set *out, const rb_set *a, const rb_set *b) {
+    return rb_merge(out, a, b, 0);
+}
+
+int rb_or(rb_set *out, const rb_set *a, const rb_set *b) {
+    return rb_merge(out, a, b, 1);
+}
+
+/* A door's set from the groups it admits: the union, stored compactly */
+int acl_resolve(rb_set *door, const rb_set *groups, const int *admit, int n) {
+    rb_set acc, next;
+    int k;
+    rb_init(&acc);
+    for (k = 0; k < n; k++) {
+        rb_init(&next);
+        if (rb_or(&next, &acc, &groups[admit[k]]) != 0) {
+            rb_free(&next);
+            rb_free(&acc);
+            return -1;
+        }
+        rb_free(&acc);
+        acc = next;
+    }
+    if (rb_optimize(&acc) != 0) {
+        rb_free(&acc);
+        return -1;
+    }
+    *door = acc;
+    return 0;
+}
+#endif
+
+/* ========================= DECISION CACHE ========================= */
+
+#if defined(HOST_TOOLS)
+/*
+ * Decisions remembered per door by (user, hour) for a controller serving
+ * many doors, where a full evaluation (validity, revocation, clearance,
+ * schedule and the door's groups) costs far more than a lookup. The hour
+ * is the schedule slot, so schedule windows never need invalidating.
+ *
+ * A cached decision carries the generations it was made under, and a
+ * change bumps exactly one counter:
+ *   - user_generation: schedules, attaching tables, a wrapped user gen
+ *   - the door's generation (dc_door_changed): its groups or clearance
+ *   - the user's gen in user_hot (user_touch): the record, revocation,
+ *     validity, expiry flips in user_sweep, group membership
+ * The first two only grow, so their sum is stored as one stamp that moves
+ * whenever either does. Invalidation is O(1) and never scans: stale
+ * entries fail to match and are overwritten.
+ */
+#define DC_WAYS 4
+
+/* 16 bytes, so a set is one cache line; hour and stamp are kept modulo 2^32 */
+typedef struct {
+    int uid;                    /* -1 for an empty way */
+    unsigned int hour;          /* now / 3600 when decided */
+    unsigned int stamp;         /* user_generation + the door's generation */
+    unsigned char gen;          /* the user's gen */
+    signed char result;
+} dc_entry;
+
+typedef int (*dc_eval_fn)(void *arg, int door, int uid, unsigned long now_s);
+
+typedef struct {
+    int doors;
+    int sets;                   /* per door, a power of two */
+    dc_entry *e;                /* doors * sets * DC_WAYS */
+    unsigned long *door_gen;
+    unsigned long hits, misses, stale; /* stale: found, but made under older generations */
+} dc_cache;
+
+/* Room for about per_door decisions at each of doors doors */
+int dc_init(dc_cache *c, int doors, int per_door) {
+    long i;
+    memset(c, 0, sizeof(*c));
+    for (c->sets = 1; c->sets * DC_WAYS < per_door; c->sets *= 2) {
+    }
+    c->doors = doors;
+    c->e = (dc_entry *)malloc(sizeof(dc_entry) * (size_t)doors * (size_t)c->sets * DC_WAYS);
+    c->door_gen = (unsigned long *)calloc((size_t)doors, sizeof(unsigned long));
+    if (!c->e || !c->door_gen) return -1;
+    for (i = 0; i < (long)doors * c->sets * DC_WAYS; i++) c->e[i].uid = -1;
+    return 0;
+}
+
+void dc_free(dc_cache *c) {
+    free(c->e);
+    free(c->door_gen);
+    c->e = 0;
+    c->door_gen = 0;
+}
+
+/* The door's groups or clearance changed */
+void dc_door_changed(dc_cache *c, int door) {
+    c->door_gen[door]++;
+}
+
+/*
+ * The decision for uid at door, from the cache or from eval. Generations
+ * are read before eval runs, so a change made during it leaves the entry
+ * stale rather than wrong.
+ */
+int dc_decide(dc_cache *c, int door, int uid, unsigned long now_s, dc_eval_fn eval, void *arg) {
+    dc_entry *set, *victim;
+    unsigned int hour, stamp;
+    unsigned char gen;
+    int w, r;
+
+    if (uid < 0 || uid >= user_count) return eval(arg, door, uid, now_s);
+    user_refresh(now_s);
+    hour = (unsigned int)(now_s / 3600UL);
+    stamp = (unsigned int)(user_generation + c->door_gen[door]);
+    gen = user_hot_tab[uid].gen;
+    w = (int)(card_mix((unsigned long)uid ^ ((unsigned long)hour << 20)) & (unsigned long)(c->sets - 1));
+    set = c->e + ((long)door * c->sets + w) * DC_WAYS;
+    victim = 0;
+    for (w = 0; w < DC_WAYS; w++) {
+        if (set[w].uid == uid && set[w].hour == hour) {
+            if (set[w].stamp == stamp && set[w].gen == gen) {
+                c->hits++;
+                return set[w].result;
+            }
+            c->stale++;
+            victim = &set[w];
+            break;
+        }
+        /* an empty way or one from an earlier hour goes first */
+        if (!victim && (set[w].uid < 0 || set[w].hour != hour)) victim = &set[w];
+    }
+    if (!victim) victim = &set[c->misses % DC_WAYS];
+    c->misses++;
+    r = eval(arg, door, uid, now_s);
+    victim->uid = uid;
+    victim->hour = hour;
+    victim->stamp = stamp;
+    victim->gen = gen;
+    victim->result = (signed char)r;
+    return r;
+}
+#endif
+
+/* Globals */
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE)
+/* templates by user id; place in external RAM on target builds */
+static fp_template fp_gallery_store[MAX_USERS];
+static unsigned char fp_gallery_slot_used[MAX_USERS];
+#endif
+#if defined(FP_CONTROLLER_MATCH)
+static unsigned char fp_zone_mask_store[MAX_USERS];
+static int fp_zone_id_store[FP_ZONES * MAX_USERS];
+#endif
+static char entered_password[PASSWORD_MAX_LEN + 1];
+#if defined(USER_FLASH)
+static const char *stored_password;  /* straight into the user store */
+#else
+static char stored_password_buf[PASSWORD_MAX_LEN + 1];
+static const char *stored_password = stored_password_buf;
+static store_dev *user_dev = &store_eeprom; /* where the password slots live */
+#endif
+static char rfid_card_string[CARD_ID_LEN + 1];
+static unsigned char door_policy = DOOR_POLICY;
+static int door_session;        /* a user is between card and decision */
+#if defined(USER_FLASH)
+static unsigned long door_quiet_from; /* timer_now_us() when the last card was dealt with */
+#endif
+#if defined(RFID_OSDP)
+static int card_reader;         /* bus address of the reader that sent the card */
+#endif
+
+/* Prototypes */
+static int access_control_loop(void);
+#if !(defined(RFID_WIEGAND) || defined(RFID_OSDP)) || defined(HOST_TOOLS)
+static int rfid_parse_frame(const unsigned char *raw, int len, char *card_buf);
+#endif
+static int card_to_user_id(const char *card);
+static const char *user_deny_text(int admit);
+static int password_matches(const char *entered, const char *stored);
+static void format_attempt_msg(char *msg, const char *prompt, int attempt, int max_attempts);
+static int check_rfid_and_get_userid(char *card_buf);
+#if defined(TOKEN_AUTH)
+static int check_token_and_get_userid(void);
+#endif
+static int load_stored_password(unsigned char user_id);
+static int verify_password_for_user(unsigned char user_id);
+static int sequential_factors(unsigned char user_id, unsigned char *matched_id);
+static int concurrent_factors(unsigned char user_id, unsigned char *matched_id);
+static int do_fingerprint_search(unsigned char *matched_id);
+static int do_fingerprint_verify(unsigned char user_id, unsigned char *matched_id);
+static void door_open_sequence(void);
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE)
+static void fp_store_load(void);
+#endif
+#if !defined(HOST_POSIX)
+static void metrics_uart_dump(void);
+#endif
+#if defined(HOST_POSIX)
+static int replay_open(const char *path);
+#endif
+#if defined(MGMT_UART)
+void mgmt_start(void);
+void mgmt_service(int budget);
+#endif
+#if defined(FW_UPDATE)
+static void fw_locate(void);
+#endif
+#if defined(USER_FLASH)
+static unsigned long door_quiet_ms(void);
+static void door_background(void);
+#endif
+
+/* Main */
+#if !defined(HOST_TOOLS)
+int main(void) {
+    return access_control_loop();
+}
+#endif
+
+/* Door controller super-loop */
+static int access_control_loop(void) {
+    unsigned char matched_fp_id = 0xFF;
+    unsigned int sessions = 0;
+
+    /* Init */
+    lcd_init();
+    uart0_init(9600);
+    keypad_init();
+    i2c_init();
+    eeprom_init();
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE)
+    fp_eeprom_init();
+#endif
+#if defined(USER_FLASH)
+    ustore_mount();
+#endif
+#if defined(CARD_MPH)
+    card_index_init(&card_mph_shipped);
+#endif
+#if defined(RFID_OSDP)
+    uart1_rs485_init(OSDP_BAUD);
+#else
+    rfid_init();
+#endif
+#if defined(RFID_WIEGAND)
+    wiegand_init();
+#endif
+    fingerprint_init();
+    motor_init();
+    timer_init();
+    rtc_init();
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE)
+    fp_gallery_attach(fp_gallery_store, fp_gallery_slot_used, MAX_USERS);
+#endif
+#if defined(FP_CONTROLLER_MATCH)
+    fp_gallery_attach_zones(fp_zone_mask_store, fp_zone_id_store);
+#endif
+#if defined(FP_SLOT_CACHE)
+    fp_cache_init(FP_MODULE_SLOTS);
+#endif
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE)
+    fp_store_load();
+#endif
+#if defined(TOKEN_AUTH)
+    token_set_issuer(0, token_build_issuer);
+#endif
+#if defined(FW_UPDATE)
+    fw_locate();
+    fw_confirm();
+#endif
+#if defined(MGMT_UART)
+    mgmt_start();
+#endif
+#if defined(USER_FLASH)
+    delay_hook = door_background;
+#endif
+#if defined(HOST_POSIX) && !defined(USER_FLASH)
+    if (getenv("MLSAS_STORE") && (user_dev = store_open(getenv("MLSAS_STORE"))) == 0) {
+        uart0_send_string("store not available, using EEPROM");
+        user_dev = &store_eeprom;
+    }
+#endif
+#if defined(HOST_POSIX)
+    if (getenv("MLSAS_PROFILE") && prof_load(getenv("MLSAS_PROFILE")) != 0) {
+        uart0_send_string("latency profile not readable");
+    }
+    if (getenv("MLSAS_REPLAY") && replay_open(getenv("MLSAS_REPLAY")) != 0) {
+        uart0_send_string("replay trace not readable");
+    }
+#endif
+#if defined(HOST_POSIX) && defined(METRICS_HTTP)
+    if (metrics_server_start() != 0) uart0_send_string("metrics server failed");
+#endif
+
+    lcd_clear();
+    lcd_puts("Multi-Level Security\nSystem Ready");
+
+    while (1) {
+        int outcome, uid, source, admit;
+        unsigned long t0;
+
+#if defined(USER_FLASH)
+        if (door_session || rfid_card_string[0] != '\0') door_quiet_from = timer_now_us();
+#endif
+        /* Clear card buffer */
+        {
+            int k;
+            for (k = 0; k < CARD_ID_LEN; k++) rfid_card_string[k] = '\0';
+        }
+
+#if defined(FP_SLOT_CACHE)
+        fp_cache_prefetch_hot();
+#endif
+        door_session = 0;
+#if defined(MGMT_UART)
+        mgmt_service(MGMT_BUDGET_IDLE);
+#endif
+#if defined(USER_FLASH)
+        {
+            int k;
+            for (k = 0; k < USTORE_STEPS_IDLE && ustore_service(door_quiet_ms()) == USTORE_PAGE; k++) {
+            }
+        }
+#endif
+        lcd_clear();
+        lcd_puts("Place RFID card...");
+
+        sessions++;
+#if !defined(HOST_POSIX)
+        if (sessions % METRICS_DUMP_EVERY == 0) metrics_uart_dump();
+#endif
+        t0 = timer_now_us();
+        uid = -1;
+        source = ACCESS_SRC_CARD;
+#if defined(TOKEN_AUTH)
+        /* a signed token stands in for the card; PIN and finger still follow */
+        uid = check_token_and_get_userid();
+        if (uid >= 0) {
+            source = ACCESS_SRC_TOKEN;
+            metrics_observe_us(MET_STAGE_TOKEN, timer_now_us() - t0);
+        } else if (uid == -1) {
+            metrics_add(MET_DENY_TOKEN, 1);
+            access_log_append(-1, MET_DENY_TOKEN, ACCESS_SRC_TOKEN);
+            delay_ms(500);
+            continue;
+        }
+#endif
+        if (uid >= 0 || check_rfid_and_get_userid(rfid_card_string) == 0) {
+            unsigned char user_id;
+            if (uid < 0) {
+                metrics_observe_us(MET_STAGE_RFID, timer_now_us() - t0);
+                uid = card_to_user_id(rfid_card_string);
+            }
+            /* validity windows and schedules mean nothing until the clock has been set */
+            if (!rtc_is_set() && user_needs_clock(uid)) admit = USER_DENY_CLOCK;
+            else admit = user_admit(uid, DOOR_CLEARANCE, rtc_now_seconds());
+            if (admit != USER_OK) {
+                metrics_add(MET_DENY_CARD, 1);
+                access_log_append(uid, MET_DENY_CARD, source);
+                user_note(uid, 0, rtc_now_seconds());
+#if defined(RFID_OSDP)
+                osdp_feedback(card_reader, 0);
+#endif
+                lcd_clear();
+                lcd_puts(user_deny_text(admit));
+                delay_ms(1500);
+                continue;
+            }
+            user_id = (unsigned char)uid;
+            door_session = 1;
+#if defined(FP_SLOT_CACHE)
+            /* get the template into a sensor slot while the PIN is typed, a packet per key scan */
+            fp_cache_note_badge(uid);
+            metrics_add(fp_cache_resident(uid) ? MET_FP_SLOT_HITS : MET_FP_SLOT_MISSES, 1);
+            fp_cache_begin(uid);
+#endif
+
+            t0 = timer_now_us();
+            outcome = (door_policy & DOOR_POLICY_CONCURRENT) ? concurrent_factors(user_id, &matched_fp_id)
+                                                             : sequential_factors(user_id, &matched_fp_id);
+            metrics_observe_us(MET_STAGE_FACTORS, timer_now_us() - t0);
+            access_log_append(uid, outcome, source);
+            user_note(uid, outcome == MET_GRANTS, rtc_now_seconds());
+            if (outcome != MET_GRANTS) {
+                metrics_add(outcome, 1);
+#if defined(RFID_OSDP)
+                osdp_feedback(card_reader, 0);
+#endif
+                continue;
+            }
+
+            /* Access granted */
+            metrics_add(MET_GRANTS, 1);
+#if defined(RFID_OSDP)
+            osdp_feedback(card_reader, 1);
+#endif
+            lcd_clear();
+            lcd_puts("All 3 Levels OK\nOpening Door");
+            t0 = timer_now_us();
+            door_open_sequence();
+            metrics_observe_us(MET_STAGE_DOOR, timer_now_us() - t0);
+            delay_ms(1000);
+        } else {
+            metrics_add(MET_DENY_RFID, 1);
+        }
+
+        delay_ms(500);
+    }
+
+    /* unreachable */
+    return 0;
+}
+
+/* ========== helper functions ========== */
+
+#if !(defined(RFID_WIEGAND) || defined(RFID_OSDP)) || defined(HOST_TOOLS)
+/* Validate an STX ... ETX frame and extract its payload string */
+static int rfid_parse_frame(const unsigned char *raw, int len, char *card_buf) {
+    int i, j;
+
+    if (len != CARD_ID_LEN) return -1;
+    if (raw[0] != 0x02 || raw[CARD_ID_LEN - 1] != 0x03) return -1;
+
+    /* extract payload bytes 1 .. CARD_ID_LEN-2 */
+    j = 0;
+    for (i = 1; i < CARD_ID_LEN - 1 && j < CARD_ID_LEN - 2; i++, j++) {
+        card_buf[j] = (char)raw[i];
+    }
+    card_buf[j] = '\0';
+    return 0;
+}
+#endif
+
+/* Read RFID framed packet and extract payload string */
+#if defined(RFID_WIEGAND)
+static int check_rfid_and_get_userid(char *card_buf) {
+    wg_frame f;
+    unsigned int waited;
+
+#if defined(HOST_POSIX)
+    wiegand_stub_present_card();
+#endif
+    for (waited = 0; waited < 20000; waited += WG_POLL_MS) {
+        wiegand_poll(timer_now_us());
+        if (wiegand_read_frame(&f)) {
+            if (!f.ok || f.facility != WG_SITE_FACILITY) return -1;
+            sprintf(card_buf, "%lu", f.card);
+            return 0;
+        }
+        delay_ms(WG_POLL_MS);
+    }
+    return -1;
+}
+#elif defined(RFID_OSDP)
+static int check_rfid_and_get_userid(char *card_buf) {
+    wg_frame f;
+    unsigned int waited;
+
+#if defined(HOST_POSIX)
+    osdp_stub_armed = 1;
+#endif
+    for (waited = 0; waited < 20000; waited += WG_POLL_MS) {
+        osdp_service(timer_now_us());
+        if (wiegand_read_frame(&f)) {
+            card_reader = f.reader;
+            if (!f.ok || f.facility != WG_SITE_FACILITY) return -1;
+            sprintf(card_buf, "%lu", f.card);
+            return 0;
+        }
+        delay_ms(WG_POLL_MS);
+    }
+    return -1;
+}
+#else
+static int check_rfid_and_get_userid(char *card_buf) {
+    unsigned char raw[CARD_ID_LEN];
+    int rc;
+
+    rc = rfid_read_blocking(raw, CARD_ID_LEN, 20000);
+    return rfid_parse_frame(raw, rc, card_buf);
+}
+#endif
+
+#if defined(TOKEN_AUTH)
+/* Poll the token relay: user id, -2 if no token is waiting, -1 if it was refused */
+static int check_token_and_get_userid(void) {
+    unsigned char tok[TOKEN_LEN + 1];
+    token_body b;
+    int len, rc;
+
+    len = uart0_read_token(tok, sizeof(tok));
+    if (len == 0) return -2;
+    rc = rtc_is_set() ? token_check(tok, len, DOOR_ZONE, rtc_now_seconds(), &b) : TOKEN_EXPIRED;
+    if (rc == TOKEN_OK && b.user < MAX_USERS) return b.user;
+    lcd_clear();
+    if (!rtc_is_set()) lcd_puts("Clock not set\nAccess Denied");
+    else if (rc == TOKEN_EXPIRED) lcd_puts("Token expired\nAccess Denied");
+    else if (rc == TOKEN_WRONG_ZONE) lcd_puts("Token not valid here\nAccess Denied");
+    else lcd_puts("Token rejected\nAccess Denied");
+    delay_ms(1500);
+    return -1;
+}
+#endif
+
+/* Map a card payload to a user id, -1 if the card is not registered */
+static int card_to_user_id(const char *card) {
+#if defined(CARD_MPH)
+    unsigned long n;
+    char *end;
+    n = strtoul(card, &end, 10);
+    if (end == card || *end != '\0') return -1;
+    return card_lookup(n);
+#else
+    int uid;
+    uid = (unsigned char)atoi(card);
+    if (uid >= MAX_USERS) return -1;
+    return uid;
+#endif
+}
+
+/* LCD text for a USER_DENY_* code */
+static const char *user_deny_text(int admit) {
+    switch (admit) {
+    case USER_DENY_REVOKED:
+        return "Card revoked\nAccess Denied";
+    case USER_DENY_EXPIRED:
+        return "Card not valid\nnow: Denied";
+    case USER_DENY_CLEARANCE:
+        return "Clearance too low\nAccess Denied";
+    case USER_DENY_SCHEDULE:
+        return "Outside schedule\nAccess Denied";
+    case USER_DENY_CLOCK:
+        return "Clock not set\nAccess Denied";
+    default:
+        return "Card not registered\nAccess Denied";
+    }
+}
+
+/* Compare keypad input against the stored password */
+static int password_matches(const char *entered, const char *stored) {
+    return strncmp(entered, stored, PASSWORD_MAX_LEN) == 0;
+}
+
+/* Two-line LCD prompt with attempt counter */
+static void format_attempt_msg(char *msg, const char *prompt, int attempt, int max_attempts) {
+    sprintf(msg, "%s\nAttempt %d/%d", prompt, attempt, max_attempts);
+}
+
+/* Verify password for user by reading EEPROM and comparing with keypad input */
+/* Point stored_password at the user's PIN (EEPROM copy, or the user store in place); 0 if unusable */
+static int load_stored_password(unsigned char user_id) {
+    int res;
+#if defined(USER_FLASH)
+    stored_password = (const char *)ustore_slot(user_id);
+    res = 0;
+#else
+    int k;
+
+    /* clear stored_password */
+    for (k = 0; k <= PASSWORD_MAX_LEN; k++) stored_password_buf[k] = '\0';
+
+    res = store_read(user_dev, USER_SLOT_ADDR(user_id), (unsigned char *)stored_password_buf, PASSWORD_MAX_LEN);
+    stored_password_buf[PASSWORD_MAX_LEN] = '\0';
+    stored_password = stored_password_buf;
+#endif
+
+    if (res != 0) {
+        lcd_puts("EEPROM Read Err");
+        delay_ms(1000);
+        return 0;
+    }
+
+    if ((unsigned char)stored_password[0] == 0xFF || stored_password[0] == '\0') {
+        lcd_puts("No Password Set\nContact Admin");
+        delay_ms(1500);
+        return 0;
+    }
+    return 1;
+}
+#if defined(FP_SLOT_CACHE)
+/*
+ * PIN entry that scans the keypad itself, so the template upload started
+ * at the card goes out a packet per scan while the user types. '#'
+ * submits, '*' clears, and a timeout leaves buf empty.
+ */
+static void read_pin_scanning(char *buf, unsigned int timeout_ms) {
+    unsigned int idle;
+    int n, key;
+
+    keypad_flush();
+    n = 0;
+    idle = 0;
+    for (;;) {
+        fp_cache_pump();
+        key = keypad_poll_key();
+        if (key == '#') break;
+        if (key > 0) {
+            if (key == '*') n = 0;
+            else if (n < PASSWORD_MAX_LEN) buf[n++] = (char)key;
+            idle = 0;
+            continue;
+        }
+        if (idle >= timeout_ms) {
+            n = 0;
+            break;
+        }
+        delay_ms(FACTOR_POLL_MS);
+        idle += FACTOR_POLL_MS;
+    }
+    buf[n] = '\0';
+}
+#endif
+static int verify_password_for_user(unsigned char user_id) {
+    int k;
+
+    if (!load_stored_password(user_id)) return 0;
+
+    /* clear entered_password */
+    for (k = 0; k <= PASSWORD_MAX_LEN; k++) entered_password[k] = '\0';
+
+#if defined(FP_SLOT_CACHE)
+    read_pin_scanning(entered_password, PASSWORD_ENTRY_TIMEOUT_MS);
+#else
+    keypad_getstring_with_timeout(entered_password, PASSWORD_MAX_LEN, PASSWORD_ENTRY_TIMEOUT_MS);
+#endif
+
+    if (password_matches(entered_password, stored_password)) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+/* Classic flow: PIN first, sensor armed only once the PIN has passed */
+static int sequential_factors(unsigned char user_id, unsigned char *matched_id) {
+    int password_verified;
+    int fingerprint_verified;
+    int attempt;
+    unsigned long t0;
+
+    /* PASSWORD: up to MAX_PASSWORD_ATTEMPTS */
+    password_verified = 0;
+    t0 = timer_now_us();
+    for (attempt = 1; attempt <= MAX_PASSWORD_ATTEMPTS; attempt++) {
+        char msg[32];
+        lcd_clear();
+        format_attempt_msg(msg, "Enter Password", attempt, MAX_PASSWORD_ATTEMPTS);
+        lcd_puts(msg);
+
+        if (verify_password_for_user(user_id)) {
+            password_verified = 1;
+            break;
+        } else {
+            if (attempt < MAX_PASSWORD_ATTEMPTS) {
+                lcd_clear();
+                lcd_puts("Wrong Password\nTry Again");
+                delay_ms(1000);
+            } else {
+                lcd_clear();
+                lcd_puts("Password Failed\nAccess Denied");
+                delay_ms(1500);
+            }
+        }
+    }
+    metrics_observe_us(MET_STAGE_PASSWORD, timer_now_us() - t0);
+    if (!password_verified) return MET_DENY_PASSWORD;
+
+    /* FINGERPRINT: up to MAX_FP_ATTEMPTS */
+    fingerprint_verified = 0;
+    t0 = timer_now_us();
+    for (attempt = 1; attempt <= MAX_FP_ATTEMPTS; attempt++) {
+        char msg[32];
+        lcd_clear();
+        format_attempt_msg(msg, "Place Finger", attempt, MAX_FP_ATTEMPTS);
+        lcd_puts(msg);
+
+        if (do_fingerprint_verify(user_id, matched_id)) {
+            fingerprint_verified = 1;
+            break;
+        } else {
+            if (attempt < MAX_FP_ATTEMPTS) {
+                lcd_clear();
+                lcd_puts("Fingerprint Fail\nTry Again");
+                delay_ms(1000);
+            } else {
+                lcd_clear();
+                lcd_puts("Access Denied");
+                delay_ms(1500);
+            }
+        }
+    }
+    metrics_observe_us(MET_STAGE_FP, timer_now_us() - t0);
+    return fingerprint_verified ? MET_GRANTS : MET_DENY_FP;
+}
+
+/*
+ * Concurrent factors: keypad and sensor are both live after the card, each
+ * result is latched as it arrives, and the decision is taken once both have
+ * passed or either has used up its attempts.
+ */
+#define FACTOR_PENDING (-1)
+
+typedef struct {
+    char pin[PASSWORD_MAX_LEN + 1];
+    int pin_len;
+    int pin_tries;
+    int fp_tries;
+    int pin_ok; /* FACTOR_PENDING, 0 = out of attempts, 1 = passed */
+    int fp_ok;
+} factor_session;
+
+static void factors_begin(factor_session *fs) {
+    memset(fs, 0, sizeof(*fs));
+    fs->pin_ok = FACTOR_PENDING;
+    fs->fp_ok = FACTOR_PENDING;
+}
+
+/* '#' submits and '*' clears; returns 1 when the key completed a PIN attempt */
+static int factors_key(factor_session *fs, int key, const char *stored) {
+    if (fs->pin_ok != FACTOR_PENDING) return 0;
+    if (key == '*') {
+        fs->pin_len = 0;
+        return 0;
+    }
+    if (key != '#') {
+        if (fs->pin_len < PASSWORD_MAX_LEN) fs->pin[fs->pin_len++] = (char)key;
+        return 0;
+    }
+    fs->pin[fs->pin_len] = '\0';
+    fs->pin_len = 0;
+    fs->pin_tries++;
+    if (password_matches(fs->pin, stored)) fs->pin_ok = 1;
+    else if (fs->pin_tries >= MAX_PASSWORD_ATTEMPTS) fs->pin_ok = 0;
+    return 1;
+}
+
+static void factors_finger(factor_session *fs, int matched) {
+    if (fs->fp_ok != FACTOR_PENDING) return;
+    fs->fp_tries++;
+    if (matched) fs->fp_ok = 1;
+    else if (fs->fp_tries >= MAX_FP_ATTEMPTS) fs->fp_ok = 0;
+}
+
+/* FACTOR_PENDING, or the MET_* outcome; a failed factor denies at once */
+static int factors_decision(const factor_session *fs) {
+    if (fs->pin_ok == 0) return MET_DENY_PASSWORD;
+    if (fs->fp_ok == 0) return MET_DENY_FP;
+    if (fs->pin_ok == 1 && fs->fp_ok == 1) return MET_GRANTS;
+    return FACTOR_PENDING;
+}
+
+/*
+ * Superloop for DOOR_POLICY_CONCURRENT doors. The finger is matched by the
+ * module (or the controller gallery) as soon as it lands, and the loop is
+ * blocked in do_fingerprint_verify for the capture and match (up to about
+ * a second). Keys pressed meanwhile are only kept if something latches
+ * them: the host stub buffers whole lines, but on the target the keypad
+ * scan must move to a timer ISR with a key FIFO (or a keypad encoder that
+ * latches keys in hardware), or they are lost. The timeout restarts on
+ * every key or finger.
+ */
+static int concurrent_factors(unsigned char user_id, unsigned char *matched_id) {
+    factor_session fs;
+    unsigned long idle_ms;
+    int key, outcome;
+
+    if (!load_stored_password(user_id)) return MET_DENY_PASSWORD;
+    factors_begin(&fs);
+    keypad_flush();
+    lcd_clear();
+    lcd_puts("Enter PIN + #\nand Place Finger");
+    idle_ms = 0;
+    while ((outcome = factors_decision(&fs)) == FACTOR_PENDING) {
+#if defined(FP_SLOT_CACHE)
+        fp_cache_pump();
+#endif
+        key = keypad_poll_key();
+        if (key > 0) {
+            idle_ms = 0;
+            if (factors_key(&fs, key, stored_password) && fs.pin_ok == FACTOR_PENDING) {
+                lcd_clear();
+                lcd_puts("Wrong Password\nTry Again");
+            }
+        }
+        if (fs.fp_ok == FACTOR_PENDING && fp_finger_present()) {
+            idle_ms = 0;
+            factors_finger(&fs, do_fingerprint_verify(user_id, matched_id));
+            if (fs.fp_ok == FACTOR_PENDING) {
+                lcd_clear();
+                lcd_puts("Fingerprint Fail\nTry Again");
+            }
+        }
+        if (idle_ms >= PASSWORD_ENTRY_TIMEOUT_MS) {
+            outcome = fs.pin_ok == FACTOR_PENDING ? MET_DENY_PASSWORD : MET_DENY_FP;
+            break;
+        }
+        delay_ms(FACTOR_POLL_MS);
+        idle_ms += FACTOR_POLL_MS;
+    }
+    if (outcome != MET_GRANTS) {
+        lcd_clear();
+        lcd_puts(outcome == MET_DENY_PASSWORD ? "Password Failed\nAccess Denied" : "Access Denied");
+        delay_ms(1500);
+    }
+    return outcome;
+}
+
+/*
+ * Fingerprint search wrapper. With FP_CONTROLLER_MATCH the controller
+ * captures the probe and searches its own gallery with the fixed-point
+ * matcher; otherwise the sensor module searches its on-board slots.
+ */
+static int do_fingerprint_search(unsigned char *matched_id) {
+    int res;
+#if defined(FP_CONTROLLER_MATCH)
+    fp_template probe;
+    if (fp_capture_template(&probe) != 0 && probe.count == 0) return 0;
+    res = fp_identify_zone(&probe, DOOR_ZONE, FP_MATCH_THRESHOLD, 0);
+#else
+    res = fp_search();
+#endif
+    if (res >= 0) {
+        *matched_id = (unsigned char)res;
+        return 1;
+    }
+    return 0;
+}
+
+/* Fingerprint check for a known user: 1:1 against its slot when cached */
+static int do_fingerprint_verify(unsigned char user_id, unsigned char *matched_id) {
+#if defined(FP_SLOT_CACHE)
+    int slot;
+    slot = fp_cache_load(user_id);
+    if (slot >= 0) {
+        if (!fp_verify_slot(slot)) return 0;
+        *matched_id = user_id;
+        return 1;
+    }
+#else
+    (void)user_id;
+#endif
+    return do_fingerprint_search(matched_id);
+}
+
+/* Motor open/close sequence */
+static void door_open_sequence(void) {
+    motor_open();
+    delay_ms(3000);
+    motor_close();
+    lcd_puts("Door Closed");
+}
+
+#if defined(FW_UPDATE)
+/* Find the bank this image runs from; the host has no boot loader, so it makes that decision here */
+static void fw_locate(void) {
+#if defined(HOST_POSIX)
+    fw_boot_select();
+#else
+    fw_running = (unsigned long)fw_locate >= fw_bank_base[1];
+#endif
+}
+#endif
+
+#if defined(HOST_POSIX) || defined(MGMT_UART)
+/* Store a password into the user's slot on user_dev (NUL padded), or stage it in the user store */
+static int provision_password(int uid, const char *pw) {
+    unsigned char slot[PASSWORD_EEPROM_SLOT_SIZE];
+    int k;
+    if (uid < 0 || uid >= MAX_USERS) return -1;
+    memset(slot, 0, sizeof(slot));
+    for (k = 0; k < PASSWORD_MAX_LEN && pw[k] != '\0'; k++) slot[k] = (unsigned char)pw[k];
+#if defined(USER_FLASH)
+    return ustore_write(uid, slot);
+#else
+    if (store_rewrite(user_dev, USER_SLOT_ADDR(uid), slot, PASSWORD_MAX_LEN) != STORE_OK) return -1;
+    return store_sync(user_dev) == STORE_OK ? 0 : -1;
+#endif
+}
+#endif
+
+#if defined(FP_CONTROLLER_MATCH)
+/*
+ * Zone z is the doors needing clearance z (the top zone: z or more), so a
+ * user's zones are every one up to its clearance, and none once revoked.
+ * Schedules and validity windows turn with the clock and stay user_admit's.
+ */
+static void door_zone_sync(int uid) {
+    const user_hot *h;
+    int top;
+    if (uid < 0 || uid >= user_count) return;
+    h = &user_hot_tab[uid];
+    top = h->clearance < FP_ZONES ? h->clearance : FP_ZONES - 1;
+    fp_gallery_set_zones(uid, (h->flags & USER_F_REVOKED) ? 0 : (2u << top) - 1);
+}
+#endif
+
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE)
+/* Refill the gallery from the template EEPROM at start-up */
+static void fp_store_load(void) {
+    unsigned char rec[FP_PACKED_MAX];
+    fp_template t;
+    int uid;
+
+    for (uid = 0; uid < MAX_USERS; uid++) {
+        if (store_read(&store_fp_eeprom, FP_STORE_ADDR(uid), rec, 1) != STORE_OK || rec[0] > FP_MAX_MINUTIAE) {
+            continue;
+        }
+        if (store_read(&store_fp_eeprom, FP_STORE_ADDR(uid) + 1, rec + 1, rec[0] * FP_PACKED_MINUTIA) != STORE_OK ||
+            fp_template_unpack(&t, rec, FP_PACKED_MAX) < 0) {
+            continue;
+        }
+        fp_gallery_enroll(uid, &t);
+    }
+#if defined(FP_CONTROLLER_MATCH)
+    for (uid = 0; uid < MAX_USERS; uid++) door_zone_sync(uid);
+#endif
+}
+
+#if defined(HOST_POSIX) || defined(MGMT_UART)
+/* Write uid's gallery entry through to the template EEPROM, a 0xFF count if it has none */
+static int fp_store_save(int uid) {
+    unsigned char rec[FP_PACKED_MAX];
+    const fp_template *t;
+    int len;
+
+    t = fp_gallery_get(uid);
+    if (t) {
+        len = fp_template_pack(t, rec);
+    } else {
+        rec[0] = 0xFF;
+        len = 1;
+    }
+    return store_write(&store_fp_eeprom, FP_STORE_ADDR(uid), rec, (unsigned int)len) == STORE_OK ? 0 : -1;
+}
+
+/* Capture uid's finger into the controller gallery, the master copy; module slots only ever cache it */
+static int enroll_finger(int uid) {
+    fp_template t;
+    if (uid < 0 || uid >= MAX_USERS || fp_capture_enroll(uid, &t) != 0 || t.count == 0) return -1;
+    if (fp_gallery_enroll(uid, &t) != 0) return -1;
+#if defined(FP_CONTROLLER_MATCH)
+    door_zone_sync(uid);
+#endif
+    fp_cache_invalidate(uid);
+    return fp_store_save(uid);
+}
+#endif
+#endif
+
+#if defined(USER_FLASH)
+static unsigned long door_quiet_ms(void) {
+    return (timer_now_us() - door_quiet_from) / 1000UL;
+}
+
+/* Every millisecond of delay: management work, and user store writes while no session is open */
+static void door_background(void) {
+#if defined(MGMT_UART)
+    mgmt_service(MGMT_BUDGET_SESSION);
+#endif
+    if (!door_session) ustore_service(door_quiet_ms());
+}
+#endif
+
+#if defined(HOST_POSIX)
+/* Start trace replay: apply the leading 'P' lines, leave the file at the first event */
+static int replay_open(const char *path) {
+    char line[256];
+    char pw[REPLAY_FIELD_LEN];
+    long pos;
+    int uid;
+
+    replay_file = fopen(path, "r");
+    if (!replay_file) return -1;
+    for (;;) {
+        pos = ftell(replay_file);
+        if (!fgets(line, sizeof(line), replay_file)) break;
+        if (line[0] == '#') continue;
+        if (line[0] != 'P') {
+            fseek(replay_file, pos, SEEK_SET);
+            break;
+        }
+        if (sscanf(line + 1, "%d %15s", &uid, pw) != 2) continue;
+        provision_password(uid, pw);
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE)
+        enroll_finger(uid);
+#endif
+    }
+    printf("[REPLAY] %s\n", path);
+    return 0;
+}
+#endif
+
+#if !defined(HOST_POSIX)
+/* Push the compact metrics snapshot out of UART0 for target-side collection */
+static void metrics_uart_dump(void) {
+    unsigned char buf[METRICS_DUMP_MAX];
+    unsigned int len;
+    len = metrics_dump_binary(buf, sizeof(buf));
+    if (len > 0) uart0_send_bytes(buf, len);
+}
+#endif
+
+/* ========================= MANAGEMENT PROTOCOL ========================= */
+
+#if defined(MGMT_UART) || defined(HOST_TOOLS)
+/*
+ * Binary request/response protocol for remote administration on UART0:
+ *
+ *   frame: SOM | length (2, whole frame) | body | CRC-16 as OSDP
+ *   body:  request id | op | flags | payload
+ *
+ * Length and CRC are little-endian, fields inside payloads big-endian.
+ * Door builds attach a secure channel keyed from MGMT_KEY and a session
+ * nonce no earlier boot used (the boot count from EEPROM and the timer),
+ * so frames recorded before a reset are no good after it. A body too
+ * short to be sealed travels plain. The host asks for the nonce with a
+ * plain SESSION; plain requests get PING and SESSION only, everything
+ * else is refused with MGMT_ERR_AUTH. Up to MGMT_SLOTS
+ * requests may be in flight and replies carry the request id, so they
+ * can come back in any order. A reply has MGMT_REPLY_BIT set in op and
+ * starts its payload with a status byte.
+ *  - batch ops (set password, enroll, delete, set card, set user) carry
+ *    many records and answer once with one status per record
+ *  - READ_LOG streams access log records over as many replies as it
+ *    takes, every one but the last flagged MGMT_FLAG_MORE
+ *  - FW_DATA chunks may be pipelined: each names its delta offset, waits
+ *    while an earlier chunk is still queued, and is refused with the
+ *    expected offset if there is a gap, so the host resends from there
+ * The UART interrupts only move bytes through two rings. All the work
+ * happens in mgmt_service, which does at most budget units (one batch
+ * record or one log chunk) per call. The super-loop calls it when idle
+ * and delay_ms calls it every millisecond, so a door in the middle of a
+ * session gives administration one unit per millisecond it would have
+ * spent waiting anyway; records that would block for longer (finger
+ * captures, EEPROM writes) are left until the session ends. A changed
+ * password applies from the next presentation.
+ */
+#define MGMT_SOM 0xA5
+#define MGMT_HEADER 3           /* SOM, length (2) */
+#define MGMT_BODY_HEADER 3      /* id, op, flags */
+#define MGMT_PAYLOAD_MAX 256
+#define MGMT_BODY_MAX (MGMT_BODY_HEADER + 1 + MGMT_PAYLOAD_MAX)
+#define MGMT_FRAME_MAX (MGMT_HEADER + MGMT_BODY_MAX + SC_OVERHEAD + 2)
+#define MGMT_SLOTS 4
+#define MGMT_RX_RING 512
+#define MGMT_TX_RING 512
+#define MGMT_LOG_CHUNK 16
+#define MGMT_REPLY_BIT 0x80
+#define MGMT_FLAG_MORE 0x01
+#define MGMT_ERASE_COST MGMT_BUDGET_IDLE /* a sector erase ends the slice */
+
+#define MGMT_OP_PING 0x01
+#define MGMT_OP_SESSION 0x02    /* plain; answers the session nonce (8) */
+#define MGMT_OP_SET_PASSWORD 0x10 /* records: uid | length | PIN digits */
+#define MGMT_OP_FP_ENROLL 0x11  /* records: uid; gallery builds capture into the gallery and template EEPROM */
+#define MGMT_OP_FP_DELETE 0x12  /* records: uid; ... and drop any module slot holding it */
+#define MGMT_OP_SET_CARD 0x13   /* records: card (4) | uid, 0xFF withdraws (CARD_MPH) */
+#define MGMT_OP_SET_USER 0x14   /* records: uid | card (4) | clearance | schedule | revoked | from (4) | until (4) */
+#define MGMT_USER_RECORD 16
+#define MGMT_OP_SET_TIME 0x15   /* Unix seconds (4); timed access is refused until this is done */
+#define MGMT_OP_READ_LOG 0x20   /* from seq (4) | max records (2) */
+#define MGMT_OP_FW_BEGIN 0x30   /* signed manifest; answered once the bank is erased */
+#define MGMT_OP_FW_DATA 0x31    /* delta offset (4) | delta bytes */
+#define MGMT_OP_FW_COMMIT 0x32
+
+#define MGMT_OK 0
+#define MGMT_ERR_FORMAT 1
+#define MGMT_ERR_USER 2
+#define MGMT_ERR_DEVICE 3
+#define MGMT_ERR_OP 4
+#define MGMT_ERR_FIRMWARE 5     /* -FW_ERR_* follows */
+#define MGMT_ERR_ORDER 6        /* delta offset expected next (4) follows */
+#define MGMT_ERR_FULL 7         /* card overflow full: regenerate the card index */
+#define MGMT_ERR_AUTH 8         /* only PING and SESSION are served on plain frames */
+#define MGMT_BOOT_ADDR 0x0E00   /* EEPROM: boot count (4), half of the session nonce */
+
+typedef struct {
+    unsigned char used;
+    unsigned char id;
+    unsigned char op;
+    unsigned char sealed;       /* came through the channel, and so does the reply */
+    int len;                    /* payload bytes */
+    int pos;                    /* next record */
+    int done;                   /* records applied; their statuses overwrite payload[0..done) */
+    unsigned long log_seq;
+    unsigned int log_left;
+    unsigned char payload[MGMT_PAYLOAD_MAX];
+} mgmt_slot;
+
+static struct {
+    mgmt_slot slot[MGMT_SLOTS];
+    int rr;
+    int busy;
+    sc_channel *channel;
+    unsigned char nonce[8];     /* the channel's session nonce */
+    unsigned char rx[MGMT_RX_RING];
+    volatile unsigned int rx_head; /* written by the receive ISR */
+    volatile unsigned int rx_tail;
+    unsigned char tx[MGMT_TX_RING];
+    volatile unsigned int tx_head;
+    volatile unsigned int tx_tail; /* written by the transmit ISR */
+    unsigned char frame[MGMT_FRAME_MAX];
+    int frame_len;
+    unsigned char body[MGMT_BODY_MAX];
+} mgmt;
+
+/* Frame a body, sealing it first when c is set; returns the frame length */
+int mgmt_frame(sc_channel *c, const unsigned char *body, int blen, unsigned char *out) {
+    unsigned int crc;
+    int n;
+    if (c) blen = sc_seal(c, body, blen, out + MGMT_HEADER);
+    else memcpy(out + MGMT_HEADER, body, (size_t)blen);
+    n = MGMT_HEADER + blen + 2;
+    out[0] = MGMT_SOM;
+    out[1] = (unsigned char)(n & 0xFF);
+    out[2] = (unsigned char)(n >> 8);
+    crc = osdp_crc16(out, n - 2);
+    out[n - 2] = (unsigned char)(crc & 0xFF);
+    out[n - 1] = (unsigned char)(crc >> 8);
+    return n;
+}
+
+/* Feed one received byte to a frame assembler; returns the frame length once complete */
+int mgmt_frame_byte(unsigned char *buf, int *len, unsigned char b) {
+    int n;
+    if (*len == 0 && b != MGMT_SOM) return 0;
+    buf[(*len)++] = b;
+    if (*len < MGMT_HEADER) return 0;
+    n = buf[1] | (buf[2] << 8);
+    if (n < MGMT_HEADER + MGMT_BODY_HEADER + 2 || n > MGMT_FRAME_MAX) {
+        *len = 0;
+        metrics_add(MET_MGMT_BAD_FRAMES, 1);
+        return 0;
+    }
+    if (*len < n) return 0;
+    *len = 0;
+    if (osdp_crc16(buf, n - 2) != (unsigned int)(buf[n - 2] | (buf[n - 1] << 8))) {
+        metrics_add(MET_MGMT_BAD_FRAMES, 1);
+        return 0;
+    }
+    return n;
+}
+
+/* UART0 receive interrupt; a byte that finds the ring full is lost and its frame fails the CRC */
+void mgmt_rx_isr(unsigned char b) {
+    unsigned int h;
+    h = mgmt.rx_head;
+    if (h - mgmt.rx_tail == MGMT_RX_RING) return;
+    mgmt.rx[h & (MGMT_RX_RING - 1)] = b;
+    mgmt.rx_head = h + 1;
+}
+
+/* UART0 transmit interrupt: the next byte for U0THR, or -1 when there is nothing to send */
+int mgmt_tx_isr(void) {
+    unsigned int t;
+    t = mgmt.tx_tail;
+    if (t == mgmt.tx_head) return -1;
+    mgmt.tx_tail = t + 1;
+    return mgmt.tx[t & (MGMT_TX_RING - 1)];
+}
+
+static int mgmt_tx_room(void) {
+    return MGMT_TX_RING - (int)(mgmt.tx_head - mgmt.tx_tail);
+}
+
+/* Queue a reply; 0 (nothing sent) if the transmit ring has no room for it yet */
+static int mgmt_reply(mgmt_slot *s, int flags, int status, const unsigned char *data, int n) {
+    unsigned char out[MGMT_FRAME_MAX];
+    sc_channel *c;
+    unsigned int h;
+    int len, i;
+
+    c = s->sealed ? mgmt.channel : 0;
+    if (mgmt_tx_room() < MGMT_HEADER + MGMT_BODY_HEADER + 1 + n + (c ? SC_OVERHEAD : 0) + 2) return 0;
+    mgmt.body[0] = s->id;
+    mgmt.body[1] = (unsigned char)(s->op | MGMT_REPLY_BIT);
+    mgmt.body[2] = (unsigned char)flags;
+    mgmt.body[3] = (unsigned char)status;
+    if (n > 0) memmove(mgmt.body + MGMT_BODY_HEADER + 1, data, (size_t)n);
+    len = mgmt_frame(c, mgmt.body, MGMT_BODY_HEADER + 1 + n, out);
+    h = mgmt.tx_head;
+    for (i = 0; i < len; i++) mgmt.tx[(h + (unsigned int)i) & (MGMT_TX_RING - 1)] = out[i];
+    mgmt.tx_head = h + (unsigned int)len;
+    return 1;
+}
+
+static int mgmt_finish(mgmt_slot *s, int status, const unsigned char *data, int n) {
+    if (!mgmt_reply(s, 0, status, data, n)) return 0;
+    s->used = 0;
+    return 1;
+}
+
+static unsigned long mgmt_be32(const unsigned char *p) {
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+/* Apply the record at s->pos and step past it; returns its status */
+static int mgmt_apply(mgmt_slot *s) {
+    char pw[PASSWORD_MAX_LEN + 1];
+    const unsigned char *r;
+    int uid, n, rc;
+
+    r = s->payload + s->pos;
+    uid = r[0];
+#if defined(CARD_MPH)
+    if (s->op == MGMT_OP_SET_CARD) {
+        if (s->pos + 5 > s->len) {
+            s->pos = s->len;
+            return MGMT_ERR_FORMAT;
+        }
+        s->pos += 5;
+        if (r[4] != 0xFF && r[4] >= MAX_USERS) return MGMT_ERR_USER;
+        rc = card_set(mgmt_be32(r), r[4] == 0xFF ? -1 : r[4]);
+        return rc == CARD_OK ? MGMT_OK : rc == CARD_ERR_FULL ? MGMT_ERR_FULL : MGMT_ERR_DEVICE;
+    }
+#endif
+    if (s->op == MGMT_OP_SET_USER) {
+        if (s->pos + MGMT_USER_RECORD > s->len) {
+            s->pos = s->len;
+            return MGMT_ERR_FORMAT;
+        }
+        s->pos += MGMT_USER_RECORD;
+        if (uid >= MAX_USERS) return MGMT_ERR_USER;
+        if (user_set(uid, mgmt_be32(r + 1), r[5], r[6]) != 0) return MGMT_ERR_FORMAT;
+        user_revoke(uid, r[7]);
+        user_set_validity(uid, mgmt_be32(r + 8), mgmt_be32(r + 12));
+#if defined(FP_CONTROLLER_MATCH)
+        door_zone_sync(uid);
+#endif
+        return MGMT_OK;
+    }
+    if (s->op == MGMT_OP_SET_PASSWORD) {
+        n = s->pos + 2 <= s->len ? r[1] : -1;
+        if (n < 1 || n > PASSWORD_MAX_LEN || s->pos + 2 + n > s->len) {
+            s->pos = s->len;
+            return MGMT_ERR_FORMAT;
+        }
+        s->pos += 2 + n;
+        if (uid >= MAX_USERS) return MGMT_ERR_USER;
+        memcpy(pw, r + 2, (size_t)n);
+        pw[n] = '\0';
+        return provision_password(uid, pw) == 0 ? MGMT_OK : MGMT_ERR_DEVICE;
+    }
+    s->pos++;
+    if (uid >= MAX_USERS) return MGMT_ERR_USER;
+#if defined(FP_CONTROLLER_MATCH) || defined(FP_SLOT_CACHE)
+    if (s->op == MGMT_OP_FP_ENROLL) {
+        rc = enroll_finger(uid);
+    } else {
+        fp_gallery_remove(uid);
+        fp_cache_invalidate(uid);
+        rc = fp_store_save(uid);
+    }
+#else
+    rc = s->op == MGMT_OP_FP_ENROLL ? fp_enroll(uid) : fp_delete(uid);
+#endif
+    return rc == 0 ? MGMT_OK : MGMT_ERR_DEVICE;
+}
+
+#if defined(FW_UPDATE) || defined(HOST_TOOLS)
+static fw_update mgmt_fw;
+
+/* Another delta chunk starting before off is still queued or being applied */
+static int mgmt_fw_behind(const mgmt_slot *s, unsigned long off) {
+    const mgmt_slot *o;
+    int i;
+    for (i = 0; i < MGMT_SLOTS; i++) {
+        o = &mgmt.slot[i];
+        if (o != s && o->used && o->op == MGMT_OP_FW_DATA && o->len >= 4 && fw_be32(o->payload) < off) return 1;
+    }
+    return 0;
+}
+
+static int mgmt_fw_fail(mgmt_slot *s, int rc) {
+    unsigned char code;
+    code = (unsigned char)-rc;
+    return mgmt_finish(s, MGMT_ERR_FIRMWARE, &code, 1);
+}
+
+static unsigned long mgmt_fw_progress(void) {
+    return mgmt_fw.consumed + mgmt_fw.out;
+}
+
+/* Firmware ops reserve a whole reply first, so the work they do is never repeated */
+static int mgmt_fw_step(mgmt_slot *s) {
+    unsigned char want[4];
+    unsigned long before;
+    int rc;
+
+    if (mgmt_tx_room() < MGMT_FRAME_MAX) return 0;
+    if (s->op == MGMT_OP_FW_BEGIN) {
+        if (s->pos == 0) {
+            s->pos = s->len;
+            rc = fw_begin(&mgmt_fw, s->payload, s->len);
+            return rc == FW_OK ? 1 : mgmt_fw_fail(s, rc);
+        }
+        if (door_session) return 0;
+        rc = fw_prepare(&mgmt_fw);
+        if (rc < 0) return mgmt_fw_fail(s, rc);
+        return rc ? MGMT_ERASE_COST : mgmt_finish(s, MGMT_OK, 0, 0);
+    }
+    if (s->op == MGMT_OP_FW_DATA && s->pos == 0) {
+        if (s->len < 4) return mgmt_finish(s, MGMT_ERR_FORMAT, 0, 0);
+        if (mgmt_fw_behind(s, fw_be32(s->payload))) return 0;
+        if (!mgmt_fw.active) return mgmt_fw_fail(s, FW_ERR_STATE);
+        if (fw_be32(s->payload) != mgmt_fw.consumed) {
+            fw_put32(want, mgmt_fw.consumed);
+            return mgmt_finish(s, MGMT_ERR_ORDER, want, 4);
+        }
+        s->pos = 4;
+    }
+    if (s->op == MGMT_OP_FW_COMMIT && mgmt_fw_behind(s, 0xFFFFFFFFUL)) return 0;
+    before = mgmt_fw_progress();
+    if (mgmt_fw.active && mgmt_fw.out < mgmt_fw.length) {
+        rc = fw_apply(&mgmt_fw, s->payload + s->pos, s->len - s->pos, 1);
+        if (rc < 0) return mgmt_fw_fail(s, rc);
+        s->pos += rc;
+    }
+    if (s->op == MGMT_OP_FW_DATA) {
+        if (s->pos == s->len) return mgmt_finish(s, MGMT_OK, 0, 0);
+        if (mgmt_fw_progress() == before) return mgmt_fw_fail(s, FW_ERR_DELTA); /* bytes past the image */
+        return 1;
+    }
+    if (mgmt_fw_progress() != before) return 1;
+    rc = fw_commit(&mgmt_fw);
+    return rc == FW_OK ? mgmt_finish(s, MGMT_OK, 0, 0) : mgmt_fw_fail(s, rc);
+}
+#endif
+
+/* Sealed requests may do anything, plain ones only PING and SESSION (host tool models run unsealed links) */
+static int mgmt_allowed(const mgmt_slot *s) {
+    if (s->sealed || s->op == MGMT_OP_PING || s->op == MGMT_OP_SESSION) return 1;
+#if defined(HOST_TOOLS)
+    if (!mgmt.channel) return 1;
+#endif
+    return 0;
+}
+
+/*
+ * Records that hold the caller for longer than a millisecond: a finger
+ * capture waits on the sensor, and EEPROM pages take 5 ms to write
+ * (user store builds only stage passwords in RAM). They wait for the
+ * session to end rather than stretch its delays.
+ */
+static int mgmt_blocks(int op) {
+#if defined(USER_FLASH)
+    if (op == MGMT_OP_SET_PASSWORD) return 0;
+#endif
+    return op == MGMT_OP_SET_PASSWORD || op == MGMT_OP_FP_ENROLL || op == MGMT_OP_FP_DELETE || op == MGMT_OP_SET_CARD;
+}
+
+/* One step of work for a request: the units it cost, 0 if it is waiting for transmit room or the session */
+static int mgmt_step(mgmt_slot *s) {
+    unsigned char chunk[5 + MGMT_LOG_CHUNK * ACCESS_LOG_RECORD];
+    int n, more;
+
+    if (!mgmt_allowed(s)) return mgmt_finish(s, MGMT_ERR_AUTH, 0, 0);
+    switch (s->op) {
+    case MGMT_OP_PING:
+        return mgmt_finish(s, MGMT_OK, s->payload, s->len);
+    case MGMT_OP_SESSION:
+        if (!mgmt.channel) return mgmt_finish(s, MGMT_ERR_OP, 0, 0);
+        return mgmt_finish(s, MGMT_OK, mgmt.nonce, 8);
+    case MGMT_OP_SET_TIME:
+        if (s->len != 4) return mgmt_finish(s, MGMT_ERR_FORMAT, 0, 0);
+        if (mgmt_tx_room() < MGMT_FRAME_MAX) return 0;
+        rtc_set_seconds(mgmt_be32(s->payload));
+        return mgmt_finish(s, MGMT_OK, 0, 0);
+    case MGMT_OP_SET_PASSWORD:
+    case MGMT_OP_FP_ENROLL:
+    case MGMT_OP_FP_DELETE:
+    case MGMT_OP_SET_USER:
+#if defined(CARD_MPH)
+    case MGMT_OP_SET_CARD:
+#endif
+        if (s->pos >= s->len) return mgmt_finish(s, MGMT_OK, s->payload, s->done);
+        if (door_session && mgmt_blocks(s->op)) return 0;
+        /* a record is at least a byte long, so payload[done] is already consumed */
+        s->payload[s->done] = (unsigned char)mgmt_apply(s);
+        s->done++;
+        return 1;
+    case MGMT_OP_READ_LOG:
+        if (s->pos == 0) {
+            if (s->len != 6) return mgmt_finish(s, MGMT_ERR_FORMAT, 0, 0);
+            s->log_seq = ((unsigned long)s->payload[0] << 24) | ((unsigned long)s->payload[1] << 16) |
+                         ((unsigned long)s->payload[2] << 8) | s->payload[3];
+            s->log_left = (unsigned int)((s->payload[4] << 8) | s->payload[5]);
+            s->pos = s->len;
+        }
+        if (mgmt_tx_room() < MGMT_FRAME_MAX) return 0;
+        n = access_log_read(&s->log_seq, chunk + 5, s->log_left < MGMT_LOG_CHUNK ? (int)s->log_left : MGMT_LOG_CHUNK);
+        s->log_left -= (unsigned int)n;
+        access_put32(chunk, s->log_seq);
+        chunk[4] = (unsigned char)n;
+        more = s->log_left > 0 && s->log_seq < access_log_next;
+        mgmt_reply(s, more ? MGMT_FLAG_MORE : 0, MGMT_OK, chunk, 5 + n * ACCESS_LOG_RECORD);
+        if (!more) s->used = 0;
+        return 1;
+#if defined(FW_UPDATE) || defined(HOST_TOOLS)
+    case MGMT_OP_FW_BEGIN:
+    case MGMT_OP_FW_DATA:
+    case MGMT_OP_FW_COMMIT:
+        return mgmt_fw_step(s);
+#endif
+    }
+    return mgmt_finish(s, MGMT_ERR_OP, 0, 0);
+}
+
+static mgmt_slot *mgmt_free_slot(void) {
+    int i;
+    for (i = 0; i < MGMT_SLOTS; i++) {
+        if (!mgmt.slot[i].used) return &mgmt.slot[i];
+    }
+    return 0;
+}
+
+/* Take a checked frame into a free slot */
+static void mgmt_accept(mgmt_slot *s, unsigned char *frame, int n) {
+    unsigned char *body;
+    int blen;
+
+    body = frame + MGMT_HEADER;
+    blen = n - MGMT_HEADER - 2;
+    s->sealed = 0;
+    if (mgmt.channel && blen >= SC_OVERHEAD + MGMT_BODY_HEADER) {
+        if (blen > MGMT_BODY_MAX + SC_OVERHEAD || (blen = sc_open(mgmt.channel, body, blen, mgmt.body)) < 0) {
+            metrics_add(MET_MGMT_BAD_FRAMES, 1);
+            return;
+        }
+        body = mgmt.body;
+        s->sealed = 1;
+    }
+    if (blen < MGMT_BODY_HEADER || blen > MGMT_BODY_HEADER + MGMT_PAYLOAD_MAX) {
+        metrics_add(MET_MGMT_BAD_FRAMES, 1);
+        return;
+    }
+    s->used = 1;
+    s->id = body[0];
+    s->op = body[1];
+    s->len = blen - MGMT_BODY_HEADER;
+    memcpy(s->payload, body + MGMT_BODY_HEADER, (size_t)s->len);
+    s->pos = s->done = 0;
+    metrics_add(MET_MGMT_REQUESTS, 1);
+}
+
+/* Assemble frames from the receive ring while a slot is free to take them */
+static void mgmt_receive(void) {
+    mgmt_slot *s;
+    unsigned char b;
+    int n;
+
+    while (mgmt.rx_tail != mgmt.rx_head && (s = mgmt_free_slot()) != 0) {
+        b = mgmt.rx[mgmt.rx_tail & (MGMT_RX_RING - 1)];
+        mgmt.rx_tail++;
+        n = mgmt_frame_byte(mgmt.frame, &mgmt.frame_len, b);
+        if (n > 0) mgmt_accept(s, mgmt.frame, n);
+    }
+}
+
+/* Up to budget units of work, round-robin over the requests in flight */
+void mgmt_service(int budget) {
+    int idle, n;
+    mgmt_slot *s;
+
+    if (mgmt.busy) return;
+    mgmt.busy = 1;
+    mgmt_receive();
+    idle = 0;
+    while (budget > 0 && idle < MGMT_SLOTS) {
+        s = &mgmt.slot[mgmt.rr];
+        mgmt.rr = (mgmt.rr + 1) % MGMT_SLOTS;
+        if (s->used && (n = mgmt_step(s)) > 0) {
+            budget -= n;
+            idle = 0;
+            mgmt_receive();
+        } else {
+            idle++;
+        }
+    }
+    mgmt.busy = 0;
+}
+
+static void mgmt_background(void) {
+    mgmt_service(MGMT_BUDGET_SESSION);
+}
+
+/* Reset the link; c seals requests and their replies under session nonce, 0 for plain frames (host tools) */
+static unsigned long mgmt_rx_depth(void) {
+    return mgmt.rx_head - mgmt.rx_tail;
+}
+
+static unsigned long mgmt_tx_depth(void) {
+    return mgmt.tx_head - mgmt.tx_tail;
+}
+
+void mgmt_init(sc_channel *c, const unsigned char *nonce) {
+    memset(&mgmt, 0, sizeof(mgmt));
+    mgmt.channel = c;
+    if (c) memcpy(mgmt.nonce, nonce, 8);
+    delay_hook = mgmt_background;
+    metrics_gauge_attach(MET_GAUGE_MGMT_RX, mgmt_rx_depth);
+    metrics_gauge_attach(MET_GAUGE_MGMT_TX, mgmt_tx_depth);
+}
+
+#if defined(MGMT_UART)
+static const unsigned char mgmt_key[AES_BLOCK] = { MGMT_KEY };
+static sc_channel mgmt_link;
+
+/* Open this boot's session: the boot count goes up first, so no two boots share a nonce */
+void mgmt_start(void) {
+    unsigned char nonce[8];
+    unsigned long boots;
+
+    eeprom_read_bytes(MGMT_BOOT_ADDR, nonce, 4);
+    boots = mgmt_be32(nonce) + 1; /* erased EEPROM reads all ones, so the first boot is 0 */
+    access_put32(nonce, boots);
+    eeprom_write_bytes(MGMT_BOOT_ADDR, nonce, 4);
+    access_put32(nonce + 4, timer_now_us());
+    sc_init(&mgmt_link, mgmt_key, nonce, 0);
+    mgmt_init(&mgmt_link, nonce);
+}
+#endif
+#endif
+
+/* ========================= HOST TOOLS ========================= */
+
+/*
+ * Built with -DHOST_TOOLS on a POSIX host: main() becomes a small command
+ * dispatcher (run, bench, bench-compare, ...) instead of the door loop.
+ */
+#if defined(HOST_TOOLS)
+#if !defined(HOST_POSIX)
+#error "HOST_TOOLS needs a POSIX host"
+#endif
+
+/* ---------- benchmark harness ---------- */
+
+#define BENCH_MAX_REPS 101
+#define BENCH_DEFAULT_REPS 21
+#define BENCH_MIN_REP_NS 2000000.0
+#define BENCH_MAX_ITERS 100000000UL
+#define BENCH_NOISE_MADS 3.0
+
+typedef void (*bench_fn)(unsigned long iters);
+
+typedef struct {
+    const char *name;
+    bench_fn fn;
+} bench_case;
+
+/* Hardware events collected per case with -p (Linux perf_event_open) */
+enum {
+    PERF_EV_CYCLES,
+    PERF_EV_INSTRUCTIONS,
+    PERF_EV_L1D_MISSES,
+    PERF_EV_LLC_MISSES,
+    PERF_EV_BRANCH_MISSES,
+    PERF_EVENTS
+};
+
+static const char *const perf_event_names[PERF_EVENTS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+};
+
+typedef struct {
+    unsigned long iters;
+    int reps;
+    double median_ns;
+    double mean_ns;
+    double stddev_ns;
+    double min_ns;
+    double mad_ns;
+    int have_perf;
+    double perf_per_op[PERF_EVENTS];
+} bench_result;
+
+/* Results are folded into this so the optimizer keeps the work */
+static volatile unsigned long bench_sink;
+
+static double bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+#if defined(BENCH_HAVE_PERF)
+static int perf_fds[PERF_EVENTS];
+static int perf_open_count;
+
+static int perf_open_event(unsigned int type, unsigned long config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group_fd < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0UL);
+}
+
+/* Open all events as one group led by cycles; 0 on success */
+static int perf_counters_open(void) {
+    static const unsigned int types[PERF_EVENTS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+    };
+    static const unsigned long configs[PERF_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int e;
+
+    perf_open_count = 0;
+    for (e = 0; e < PERF_EVENTS; e++) {
+        perf_fds[e] = perf_open_event(types[e], configs[e], e == 0 ? -1 : perf_fds[0]);
+        if (perf_fds[e] < 0) {
+            if (e == 0) return -1;
+            continue; /* event not supported here; leave it out of the group */
+        }
+        perf_open_count++;
+    }
+    return 0;
+}
+
+static void perf_counters_start(void) {
+    ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* Stop the group and read scaled totals (multiplexing corrected); -1 for missing events */
+static int perf_counters_stop(double *totals) {
+    __u64 buf[3 + PERF_EVENTS];
+    double scale;
+    int e, k;
+
+    ioctl(perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(perf_fds[0], buf, sizeof(buf)) < (long)(3 * sizeof(__u64))) return -1;
+    if (buf[0] != (__u64)perf_open_count || buf[2] == 0) return -1;
+    scale = (double)buf[1] / (double)buf[2];
+    k = 0;
+    for (e = 0; e < PERF_EVENTS; e++) {
+        totals[e] = perf_fds[e] < 0 ? -1.0 : (double)buf[3 + k++] * scale;
+    }
+    return 0;
+}
+#endif
+
+static void bench_eeprom_read(unsigned long iters) {
+    unsigned char buf[PASSWORD_MAX_LEN];
+    unsigned long i;
+    for (i = 0; i < iters; i++) {
+        eeprom_read_bytes(USER_SLOT_ADDR(i % MAX_USERS), buf, PASSWORD_MAX_LEN);
+        bench_sink += buf[0];
+    }
+}
+
+static void bench_eeprom_write(unsigned long iters) {
+    unsigned char buf[PASSWORD_EEPROM_SLOT_SIZE];
+    unsigned long i;
+    memset(buf, '7', sizeof(buf));
+    for (i = 0; i < iters; i++) {
+        buf[0] = (unsigned char)i;
+        eeprom_write_bytes(USER_SLOT_ADDR(i % MAX_USERS), buf, PASSWORD_EEPROM_SLOT_SIZE);
+    }
+    bench_sink += eeprom_memory[0];
+}
+
+static void bench_rfid_parse(unsigned long iters) {
+    unsigned char raw[CARD_ID_LEN];
+    char card[CARD_ID_LEN + 1];
+    unsigned long i;
+    raw[0] = 0x02;
+    memcpy(raw + 1, "00000042", CARD_ID_LEN - 2);
+    raw[CARD_ID_LEN - 1] = 0x03;
+    for (i = 0; i < iters; i++) {
+        raw[CARD_ID_LEN - 2] = (unsigned char)('0' + (i & 7));
+        bench_sink += (unsigned long)rfid_parse_frame(raw, CARD_ID_LEN, card) + (unsigned char)card[7];
+    }
+}
+
+static void bench_password_compare(unsigned long iters) {
+    static const char stored[PASSWORD_MAX_LEN + 1] = "48151623";
+    char entered[PASSWORD_MAX_LEN + 1];
+    unsigned long i;
+    memcpy(entered, stored, sizeof(entered));
+    for (i = 0; i < iters; i++) {
+        entered[PASSWORD_MAX_LEN - 1] = (char)('0' + (i & 3));
+        bench_sink += (unsigned long)password_matches(entered, stored);
+    }
+}
+
+static void bench_card_lookup(unsigned long iters) {
+    static const char *const cards[4] = { "00000007", "00000042", "00000049", "00000099" };
+    unsigned long i;
+    for (i = 0; i < iters; i++) bench_sink += (unsigned long)card_to_user_id(cards[i & 3]);
+}
+
+/* The admission check after the card, with the clock crossing an hour every 230400 calls */
+static void bench_user_admit(unsigned long iters) {
+    unsigned long i;
+    for (i = 0; i < iters; i++) {
+        bench_sink += (unsigned long)(user_admit((int)(i % MAX_USERS), 0, 1700000000UL + (i >> 6)) + 8);
+    }
+}
+
+static int bench_dc_eval(void *arg, int door, int uid, unsigned long now_s) {
+    (void)arg;
+    (void)door;
+    return user_admit(uid, 0, now_s);
+}
+
+/* Cached decisions for every user at 8 doors within one hour: the hit path a busy controller lives on */
+static void bench_dc_decide(unsigned long iters) {
+    static dc_cache c;
+    static int ready;
+    unsigned long i;
+
+    if (!ready) {
+        if (dc_init(&c, 8, 2 * MAX_USERS) != 0) return;
+        ready = 1;
+    }
+    for (i = 0; i < iters; i++) {
+        bench_sink +=
+            (unsigned long)(dc_decide(&c, (int)(i & 7), (int)(i % MAX_USERS), 1700000000UL, bench_dc_eval, 0) + 8);
+    }
+}
+
+static void bench_lcd_format(unsigned long iters) {
+    char msg[32];
+    unsigned long i;
+    for (i = 0; i < iters; i++) {
+        format_attempt_msg(msg, "Enter Password", (int)(i % MAX_PASSWORD_ATTEMPTS) + 1, MAX_PASSWORD_ATTEMPTS);
+        bench_sink += (unsigned char)msg[24];
+    }
+}
+
+/* 64-byte frames on the bitsliced path, the one the firmware runs */
+static void bench_aes_prepare(aes128_key *k, sc_channel *c) {
+    static const unsigned char key[AES_BLOCK] = "mlsas bench key";
+#if defined(AES_HAVE_NI)
+    aes_ni_state = 0;
+#endif
+    if (k) aes128_init(k, key);
+    if (c) sc_init(c, key, key, 1);
+}
+
+static void bench_aes_ctr(unsigned long iters) {
+    unsigned char ctr[AES_BLOCK], buf[64];
+    aes128_key k;
+    unsigned long i;
+    bench_aes_prepare(&k, 0);
+    memset(ctr, 0, AES_BLOCK);
+    memset(buf, 0x33, sizeof(buf));
+    for (i = 0; i < iters; i++) aes128_ctr(&k, ctr, buf, (int)sizeof(buf));
+    bench_sink += buf[0];
+}
+
+static void bench_aes_cmac(unsigned long iters) {
+    unsigned char buf[64], mac[AES_BLOCK];
+    aes128_key k;
+    unsigned long i;
+    bench_aes_prepare(&k, 0);
+    memset(buf, 0x33, sizeof(buf));
+    for (i = 0; i < iters; i++) {
+        buf[0] = (unsigned char)i;
+        aes128_cmac(&k, buf, (int)sizeof(buf), mac);
+        bench_sink += mac[0];
+    }
+}
+
+static void bench_sc_seal(unsigned long iters) {
+    unsigned char buf[64], out[64 + SC_OVERHEAD];
+    sc_channel c;
+    unsigned long i;
+    bench_aes_prepare(0, &c);
+    memset(buf, 0x33, sizeof(buf));
+    for (i = 0; i < iters; i++) bench_sink += (unsigned long)sc_seal(&c, buf, (int)sizeof(buf), out) + out[SC_SEQ];
+}
+
+/* A full-size OSDP packet, as checked on every reply and command */
+static void bench_osdp_crc(unsigned long iters) {
+    unsigned char pkt[OSDP_MAX_PACKET];
+    unsigned long i;
+    memset(pkt, 0x5A, sizeof(pkt));
+    pkt[0] = OSDP_SOM;
+    for (i = 0; i < iters; i++) {
+        pkt[1] = (unsigned char)i;
+        bench_sink += osdp_crc16(pkt, OSDP_MAX_PACKET - 2);
+    }
+}
+
+/* cases that live next to their modules further down */
+static void bench_fp_match_float(unsigned long iters);
+static void bench_fp_match_fixed(unsigned long iters);
+static void bench_card_mph(unsigned long iters);
+
+static const bench_case bench_cases[] = {
+    { "eeprom_read_bytes", bench_eeprom_read },
+    { "eeprom_write_bytes", bench_eeprom_write },
+    { "rfid_parse_frame", bench_rfid_parse },
+    { "password_compare", bench_password_compare },
+    { "card_to_user_id", bench_card_lookup },
+    { "card_mph_find", bench_card_mph },
+    { "user_admit", bench_user_admit },
+    { "dc_decide", bench_dc_decide },
+    { "lcd_format_attempt", bench_lcd_format },
+    { "fp_match_score_float", bench_fp_match_float },
+    { "fp_match_score_fixed", bench_fp_match_fixed },
+    { "aes128_ctr_64", bench_aes_ctr },
+    { "aes128_cmac_64", bench_aes_cmac },
+    { "sc_seal_64", bench_sc_seal },
+    { "osdp_crc16_64", bench_osdp_crc }
+};
+#define BENCH_CASES ((int)(sizeof(bench_cases) / sizeof(bench_cases[0])))
+
+static int bench_cmp_double(const void *a, const void *b) {
+    double x, y;
+    x = *(const double *)a;
+    y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_median_sorted(const double *v, int n) {
+    if (n % 2) return v[n / 2];
+    return (v[n / 2 - 1] + v[n / 2]) / 2.0;
+}
+
+/*
+ * Calibrate the iteration count, warm up, then time reps and summarise.
+ * With use_perf the counters run in a separate pass so ioctl overhead
+ * never lands inside the timed samples.
+ */
+static void bench_run_case(const bench_case *bc, int reps, int use_perf, bench_result *r) {
+    double samples[BENCH_MAX_REPS];
+    double dev[BENCH_MAX_REPS];
+    double t0, t, sum, sq;
+    unsigned long iters;
+    int k;
+#if defined(BENCH_HAVE_PERF)
+    double totals[PERF_EVENTS];
+#endif
+
+    bc->fn(0);                  /* one-time setup (tables, templates) stays out of the calibration */
+    iters = 1;
+    for (;;) {
+        t0 = bench_now_ns();
+        bc->fn(iters);
+        t = bench_now_ns() - t0;
+        if (t >= BENCH_MIN_REP_NS || iters >= BENCH_MAX_ITERS) break;
+        iters *= 2;
+    }
+    bc->fn(iters);
+
+    sum = 0.0;
+    for (k = 0; k < reps; k++) {
+        t0 = bench_now_ns();
+        bc->fn(iters);
+        samples[k] = (bench_now_ns() - t0) / (double)iters;
+        sum += samples[k];
+    }
+    qsort(samples, (size_t)reps, sizeof(double), bench_cmp_double);
+
+    r->iters = iters;
+    r->reps = reps;
+    r->min_ns = samples[0];
+    r->mean_ns = sum / reps;
+    r->median_ns = bench_median_sorted(samples, reps);
+    sq = 0.0;
+    for (k = 0; k < reps; k++) {
+        sq += (samples[k] - r->mean_ns) * (samples[k] - r->mean_ns);
+        dev[k] = samples[k] > r->median_ns ? samples[k] - r->median_ns : r->median_ns - samples[k];
+    }
+    r->stddev_ns = reps > 1 ? sqrt(sq / (reps - 1)) : 0.0;
+    qsort(dev, (size_t)reps, sizeof(double), bench_cmp_double);
+    r->mad_ns = bench_median_sorted(dev, reps);
+
+    r->have_perf = 0;
+#if defined(BENCH_HAVE_PERF)
+    if (use_perf) {
+        perf_counters_start();
+        for (k = 0; k < reps; k++) bc->fn(iters);
+        if (perf_counters_stop(totals) == 0) {
+            r->have_perf = 1;
+            for (k = 0; k < PERF_EVENTS; k++) {
+                r->perf_per_op[k] = totals[k] < 0.0 ? -1.0 : totals[k] / ((double)iters * reps);
+            }
+        }
+    }
+#else
+    (void)use_perf;
+#endif
+}
+
+/* Extra JSON members for the hardware counters; missing events are null */
+static void bench_print_perf(FILE *out, const bench_result *r) {
+    const double *v;
+    int e;
+
+    if (!r->have_perf) return;
+    v = r->perf_per_op;
+    for (e = 0; e < PERF_EVENTS; e++) {
+        if (v[e] < 0.0) fprintf(out, ", \"%s_per_op\": null", perf_event_names[e]);
+        else fprintf(out, ", \"%s_per_op\": %.4f", perf_event_names[e], v[e]);
+    }
+    if (v[PERF_EV_CYCLES] > 0.0 && v[PERF_EV_INSTRUCTIONS] >= 0.0) {
+        fprintf(out, ", \"ipc\": %.3f", v[PERF_EV_INSTRUCTIONS] / v[PERF_EV_CYCLES]);
+    }
+}
+
+/* bench [-r reps] [-f substring] [-o file.json] [-p] */
+static int tool_bench(int argc, char **argv) {
+    const char *filter;
+    const char *out_path;
+    FILE *out;
+    bench_result r;
+    int reps, use_perf;
+    int i, first;
+
+    reps = BENCH_DEFAULT_REPS;
+    filter = 0;
+    out_path = 0;
+    use_perf = 0;
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0) use_perf = 1;
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) filter = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) out_path = argv[++i];
+        else {
+            fprintf(stderr, "bench: unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (reps < 3) reps = 3;
+    if (reps > BENCH_MAX_REPS) reps = BENCH_MAX_REPS;
+#if defined(BENCH_HAVE_PERF)
+    if (use_perf && perf_counters_open() != 0) {
+        fprintf(stderr, "bench: perf_event_open unavailable, timing only\n");
+        use_perf = 0;
+    }
+#else
+    if (use_perf) fprintf(stderr, "bench: hardware counters need Linux, timing only\n");
+    use_perf = 0;
+#endif
+    out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "bench: cannot open %s\n", out_path);
+        return 1;
+    }
+
+    /* erased EEPROM without the stub's console banner (stdout may carry JSON) */
+    memset(eeprom_memory, 0xFF, EEPROM_SIZE);
+    fprintf(out, "{\"benchmarks\": [\n");
+    first = 1;
+    for (i = 0; i < BENCH_CASES; i++) {
+        if (filter && !strstr(bench_cases[i].name, filter)) continue;
+        bench_run_case(&bench_cases[i], reps, use_perf, &r);
+        fprintf(stderr, "%-28s %12.2f ns/op  (mad %.2f, min %.2f, %lu iters x %d)\n",
+                bench_cases[i].name, r.median_ns, r.mad_ns, r.min_ns, r.iters, r.reps);
+        if (r.have_perf) {
+            fprintf(stderr, "%-28s cyc %.1f  ins %.1f  ipc %.2f  l1d %.3f  llc %.4f  br %.3f  /op\n", "",
+                    r.perf_per_op[PERF_EV_CYCLES], r.perf_per_op[PERF_EV_INSTRUCTIONS],
+                    r.perf_per_op[PERF_EV_CYCLES] > 0.0 ?
+                        r.perf_per_op[PERF_EV_INSTRUCTIONS] / r.perf_per_op[PERF_EV_CYCLES] : 0.0,
+                    r.perf_per_op[PERF_EV_L1D_MISSES], r.perf_per_op[PERF_EV_LLC_MISSES],
+                    r.perf_per_op[PERF_EV_BRANCH_MISSES]);
+        }
+        /* one object per line keeps bench-compare's parser trivial */
+        fprintf(out, "%s  {\"name\": \"%s\", \"iters\": %lu, \"reps\": %d, \"median_ns\": %.3f, "
+                     "\"mean_ns\": %.3f, \"stddev_ns\": %.3f, \"min_ns\": %.3f, \"mad_ns\": %.3f",
+                first ? "" : ",\n", bench_cases[i].name, r.iters, r.reps, r.median_ns,
+                r.mean_ns, r.stddev_ns, r.min_ns, r.mad_ns);
+        bench_print_perf(out, &r);
+        fprintf(out, "}");
+        first = 0;
+    }
+    fprintf(out, "\n]}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
+#define BENCH_FILE_MAX 256
+
+typedef struct {
+    char name[64];
+    double median_ns;
+    double mad_ns;
+} bench_record;
+
+static double bench_json_number(const char *line, const char *key) {
+    const char *p;
+    p = strstr(line, key);
+    if (!p) return 0.0;
+    return atof(p + strlen(key));
+}
+
+static int bench_load(const char *path, bench_record *recs) {
+    char line[512];
+    FILE *f;
+    const char *p, *e;
+    int n;
+
+    f = fopen(path, "r");
+    if (!f) return -1;
+    n = 0;
+    while (n < BENCH_FILE_MAX && fgets(line, sizeof(line), f)) {
+        p = strstr(line, "\"name\": \"");
+        if (!p) continue;
+        p += 9;
+        e = strchr(p, '"');
+        if (!e || e - p >= (int)sizeof(recs[n].name)) continue;
+        memcpy(recs[n].name, p, (size_t)(e - p));
+        recs[n].name[e - p] = '\0';
+        recs[n].median_ns = bench_json_number(line, "\"median_ns\": ");
+        recs[n].mad_ns = bench_json_number(line, "\"mad_ns\": ");
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+/*
+ * bench-compare base.json new.json [threshold_pct]
+ * A case regresses when its median grows by more than the threshold and the
+ * growth also exceeds BENCH_NOISE_MADS times the combined dispersion.
+ */
+static int tool_bench_compare(int argc, char **argv) {
+    static bench_record base[BENCH_FILE_MAX];
+    static bench_record cur[BENCH_FILE_MAX];
+    double threshold, delta, pct;
+    int nb, nc, i, j, regressions;
+    const char *verdict;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: bench-compare base.json new.json [threshold_pct]\n");
+        return 2;
+    }
+    threshold = argc > 2 ? atof(argv[2]) : 5.0;
+    nb = bench_load(argv[0], base);
+    nc = bench_load(argv[1], cur);
+    if (nb < 0 || nc < 0) {
+        fprintf(stderr, "bench-compare: cannot read input\n");
+        return 2;
+    }
+    regressions = 0;
+    for (i = 0; i < nc; i++) {
+        for (j = 0; j < nb && strcmp(base[j].name, cur[i].name) != 0; j++) {
+            /* match by name */
+        }
+        if (j == nb || base[j].median_ns <= 0.0) {
+            printf("%-28s %12.2f ns/op  new\n", cur[i].name, cur[i].median_ns);
+            continue;
+        }
+        delta = cur[i].median_ns - base[j].median_ns;
+        pct = 100.0 * delta / base[j].median_ns;
+        verdict = "ok";
+        if (pct > threshold && delta > BENCH_NOISE_MADS * (base[j].mad_ns + cur[i].mad_ns)) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (-pct > threshold && -delta > BENCH_NOISE_MADS * (base[j].mad_ns + cur[i].mad_ns)) {
+            verdict = "improved";
+        }
+        printf("%-28s %12.2f -> %12.2f ns/op  %+7.1f%%  %s\n",
+               cur[i].name, base[j].median_ns, cur[i].median_ns, pct, verdict);
+    }
+    printf("%d regression(s) over %.1f%%\n", regressions, threshold);
+    return regressions ? 1 : 0;
+}
+
+/* ---------- simulation RNG ---------- */
+
+/* xorshift32: tiny, seedable and identical on every host */
+typedef struct {
+    unsigned long s;
+} sim_rng;
+
+static void sim_rng_seed(sim_rng *r, unsigned long seed) {
+    r->s = (seed * 2654435761UL + 0x9E3779B9UL) & 0xFFFFFFFFUL;
+    if (r->s == 0) r->s = 1;
+}
+
+static unsigned long sim_rng_next(sim_rng *r) {
+    unsigned long x;
+    x = r->s;
+    x ^= (x << 13) & 0xFFFFFFFFUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xFFFFFFFFUL;
+    r->s = x;
+    return x;
+}
+
+/* Uniform in (0,1) */
+static double sim_rng_uniform(sim_rng *r) {
+    return ((double)(sim_rng_next(r) >> 8) + 0.5) / 16777216.0;
+}
+
+static unsigned long sim_rng_below(sim_rng *r, unsigned long n) {
+    return (unsigned long)(sim_rng_uniform(r) * (double)n);
+}
+
+static double sim_rng_exp(sim_rng *r, double rate) {
+    return -log(sim_rng_uniform(r)) / rate;
+}
+
+/* Zipf(s) over 0..n-1 by inverse CDF */
+typedef struct {
+    int n;
+    double *cdf;
+} zipf_table;
+
+static int zipf_init(zipf_table *z, int n, double s) {
+    double sum;
+    int i;
+    z->n = n;
+    z->cdf = (double *)malloc(sizeof(double) * (size_t)n);
+    if (!z->cdf) return -1;
+    sum = 0.0;
+    for (i = 0; i < n; i++) {
+        sum += 1.0 / pow((double)(i + 1), s);
+        z->cdf[i] = sum;
+    }
+    for (i = 0; i < n; i++) z->cdf[i] /= sum;
+    return 0;
+}
+
+static int zipf_sample(const zipf_table *z, sim_rng *r) {
+    double u;
+    int lo, hi, mid;
+    u = sim_rng_uniform(r);
+    lo = 0;
+    hi = z->n - 1;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (z->cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* ---------- badge traffic workload ---------- */
+
+#define WL_DAY_S 86400.0
+#define WL_MAX_DIRECT_EVENTS 4000000UL
+
+typedef struct {
+    unsigned long seed;
+    int users;
+    int doors;
+    double hours;
+    double start_hour;
+    double zipf_s;
+    double pin_typo;
+    double fp_fail;
+    double attacks_per_day;
+    unsigned long max_events;
+} workload_config;
+
+typedef struct {
+    workload_config cfg;
+    sim_rng rng;
+    zipf_table user_pop;
+    zipf_table door_pop;
+    int *home_door;
+    double lambda_max;
+    double t;
+    double t_end;
+    double next_normal;
+    double next_attack;
+    int burst_left;
+    int burst_door;
+    unsigned long emitted;
+} workload_gen;
+
+static double wl_bump(double t, double mu, double sigma) {
+    double d;
+    d = fmod(t - mu + 1.5 * WL_DAY_S, WL_DAY_S) - 0.5 * WL_DAY_S;
+    return exp(-d * d / (2.0 * sigma * sigma)) / (sigma * 2.5066282746310002);
+}
+
+/*
+ * Presentations per second at time-of-day t (seconds): a low background
+ * plus shift changes at 06:00, 14:00 and 22:00 (a third of the site leaves
+ * and a third arrives) and a broad lunch peak around 12:30.
+ */
+static double wl_rate(const workload_gen *g, double t) {
+    double u, rate;
+    u = (double)g->cfg.users;
+    rate = u * 0.5 / WL_DAY_S;
+    rate += (2.0 * u / 3.0) * (wl_bump(t, 6.0 * 3600.0, 900.0) +
+                               wl_bump(t, 14.0 * 3600.0, 900.0) +
+                               wl_bump(t, 22.0 * 3600.0, 900.0));
+    rate += 0.8 * u * wl_bump(t, 12.5 * 3600.0, 2400.0);
+    return rate;
+}
+
+/* Next arrival of the non-homogeneous Poisson process by thinning */
+static double wl_next_arrival(workload_gen *g, double t) {
+    for (;;) {
+        t += sim_rng_exp(&g->rng, g->lambda_max);
+        if (sim_rng_uniform(&g->rng) * g->lambda_max <= wl_rate(g, fmod(t, WL_DAY_S))) return t;
+    }
+}
+
+/* Deterministic 4..8 digit PIN per user */
+static void wl_password(unsigned long seed, int uid, char *out) {
+    sim_rng r;
+    int len, k;
+    sim_rng_seed(&r, seed ^ ((unsigned long)uid * 0x85EBCA6BUL));
+    len = 4 + (int)sim_rng_below(&r, PASSWORD_MAX_LEN - 3);
+    for (k = 0; k < len; k++) out[k] = (char)('0' + sim_rng_below(&r, 10));
+    out[len] = '\0';
+}
+
+static int workload_init(workload_gen *g, const workload_config *cfg) {
+    double t, r;
+    int i;
+
+    memset(g, 0, sizeof(*g));
+    g->cfg = *cfg;
+    sim_rng_seed(&g->rng, cfg->seed);
+    if (zipf_init(&g->user_pop, cfg->users, cfg->zipf_s) != 0) return -1;
+    if (zipf_init(&g->door_pop, cfg->doors, cfg->zipf_s) != 0) return -1;
+    g->home_door = (int *)malloc(sizeof(int) * (size_t)cfg->users);
+    if (!g->home_door) return -1;
+    for (i = 0; i < cfg->users; i++) g->home_door[i] = zipf_sample(&g->door_pop, &g->rng);
+
+    for (t = 0.0; t < WL_DAY_S; t += 60.0) {
+        r = wl_rate(g, t);
+        if (r > g->lambda_max) g->lambda_max = r;
+    }
+    g->lambda_max *= 1.05;
+    g->t = cfg->start_hour * 3600.0;
+    g->t_end = g->t + cfg->hours * 3600.0;
+    g->next_normal = wl_next_arrival(g, g->t);
+    g->next_attack = cfg->attacks_per_day > 0.0 ? g->t + sim_rng_exp(&g->rng, cfg->attacks_per_day / WL_DAY_S) : -1.0;
+    return 0;
+}
+
+static void workload_free(workload_gen *g) {
+    free(g->user_pop.cdf);
+    free(g->door_pop.cdf);
+    free(g->home_door);
+}
+
+/* Produce the next presentation in time order; 0 when the run is over */
+static int workload_next(workload_gen *g, replay_event *ev) {
+    char pw[PASSWORD_MAX_LEN + 1];
+    unsigned long v;
+    int attack, uid, k;
+
+    if (g->cfg.max_events && g->emitted >= g->cfg.max_events) return 0;
+    attack = g->next_attack >= 0.0 && g->next_attack < g->next_normal;
+    g->t = attack ? g->next_attack : g->next_normal;
+    if (!g->cfg.max_events && g->t >= g->t_end) return 0;
+
+    memset(ev, 0, sizeof(*ev));
+    ev->t_ms = (unsigned long)(g->t * 1000.0);
+    if (attack) {
+        /* burst of unregistered cards at one door, a few seconds apart */
+        if (g->burst_left == 0) {
+            g->burst_left = 10 + (int)sim_rng_below(&g->rng, 31);
+            g->burst_door = (int)sim_rng_below(&g->rng, (unsigned long)g->cfg.doors);
+        }
+        ev->door = g->burst_door;
+        v = 10000000UL + sim_rng_below(&g->rng, 89000000UL);
+        v = (v & ~0xFFUL) | (unsigned long)(MAX_USERS + sim_rng_below(&g->rng, 256 - MAX_USERS));
+        sprintf(ev->card, "%08lu", v);
+        if (--g->burst_left > 0) g->next_attack = g->t + 1.0 + 3.0 * sim_rng_uniform(&g->rng);
+        else g->next_attack = g->t + sim_rng_exp(&g->rng, g->cfg.attacks_per_day / WL_DAY_S);
+    } else {
+        uid = zipf_sample(&g->user_pop, &g->rng);
+        ev->door = sim_rng_uniform(&g->rng) < 0.8 ? g->home_door[uid] : zipf_sample(&g->door_pop, &g->rng);
+        sprintf(ev->card, "%08d", uid);
+        wl_password(g->cfg.seed, uid, pw);
+        for (k = 0; k < REPLAY_MAX_ATTEMPTS; k++) {
+            strcpy(ev->pin[ev->n_pin], pw);
+            if (sim_rng_uniform(&g->rng) >= g->cfg.pin_typo) {
+                ev->n_pin++;
+                break;
+            }
+            /* typo: one digit off */
+            ev->pin[ev->n_pin][sim_rng_below(&g->rng, (unsigned long)strlen(pw))] ^= 1;
+            ev->n_pin++;
+        }
+        if (strcmp(ev->pin[ev->n_pin - 1], pw) == 0) {
+            for (k = 0; k < REPLAY_MAX_ATTEMPTS; k++) {
+                ev->fp[ev->n_fp] = (unsigned char)(sim_rng_uniform(&g->rng) >= g->cfg.fp_fail);
+                if (ev->fp[ev->n_fp++]) break;
+            }
+        }
+        g->next_normal = wl_next_arrival(g, g->t);
+    }
+    g->emitted++;
+    return 1;
+}
+
+static void workload_write_event(FILE *f, const replay_event *ev) {
+    int k;
+    fprintf(f, "E %lu %d %s %d", ev->t_ms, ev->door, ev->card, ev->n_pin);
+    for (k = 0; k < ev->n_pin; k++) fprintf(f, " %s", ev->pin[k]);
+    fprintf(f, " %d", ev->n_fp);
+    for (k = 0; k < ev->n_fp; k++) fprintf(f, " %d", ev->fp[k]);
+    fprintf(f, "\n");
+}
+
+/*
+ * Decision engine without peripherals: the same frame parse, card lookup,
+ * EEPROM password check and attempt limits as the door loop, returning the
+ * metrics id of the outcome.
+ */
+static int access_decide(const replay_event *ev) {
+    unsigned char raw[CARD_ID_LEN];
+    char card[CARD_ID_LEN + 1];
+    char stored[PASSWORD_MAX_LEN + 1];
+    int uid, k, ok;
+
+    memset(raw, 0, sizeof(raw));
+    raw[0] = 0x02;
+    for (k = 0; k < CARD_ID_LEN - 2 && ev->card[k] != '\0'; k++) raw[1 + k] = (unsigned char)ev->card[k];
+    raw[1 + k] = 0x03;
+    if (rfid_parse_frame(raw, CARD_ID_LEN, card) != 0) return MET_DENY_RFID;
+    uid = card_to_user_id(card);
+    if (user_admit(uid, DOOR_CLEARANCE, rtc_now_seconds()) != USER_OK) return MET_DENY_CARD;
+
+    stored[PASSWORD_MAX_LEN] = '\0';
+    if (eeprom_read_bytes(USER_SLOT_ADDR(uid), (unsigned char *)stored, PASSWORD_MAX_LEN) != 0 ||
+        (unsigned char)stored[0] == 0xFF || stored[0] == '\0') {
+        return MET_DENY_PASSWORD;
+    }
+    ok = 0;
+    for (k = 0; k < ev->n_pin && k < MAX_PASSWORD_ATTEMPTS && !ok; k++) ok = password_matches(ev->pin[k], stored);
+    if (!ok) return MET_DENY_PASSWORD;
+    ok = 0;
+    for (k = 0; k < ev->n_fp && k < MAX_FP_ATTEMPTS && !ok; k++) ok = ev->fp[k];
+    return ok ? MET_GRANTS : MET_DENY_FP;
+}
+
+/*
+ * workload [-s seed] [-u users] [-d doors] [-H hours] [-S start_hour]
+ *          [-z zipf_s] [-t pin_typo] [-f fp_fail] [-a attacks_per_day]
+ *          [-n events] [-o trace.txt | -x]
+ * Writes a replay trace (see SIMULATION REPLAY), or with -x feeds the
+ * events straight into access_decide() and reports events per second.
+ */
+static int tool_workload(int argc, char **argv) {
+    workload_config cfg;
+    workload_gen g;
+    replay_event *evs;
+    unsigned long outcome[MET_COUNTERS];
+    unsigned long n, i, passes, p;
+    const char *out_path;
+    char pw[PASSWORD_MAX_LEN + 1];
+    FILE *out;
+    double t0, dt;
+    int direct, k;
+
+    cfg.seed = 1;
+    cfg.users = MAX_USERS;
+    cfg.doors = 8;
+    cfg.hours = 24.0;
+    cfg.start_hour = 0.0;
+    cfg.zipf_s = 1.1;
+    cfg.pin_typo = 0.04;
+    cfg.fp_fail = 0.03;
+    cfg.attacks_per_day = 1.0;
+    cfg.max_events = 0;
+    out_path = 0;
+    direct = 0;
+    for (k = 0; k < argc; k++) {
+        if (strcmp(argv[k], "-x") == 0) direct = 1;
+        else if (k + 1 >= argc) break;
+        else if (strcmp(argv[k], "-s") == 0) cfg.seed = strtoul(argv[++k], 0, 10);
+        else if (strcmp(argv[k], "-u") == 0) cfg.users = atoi(argv[++k]);
+        else if (strcmp(argv[k], "-d") == 0) cfg.doors = atoi(argv[++k]);
+        else if (strcmp(argv[k], "-H") == 0) cfg.hours = atof(argv[++k]);
+        else if (strcmp(argv[k], "-S") == 0) cfg.start_hour = atof(argv[++k]);
+        else if (strcmp(argv[k], "-z") == 0) cfg.zipf_s = atof(argv[++k]);
+        else if (strcmp(argv[k], "-t") == 0) cfg.pin_typo = atof(argv[++k]);
+        else if (strcmp(argv[k], "-f") == 0) cfg.fp_fail = atof(argv[++k]);
+        else if (strcmp(argv[k], "-a") == 0) cfg.attacks_per_day = atof(argv[++k]);
+        else if (strcmp(argv[k], "-n") == 0) cfg.max_events = strtoul(argv[++k], 0, 10);
+        else if (strcmp(argv[k], "-o") == 0) out_path = argv[++k];
+        else break;
+    }
+    if (k < argc) {
+        fprintf(stderr, "workload: bad option %s\n", argv[k]);
+        return 2;
+    }
+    if (cfg.users < 1 || cfg.users > MAX_USERS) cfg.users = MAX_USERS;
+    if (cfg.doors < 1) cfg.doors = 1;
+    if (workload_init(&g, &cfg) != 0) return 1;
+
+    if (!direct) {
+        out = out_path ? fopen(out_path, "w") : stdout;
+        if (!out) return 1;
+        fprintf(out, "# mlsas workload seed=%lu users=%d doors=%d hours=%.2f start=%.2f\n",
+                cfg.seed, cfg.users, cfg.doors, cfg.hours, cfg.start_hour);
+        for (k = 0; k < cfg.users; k++) {
+            wl_password(cfg.seed, k, pw);
+            fprintf(out, "P %d %s\n", k, pw);
+        }
+        n = 0;
+        evs = (replay_event *)malloc(sizeof(replay_event));
+        if (!evs) return 1;
+        while (workload_next(&g, evs)) {
+            workload_write_event(out, evs);
+            n++;
+        }
+        free(evs);
+        if (out != stdout) fclose(out);
+        fprintf(stderr, "workload: %lu events\n", n);
+        workload_free(&g);
+        return 0;
+    }
+
+    /* direct drive: generate up front so only the decisions are timed */
+    if (!cfg.max_events) g.cfg.max_events = 1000000UL;
+    if (g.cfg.max_events > WL_MAX_DIRECT_EVENTS) g.cfg.max_events = WL_MAX_DIRECT_EVENTS;
+    evs = (replay_event *)malloc(sizeof(replay_event) * g.cfg.max_events);
+    if (!evs) return 1;
+    n = 0;
+    while (n < g.cfg.max_events && workload_next(&g, &evs[n])) n++;
+    memset(eeprom_memory, 0xFF, EEPROM_SIZE);
+    for (k = 0; k < cfg.users; k++) {
+        wl_password(cfg.seed, k, pw);
+        provision_password(k, pw);
+    }
+    memset(outcome, 0, sizeof(outcome));
+    for (i = 0; i < n; i++) outcome[access_decide(&evs[i])]++;
+
+    passes = 1;
+    for (;;) {
+        t0 = bench_now_ns();
+        for (p = 0; p < passes; p++) {
+            for (i = 0; i < n; i++) bench_sink += (unsigned long)access_decide(&evs[i]);
+        }
+        dt = bench_now_ns() - t0;
+        if (dt > 5e8 || passes >= 1024) break;
+        passes *= 2;
+    }
+    printf("events %lu (%.1f h simulated), %.2f M decisions/s\n",
+           n, n ? (double)(evs[n - 1].t_ms / 1000UL) / 3600.0 - cfg.start_hour : 0.0,
+           (double)n * (double)passes / dt * 1e3);
+    printf("grants %lu, denied: rfid %lu card %lu password %lu fingerprint %lu\n",
+           outcome[MET_GRANTS], outcome[MET_DENY_RFID], outcome[MET_DENY_CARD],
+           outcome[MET_DENY_PASSWORD], outcome[MET_DENY_FP]);
+    free(evs);
+    workload_free(&g);
+    return 0;
+}
+
+/* ---------- reference (floating point) minutiae matcher ---------- */
+
+#define FP_PI 3.14159265358979323846
+#define FP_UNIT_RAD (2.0 * FP_PI / FP_ANGLE_STEPS)
+
+static int fp_angle_diff(int a, int b) {
+    int d;
+    d = (a - b) & (FP_ANGLE_STEPS - 1);
+    return d >= FP_ANGLE_STEPS / 2 ? d - FP_ANGLE_STEPS : d;
+}
+
+/*
+ * Align probe p onto gallery g with a two-stage Hough vote: rotation first,
+ * then translation under each of the FP_ROT_CANDIDATES strongest rotations
+ * (ridge flow makes the rotation histogram multi-modal, with a ghost peak
+ * half a turn away). The candidate whose translation peak is tallest wins;
+ * its pose is refined from the pairs in that 2x2 cell window and minutiae
+ * are then paired greedily within the tolerances.
+ * Score is FP_SCORE_MAX * matched^2 / (|p| * |g|).
+ */
+static int fp_match_score_float(const fp_template *p, const fp_template *g) {
+    unsigned short abins[FP_HOUGH_ANGLE_BINS];
+    unsigned short smooth[FP_HOUGH_ANGLE_BINS];
+    unsigned short cells[FP_HOUGH_XY_CELLS * FP_HOUGH_XY_CELLS];
+    unsigned char used[FP_MAX_MINUTIAE];
+    double c, s, rot, tx, ty, qx, qy, sx, sy, spx, spy, dx, dy, d2, best_d2;
+    int i, j, b, k, cand, best, vote, top, cx, cy, win_x, win_y, rot_units, matched, pick, n, da;
+    long sa;
+    const int half = FP_HOUGH_XY_CELLS * FP_HOUGH_XY_BIN / 2;
+    const int bin_w = FP_ANGLE_STEPS / FP_HOUGH_ANGLE_BINS;
+
+    if (p->count == 0 || g->count == 0) return 0;
+
+    memset(abins, 0, sizeof(abins));
+    for (i = 0; i < p->count; i++) {
+        for (j = 0; j < g->count; j++) abins[((g->m[j].angle - p->m[i].angle) & (FP_ANGLE_STEPS - 1)) / bin_w]++;
+    }
+    for (b = 0; b < FP_HOUGH_ANGLE_BINS; b++) {
+        smooth[b] = (unsigned short)(abins[(b + FP_HOUGH_ANGLE_BINS - 1) % FP_HOUGH_ANGLE_BINS] + 2 * abins[b] +
+                                     abins[(b + 1) % FP_HOUGH_ANGLE_BINS]);
+    }
+
+    top = -1;
+    rot_units = 0;
+    win_x = win_y = 0;
+    for (cand = 0; cand < FP_ROT_CANDIDATES; cand++) {
+        /* next strongest rotation bin; used ones and their neighbours are zeroed */
+        best = 0;
+        for (b = 1; b < FP_HOUGH_ANGLE_BINS; b++) {
+            if (smooth[b] > smooth[best]) best = b;
+        }
+        if (smooth[best] == 0) break;
+        for (k = -1; k <= 1; k++) smooth[(best + k + FP_HOUGH_ANGLE_BINS) % FP_HOUGH_ANGLE_BINS] = 0;
+
+        k = best * bin_w + bin_w / 2;
+        rot = k * FP_UNIT_RAD;
+        c = cos(rot);
+        s = sin(rot);
+        memset(cells, 0, sizeof(cells));
+        for (i = 0; i < p->count; i++) {
+            qx = c * p->m[i].x - s * p->m[i].y;
+            qy = s * p->m[i].x + c * p->m[i].y;
+            for (j = 0; j < g->count; j++) {
+                if (abs(fp_angle_diff(g->m[j].angle, p->m[i].angle + k)) > FP_MATCH_ANGLE) continue;
+                cx = (int)floor((g->m[j].x - qx + half) / FP_HOUGH_XY_BIN);
+                cy = (int)floor((g->m[j].y - qy + half) / FP_HOUGH_XY_BIN);
+                if (cx < 0 || cy < 0 || cx >= FP_HOUGH_XY_CELLS || cy >= FP_HOUGH_XY_CELLS) continue;
+                cells[cy * FP_HOUGH_XY_CELLS + cx]++;
+            }
+        }
+        /* best 2x2 window, so a peak on a cell boundary is not split four ways */
+        for (cy = 0; cy + 1 < FP_HOUGH_XY_CELLS; cy++) {
+            for (cx = 0; cx + 1 < FP_HOUGH_XY_CELLS; cx++) {
+                b = cy * FP_HOUGH_XY_CELLS + cx;
+                vote = cells[b] + cells[b + 1] + cells[b + FP_HOUGH_XY_CELLS] + cells[b + FP_HOUGH_XY_CELLS + 1];
+                if (vote > top) {
+                    top = vote;
+                    rot_units = k;
+                    win_x = cx;
+                    win_y = cy;
+                }
+            }
+        }
+    }
+    if (top <= 0) return 0;
+
+    /* refine: mean rotation residual, then translation between the centroids */
+    rot = rot_units * FP_UNIT_RAD;
+    c = cos(rot);
+    s = sin(rot);
+    sx = sy = 0.0;
+    spx = spy = 0.0;
+    sa = 0;
+    n = 0;
+    for (i = 0; i < p->count; i++) {
+        qx = c * p->m[i].x - s * p->m[i].y;
+        qy = s * p->m[i].x + c * p->m[i].y;
+        for (j = 0; j < g->count; j++) {
+            da = fp_angle_diff(g->m[j].angle, p->m[i].angle + rot_units);
+            if (abs(da) > FP_MATCH_ANGLE) continue;
+            cx = (int)floor((g->m[j].x - qx + half) / FP_HOUGH_XY_BIN);
+            cy = (int)floor((g->m[j].y - qy + half) / FP_HOUGH_XY_BIN);
+            if (cx < win_x || cx > win_x + 1 || cy < win_y || cy > win_y + 1) continue;
+            sa += da;
+            sx += g->m[j].x;
+            sy += g->m[j].y;
+            spx += p->m[i].x;
+            spy += p->m[i].y;
+            n++;
+        }
+    }
+    rot_units += (int)floor((double)sa / n + 0.5);
+    rot = rot_units * FP_UNIT_RAD;
+    c = cos(rot);
+    s = sin(rot);
+    tx = (sx - (c * spx - s * spy)) / n;
+    ty = (sy - (s * spx + c * spy)) / n;
+
+    memset(used, 0, sizeof(used));
+    matched = 0;
+    for (i = 0; i < p->count; i++) {
+        qx = c * p->m[i].x - s * p->m[i].y + tx;
+        qy = s * p->m[i].x + c * p->m[i].y + ty;
+        pick = -1;
+        best_d2 = (double)(FP_MATCH_DIST * FP_MATCH_DIST) + 0.5;
+        for (j = 0; j < g->count; j++) {
+            if (used[j]) continue;
+            if (abs(fp_angle_diff(g->m[j].angle, p->m[i].angle + rot_units)) > FP_MATCH_ANGLE) continue;
+            dx = g->m[j].x - qx;
+            dy = g->m[j].y - qy;
+            d2 = dx * dx + dy * dy;
+            if (d2 < best_d2) {
+                best_d2 = d2;
+                pick = j;
+            }
+        }
+        if (pick >= 0) {
+            used[pick] = 1;
+            matched++;
+        }
+    }
+    return FP_SCORE_MAX * matched * matched / (p->count * g->count);
+}
+
+/* ---------- synthetic fingerprint gallery ---------- */
+
+/*
+ * Each synthetic finger is a master minutiae set laid along a core/delta
+ * orientation field (so directions are correlated the way real ridge flow
+ * is). Impressions of it get a random pose, smooth elastic distortion,
+ * jitter, dropped and spurious minutiae, and are cropped to the sensor
+ * window. Every finger and impression derives from (seed, finger,
+ * impression), so probe sets regenerate without being stored.
+ */
+#define FPGEN_WIN_W 300
+#define FPGEN_WIN_H 400
+#define FPGEN_MASTER_MAX 56
+#define FPGEN_MIN_SEP 16.0
+
+typedef struct {
+    int count;
+    double x[FPGEN_MASTER_MAX];
+    double y[FPGEN_MASTER_MAX];
+    double a[FPGEN_MASTER_MAX];
+    unsigned char type[FPGEN_MASTER_MAX];
+    double core_x, core_y, delta_x, delta_y, field_rot;
+} fpgen_master;
+
+static double sim_rng_gauss(sim_rng *r) {
+    return sqrt(-2.0 * log(sim_rng_uniform(r))) * cos(2.0 * FP_PI * sim_rng_uniform(r));
+}
+
+static double fpgen_orientation(const fpgen_master *f, double x, double y) {
+    return f->field_rot + 0.5 * (atan2(y - f->core_y, x - f->core_x) - atan2(y - f->delta_y, x - f->delta_x));
+}
+
+/* Minutia direction: ridge orientation, either sense, with a little noise */
+static double fpgen_direction(const fpgen_master *f, sim_rng *r, double x, double y) {
+    double a;
+    a = fpgen_orientation(f, x, y) + 0.12 * sim_rng_gauss(r);
+    if (sim_rng_uniform(r) < 0.5) a += FP_PI;
+    return a;
+}
+
+static void fpgen_make_master(fpgen_master *f, unsigned long seed, unsigned long finger) {
+    sim_rng r;
+    double x, y, dx, dy;
+    int target, tries, k, ok;
+
+    sim_rng_seed(&r, seed ^ (finger * 0x9E3779B1UL));
+    f->core_x = FPGEN_WIN_W * (0.35 + 0.3 * sim_rng_uniform(&r));
+    f->core_y = FPGEN_WIN_H * (0.3 + 0.2 * sim_rng_uniform(&r));
+    f->delta_x = f->core_x + (sim_rng_uniform(&r) < 0.5 ? -1.0 : 1.0) * (60.0 + 80.0 * sim_rng_uniform(&r));
+    f->delta_y = f->core_y + 120.0 + 80.0 * sim_rng_uniform(&r);
+    f->field_rot = 0.3 * sim_rng_gauss(&r);
+    target = 38 + (int)sim_rng_below(&r, FPGEN_MASTER_MAX - 37);
+    f->count = 0;
+    for (tries = 0; f->count < target && tries < 4000; tries++) {
+        x = -30.0 + (FPGEN_WIN_W + 60.0) * sim_rng_uniform(&r);
+        y = -30.0 + (FPGEN_WIN_H + 60.0) * sim_rng_uniform(&r);
+        ok = 1;
+        for (k = 0; k < f->count && ok; k++) {
+            dx = f->x[k] - x;
+            dy = f->y[k] - y;
+            ok = dx * dx + dy * dy >= FPGEN_MIN_SEP * FPGEN_MIN_SEP;
+        }
+        if (!ok) continue;
+        f->x[f->count] = x;
+        f->y[f->count] = y;
+        f->a[f->count] = fpgen_direction(f, &r, x, y);
+        f->type[f->count] = (unsigned char)(sim_rng_uniform(&r) < 0.5 ? FP_TYPE_ENDING : FP_TYPE_BIFURCATION);
+        f->count++;
+    }
+}
+
+static unsigned char fpgen_angle_units(double a) {
+    long u;
+    u = (long)floor(a / FP_UNIT_RAD + 0.5);
+    return (unsigned char)(u & (FP_ANGLE_STEPS - 1));
+}
+
+/* One capture of a master finger under a random pose and skin distortion */
+static void fpgen_impression(fp_template *t, const fpgen_master *f, unsigned long seed,
+                             unsigned long finger, unsigned long impression) {
+    sim_rng r;
+    double rot, c, s, tx, ty, ex, ey, amp, psi1, psi2, x, y, rr, px, py, L, prob;
+    int i, spurious, k;
+
+    sim_rng_seed(&r, seed ^ (finger * 0x9E3779B1UL) ^ ((impression + 1) * 0x85EBCA77UL));
+    rot = 0.14 * sim_rng_gauss(&r);
+    if (rot > 0.45) rot = 0.45;
+    if (rot < -0.45) rot = -0.45;
+    c = cos(rot);
+    s = sin(rot);
+    tx = 20.0 * sim_rng_gauss(&r);
+    ty = 20.0 * sim_rng_gauss(&r);
+    ex = FPGEN_WIN_W / 2 + 30.0 * sim_rng_gauss(&r);
+    ey = FPGEN_WIN_H / 2 + 30.0 * sim_rng_gauss(&r);
+    amp = 3.0 + 5.0 * sim_rng_uniform(&r);
+    psi1 = 2.0 * FP_PI * sim_rng_uniform(&r);
+    psi2 = 2.0 * FP_PI * sim_rng_uniform(&r);
+
+    t->count = 0;
+    for (i = 0; i < f->count && t->count < FP_MAX_MINUTIAE; i++) {
+        if (sim_rng_uniform(&r) < 0.12) continue; /* missed by the extractor */
+        /* elastic distortion grows with distance from the contact centre */
+        rr = ((f->x[i] - ex) * (f->x[i] - ex) + (f->y[i] - ey) * (f->y[i] - ey)) / (200.0 * 200.0);
+        x = f->x[i] + amp * rr * cos(psi1 + f->y[i] * (2.0 * FP_PI / 300.0));
+        y = f->y[i] + amp * rr * sin(psi2 + f->x[i] * (2.0 * FP_PI / 300.0));
+        px = c * (x - FPGEN_WIN_W / 2) - s * (y - FPGEN_WIN_H / 2) + FPGEN_WIN_W / 2 + tx + 1.5 * sim_rng_gauss(&r);
+        py = s * (x - FPGEN_WIN_W / 2) + c * (y - FPGEN_WIN_H / 2) + FPGEN_WIN_H / 2 + ty + 1.5 * sim_rng_gauss(&r);
+        if (px < 0.0 || py < 0.0 || px >= FPGEN_WIN_W || py >= FPGEN_WIN_H) continue;
+        t->m[t->count].x = (short)floor(px + 0.5);
+        t->m[t->count].y = (short)floor(py + 0.5);
+        t->m[t->count].angle = fpgen_angle_units(f->a[i] + rot + 0.07 * sim_rng_gauss(&r));
+        /* endings and bifurcations are confused now and then */
+        t->m[t->count].type = (unsigned char)(sim_rng_uniform(&r) < 0.1 ? !f->type[i] : f->type[i]);
+        t->count++;
+    }
+
+    /* spurious minutiae from scars, creases and noise: Poisson(3) */
+    L = exp(-3.0);
+    prob = sim_rng_uniform(&r);
+    for (spurious = 0; prob > L; spurious++) prob *= sim_rng_uniform(&r);
+    for (k = 0; k < spurious && t->count < FP_MAX_MINUTIAE; k++) {
+        px = FPGEN_WIN_W * sim_rng_uniform(&r);
+        py = FPGEN_WIN_H * sim_rng_uniform(&r);
+        t->m[t->count].x = (short)px;
+        t->m[t->count].y = (short)py;
+        t->m[t->count].angle = fpgen_angle_units(fpgen_direction(f, &r, px, py) + rot);
+        t->m[t->count].type = (unsigned char)sim_rng_below(&r, 2);
+        t->count++;
+    }
+}
+
+/* Gallery entry is impression 0 of each finger; probes are impressions 1.. */
+static void fpgen_template(fp_template *t, unsigned long seed, unsigned long finger, unsigned long impression) {
+    fpgen_master f;
+    fpgen_make_master(&f, seed, finger);
+    fpgen_impression(t, &f, seed, finger, impression);
+}
+
+/* Allocate a host gallery, generate n fingers and enroll them as ids 0..n-1 */
+static int fpgen_enroll_gallery(unsigned long seed, int n) {
+    fp_template *store;
+    unsigned char *used;
+    fp_template t;
+    int i;
+
+    store = (fp_template *)malloc(sizeof(fp_template) * (size_t)n);
+    used = (unsigned char *)malloc((size_t)n);
+    if (!store || !used) return -1;
+    fp_gallery_attach(store, used, n);
+    for (i = 0; i < n; i++) {
+        fpgen_template(&t, seed, (unsigned long)i, 0);
+        fp_gallery_enroll(i, &t);
+    }
+    return 0;
+}
+
+#define FPG_MAX_FINGERS 1000000UL
+#define FPG_MAX_PROBES 16UL
+
+/* Probes read back from an fpgallery file, all impression 1s, then 2s...; 0 when generating */
+static fp_template *fpg_probe;
+static unsigned long fpg_fingers, fpg_probes;
+
+/* Read an fpgallery file: enroll each finger as ids 0..n-1 and keep its probes */
+static int fpgallery_load(const char *path) {
+    unsigned char hdr[12];
+    unsigned char packed[FP_PACKED_MAX];
+    unsigned long n, probes, i;
+    fp_template *store;
+    unsigned char *used;
+    fp_template t;
+    FILE *in;
+    int k, len, ok;
+
+    in = fopen(path, "rb");
+    if (!in) return -1;
+    n = probes = 0;
+    ok = fread(hdr, 1, sizeof(hdr), in) == sizeof(hdr) && memcmp(hdr, "FPG1", 4) == 0;
+    for (k = 0; k < 4; k++) {
+        n = (n << 8) | hdr[4 + k];
+        probes = (probes << 8) | hdr[8 + k];
+    }
+    ok = ok && n >= 2 && n <= FPG_MAX_FINGERS && probes >= 1 && probes <= FPG_MAX_PROBES;
+    store = 0;
+    used = 0;
+    if (ok) {
+        store = (fp_template *)malloc(sizeof(fp_template) * n);
+        used = (unsigned char *)malloc(n);
+        fpg_probe = (fp_template *)malloc(sizeof(fp_template) * n * probes);
+        ok = store && used && fpg_probe;
+    }
+    if (ok) fp_gallery_attach(store, used, (int)n);
+    for (i = 0; ok && i < n * (probes + 1); i++) {
+        ok = fread(packed, 1, 2, in) == 2;
+        len = (packed[0] << 8) | packed[1];
+        ok = ok && len >= 1 && len <= FP_PACKED_MAX && fread(packed, 1, (size_t)len, in) == (size_t)len &&
+             fp_template_unpack(&t, packed, len) == len;
+        if (!ok) break;
+        if (i < n) fp_gallery_enroll((int)i, &t);
+        else fpg_probe[i - n] = t;
+    }
+    fclose(in);
+    if (!ok) {
+        free(store);
+        free(used);
+        free(fpg_probe);
+        fpg_probe = 0;
+        return -1;
+    }
+    fpg_fingers = n;
+    fpg_probes = probes;
+    return 0;
+}
+
+/* Impression k (1..) of finger f: from the loaded file, else generated */
+static void fpeval_probe(fp_template *t, unsigned long seed, int f, int k) {
+    if (fpg_probe) *t = fpg_probe[(unsigned long)(k - 1) * fpg_fingers + (unsigned long)f];
+    else fpgen_template(t, seed, (unsigned long)f, (unsigned long)k);
+}
+
+static fp_template bench_fp_gal, bench_fp_mate, bench_fp_other;
+
+static void bench_fp_prepare(void) {
+    static int ready;
+    if (ready) return;
+    fpgen_template(&bench_fp_gal, 1, 0, 0);
+    fpgen_template(&bench_fp_mate, 1, 0, 1);
+    fpgen_template(&bench_fp_other, 1, 1, 1);
+    ready = 1;
+}
+
+/* One mated and one non-mated comparison per two iterations */
+static void bench_fp_match_float(unsigned long iters) {
+    unsigned long i;
+    bench_fp_prepare();
+    for (i = 0; i < iters; i++) {
+        bench_sink += (unsigned long)fp_match_score_float(i & 1 ? &bench_fp_other : &bench_fp_mate, &bench_fp_gal);
+    }
+}
+
+static void bench_fp_match_fixed(unsigned long iters) {
+    unsigned long i;
+    bench_fp_prepare();
+    for (i = 0; i < iters; i++) {
+        bench_sink += (unsigned long)fp_match_score(i & 1 ? &bench_fp_other : &bench_fp_mate, &bench_fp_gal);
+    }
+}
+
+/*
+ * fpgallery [-s seed] [-n fingers] [-p probes] -o file
+ * File: "FPG1", fingers and probes per finger (u32 BE), then the packed
+ * gallery templates followed by every finger's probes, each prefixed by
+ * its packed length (u16 BE).
+ */
+static int tool_fpgallery(int argc, char **argv) {
+    unsigned char packed[FP_PACKED_MAX];
+    unsigned char hdr[12];
+    unsigned long seed, f, imp;
+    unsigned long n, probes;
+    const char *out_path;
+    fp_template t;
+    FILE *out;
+    int k, len;
+
+    seed = 1;
+    n = 10000;
+    probes = 2;
+    out_path = 0;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-n") == 0) n = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-p") == 0) probes = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-o") == 0) out_path = argv[k + 1];
+        else break;
+    }
+    if (k != argc || !out_path) {
+        fprintf(stderr, "usage: fpgallery [-s seed] [-n fingers] [-p probes] -o file\n");
+        return 2;
+    }
+    out = fopen(out_path, "wb");
+    if (!out) return 1;
+    memcpy(hdr, "FPG1", 4);
+    for (k = 0; k < 4; k++) {
+        hdr[4 + k] = (unsigned char)(n >> (24 - 8 * k));
+        hdr[8 + k] = (unsigned char)(probes >> (24 - 8 * k));
+    }
+    fwrite(hdr, 1, sizeof(hdr), out);
+    for (imp = 0; imp <= probes; imp++) {
+        for (f = 0; f < n; f++) {
+            fpgen_template(&t, seed, f, imp);
+            len = fp_template_pack(&t, packed);
+            fputc(len >> 8, out);
+            fputc(len & 0xFF, out);
+            fwrite(packed, 1, (size_t)len, out);
+        }
+    }
+    fclose(out);
+    fprintf(stderr, "fpgallery: %lu fingers, %lu probes each -> %s\n", n, probes, out_path);
+    return 0;
+}
+
+#define FPEVAL_THRESHOLDS 11
+/* fixed vs float agreement over 2000 pairs; fpeval fails outside it */
+#define FPEVAL_MIN_SAME_PCT 94.0
+#define FPEVAL_MAX_MEAN_DIFF 2.5
+#define FPEVAL_MAX_FLIPS 10
+
+/*
+ * fpeval [-s seed] [-n fingers] [-p probes] [-i impostors_per_probe] [-q id_probes] [-g file]
+ * Enrolls a synthetic gallery (or an fpgallery file's, with its probes),
+ * scores mated and random non-mated pairs,
+ * prints FNMR/FMR against threshold and the EER, then runs 1:N searches
+ * for rank-1 accuracy and gallery templates scanned per second. Exits 1
+ * if the fixed-point matcher strays from the float one (FPEVAL_MAX_*).
+ */
+static int tool_fpeval(int argc, char **argv) {
+    static const int thresholds[FPEVAL_THRESHOLDS] = { 10, 20, 30, 40, 60, 80, 100, 150, 200, 300, 400 };
+    unsigned long gen_hist[FP_SCORE_MAX + 1];
+    unsigned long imp_hist[FP_SCORE_MAX + 1];
+    unsigned long seed, ngen, nimp, fnm, fm, hits;
+    const char *gallery_path;
+    int n, probes, impostors, qprobes, k, f, i, other, sc, best, best_id, eer_t;
+    double t0, cmp_ns, fix_ns, id_ns, fmr, fnmr, eer, gap;
+    int max_diff, rc;
+    sim_rng r;
+    fp_template probe;
+
+    seed = 1;
+    n = 2000;
+    probes = 2;
+    impostors = 50;
+    qprobes = 100;
+    gallery_path = 0;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-n") == 0) n = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-p") == 0) probes = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-i") == 0) impostors = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-q") == 0) qprobes = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-g") == 0) gallery_path = argv[k + 1];
+        else break;
+    }
+    if (k != argc || n < 2 || probes < 1) {
+        fprintf(stderr, "usage: fpeval [-s seed] [-n fingers] [-p probes] [-i impostors] [-q id_probes] [-g file]\n");
+        return 2;
+    }
+    if (gallery_path) {
+        if (fpgallery_load(gallery_path) != 0) {
+            fprintf(stderr, "fpeval: %s is not a readable fpgallery file\n", gallery_path);
+            return 1;
+        }
+        /* the file decides the gallery; -n and -p can only narrow it */
+        if ((unsigned long)n > fpg_fingers) n = (int)fpg_fingers;
+        if ((unsigned long)probes > fpg_probes) probes = (int)fpg_probes;
+    } else if (fpgen_enroll_gallery(seed, n) != 0) {
+        return 1;
+    }
+
+    memset(gen_hist, 0, sizeof(gen_hist));
+    memset(imp_hist, 0, sizeof(imp_hist));
+    sim_rng_seed(&r, seed + 17);
+    ngen = nimp = 0;
+    cmp_ns = 0.0;
+    for (f = 0; f < n; f++) {
+        for (k = 1; k <= probes; k++) {
+            fpeval_probe(&probe, seed, f, k);
+            t0 = bench_now_ns();
+            sc = fp_match_score_float(&probe, fp_gallery_get(f));
+            gen_hist[sc]++;
+            ngen++;
+            for (i = 0; i < impostors; i++) {
+                other = (f + 1 + (int)sim_rng_below(&r, (unsigned long)(n - 1))) % n;
+                imp_hist[fp_match_score_float(&probe, fp_gallery_get(other))]++;
+                nimp++;
+            }
+            cmp_ns += bench_now_ns() - t0;
+        }
+    }
+
+    printf("fingers %d, mated %lu, non-mated %lu, %.0f comparisons/s\n",
+           n, ngen, nimp, (double)(ngen + nimp) / cmp_ns * 1e9);
+    printf("threshold      FNMR        FMR\n");
+    for (k = 0; k < FPEVAL_THRESHOLDS; k++) {
+        fnm = fm = 0;
+        for (sc = 0; sc <= FP_SCORE_MAX; sc++) {
+            if (sc < thresholds[k]) fnm += gen_hist[sc];
+            else fm += imp_hist[sc];
+        }
+        printf("%9d  %9.5f  %9.6f\n", thresholds[k], (double)fnm / ngen, (double)fm / nimp);
+    }
+    /* EER: threshold where the two error curves cross */
+    fnm = 0;
+    fm = nimp;
+    eer = 1.0;
+    eer_t = 0;
+    gap = 2.0;
+    for (sc = 0; sc <= FP_SCORE_MAX; sc++) {
+        fnmr = (double)fnm / ngen;
+        fmr = (double)fm / nimp;
+        if (fabs(fnmr - fmr) < gap) {
+            gap = fabs(fnmr - fmr);
+            eer = (fnmr + fmr) / 2.0;
+            eer_t = sc;
+        }
+        fnm += gen_hist[sc];
+        fm -= imp_hist[sc];
+    }
+    printf("EER %.4f at threshold %d\n", eer, eer_t);
+
+    /* fixed-point matcher against the reference on the same pairs */
+    sim_rng_seed(&r, seed + 29);
+    fnm = fm = 0;
+    gap = 0.0;
+    cmp_ns = fix_ns = 0.0;
+    max_diff = 0;
+    rc = 0;
+    for (k = 0; k < 2000; k++) {
+        f = (int)sim_rng_below(&r, (unsigned long)n);
+        other = k & 1 ? f : (f + 1 + (int)sim_rng_below(&r, (unsigned long)(n - 1))) % n;
+        fpeval_probe(&probe, seed, f, 1);
+        t0 = bench_now_ns();
+        sc = fp_match_score_float(&probe, fp_gallery_get(other));
+        cmp_ns += bench_now_ns() - t0;
+        t0 = bench_now_ns();
+        i = fp_match_score(&probe, fp_gallery_get(other));
+        fix_ns += bench_now_ns() - t0;
+        if (abs(sc - i) > max_diff) max_diff = abs(sc - i);
+        gap += abs(sc - i);
+        fnm += sc == i;
+        fm += (sc >= FP_MATCH_THRESHOLD) != (i >= FP_MATCH_THRESHOLD);
+    }
+    printf("fixed vs float: %.1f%% identical, mean |diff| %.2f, max %d, decision flips %lu/2000, "
+           "%.2f vs %.2f us per comparison\n",
+           fnm / 20.0, gap / 2000.0, max_diff, fm, fix_ns / 2000.0 / 1e3, cmp_ns / 2000.0 / 1e3);
+    if (fnm / 20.0 < FPEVAL_MIN_SAME_PCT || gap / 2000.0 > FPEVAL_MAX_MEAN_DIFF || fm > FPEVAL_MAX_FLIPS) {
+        printf("fixed vs float: outside tolerance (identical >= %.0f%%, mean |diff| <= %.1f, flips <= %d)\n",
+               FPEVAL_MIN_SAME_PCT, FPEVAL_MAX_MEAN_DIFF, FPEVAL_MAX_FLIPS);
+        rc = 1;
+    }
+
+    /* 1:N identification over the whole gallery */
+    if (qprobes > n) qprobes = n;
+    hits = 0;
+    t0 = bench_now_ns();
+    for (k = 0; k < qprobes; k++) {
+        f = (int)((long)k * n / qprobes);
+        fpeval_probe(&probe, seed, f, 1);
+        best = -1;
+        best_id = -1;
+        for (i = 0; i < n; i++) {
+            sc = fp_match_score_float(&probe, fp_gallery_get(i));
+            if (sc > best) {
+                best = sc;
+                best_id = i;
+            }
+        }
+        hits += best_id == f;
+    }
+    id_ns = bench_now_ns() - t0;
+    if (qprobes > 0) {
+        printf("1:N over %d: rank-1 %.4f, %.0f templates/s, %.2f ms per search\n", n,
+               (double)hits / qprobes, (double)qprobes * n / id_ns * 1e9, id_ns / qprobes / 1e6);
+    }
+    return rc;
+}
+
+/*
+ * fpcache [-s seed] [-n events] [-u users]
+ * Replays generated badge traffic through the slot cache for several slot
+ * counts, with and without idle-time hot prefetch, and reports how often
+ * the resolved user's template was already resident (no upload needed).
+ * Uploads that do happen start at RFID time, overlapped with PIN entry.
+ */
+static int tool_fpcache(int argc, char **argv) {
+    static const int slot_counts[] = { 4, 8, 16, 32 };
+    workload_config cfg;
+    workload_gen g;
+    replay_event ev;
+    unsigned long hits, events, uploads;
+    double last_t;
+    int k, sc, prefetch, uid;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.seed = 1;
+    cfg.users = MAX_USERS;
+    cfg.doors = 8;
+    cfg.zipf_s = 1.1;
+    cfg.pin_typo = 0.04;
+    cfg.fp_fail = 0.03;
+    cfg.attacks_per_day = 1.0;
+    cfg.max_events = 100000;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) cfg.seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-n") == 0) cfg.max_events = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-u") == 0) cfg.users = atoi(argv[k + 1]);
+        else break;
+    }
+    if (k != argc) {
+        fprintf(stderr, "usage: fpcache [-s seed] [-n events] [-u users]\n");
+        return 2;
+    }
+    if (cfg.users < 1 || cfg.users > MAX_USERS) cfg.users = MAX_USERS;
+    if (fpgen_enroll_gallery(cfg.seed, MAX_USERS) != 0) return 1;
+    stub_quiet = 1;
+
+    printf("users %d, events %lu, Zipf %.2f\n", cfg.users, cfg.max_events, cfg.zipf_s);
+    printf("slots  prefetch   hit-rate  uploads/1k\n");
+    for (sc = 0; sc < (int)(sizeof(slot_counts) / sizeof(slot_counts[0])); sc++) {
+        for (prefetch = 0; prefetch <= 1; prefetch++) {
+            if (workload_init(&g, &cfg) != 0) return 1;
+            fp_cache_init(slot_counts[sc]);
+            hits = events = 0;
+            uploads = metrics_sum_counter(MET_FP_SLOT_UPLOADS);
+            last_t = 0.0;
+            while (workload_next(&g, &ev)) {
+                uid = card_to_user_id(ev.card);
+                if (uid < 0) continue;
+                /* gaps of a minute or more give the loop idle time */
+                if (prefetch && g.t - last_t >= 60.0) fp_cache_prefetch_hot();
+                last_t = g.t;
+                fp_cache_note_badge(uid);
+                hits += fp_cache_resident(uid);
+                events++;
+                fp_cache_load(uid);
+            }
+            workload_free(&g);
+            printf("%5d  %8s   %7.2f%%  %10.1f\n", slot_counts[sc], prefetch ? "hot" : "lru",
+                   events ? 100.0 * hits / events : 0.0,
+                   events ? 1000.0 * (metrics_sum_counter(MET_FP_SLOT_UPLOADS) - uploads) / events : 0.0);
+        }
+    }
+    stub_quiet = 0;
+    return 0;
+}
+
+/* ---------- dispatcher ---------- */
+
+static int tool_run(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    return access_control_loop();
+}
+
+/*
+ * Policy model for fpzone: zone 0 is the site-wide entrance, zones 1.. are
+ * departments of Zipf-distributed size. Staff get their department, a few
+ * get a second one, and facilities/security hold every zone.
+ */
+static unsigned fpzone_policy(sim_rng *r, const zipf_table *dept, int zones) {
+    unsigned mask;
+    if (sim_rng_uniform(r) < 0.02) return (1u << zones) - 1u;
+    mask = 1u | (1u << (1 + zipf_sample(dept, r)));
+    if (sim_rng_uniform(r) < 0.15) mask |= 1u << (1 + zipf_sample(dept, r));
+    return mask;
+}
+
+/*
+ * fpzone [-s seed] [-n fingers] [-z zones] [-q probes] [-i impostors] [-c churn]
+ * Builds zone partitions incrementally (policy before and after enrollment,
+ * then churn), checks them against the policy, and compares zone-scoped with
+ * whole-gallery identification for speed and false-match exposure.
+ */
+static int tool_fpzone(int argc, char **argv) {
+    unsigned char *mask;
+    int *ids, *members;
+    fp_template *store;
+    unsigned char *used;
+    unsigned long seed;
+    int n, zones, qprobes, impostors, churn, k, i, z, id, hits, exposed_all, exposed, count;
+    double t0, all_ns, zone_ns, ratio_sum;
+    zipf_table dept;
+    sim_rng r;
+    fp_template probe;
+
+    seed = 1;
+    n = 1000;
+    zones = FP_ZONES;
+    qprobes = 30;
+    impostors = 100;
+    churn = 1000;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-n") == 0) n = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-z") == 0) zones = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-q") == 0) qprobes = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-i") == 0) impostors = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-c") == 0) churn = atoi(argv[k + 1]);
+        else break;
+    }
+    if (k != argc || n < 2 || zones < 2 || zones > FP_ZONES || qprobes < 1 || impostors < 0 || churn < 0) {
+        fprintf(stderr, "usage: fpzone [-s seed] [-n fingers] [-z zones 2..%d] [-q probes] [-i impostors] [-c churn]\n",
+                FP_ZONES);
+        return 2;
+    }
+    mask = (unsigned char *)malloc((size_t)n);
+    ids = (int *)malloc(sizeof(int) * (size_t)n * FP_ZONES);
+    members = (int *)malloc(sizeof(int) * (size_t)n);
+    store = (fp_template *)malloc(sizeof(fp_template) * (size_t)n);
+    used = (unsigned char *)malloc((size_t)n);
+    if (!mask || !ids || !members || !store || !used || zipf_init(&dept, zones - 1, 1.0) != 0) return 1;
+    sim_rng_seed(&r, seed + 41);
+
+    /* half the policy is set before enrollment, half after, then churn */
+    fp_gallery_attach(store, used, n);
+    fp_gallery_attach_zones(mask, ids);
+    for (id = 0; id < n; id += 2) fp_gallery_set_zones(id, fpzone_policy(&r, &dept, zones));
+    for (id = 0; id < n; id++) {
+        fpgen_template(&probe, seed, (unsigned long)id, 0);
+        fp_gallery_enroll(id, &probe);
+    }
+    for (id = 1; id < n; id += 2) fp_gallery_set_zones(id, fpzone_policy(&r, &dept, zones));
+    for (k = 0; k < churn; k++) {
+        id = (int)sim_rng_below(&r, (unsigned long)n);
+        if (k % 10 == 0) {
+            fp_gallery_remove(id);
+            fpgen_template(&probe, seed, (unsigned long)id, 0);
+            fp_gallery_enroll(id, &probe);
+        } else {
+            fp_gallery_set_zones(id, fpzone_policy(&r, &dept, zones));
+        }
+    }
+    for (z = 0; z < FP_ZONES; z++) {
+        count = 0;
+        for (id = 0; id < n; id++) count += (mask[id] >> z) & 1;
+        for (i = 0; i < fp_zone_len[z]; i++) count -= (mask[ids[(long)z * n + i]] >> z) & 1;
+        if (count != 0) {
+            fprintf(stderr, "zone %d partition out of step with policy\n", z);
+            return 1;
+        }
+    }
+
+    /* whole-gallery baseline */
+    t0 = bench_now_ns();
+    for (k = 0; k < qprobes; k++) {
+        fpgen_template(&probe, seed, (unsigned long)((long)k * n / qprobes), 1);
+        fp_identify(&probe, FP_MATCH_THRESHOLD, 0);
+    }
+    all_ns = (bench_now_ns() - t0) / qprobes;
+
+    /* unenrolled fingers: how many would open some door searched globally */
+    exposed_all = 0;
+    for (i = 0; i < impostors; i++) {
+        fpgen_template(&probe, seed, (unsigned long)(n + i), 1);
+        exposed_all += fp_identify(&probe, FP_MATCH_THRESHOLD, 0) >= 0;
+    }
+
+    printf("fingers %d, zones %d, churn %d, whole gallery %.2f ms per search, %d/%d impostors matched\n",
+           n, zones, churn, all_ns / 1e6, exposed_all, impostors);
+    printf("zone  members   ratio  ms/search  speedup  rank-1  impostors matched\n");
+    ratio_sum = 0.0;
+    for (z = 0; z < zones; z++) {
+        /* mated probes of users admitted in this zone */
+        count = 0;
+        for (id = 0; id < n; id++) {
+            if ((mask[id] >> z) & 1) members[count++] = id;
+        }
+        hits = 0;
+        zone_ns = 0.0;
+        for (k = 0; k < qprobes && count > 0; k++) {
+            id = members[(long)k * count / qprobes];
+            fpgen_template(&probe, seed, (unsigned long)id, 1);
+            t0 = bench_now_ns();
+            hits += fp_identify_zone(&probe, z, FP_MATCH_THRESHOLD, 0) == id;
+            zone_ns += bench_now_ns() - t0;
+        }
+        zone_ns /= qprobes;
+        exposed = 0;
+        for (i = 0; i < impostors; i++) {
+            fpgen_template(&probe, seed, (unsigned long)(n + i), 1);
+            exposed += fp_identify_zone(&probe, z, FP_MATCH_THRESHOLD, 0) >= 0;
+        }
+        ratio_sum += (double)count / n;
+        printf("%4d  %7d  %6.3f  %9.3f  %6.1fx  %6.3f  %8d/%d\n", z, count, (double)count / n, zone_ns / 1e6,
+               zone_ns > 0.0 ? all_ns / zone_ns : 0.0, (double)hits / qprobes, exposed, impostors);
+    }
+    printf("mean authorization ratio %.3f\n", ratio_sum / zones);
+    free(dept.cdf);
+    free(mask);
+    free(ids);
+    free(members);
+    free(store);
+    free(used);
+    return 0;
+}
+
+/*
+ * Scatter-gather gallery search (fpdist). Shard s holds ids with
+ * id % nodes == s and lives on node s, with a replica on node s+1. The
+ * requesting controller sends the probe to every primary, hedges a shard
+ * to its replica once the primary is slower than the recent p90 of shard
+ * replies, and
+ * merges the first top-K reply per shard. Nodes are forked processes on
+ * localhost UDP.
+ *
+ *   query  'Q' qid[4] shard k template(packed)
+ *   reply  'R' qid[4] shard n { id[4] score[2] } * n
+ *   ready  'H' node          exit  'X'
+ */
+#define DIST_MAX_NODES 16
+#define DIST_MAX_K 16
+#define DIST_MSG_MAX (7 + FP_PACKED_MAX + DIST_MAX_K * 6)
+#define DIST_LAT_RING 256
+#define DIST_HEDGE_MIN_SAMPLES 16
+#define DIST_HEDGE_PCT 90
+#define DIST_TIMEOUT_MS 5000
+#define DIST_NODE_QUEUE 8
+
+typedef struct {
+    int id;
+    int score;
+} dist_hit;
+
+typedef struct {
+    int fd;
+    int nodes;
+    int pid[DIST_MAX_NODES];
+    struct sockaddr_in addr[DIST_MAX_NODES];
+    double lat[DIST_LAT_RING];
+    int lat_n;
+    unsigned long sent_qid[DIST_LAT_RING];
+    double sent_at[DIST_LAT_RING];
+    unsigned long hedges;
+} dist_cluster;
+
+static void dist_put32(unsigned char *p, unsigned long v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static unsigned long dist_get32(const unsigned char *p) {
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+/* Insert into a best-first list of at most k hits; returns the new length */
+static int dist_topk_insert(dist_hit *top, int n, int k, int id, int score) {
+    int i;
+    if (n == k && score <= top[n - 1].score) return n;
+    if (n < k) n++;
+    for (i = n - 1; i > 0 && top[i - 1].score < score; i--) top[i] = top[i - 1];
+    top[i].id = id;
+    top[i].score = score;
+    return n;
+}
+
+static int dist_udp_socket(struct sockaddr_in *bound) {
+    socklen_t len;
+    int fd;
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    memset(bound, 0, sizeof(*bound));
+    bound->sin_family = AF_INET;
+    bound->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(*bound);
+    if (bind(fd, (struct sockaddr *)bound, len) != 0 || getsockname(fd, (struct sockaddr *)bound, &len) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Score one query against the shard it names; returns the reply length or 0 */
+static int dist_node_answer(unsigned char *msg, int len, fp_template *const *store, const int *shard,
+                            const int *count, int nodes) {
+    dist_hit top[DIST_MAX_K];
+    fp_template probe;
+    int h, i, k, nt;
+
+    h = msg[5] == shard[0] ? 0 : (msg[5] == shard[1] ? 1 : -1);
+    k = msg[6] < DIST_MAX_K ? msg[6] : DIST_MAX_K;
+    if (h < 0 || k < 1 || fp_template_unpack(&probe, msg + 7, len - 7) < 0) return 0;
+    nt = 0;
+    for (i = 0; i < count[h]; i++) {
+        nt = dist_topk_insert(top, nt, k, i * nodes + shard[h], fp_match_score(&probe, &store[h][i]));
+    }
+    msg[0] = 'R';
+    msg[6] = (unsigned char)nt;
+    for (i = 0; i < nt; i++) {
+        dist_put32(msg + 7 + i * 6, (unsigned long)top[i].id);
+        msg[11 + i * 6] = (unsigned char)(top[i].score >> 8);
+        msg[12 + i * 6] = (unsigned char)top[i].score;
+    }
+    return 7 + nt * 6;
+}
+
+/*
+ * Node process: build its primary shard and the replica of its
+ * predecessor's, then answer queries until told to exit. The requester
+ * has one query outstanding, so anything older than the newest queued
+ * qid has already been answered elsewhere and is dropped unscored.
+ * straggle is the chance a reply is held back stall_ms (GC, flash, a
+ * busy neighbour).
+ */
+static void dist_node_run(int fd, const struct sockaddr_in *coord, int node, int nodes, int n,
+                          unsigned long seed, double straggle, int stall_ms) {
+    static unsigned char pend[DIST_NODE_QUEUE][DIST_MSG_MAX];
+    fp_template *store[2];
+    int shard[2], count[2], len[DIST_NODE_QUEUE], h, i, np, flags;
+    struct sockaddr_in from[DIST_NODE_QUEUE];
+    socklen_t flen[DIST_NODE_QUEUE];
+    unsigned long latest;
+    struct timespec ts;
+    sim_rng r;
+
+    shard[0] = node;
+    shard[1] = (node + nodes - 1) % nodes;
+    for (h = 0; h < 2; h++) {
+        count[h] = n / nodes + (shard[h] < n % nodes);
+        store[h] = (fp_template *)malloc(sizeof(fp_template) * (size_t)(count[h] + 1));
+        if (!store[h]) _exit(1);
+        for (i = 0; i < count[h]; i++) {
+            fpgen_template(&store[h][i], seed, (unsigned long)(i * nodes + shard[h]), 0);
+        }
+    }
+    sim_rng_seed(&r, seed * 31 + (unsigned long)node);
+    pend[0][0] = 'H';
+    pend[0][1] = (unsigned char)node;
+    sendto(fd, pend[0], 2, 0, (const struct sockaddr *)coord, sizeof(*coord));
+    latest = 0;
+    for (;;) {
+        /* block for one datagram, then take whatever else is already queued */
+        np = 0;
+        flags = 0;
+        while (np < DIST_NODE_QUEUE) {
+            flen[np] = sizeof(from[np]);
+            len[np] = (int)recvfrom(fd, pend[np], DIST_MSG_MAX, flags, (struct sockaddr *)&from[np], &flen[np]);
+            if (len[np] < 1) break;
+            if (pend[np][0] == 'X') _exit(0);
+            flags = MSG_DONTWAIT;
+            if (pend[np][0] != 'Q' || len[np] < 7) continue;
+            if (dist_get32(pend[np] + 1) > latest) latest = dist_get32(pend[np] + 1);
+            np++;
+        }
+        if (np == 0 && flags == 0) break;
+        for (i = 0; i < np; i++) {
+            if (dist_get32(pend[i] + 1) < latest) continue;
+            len[i] = dist_node_answer(pend[i], len[i], store, shard, count, nodes);
+            if (len[i] == 0) continue;
+            if (sim_rng_uniform(&r) < straggle) {
+                ts.tv_sec = stall_ms / 1000;
+                ts.tv_nsec = (long)(stall_ms % 1000) * 1000000L;
+                nanosleep(&ts, 0);
+            }
+            sendto(fd, pend[i], (size_t)len[i], 0, (struct sockaddr *)&from[i], flen[i]);
+        }
+    }
+    _exit(0);
+}
+
+static void dist_stop(dist_cluster *c) {
+    unsigned char x;
+    int i;
+    x = 'X';
+    for (i = 0; i < c->nodes; i++) {
+        if (c->pid[i] <= 0) continue;
+        sendto(c->fd, &x, 1, 0, (struct sockaddr *)&c->addr[i], sizeof(c->addr[i]));
+        waitpid(c->pid[i], 0, 0);
+    }
+    close(c->fd);
+}
+
+static int dist_start(dist_cluster *c, int nodes, int n, unsigned long seed, double straggle, int stall_ms) {
+    struct sockaddr_in coord;
+    struct pollfd pfd;
+    unsigned char msg[2];
+    int i, fd, ready;
+
+    memset(c, 0, sizeof(*c));
+    c->nodes = nodes;
+    c->fd = dist_udp_socket(&coord);
+    if (c->fd < 0) return -1;
+    for (i = 0; i < nodes; i++) {
+        fd = dist_udp_socket(&c->addr[i]);
+        if (fd < 0) break;
+        fflush(stdout);
+        c->pid[i] = fork();
+        if (c->pid[i] == 0) {
+            close(c->fd);
+            dist_node_run(fd, &coord, i, nodes, n, seed, straggle, stall_ms);
+        }
+        close(fd);
+        if (c->pid[i] < 0) break;
+    }
+    ready = 0;
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    while (i == nodes && ready < nodes && poll(&pfd, 1, 60000) == 1) {
+        if (recv(c->fd, msg, sizeof(msg), 0) == 2 && msg[0] == 'H') ready++;
+    }
+    if (ready != nodes) {
+        dist_stop(c);
+        return -1;
+    }
+    return 0;
+}
+
+static double dist_hedge_ms(const dist_cluster *c) {
+    double v[DIST_LAT_RING];
+    int n;
+    n = c->lat_n < DIST_LAT_RING ? c->lat_n : DIST_LAT_RING;
+    memcpy(v, c->lat, sizeof(double) * (size_t)n);
+    qsort(v, (size_t)n, sizeof(double), bench_cmp_double);
+    return v[(n * DIST_HEDGE_PCT) / 100];
+}
+
+/* One identification: returns merged hits (best first) or -1 on timeout */
+static int dist_search(dist_cluster *c, unsigned long qid, const fp_template *probe, int k, int hedge,
+                       dist_hit *out) {
+    unsigned char req[DIST_MSG_MAX], rep[DIST_MSG_MAX];
+    unsigned char done[DIST_MAX_NODES], backup[DIST_MAX_NODES];
+    struct pollfd pfd;
+    struct sockaddr_in from;
+    socklen_t flen;
+    double t0, now, hedge_at;
+    unsigned long rq;
+    int s, i, len, req_len, left, nout, wait_ms;
+
+    req[0] = 'Q';
+    dist_put32(req + 1, qid);
+    req[6] = (unsigned char)k;
+    req_len = 7 + fp_template_pack(probe, req + 7);
+    t0 = bench_now_ns();
+    c->sent_qid[qid % DIST_LAT_RING] = qid;
+    c->sent_at[qid % DIST_LAT_RING] = t0;
+    for (s = 0; s < c->nodes; s++) {
+        req[5] = (unsigned char)s;
+        sendto(c->fd, req, (size_t)req_len, 0, (struct sockaddr *)&c->addr[s], sizeof(c->addr[s]));
+        done[s] = backup[s] = 0;
+    }
+    hedge = hedge && c->nodes > 1 && c->lat_n >= DIST_HEDGE_MIN_SAMPLES;
+    hedge_at = hedge ? t0 + dist_hedge_ms(c) * 1e6 : 0.0;
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    left = c->nodes;
+    nout = 0;
+    while (left > 0) {
+        now = bench_now_ns();
+        if (now - t0 > DIST_TIMEOUT_MS * 1e6) return -1;
+        wait_ms = hedge ? (int)((hedge_at - now) / 1e6) + 1 : DIST_TIMEOUT_MS;
+        if (wait_ms < 0) wait_ms = 0;
+        if (poll(&pfd, 1, wait_ms) == 0) {
+            if (!hedge) continue;
+            for (s = 0; s < c->nodes; s++) {
+                if (done[s] || backup[s]) continue;
+                req[5] = (unsigned char)s;
+                i = (s + 1) % c->nodes;
+                sendto(c->fd, req, (size_t)req_len, 0, (struct sockaddr *)&c->addr[i], sizeof(c->addr[i]));
+                backup[s] = 1;
+                c->hedges++;
+            }
+            hedge = 0;
+            continue;
+        }
+        flen = sizeof(from);
+        len = (int)recvfrom(c->fd, rep, sizeof(rep), 0, (struct sockaddr *)&from, &flen);
+        if (len < 7 || rep[0] != 'R' || rep[5] >= c->nodes) continue;
+        s = rep[5];
+        rq = dist_get32(rep + 1);
+        /*
+         * Every primary reply, late ones included, feeds the hedge
+         * threshold; hedged winners would bias it towards the delay itself.
+         */
+        if (from.sin_port == c->addr[s].sin_port && c->sent_qid[rq % DIST_LAT_RING] == rq) {
+            c->lat[c->lat_n++ % DIST_LAT_RING] = (bench_now_ns() - c->sent_at[rq % DIST_LAT_RING]) / 1e6;
+        }
+        if (rq != qid || done[s] || len < 7 + rep[6] * 6) continue;
+        done[s] = 1;
+        left--;
+        for (i = 0; i < rep[6]; i++) {
+            nout = dist_topk_insert(out, nout, k, (int)dist_get32(rep + 7 + i * 6),
+                                    (rep[11 + i * 6] << 8) | rep[12 + i * 6]);
+        }
+    }
+    return nout;
+}
+
+/*
+ * fpdist [-s seed] [-n fingers] [-N max_nodes] [-q queries] [-k topk]
+ *        [-x straggle_prob] [-m stall_ms]
+ * p50/p99 identification latency for 1, 2, 4 .. max_nodes nodes, plain
+ * scatter-gather vs hedged.
+ */
+static int tool_fpdist(int argc, char **argv) {
+    dist_cluster c;
+    dist_hit hits[DIST_MAX_K];
+    fp_template probe;
+    unsigned long seed, qid;
+    double straggle, t0, *lat;
+    int n, max_nodes, queries, k, stall_ms, nodes, hedge, q, res, rank1, a;
+
+    seed = 1;
+    n = 1000;
+    max_nodes = 8;
+    queries = 200;
+    k = 5;
+    straggle = 0.01;
+    stall_ms = 50;
+    for (a = 0; a + 1 < argc; a += 2) {
+        if (strcmp(argv[a], "-s") == 0) seed = strtoul(argv[a + 1], 0, 10);
+        else if (strcmp(argv[a], "-n") == 0) n = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-N") == 0) max_nodes = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-q") == 0) queries = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-k") == 0) k = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-x") == 0) straggle = atof(argv[a + 1]);
+        else if (strcmp(argv[a], "-m") == 0) stall_ms = atoi(argv[a + 1]);
+        else break;
+    }
+    if (a != argc || n < 1 || max_nodes < 1 || max_nodes > DIST_MAX_NODES || queries < 1 || k < 1 ||
+        k > DIST_MAX_K || stall_ms < 0) {
+        fprintf(stderr, "usage: fpdist [-s seed] [-n fingers] [-N max_nodes<=%d] [-q queries] [-k topk<=%d] "
+                "[-x straggle_prob] [-m stall_ms]\n", DIST_MAX_NODES, DIST_MAX_K);
+        return 2;
+    }
+    lat = (double *)malloc(sizeof(double) * (size_t)queries);
+    if (!lat) return 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("fingers %d, top-%d, %d queries, straggle %.0f%% x %d ms\n", n, k, queries, straggle * 100.0, stall_ms);
+#if defined(_SC_NPROCESSORS_ONLN)
+    /* nodes beyond the core count time-share, so latency stops scaling there */
+    printf("online cpus %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+    /* a hedge re-runs a shard on a node that is busy with its own, so it only pays with a core to spare */
+    printf("hedging needs a spare core: at %ld node(s) or more, hedged requests compete with the primaries "
+           "and can raise p99\n", sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+    printf("nodes  hedged     p50 ms     p99 ms   hedges  rank-1\n");
+    qid = 0;
+    for (nodes = 1; nodes <= max_nodes; nodes *= 2) {
+        if (dist_start(&c, nodes, n, seed, straggle, stall_ms) != 0) {
+            fprintf(stderr, "fpdist: could not start %d nodes\n", nodes);
+            free(lat);
+            return 1;
+        }
+        for (hedge = 0; hedge <= (nodes > 1); hedge++) {
+            c.hedges = 0;
+            rank1 = 0;
+            for (q = 0; q < queries; q++) {
+                a = (int)((long)q * n / queries);
+                fpgen_template(&probe, seed, (unsigned long)a, 1);
+                t0 = bench_now_ns();
+                res = dist_search(&c, ++qid, &probe, k, hedge, hits);
+                lat[q] = (bench_now_ns() - t0) / 1e6;
+                rank1 += res > 0 && hits[0].id == a;
+            }
+            qsort(lat, (size_t)queries, sizeof(double), bench_cmp_double);
+            printf("%5d  %6s  %9.2f  %9.2f  %7lu  %6.3f\n", nodes, hedge ? "yes" : "no", lat[queries / 2],
+                   lat[(queries * 99) / 100], c.hedges, (double)rank1 / queries);
+        }
+        dist_stop(&c);
+    }
+    free(lat);
+    return 0;
+}
+
+/*
+ * Interaction model for the factors tool (ms): reaction before the first
+ * key, the "Try Again" message, and module match time per finger.
+ */
+#define FT_REACT_MS 800.0
+#define FT_RETRY_MS 1000.0
+#define FT_FP_MATCH_MS 600.0
+#define FT_QUICK_MS 3000.0
+#define FT_MAX_EVENTS (MAX_PASSWORD_ATTEMPTS * (PASSWORD_MAX_LEN + 1) + MAX_FP_ATTEMPTS)
+
+typedef struct {
+    double t;
+    int key;    /* 0 for a finger event */
+    int match;
+} ft_event;
+
+static int ft_cmp_event(const void *a, const void *b) {
+    double d;
+    d = ((const ft_event *)a)->t - ((const ft_event *)b)->t;
+    return d < 0.0 ? -1 : (d > 0.0 ? 1 : 0);
+}
+
+/* Keys up to the first correct PIN; returns its submit time, or -1 */
+static double ft_key_events(const replay_event *ev, const char *stored, double key_ms, sim_rng *r,
+                            ft_event *e, int *n) {
+    double t;
+    int k, c;
+    t = FT_REACT_MS;
+    for (k = 0; k < ev->n_pin && k < MAX_PASSWORD_ATTEMPTS; k++) {
+        for (c = 0; c < PASSWORD_MAX_LEN && ev->pin[k][c] != '\0'; c++) {
+            t += key_ms * (0.7 + 0.6 * sim_rng_uniform(r));
+            e[*n].t = t;
+            e[(*n)++].key = ev->pin[k][c];
+        }
+        t += key_ms;
+        e[*n].t = t;
+        e[(*n)++].key = '#';
+        if (password_matches(ev->pin[k], stored)) return t;
+        t += FT_RETRY_MS + FT_REACT_MS / 2.0;
+    }
+    return -1.0;
+}
+
+/* Finger attempts from when the sensor is armed; returns the first match time, or -1 */
+static double ft_finger_events(const replay_event *ev, double armed, double place_ms, sim_rng *r,
+                               ft_event *e, int *n) {
+    double t;
+    int k;
+    t = armed + place_ms * (0.7 + 0.6 * sim_rng_uniform(r));
+    for (k = 0; k < ev->n_fp && k < MAX_FP_ATTEMPTS; k++) {
+        t += FT_FP_MATCH_MS;
+        e[*n].t = t;
+        e[*n].key = 0;
+        e[(*n)++].match = ev->fp[k];
+        if (ev->fp[k]) return t;
+        t += FT_RETRY_MS + place_ms / 2.0;
+    }
+    return -1.0;
+}
+
+/* Feed events in time order through the session; decision time from the card */
+static double ft_run(ft_event *e, int n, const char *stored, int *outcome) {
+    factor_session fs;
+    int i;
+    qsort(e, (size_t)n, sizeof(ft_event), ft_cmp_event);
+    factors_begin(&fs);
+    for (i = 0; i < n; i++) {
+        if (e[i].key) factors_key(&fs, e[i].key, stored);
+        else factors_finger(&fs, e[i].match);
+        *outcome = factors_decision(&fs);
+        if (*outcome != FACTOR_PENDING) return e[i].t;
+    }
+    *outcome = fs.pin_ok == FACTOR_PENDING ? MET_DENY_PASSWORD : MET_DENY_FP;
+    return (n ? e[n - 1].t : 0.0) + PASSWORD_ENTRY_TIMEOUT_MS;
+}
+
+typedef struct {
+    double seq;
+    double conc;
+    double pin;
+    double fp;
+} ft_sample;
+
+/* Column of a sample array, or only the quick sessions if quick_ms > 0 */
+static int ft_column(const ft_sample *s, int n, int col, double quick_ms, double *out) {
+    int i, m;
+    double v;
+    m = 0;
+    for (i = 0; i < n; i++) {
+        if (quick_ms > 0.0 && (s[i].pin > quick_ms || s[i].fp > quick_ms)) continue;
+        v = col == 0 ? s[i].seq : (col == 1 ? s[i].conc : (s[i].pin > s[i].fp ? s[i].pin : s[i].fp));
+        out[m++] = v;
+    }
+    return m;
+}
+
+static void ft_report(const char *label, double *v, int n) {
+    double sum;
+    int i;
+    if (n == 0) return;
+    qsort(v, (size_t)n, sizeof(double), bench_cmp_double);
+    sum = 0.0;
+    for (i = 0; i < n; i++) sum += v[i];
+    printf("%-22s %8.0f %8.0f %8.0f\n", label, sum / n, v[n / 2], v[(n * 9) / 10]);
+}
+
+/*
+ * factors [-s seed] [-H hours] [-t pin_typo] [-f fp_fail]
+ * Time from card to decision on generated traffic through the concurrent
+ * factor state machine, sensor armed after the PIN vs with the keypad.
+ * Both flows see the same keystrokes and finger timings; the sequential
+ * flow never sees a finger when the PIN fails. The concurrent flow assumes
+ * keys are latched while a finger is matched (see concurrent_factors).
+ */
+static int tool_factors(int argc, char **argv) {
+    workload_config cfg;
+    workload_gen g;
+    replay_event ev;
+    ft_event e[FT_MAX_EVENTS];
+    char pw[PASSWORD_MAX_LEN + 1];
+    char stored[PASSWORD_MAX_LEN + 1];
+    double key_ms[MAX_USERS], place_ms[MAX_USERS];
+    double pin_t, fp_t, ts, tc, *col;
+    ft_sample *smp;
+    unsigned long sessions;
+    int k, n, m, uid, out_s, out_c, grants, cap, mismatch;
+    sim_rng r, snap, sess;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.seed = 1;
+    cfg.users = MAX_USERS;
+    cfg.doors = 8;
+    cfg.hours = 24.0 * 7;
+    cfg.zipf_s = 1.1;
+    cfg.pin_typo = 0.04;
+    cfg.fp_fail = 0.03;
+    cfg.attacks_per_day = 0.0;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) cfg.seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-H") == 0) cfg.hours = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-t") == 0) cfg.pin_typo = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-f") == 0) cfg.fp_fail = atof(argv[k + 1]);
+        else break;
+    }
+    if (k != argc || cfg.hours <= 0.0) {
+        fprintf(stderr, "usage: factors [-s seed] [-H hours] [-t pin_typo] [-f fp_fail]\n");
+        return 2;
+    }
+    if (workload_init(&g, &cfg) != 0) return 1;
+    memset(eeprom_memory, 0xFF, EEPROM_SIZE);
+    sim_rng_seed(&r, cfg.seed + 53);
+    for (k = 0; k < cfg.users; k++) {
+        wl_password(cfg.seed, k, pw);
+        provision_password(k, pw);
+        /* steady typists to hunt-and-peck, quick to hesitant placement */
+        key_ms[k] = 300.0 * exp(0.35 * sim_rng_gauss(&r));
+        place_ms[k] = 1200.0 * exp(0.4 * sim_rng_gauss(&r));
+    }
+    cap = 1024;
+    smp = (ft_sample *)malloc(sizeof(ft_sample) * (size_t)cap);
+    if (!smp) return 1;
+
+    sessions = 0;
+    grants = mismatch = 0;
+    while (workload_next(&g, &ev)) {
+        uid = card_to_user_id(ev.card);
+        if (uid < 0) continue;
+        stored[PASSWORD_MAX_LEN] = '\0';
+        eeprom_read_bytes(USER_SLOT_ADDR(uid), (unsigned char *)stored, PASSWORD_MAX_LEN);
+        sessions++;
+        snap = r;
+        sim_rng_next(&r);
+
+        sess = snap;
+        n = 0;
+        pin_t = ft_key_events(&ev, stored, key_ms[uid], &sess, e, &n);
+        /* the sensor is only armed by a correct PIN */
+        if (pin_t >= 0.0) ft_finger_events(&ev, pin_t, place_ms[uid], &sess, e, &n);
+        ts = ft_run(e, n, stored, &out_s);
+
+        sess = snap;
+        n = 0;
+        pin_t = ft_key_events(&ev, stored, key_ms[uid], &sess, e, &n);
+        fp_t = ft_finger_events(&ev, 0.0, place_ms[uid], &sess, e, &n);
+        tc = ft_run(e, n, stored, &out_c);
+        mismatch += out_s != out_c;
+        if (out_c != MET_GRANTS || out_s != MET_GRANTS) continue;
+        if (grants == cap) {
+            cap *= 2;
+            smp = (ft_sample *)realloc(smp, sizeof(ft_sample) * (size_t)cap);
+            if (!smp) return 1;
+        }
+        smp[grants].seq = ts;
+        smp[grants].conc = tc;
+        smp[grants].pin = pin_t;
+        smp[grants].fp = fp_t;
+        grants++;
+    }
+    workload_free(&g);
+
+    col = (double *)malloc(sizeof(double) * (size_t)(grants + 1));
+    if (!col) return 1;
+    printf("sessions %lu, granted %d, decisions differing between flows %d\n", sessions, grants, mismatch);
+    printf("time to decision, granted     mean      p50      p90  (ms)\n");
+    ft_report("sequential", col, ft_column(smp, grants, 0, 0.0, col));
+    ft_report("concurrent", col, ft_column(smp, grants, 1, 0.0, col));
+    m = ft_column(smp, grants, 2, FT_QUICK_MS, col);
+    printf("quick with both factors (each <= %.0f ms): %d\n", FT_QUICK_MS, m);
+    ft_report("  sequential", col, ft_column(smp, grants, 0, FT_QUICK_MS, col));
+    ft_report("  concurrent", col, ft_column(smp, grants, 1, FT_QUICK_MS, col));
+    ft_report("  max(PIN, finger)", col, ft_column(smp, grants, 2, FT_QUICK_MS, col));
+    free(col);
+    free(smp);
+    return 0;
+}
+
+/* ---- Wiegand edge-stream emulator ---- */
+typedef struct {
+    unsigned long t;
+    unsigned short reader;
+    unsigned char line;
+} wg_edge;
+
+typedef struct {
+    unsigned long facility;
+    unsigned long card;
+    unsigned char bits;
+    unsigned char ok;
+} wg_expect;
+
+static int wg_cmp_edge(const void *a, const void *b) {
+    unsigned long x, y;
+    x = ((const wg_edge *)a)->t;
+    y = ((const wg_edge *)b)->t;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+ * wiegand [-s seed] [-r readers] [-n frames] [-g glitch] [-e bit_error]
+ * Every reader presents frames back to back (mixed 26/34/37-bit, 1-2 ms
+ * bit period, 30-200 ms between cards). The merged edge stream goes
+ * through the capture ISR entry and wiegand_poll runs every poll interval
+ * of emulated time. glitch adds a stray edge 50 us after a bit; bit_error
+ * flips a bit so the frame must fail parity.
+ */
+static int tool_wiegand(int argc, char **argv) {
+    static const int polls[] = { 1, 10, 50, 100, 200 };
+    static const int lens[] = { 26, 34, 37 };
+    wg_edge *edges;
+    wg_expect *expect;
+    int *next;
+    unsigned char raw[WG_MAX_BITS / 8];
+    unsigned long seed, t, period, ne, cap, poll_at, overruns, last;
+    unsigned long good, bad_ok, errors_caught, wrong, missed, injected;
+    double glitch, bit_error, t0, ns;
+    int readers, frames, k, rd, f, i, bits, pi, flip;
+    wg_frame fr;
+    wg_expect *x;
+    sim_rng r;
+
+    seed = 1;
+    readers = 16;
+    frames = 500;
+    glitch = 0.02;
+    bit_error = 0.01;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-r") == 0) readers = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-n") == 0) frames = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-g") == 0) glitch = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-e") == 0) bit_error = atof(argv[k + 1]);
+        else break;
+    }
+    if (k != argc || readers < 1 || readers > WG_MAX_READERS || frames < 1) {
+        fprintf(stderr, "usage: wiegand [-s seed] [-r readers<=%d] [-n frames] [-g glitch] [-e bit_error]\n",
+                WG_MAX_READERS);
+        return 2;
+    }
+    cap = (unsigned long)readers * (unsigned long)frames * (WG_MAX_BITS + 1);
+    edges = (wg_edge *)malloc(sizeof(wg_edge) * cap);
+    expect = (wg_expect *)malloc(sizeof(wg_expect) * (size_t)readers * (size_t)frames);
+    next = (int *)malloc(sizeof(int) * (size_t)readers);
+    if (!edges || !expect || !next) return 1;
+
+    sim_rng_seed(&r, seed);
+    ne = 0;
+    injected = 0;
+    last = 0;
+    for (rd = 0; rd < readers; rd++) {
+        period = 1000 + sim_rng_below(&r, 1001);
+        t = 1000 + sim_rng_below(&r, 50000);
+        for (f = 0; f < frames; f++) {
+            x = &expect[rd * frames + f];
+            x->bits = (unsigned char)lens[sim_rng_below(&r, 3)];
+            x->facility = sim_rng_below(&r, x->bits == 26 ? 256 : 65536);
+            x->card = sim_rng_below(&r, x->bits == 37 ? 524288UL : 65536UL);
+            bits = wiegand_encode(x->bits, x->facility, x->card, raw);
+            flip = sim_rng_uniform(&r) < bit_error ? (int)sim_rng_below(&r, (unsigned long)bits) : -1;
+            x->ok = flip < 0;
+            injected += flip >= 0;
+            for (i = 0; i < bits; i++) {
+                edges[ne].t = t;
+                edges[ne].reader = (unsigned short)rd;
+                edges[ne].line = (unsigned char)(wg_raw_bit(raw, i) ^ (i == flip));
+                ne++;
+                if (sim_rng_uniform(&r) < glitch / bits) {
+                    edges[ne] = edges[ne - 1];
+                    edges[ne].t += 50;
+                    ne++;
+                }
+                t += period + sim_rng_below(&r, period / 10 + 1);
+            }
+            t += 30000 + sim_rng_below(&r, 170001);
+        }
+        if (t > last) last = t;
+    }
+    qsort(edges, (size_t)ne, sizeof(wg_edge), wg_cmp_edge);
+
+    printf("readers %d, frames/reader %d, edges %lu over %.1f s, bit errors injected %lu\n",
+           readers, frames, ne, last / 1e6, injected);
+    printf("poll ms   decoded    parity-caught  wrong  missed  overruns   Medges/s\n");
+    for (pi = 0; pi < (int)(sizeof(polls) / sizeof(polls[0])); pi++) {
+        wiegand_init();
+        for (rd = 0; rd < readers; rd++) next[rd] = 0;
+        overruns = metrics_sum_counter(MET_WIEGAND_OVERRUNS);
+        good = bad_ok = errors_caught = wrong = 0;
+        poll_at = (unsigned long)polls[pi] * 1000UL;
+        ns = 0.0;
+        for (i = 0; i <= (int)ne; i++) {
+            t = i < (int)ne ? edges[i].t : last + WG_FRAME_GAP_US + poll_at;
+            while (poll_at <= t) {
+                t0 = bench_now_ns();
+                wiegand_poll(poll_at);
+                ns += bench_now_ns() - t0;
+                while (wiegand_read_frame(&fr)) {
+                    if (next[fr.reader] >= frames) {
+                        wrong++;
+                        continue;
                     }
+                    x = &expect[fr.reader * frames + next[fr.reader]++];
+                    if (!x->ok) errors_caught += !fr.ok;
+                    else if (fr.ok && fr.bits == x->bits && fr.facility == x->facility && fr.card == x->card) good++;
+                    else wrong++;
+                    bad_ok += !x->ok && fr.ok;
+                }
+                poll_at += (unsigned long)polls[pi] * 1000UL;
+            }
+            if (i == (int)ne) break;
+            t0 = bench_now_ns();
+            wiegand_edge_isr(edges[i].reader, edges[i].line, edges[i].t);
+            ns += bench_now_ns() - t0;
+        }
+        missed = 0;
+        for (rd = 0; rd < readers; rd++) missed += (unsigned long)(frames - next[rd]);
+        printf("%7d  %8lu/%lu  %8lu/%lu  %5lu  %6lu  %8lu  %9.2f\n", polls[pi], good,
+               (unsigned long)readers * frames - injected, errors_caught, injected, wrong + bad_ok, missed,
+               metrics_sum_counter(MET_WIEGAND_OVERRUNS) - overruns, ne / ns * 1e3);
+    }
+    free(edges);
+    free(expect);
+    free(next);
+    return 0;
+}
+
+/* Synthetic sensor frame: warped concentric ridges with breaks and noise */
+static void fpstream_synth(unsigned char *img, unsigned long seed) {
+    sim_rng r;
+    double cx, cy, dx, dy, ph, v;
+    int x, y, k, bx, by;
+
+    sim_rng_seed(&r, seed);
+    cx = FP_IMG_W * (0.35 + 0.3 * sim_rng_uniform(&r));
+    cy = FP_IMG_H * (0.35 + 0.3 * sim_rng_uniform(&r));
+    for (y = 0; y < FP_IMG_H; y++) {
+        for (x = 0; x < FP_IMG_W; x++) {
+            dx = (x - FP_IMG_W / 2) / (FP_IMG_W * 0.46);
+            dy = (y - FP_IMG_H / 2) / (FP_IMG_H * 0.48);
+            if (dx * dx + dy * dy > 1.0) {
+                v = 225.0 + 6.0 * sim_rng_gauss(&r);
+            } else {
+                ph = sqrt((x - cx) * (x - cx) + 1.4 * (y - cy) * (y - cy)) * (2.0 * FP_PI / 9.0);
+                ph += 2.0 * sin(x / 37.0 + y / 53.0);
+                v = 135.0 + 85.0 * cos(ph) + 12.0 * sim_rng_gauss(&r);
+            }
+            img[y * FP_IMG_W + x] = (unsigned char)(v < 0.0 ? 0 : (v > 255.0 ? 255 : v));
+        }
+    }
+    /* pale spots cut ridges and create endings */
+    for (k = 0; k < 25; k++) {
+        bx = 40 + (int)sim_rng_below(&r, FP_IMG_W - 80);
+        by = 40 + (int)sim_rng_below(&r, FP_IMG_H - 80);
+        for (y = by - 3; y <= by + 3; y++) {
+            for (x = bx - 3; x <= bx + 3; x++) {
+                if ((x - bx) * (x - bx) + (y - by) * (y - by) <= 9) img[y * FP_IMG_W + x] = 215;
+            }
+        }
+    }
+}
+
+/*
+ * Whole-frame reference for fp_stream: the same block statistics, ridge
+ * skeleton and crossing-number rules, but run one stage at a time over
+ * full-size buffers, with none of the streamer's row rings or scheduling.
+ */
+#define FPREF_PX(img, x, y) ((img)[fp_clamp(y, 0, FP_IMG_H - 1) * FP_IMG_W + fp_clamp(x, 0, FP_IMG_W - 1)])
+
+static void fpstream_reference(const unsigned char *img, fp_template *t) {
+    static const signed char nx[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+    static const signed char ny[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+    static unsigned char orient[FP_BLK_ROWS][FP_BLK_COLS];
+    static unsigned char mean[FP_BLK_ROWS][FP_BLK_COLS];
+    static unsigned char fg[FP_BLK_ROWS][FP_BLK_COLS];
+    static unsigned char skel[FP_IMG_H][FP_IMG_W];
+    unsigned char p[8];
+    long sum, sumsq, gxx, gyy, gxy, gx, gy, m, c, sn;
+    int bx, by, x, y, v, k, i, cn, last, ok, o, a, dx1, dy1, dx2, dy2;
+
+    for (by = 0; by < FP_BLK_ROWS; by++) {
+        for (bx = 0; bx < FP_BLK_COLS; bx++) {
+            sum = sumsq = gxx = gyy = gxy = 0;
+            for (y = by * FP_BLK; y < (by + 1) * FP_BLK; y++) {
+                for (x = bx * FP_BLK; x < (bx + 1) * FP_BLK; x++) {
+                    v = img[y * FP_IMG_W + x];
+                    sum += v;
+                    sumsq += (long)v * v;
+                    gx = (long)FPREF_PX(img, x + 1, y) - FPREF_PX(img, x - 1, y);
+                    gy = (long)FPREF_PX(img, x, y + 1) - FPREF_PX(img, x, y - 1);
+                    gxx += gx * gx;
+                    gyy += gy * gy;
+                    gxy += gx * gy;
+                }
+            }
+            m = sum / (FP_BLK * FP_BLK);
+            mean[by][bx] = (unsigned char)m;
+            fg[by][bx] = (unsigned char)(sumsq / (FP_BLK * FP_BLK) - m * m >= FP_SEG_MIN_VAR);
+            orient[by][bx] = (unsigned char)(((fp_atan2_units(2 * gxy, gxx - gyy) >> 1) + 64) & 127);
+        }
+    }
+
+    memset(skel, 0, sizeof(skel));
+    for (y = 0; y < FP_IMG_H; y++) {
+        for (x = 0; x < FP_IMG_W; x++) {
+            by = y / FP_BLK;
+            bx = x / FP_BLK;
+            v = img[y * FP_IMG_W + x];
+            if (!fg[by][bx] || v >= mean[by][bx]) continue;
+            c = fp_sin_q14(orient[by][bx] + 64 + FP_ANGLE_STEPS / 4);
+            sn = fp_sin_q14(orient[by][bx] + 64);
+            dx1 = (int)fp_div_floor(c + 8192, 16384);
+            dy1 = (int)fp_div_floor(sn + 8192, 16384);
+            dx2 = (int)fp_div_floor(2 * c + 8192, 16384);
+            dy2 = (int)fp_div_floor(2 * sn + 8192, 16384);
+            if (v > FPREF_PX(img, x + dx1, y + dy1) || v >= FPREF_PX(img, x - dx1, y - dy1)) continue;
+            if (v > FPREF_PX(img, x + dx2, y + dy2) || v >= FPREF_PX(img, x - dx2, y - dy2)) continue;
+            skel[y][x] = 1;
+        }
+    }
+
+    t->count = 0;
+    for (y = FP_BLK; y < FP_IMG_H - FP_BLK; y++) {
+        for (x = FP_BLK; x < FP_IMG_W - FP_BLK && t->count < FP_MAX_MINUTIAE; x++) {
+            if (!skel[y][x]) continue;
+            for (k = 0; k < 8; k++) p[k] = skel[y + ny[k]][x + nx[k]];
+            cn = 0;
+            for (k = 0; k < 8; k++) cn += p[k] != p[(k + 1) & 7];
+            cn /= 2;
+            if (cn != 1 && cn != 3) continue;
+            by = y / FP_BLK;
+            bx = x / FP_BLK;
+            ok = 1;
+            for (k = -1; k <= 1 && ok; k++) ok = fg[by][bx + k] && fg[by - 1][bx + k];
+            for (i = 0; i < t->count && ok; i++) ok = abs(t->m[i].x - x) + abs(t->m[i].y - y) > FP_MINUTIA_SEP;
+            if (!ok) continue;
+            o = orient[by][bx];
+            if (cn == 1) {
+                last = 0;
+                for (k = 0; k < 8; k++) {
+                    if (p[k]) last = k;
+                }
+                a = fp_atan2_units(-ny[last], -nx[last]);
+                if (fp_abs(fp_wrap_diff(a, o)) > 64) o += 128;
+            }
+            t->m[t->count].x = (short)x;
+            t->m[t->count].y = (short)y;
+            t->m[t->count].angle = (unsigned char)o;
+            t->m[t->count].type = (unsigned char)(cn == 1 ? FP_TYPE_ENDING : FP_TYPE_BIFURCATION);
+            t->count++;
+        }
+    }
+}
+
+/* First minutia where a and b differ in position, angle or type; -1 if none */
+static int fpstream_diff(const fp_template *a, const fp_template *b) {
+    int i;
+    for (i = 0; i < a->count && i < b->count; i++) {
+        if (a->m[i].x != b->m[i].x || a->m[i].y != b->m[i].y || a->m[i].angle != b->m[i].angle ||
+            a->m[i].type != b->m[i].type) {
+            return i;
+        }
+    }
+    return a->count == b->count ? -1 : i;
+}
+
+/*
+ * Streamed against whole-frame extraction of img. A template fills up
+ * within the top third or so, so the frame is also tried with the top
+ * third and two thirds blanked to background, moving the minutiae down.
+ */
+static int fpstream_check(fp_stream *st, const unsigned char *img, unsigned char *work, int frame) {
+    fp_template t, ref;
+    int band, y, k;
+
+    for (band = 0; band < 3; band++) {
+        memcpy(work, img, FP_IMG_W * FP_IMG_H);
+        memset(work, 225, (size_t)(band * (FP_IMG_H / 3)) * FP_IMG_W);
+        fp_stream_begin(st);
+        for (y = 0; y < FP_IMG_H; y++) fp_stream_push_row(st, work + y * FP_IMG_W);
+        fp_stream_finish(st, &t);
+        fpstream_reference(work, &ref);
+        k = fpstream_diff(&t, &ref);
+        if (k >= 0) {
+            fprintf(stderr, "frame %d, top %d/3 blank: streamed and whole-frame extraction differ at minutia %d "
+                    "(%d vs %d found)\n", frame, band, k, t.count, ref.count);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Post-upload latency of minutiae extraction, batch vs streamed. Row
+ * arrival follows the sensor link (4 bpp); compute is host time scaled by
+ * -k to approximate the target core.
+ */
+static int tool_fpstream(int argc, char **argv) {
+    static fp_stream st;
+    unsigned char *img;
+    unsigned char *work;
+    fp_template t;
+    unsigned long seed, baud;
+    double scale, row_us, upload_us, t0, cost, done, batch_us, push_us, tail_us;
+    int k, y, frames, f, count;
+    double sum_batch, sum_stream, sum_compute;
+    long sum_count;
+
+    seed = 1;
+    baud = 921600UL;
+    scale = 40.0;
+    frames = 20;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-b") == 0) baud = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-k") == 0) scale = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-n") == 0) frames = atoi(argv[k + 1]);
+        else break;
+    }
+    if (k != argc || baud == 0 || scale <= 0.0 || frames < 1) {
+        fprintf(stderr, "usage: fpstream [-s seed] [-b baud] [-k cpu_scale] [-n frames]\n");
+        return 2;
+    }
+    img = (unsigned char *)malloc(FP_IMG_W * FP_IMG_H);
+    work = (unsigned char *)malloc(FP_IMG_W * FP_IMG_H);
+    if (!img || !work) {
+        free(img);
+        free(work);
+        return 1;
+    }
+
+    /* 10 bits per byte on the wire, two pixels per byte */
+    row_us = (FP_IMG_W / 2) * 10.0 * 1e6 / (double)baud;
+    upload_us = row_us * FP_IMG_H;
+    sum_batch = sum_stream = sum_compute = 0.0;
+    sum_count = 0;
+    for (f = 0; f < frames; f++) {
+        fpstream_synth(img, seed + (unsigned long)f);
+
+        /* batch: whole frame buffered, then processed */
+        t0 = bench_now_ns();
+        fp_stream_begin(&st);
+        for (y = 0; y < FP_IMG_H; y++) fp_stream_push_row(&st, img + y * FP_IMG_W);
+        count = fp_stream_finish(&st, &t);
+        batch_us = (bench_now_ns() - t0) / 1000.0 * scale;
+
+        /* streamed: each row is processed when it lands, queueing if busy */
+        done = 0.0;
+        push_us = 0.0;
+        fp_stream_begin(&st);
+        for (y = 0; y < FP_IMG_H; y++) {
+            t0 = bench_now_ns();
+            fp_stream_push_row(&st, img + y * FP_IMG_W);
+            cost = (bench_now_ns() - t0) / 1000.0 * scale;
+            push_us += cost;
+            if (done < row_us * (y + 1)) done = row_us * (y + 1);
+            done += cost;
+        }
+        t0 = bench_now_ns();
+        fp_stream_finish(&st, &t);
+        tail_us = (bench_now_ns() - t0) / 1000.0 * scale;
+        done += tail_us;
+        if (fpstream_check(&st, img, work, f) != 0) {
+            free(img);
+            free(work);
+            return 1;
+        }
+        sum_batch += batch_us;
+        sum_stream += done - upload_us;
+        sum_compute += push_us + tail_us;
+        sum_count += count;
+    }
+    free(img);
+    free(work);
+
+    printf("frame %dx%d, %lu baud: upload %.1f ms, cpu scale x%.0f, %d frames\n",
+           FP_IMG_W, FP_IMG_H, baud, upload_us / 1000.0, scale, frames);
+    printf("minutiae/frame      %8.1f\n", (double)sum_count / frames);
+    printf("compute/frame       %8.2f ms\n", sum_compute / frames / 1000.0);
+    printf("after upload, batch %8.2f ms\n", sum_batch / frames / 1000.0);
+    printf("after upload, stream%8.2f ms\n", sum_stream / frames / 1000.0);
+    return 0;
+}
+
+/* ---- osdp: readers on a pty-emulated RS-485 bus ---- */
+
+typedef struct {
+    double t;                   /* us after emulator start */
+    int reader;
+    int first;                  /* first badge of a visit: the reader was idle */
+} osdp_card_ev;
+
+static int osdp_cmp_card(const void *a, const void *b) {
+    double x, y;
+    x = ((const osdp_card_ev *)a)->t;
+    y = ((const osdp_card_ev *)b)->t;
+    return (x > y) - (x < y);
+}
+
+static double osdp_mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void osdp_sleep_until(double t_us) {
+    struct timespec ts;
+    double d;
+    d = t_us - osdp_mono_us();
+    if (d <= 0.0) return;
+    ts.tv_sec = (time_t)(d / 1e6);
+    ts.tv_nsec = (long)((d - ts.tv_sec * 1e6) * 1e3);
+    nanosleep(&ts, 0);
+}
+
+/* Visitors arrive in groups at a Zipf-chosen door and badge one after another */
+static int osdp_cards(osdp_card_ev **out, int readers, unsigned long seed, double secs, double groups) {
+    osdp_card_ev *ev;
+    zipf_table z;
+    sim_rng r;
+    double t, tc;
+    int n, cap, k, m, rd;
+
+    sim_rng_seed(&r, seed);
+    if (zipf_init(&z, readers, 1.0) != 0) return -1;
+    cap = 64;
+    n = 0;
+    ev = (osdp_card_ev *)malloc(sizeof(osdp_card_ev) * (size_t)cap);
+    for (t = 500e3 + sim_rng_exp(&r, groups / 1e6); ev && t < secs * 1e6; t += sim_rng_exp(&r, groups / 1e6)) {
+        rd = zipf_sample(&z, &r);
+        m = 1 + (int)sim_rng_below(&r, 5);
+        tc = t;
+        for (k = 0; k < m && tc < secs * 1e6; k++) {
+            if (n == cap) {
+                cap *= 2;
+                ev = (osdp_card_ev *)realloc(ev, sizeof(osdp_card_ev) * (size_t)cap);
+                if (!ev) break;
+            }
+            ev[n].t = tc;
+            ev[n].reader = rd;
+            ev[n].first = k == 0;
+            n++;
+            tc += 800e3 + sim_rng_below(&r, 1200001);
+        }
+    }
+    free(z.cdf);
+    if (!ev) return -1;
+    qsort(ev, (size_t)n, sizeof(osdp_card_ev), osdp_cmp_card);
+    *out = ev;
+    return n;
+}
+
+/*
+ * Emulator: every reader 0..readers-1 on the slave side of the pty. A
+ * command is taken to finish arriving n bytes after it was written, the
+ * addressed reader answers after its turnaround, and the reply is
+ * released when its last byte would be off the wire. Results (latency of
+ * each delivered card, whether it opened a visit) go back over out_fd.
+ */
+static void osdp_emu_run(int fd, int out_fd, int readers, unsigned long seed, double byte_us, double turn_us,
+                         double secs, double groups) {
+    unsigned char in[256], f[OSDP_MAX_PACKET], reply[OSDP_MAX_PACKET], data[4 + WG_MAX_BITS / 8];
+    osdp_card_ev *ev;
+    double *lat, start, now, cmd_end, reply_end;
+    int *head, *nxt, *first;
+    int n, nev, got, i, k, len, rn, bits, addr, card;
+
+    nev = osdp_cards(&ev, readers, seed, secs, groups);
+    if (nev < 0) _exit(1);
+    head = (int *)malloc(sizeof(int) * (size_t)readers);
+    nxt = (int *)malloc(sizeof(int) * (size_t)(nev + 1));
+    lat = (double *)malloc(sizeof(double) * (size_t)(nev + 1));
+    first = (int *)malloc(sizeof(int) * (size_t)(nev + 1));
+    if (!head || !nxt || !lat || !first) _exit(1);
+    /* per-reader queues threaded through the time-ordered list */
+    for (i = 0; i < readers; i++) head[i] = -1;
+    for (i = nev - 1; i >= 0; i--) {
+        nxt[i] = head[ev[i].reader];
+        head[ev[i].reader] = i;
+    }
+
+    got = 0;
+    len = 0;
+    start = osdp_mono_us();
+    while ((n = (int)read(fd, in, sizeof(in))) > 0) {
+        for (k = 0; k < n; k++) {
+            rn = osdp_frame_byte(f, &len, in[k]);
+            if (rn == 0 || f[1] >= readers) continue;
+            now = osdp_mono_us();
+            addr = f[1];
+            cmd_end = now + rn * byte_us;
+            i = head[addr];
+            if (f[5] == OSDP_CMD_POLL && i >= 0 && start + ev[i].t <= cmd_end) {
+                card = i + 1;
+                bits = wiegand_encode(26, WG_SITE_FACILITY, (unsigned long)card, data + 4);
+                data[0] = 0;
+                data[1] = 1;
+                data[2] = (unsigned char)bits;
+                data[3] = 0;
+                rn = osdp_build(OSDP_REPLY_BIT | addr, f[4], OSDP_REPLY_RAW, data, 4 + (bits + 7) / 8, reply);
+                head[addr] = nxt[i];
+            } else {
+                i = -1;
+                rn = osdp_build(OSDP_REPLY_BIT | addr, f[4], OSDP_REPLY_ACK, 0, 0, reply);
+            }
+            reply_end = cmd_end + turn_us + rn * byte_us;
+            osdp_sleep_until(reply_end);
+            if (write(fd, reply, (size_t)rn) != rn) break;
+            if (i >= 0) {
+                lat[got] = reply_end - (start + ev[i].t);
+                first[got] = ev[i].first;
+                got++;
+            }
+        }
+    }
+    if (write(out_fd, &got, sizeof(got)) == sizeof(got)) {
+        for (i = 0; i < got; i++) {
+            if (write(out_fd, &lat[i], sizeof(double)) != sizeof(double)) break;
+            if (write(out_fd, &first[i], sizeof(int)) != sizeof(int)) break;
+        }
+    }
+    _exit(0);
+}
+
+static int osdp_tool_fd;
+
+static void osdp_tool_tx(const unsigned char *buf, int len) {
+    if (write(osdp_tool_fd, buf, (size_t)len) != len) metrics_add(MET_OSDP_BAD_FRAMES, 1);
+}
+
+static void osdp_pty_raw(int fd) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0) return;
+    tio.c_iflag &= ~(tcflag_t)(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    tio.c_oflag &= ~(tcflag_t)OPOST;
+    tio.c_lflag &= ~(tcflag_t)(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(tcflag_t)(CSIZE | PARENB);
+    tio.c_cflag |= CS8;
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+typedef struct {
+    int cards, sent, polls, timeouts;
+    double p50, p99, max, cold_p99;
+} osdp_run_result;
+
+static double osdp_pct(double *v, int n, double p) {
+    if (n == 0) return 0.0;
+    qsort(v, (size_t)n, sizeof(double), bench_cmp_double);
+    return v[(int)(p * (n - 1))];
+}
+
+/* One run: emulator on the slave, the control panel core on the master */
+static int osdp_run(int readers, int adaptive, unsigned long seed, unsigned long baud, double turn_us, double secs,
+                    double groups, osdp_run_result *res) {
+    unsigned char in[256];
+    struct pollfd pfd;
+    double *lat, *cold, end, v;
+    unsigned long polls, timeouts;
+    int master, slave, pipefd[2], n, i, got, nc, is_first;
+    pid_t pid;
+    wg_frame fr;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) return -1;
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0 || pipe(pipefd) != 0) return -1;
+    osdp_pty_raw(slave);
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        close(master);
+        close(pipefd[0]);
+        osdp_emu_run(slave, pipefd[1], readers, seed, 10e6 / baud, turn_us, secs, groups);
+    }
+    close(slave);
+    close(pipefd[1]);
+    if (pid < 0) return -1;
+
+    wg_frame_head = wg_frame_tail = 0;
+    polls = metrics_sum_counter(MET_OSDP_POLLS);
+    timeouts = metrics_sum_counter(MET_OSDP_TIMEOUTS);
+    osdp_tool_fd = master;
+    osdp_init(readers, adaptive, osdp_tool_tx);
+    memset(res, 0, sizeof(*res));
+    end = osdp_mono_us() + secs * 1e6 + 2e6;
+    pfd.fd = master;
+    pfd.events = POLLIN;
+    while (osdp_mono_us() < end) {
+        if (poll(&pfd, 1, 2) == 1) {
+            n = (int)read(master, in, sizeof(in));
+            for (i = 0; i < n; i++) osdp_rx_byte(in[i], timer_now_us());
+        }
+        osdp_tick(timer_now_us());
+        while (wiegand_read_frame(&fr)) {
+            res->cards++;
+            osdp_feedback(fr.reader, fr.ok);
+        }
+    }
+    res->polls = (int)(metrics_sum_counter(MET_OSDP_POLLS) - polls);
+    res->timeouts = (int)(metrics_sum_counter(MET_OSDP_TIMEOUTS) - timeouts);
+    close(master);
+
+    got = 0;
+    lat = cold = 0;
+    if (read(pipefd[0], &got, sizeof(got)) == sizeof(got) && got > 0) {
+        lat = (double *)malloc(sizeof(double) * (size_t)got);
+        cold = (double *)malloc(sizeof(double) * (size_t)got);
+    }
+    nc = 0;
+    for (i = 0; lat && cold && i < got; i++) {
+        if (read(pipefd[0], &v, sizeof(v)) != sizeof(v) || read(pipefd[0], &is_first, sizeof(is_first)) != sizeof(is_first)) break;
+        lat[i] = v / 1000.0;
+        if (is_first) cold[nc++] = v / 1000.0;
+    }
+    close(pipefd[0]);
+    waitpid(pid, 0, 0);
+    res->sent = i;
+    res->cold_p99 = osdp_pct(cold, nc, 0.99);
+    res->p50 = osdp_pct(lat, i, 0.50);
+    res->p99 = osdp_pct(lat, i, 0.99);
+    res->max = i > 0 ? lat[i - 1] : 0.0;
+    free(lat);
+    free(cold);
+    return 0;
+}
+
+/*
+ * osdp [-s seed] [-r max_readers] [-b baud] [-t turnaround_ms] [-d seconds]
+ *      [-g groups_per_s] [-i idle_stride]
+ * For 1..max_readers readers on one bus, round-robin polling against the
+ * adaptive scheduler. Latency is card on the reader to the last byte of
+ * its osdp_RAW reply; "visit p99" covers only the first badge of each
+ * group, i.e. a card at a reader that had gone idle.
+ */
+static int tool_osdp(int argc, char **argv) {
+    static const int counts[] = { 1, 2, 4, 8, 16, 32 };
+    osdp_run_result res;
+    unsigned long seed, baud;
+    double turn_ms, secs, groups;
+    int k, max_readers, c, mode;
+
+    seed = 1;
+    max_readers = OSDP_MAX_PD;
+    baud = 9600UL;
+    turn_ms = 3.0;
+    secs = 10.0;
+    groups = 2.0;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-r") == 0) max_readers = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-b") == 0) baud = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-t") == 0) turn_ms = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-d") == 0) secs = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-g") == 0) groups = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-i") == 0) osdp_idle_stride = atoi(argv[k + 1]);
+        else break;
+    }
+    if (k != argc || max_readers < 1 || max_readers > OSDP_MAX_PD || baud == 0 || secs <= 0.0 || groups <= 0.0 ||
+        osdp_idle_stride < 1) {
+        fprintf(stderr, "usage: osdp [-s seed] [-r max_readers<=%d] [-b baud] [-t turnaround_ms] [-d seconds] "
+                        "[-g groups_per_s] [-i idle_stride]\n", OSDP_MAX_PD);
+        return 2;
+    }
+    printf("%lu baud, turnaround %.1f ms, %.0f s per run, %.1f visitor groups/s, idle stride %d\n", baud, turn_ms,
+           secs, groups, osdp_idle_stride);
+    printf("readers  scheduler    cards  polls/s  p50 ms  p99 ms  max ms  visit p99\n");
+    for (c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])) && counts[c] <= max_readers; c++) {
+        for (mode = 0; mode < 2; mode++) {
+            if (osdp_run(counts[c], mode, seed, baud, turn_ms * 1000.0, secs, groups, &res) != 0) {
+                fprintf(stderr, "pty setup failed\n");
+                return 1;
+            }
+            if (res.cards != res.sent || res.timeouts) {
+                fprintf(stderr, "%d readers: %d cards sent, %d received, %d timeouts\n", counts[c], res.sent,
+                        res.cards, res.timeouts);
+            }
+            printf("%7d  %-11s %6d  %7.1f  %6.1f  %6.1f  %6.1f  %9.1f\n", counts[c], mode ? "adaptive" : "round-robin",
+                   res.sent, res.polls / (secs + 2.0), res.p50, res.p99, res.max, res.cold_p99);
+        }
+    }
+    return 0;
+}
+
+/* ---- aes: known answers, cross-checks and cost per frame ---- */
+
+/* Byte-oriented reference: S-box table from GF(2^8) inversion, xtime MixColumns */
+static unsigned char aes_ref_sbox[256];
+
+static unsigned char aes_ref_mul(unsigned char a, unsigned char b) {
+    unsigned char p;
+    p = 0;
+    while (b) {
+        if (b & 1) p ^= a;
+        a = (unsigned char)((a << 1) ^ (a & 0x80 ? 0x1B : 0));
+        b >>= 1;
+    }
+    return p;
+}
+
+static void aes_ref_init(void) {
+    unsigned char x, inv, s;
+    int v, k;
+    for (v = 0; v < 256; v++) {
+        x = (unsigned char)v;
+        inv = 1;
+        for (k = 0; k < 254; k++) inv = aes_ref_mul(inv, x);
+        if (v == 0) inv = 0;
+        s = inv;
+        for (k = 1; k <= 4; k++) s ^= (unsigned char)((inv << k) | (inv >> (8 - k)));
+        aes_ref_sbox[v] = (unsigned char)(s ^ 0x63);
+    }
+}
+
+static void aes_ref_expand(const unsigned char *key, unsigned char rk[AES_ROUNDS + 1][AES_BLOCK]) {
+    unsigned char rc, t[4];
+    int r, i;
+    memcpy(rk[0], key, AES_BLOCK);
+    rc = 1;
+    for (r = 1; r <= AES_ROUNDS; r++) {
+        for (i = 0; i < 4; i++) t[i] = aes_ref_sbox[rk[r - 1][12 + ((i + 1) & 3)]];
+        t[0] ^= rc;
+        rc = aes_ref_mul(rc, 2);
+        for (i = 0; i < AES_BLOCK; i++) rk[r][i] = (unsigned char)((i < 4 ? t[i] : rk[r][i - 4]) ^ rk[r - 1][i]);
+    }
+}
+
+static void aes_ref_encrypt(unsigned char rk[AES_ROUNDS + 1][AES_BLOCK], unsigned char *b) {
+    unsigned char t[AES_BLOCK], a0, a1, a2, a3;
+    int r, i, c;
+    for (i = 0; i < AES_BLOCK; i++) b[i] ^= rk[0][i];
+    for (r = 1; r <= AES_ROUNDS; r++) {
+        for (i = 0; i < AES_BLOCK; i++) t[i] = aes_ref_sbox[b[(i + 4 * (i & 3)) & 15]];
+        for (c = 0; c < 4 && r < AES_ROUNDS; c++) {
+            a0 = t[4 * c];
+            a1 = t[4 * c + 1];
+            a2 = t[4 * c + 2];
+            a3 = t[4 * c + 3];
+            t[4 * c] = (unsigned char)(aes_ref_mul(a0, 2) ^ aes_ref_mul(a1, 3) ^ a2 ^ a3);
+            t[4 * c + 1] = (unsigned char)(a0 ^ aes_ref_mul(a1, 2) ^ aes_ref_mul(a2, 3) ^ a3);
+            t[4 * c + 2] = (unsigned char)(a0 ^ a1 ^ aes_ref_mul(a2, 2) ^ aes_ref_mul(a3, 3));
+            t[4 * c + 3] = (unsigned char)(aes_ref_mul(a0, 3) ^ a1 ^ a2 ^ aes_ref_mul(a3, 2));
+        }
+        for (i = 0; i < AES_BLOCK; i++) b[i] = (unsigned char)(t[i] ^ rk[r][i]);
+    }
+}
+
+static int aes_hex(const char *h, unsigned char *out) {
+    unsigned int v;
+    int n;
+    for (n = 0; h[0] && h[1]; h += 2, n++) {
+        if (sscanf(h, "%2x", &v) != 1) return -1;
+        out[n] = (unsigned char)v;
+    }
+    return n;
+}
+
+static int aes_check(const char *name, const unsigned char *got, const char *want_hex, int *fails) {
+    unsigned char want[128];
+    int n, ok;
+    n = aes_hex(want_hex, want);
+    ok = n > 0 && memcmp(got, want, (size_t)n) == 0;
+    if (!ok) {
+        printf("  FAIL %s\n", name);
+        (*fails)++;
+    }
+    return ok;
+}
+
+#define AES_T_KEY "2b7e151628aed2a6abf7158809cf4f3c"
+#define AES_T_MSG "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51" \
+                  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710"
+
+/* FIPS-197, SP 800-38A and RFC 4493 vectors plus randomized cross-checks; returns failures */
+static int aes_selftest(void) {
+    static const int cmac_len[4] = { 0, 16, 40, 64 };
+    static const char *const cmac_tag[4] = {
+        "bb1d6929e95937287fa37d129b756746", "070a16b46b4d4144f79bdd9dd04a287c",
+        "dfa66747de9ae63030ca32611497c827", "51f0bebf7e3b9d92fc49741779363cfe"
+    };
+    unsigned char key[AES_BLOCK], key2[AES_BLOCK], iv[AES_BLOCK], msg[96], buf[128], buf2[128], mac[AES_BLOCK];
+    unsigned char rk[AES_ROUNDS + 1][AES_BLOCK], rk2[AES_ROUNDS + 1][AES_BLOCK];
+    unsigned char sealed[128 + SC_OVERHEAD], nonce[8], senc[AES_BLOCK], smac[AES_BLOCK];
+    unsigned long s[8];
+    aes128_key k, kp;
+    aes_job jobs[4];
+    sc_channel ca, cb;
+    sim_rng r;
+    int fails, i, v, n, t, len;
+
+    fails = 0;
+    /* every S-box input, 32 bytes per pass */
+    for (v = 0; v < 256; v += 32) {
+        for (i = 0; i < 32; i++) buf[i] = (unsigned char)(v + i);
+        aes_pack(s, buf, buf + 16);
+        aes_sub_bytes(s);
+        aes_unpack(buf2, buf2 + 16, s);
+        for (i = 0; i < 32; i++) {
+            if (buf2[i] != aes_ref_sbox[v + i]) break;
+        }
+        if (i < 32) {
+            printf("  FAIL sbox %02x\n", v + i);
+            fails++;
+            break;
+        }
+        aes_inv_sub_bytes(s);
+        aes_unpack(buf2, buf2 + 16, s);
+        if (memcmp(buf, buf2, 32) != 0) {
+            printf("  FAIL inverse sbox near %02x\n", v);
+            fails++;
+            break;
+        }
+    }
+
+    aes_hex("000102030405060708090a0b0c0d0e0f", key);
+    aes_hex("00112233445566778899aabbccddeeff", buf);
+    aes128_init(&k, key);
+    aes128_encrypt2(&k, buf, 0);
+    aes_check("FIPS-197 C.1 encrypt", buf, "69c4e0d86a7b0430d8cdb78070b4c55a", &fails);
+    aes128_decrypt2(&k, buf, 0);
+    aes_check("FIPS-197 C.1 decrypt", buf, "00112233445566778899aabbccddeeff", &fails);
+
+    aes_hex(AES_T_KEY, key);
+    aes_hex(AES_T_MSG, msg);
+    aes128_init(&k, key);
+    aes_hex("000102030405060708090a0b0c0d0e0f", iv);
+    memcpy(buf, msg, 64);
+    aes128_cbc_encrypt(&k, iv, buf, 64);
+    aes_check("SP 800-38A CBC encrypt", buf, "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+              "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7", &fails);
+    aes_hex("000102030405060708090a0b0c0d0e0f", iv);
+    aes128_cbc_decrypt(&k, iv, buf, 64);
+    aes_check("SP 800-38A CBC decrypt", buf, AES_T_MSG, &fails);
+    aes_hex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", iv);
+    memcpy(buf, msg, 64);
+    aes128_ctr(&k, iv, buf, 64);
+    aes_check("SP 800-38A CTR", buf, "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+              "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee", &fails);
+    for (t = 0; t < 4; t++) {
+        aes128_cmac(&k, msg, cmac_len[t], mac);
+        aes_check("RFC 4493 CMAC", mac, cmac_tag[t], &fails);
+        jobs[t].data = msg;
+        jobs[t].len = cmac_len[t];
+    }
+    aes128_cmac_batch(&k, jobs, 4);
+    for (t = 0; t < 4; t++) aes_check("RFC 4493 CMAC batch", jobs[t].mac, cmac_tag[t], &fails);
+
+    /* random keys and data against the byte-oriented reference, both lanes */
+    sim_rng_seed(&r, 7);
+    for (t = 0; t < 200; t++) {
+        for (i = 0; i < AES_BLOCK; i++) {
+            key[i] = (unsigned char)sim_rng_below(&r, 256);
+            key2[i] = (unsigned char)sim_rng_below(&r, 256);
+        }
+        for (i = 0; i < 96; i++) msg[i] = (unsigned char)sim_rng_below(&r, 256);
+        aes_ref_expand(key, rk);
+        aes_ref_expand(key2, rk2);
+        aes128_init_pair(&kp, key, key2);
+        memcpy(buf, msg, 32);
+        memcpy(buf2, msg, 32);
+        aes128_encrypt2(&kp, buf, buf + 16);
+        aes_ref_encrypt(rk, buf2);
+        aes_ref_encrypt(rk2, buf2 + 16);
+        if (memcmp(buf, buf2, 32) != 0) {
+            printf("  FAIL random pair-key encrypt %d\n", t);
+            fails++;
+            break;
+        }
+        aes128_decrypt2(&kp, buf, buf + 16);
+        if (memcmp(buf, msg, 32) != 0) {
+            printf("  FAIL random decrypt %d\n", t);
+            fails++;
+            break;
+        }
+        /* CBC over an odd block count and back */
+        aes128_init(&k, key);
+        memcpy(iv, msg + 80, AES_BLOCK);
+        memcpy(buf, msg, 80);
+        aes128_cbc_encrypt(&k, iv, buf, 80);
+        memcpy(iv, msg + 80, AES_BLOCK);
+        aes128_cbc_decrypt(&k, iv, buf, 80);
+        if (memcmp(buf, msg, 80) != 0) {
+            printf("  FAIL random CBC round trip %d\n", t);
+            fails++;
+            break;
+        }
+    }
+
+    /* secure channel: explicit CTR + CMAC composition, tamper, replay and reflection */
+    aes_hex(AES_T_KEY, key);
+    aes_hex("0001020304050607", nonce);
+    sc_init(&ca, key, nonce, 1);
+    sc_init(&cb, key, nonce, 0);
+    aes_ref_expand(key, rk);
+    memset(senc, 0, AES_BLOCK);
+    senc[0] = 0x01;
+    senc[1] = 0x82;
+    memcpy(senc + 2, nonce, 8);
+    memcpy(smac, senc, AES_BLOCK);
+    smac[1] = 0x01;
+    aes_ref_encrypt(rk, senc);
+    aes_ref_encrypt(rk, smac);
+    for (len = 0; len <= 80; len += 7) {
+        for (i = 0; i < len; i++) msg[i] = (unsigned char)(len + 3 * i);
+        n = sc_seal(&ca, msg, len, sealed);
+        /* expected: CTR under S-ENC, counter = dir | seq | 0.., CMAC under S-MAC over dir | 0.. | seq | ct */
+        memset(iv, 0, AES_BLOCK);
+        iv[0] = 0x01;
+        memcpy(iv + 1, sealed, SC_SEQ);
+        aes128_init(&k, senc);
+        memcpy(buf, sealed, SC_SEQ);
+        memcpy(buf + SC_SEQ, msg, (size_t)len);
+        aes128_ctr(&k, iv, buf + SC_SEQ, len);
+        aes128_init(&k, smac);
+        memset(buf2, 0, AES_BLOCK);
+        buf2[0] = 0x01;
+        memcpy(buf2 + AES_BLOCK, buf, (size_t)(SC_SEQ + len));
+        aes128_cmac(&k, buf2, AES_BLOCK + SC_SEQ + len, mac);
+        if (n != len + SC_OVERHEAD || memcmp(buf, sealed, (size_t)(SC_SEQ + len)) != 0 ||
+            memcmp(mac, sealed + SC_SEQ + len, SC_TAG) != 0) {
+            printf("  FAIL channel seal, %d bytes\n", len);
+            fails++;
+            break;
+        }
+        if (sc_open(&cb, sealed, n, buf2) != len || memcmp(buf2, msg, (size_t)len) != 0) {
+            printf("  FAIL channel open, %d bytes\n", len);
+            fails++;
+            break;
+        }
+        if (sc_open(&cb, sealed, n, buf2) != -1) {
+            printf("  FAIL channel replay accepted\n");
+            fails++;
+            break;
+        }
+        n = sc_seal(&ca, msg, len, sealed);
+        sealed[(unsigned long)t++ % (unsigned long)n] ^= 0x10;
+        if (sc_open(&cb, sealed, n, buf2) != -1) {
+            printf("  FAIL channel tamper accepted\n");
+            fails++;
+            break;
+        }
+        /* a frame sent back to the side that sealed it */
+        n = sc_seal(&ca, msg, len, sealed);
+        if (sc_open(&ca, sealed, n, buf2) != -1) {
+            printf("  FAIL channel reflected frame accepted, %d bytes\n", len);
+            fails++;
+            break;
+        }
+        n = sc_seal(&cb, msg, len, sealed);
+        if (sc_open(&cb, sealed, n, buf2) != -1 || sc_open(&ca, sealed, n, buf2) != len) {
+            printf("  FAIL channel reflected reply accepted, %d bytes\n", len);
+            fails++;
+            break;
+        }
+    }
+    return fails;
+}
+
+static double aes_cycles(void) {
+#if defined(AES_HAVE_NI)
+    return (double)__builtin_ia32_rdtsc();
+#else
+    return 0.0;
+#endif
+}
+
+typedef struct {
+    double ns, cycles, passes;  /* per frame */
+} aes_cost;
+
+enum { AES_OP_REF_CTR, AES_OP_CTR, AES_OP_CMAC, AES_OP_CMAC_BATCH, AES_OP_CBC_BATCH, AES_OP_SEAL, AES_OP_OPEN };
+
+#define AES_BATCH 8
+
+static void aes_measure(int op, int len, aes_cost *out) {
+    static unsigned char data[AES_BATCH][256 + SC_OVERHEAD], sealed[256 + SC_OVERHEAD];
+    unsigned char rk[AES_ROUNDS + 1][AES_BLOCK], ctr[AES_BLOCK], ks[AES_BLOCK], key[AES_BLOCK], nonce[8];
+    aes128_key k;
+    aes_job jobs[AES_BATCH];
+    sc_channel ca, cb;
+    double t0, c0, p0, frames;
+    int i, b, per, off, n;
+
+    memset(key, 0x5A, AES_BLOCK);
+    memset(nonce, 0x11, sizeof(nonce));
+    memset(ctr, 0, AES_BLOCK);
+    aes128_init(&k, key);
+    aes_ref_expand(key, rk);
+    sc_init(&ca, key, nonce, 1);
+    sc_init(&cb, key, nonce, 0);
+    per = op == AES_OP_CMAC_BATCH || op == AES_OP_CBC_BATCH ? AES_BATCH : 1;
+    n = sc_seal(&ca, data[0], len, sealed);
+    frames = 0.0;
+    t0 = bench_now_ns();
+    c0 = aes_cycles();
+    p0 = (double)aes_passes;
+    do {
+        for (i = 0; i < 64; i++) {
+            switch (op) {
+            case AES_OP_REF_CTR:
+                for (off = 0; off < len; off += AES_BLOCK) {
+                    memcpy(ks, ctr, AES_BLOCK);
+                    aes_ctr_inc(ctr);
+                    aes_ref_encrypt(rk, ks);
+                    aes_xor_block(data[0] + off, ks, len - off < AES_BLOCK ? len - off : AES_BLOCK);
+                }
+                break;
+            case AES_OP_CTR:
+                aes128_ctr(&k, ctr, data[0], len);
+                break;
+            case AES_OP_CMAC:
+                aes128_cmac(&k, data[0], len, ks);
+                break;
+            case AES_OP_CMAC_BATCH:
+            case AES_OP_CBC_BATCH:
+                for (b = 0; b < AES_BATCH; b++) {
+                    jobs[b].data = data[b];
+                    jobs[b].len = len;
+                    memset(jobs[b].iv, b, AES_BLOCK);
+                }
+                if (op == AES_OP_CMAC_BATCH) aes128_cmac_batch(&k, jobs, AES_BATCH);
+                else aes128_cbc_encrypt_batch(&k, jobs, AES_BATCH);
+                break;
+            case AES_OP_SEAL:
+                sc_seal(&ca, data[0], len, data[1]);
+                break;
+            default:
+                cb.rx_seq = 0;
+                sc_open(&cb, sealed, n, data[1]);
+                break;
+            }
+            frames += per;
+        }
+    } while (bench_now_ns() - t0 < 30e6);
+    out->ns = (bench_now_ns() - t0) / frames;
+    out->cycles = (aes_cycles() - c0) / frames;
+    out->passes = ((double)aes_passes - p0) / frames;
+    bench_sink += data[1][0] + ks[0];
+}
+
+/*
+ * aes [-i 0|1] [-c cycles_per_pass] [-m mhz]
+ * Known-answer and cross-checks on the bitsliced core (and on AES-NI when
+ * present and -i 1), then cost per frame for 16/64/256-byte frames.
+ * "passes" counts two-lane block invocations per frame. The ARM7 column is
+ * passes times a per-pass cycle budget (-c; the default is an instruction
+ * count of pack, ten rounds with register spills and unpack on ARM7TDMI)
+ * at -m MHz. Host cycles are TSC ticks and only shown on x86.
+ */
+static int tool_aes(int argc, char **argv) {
+    static const int lens[3] = { 16, 64, 256 };
+    static const char *const names[] = {
+        "byte-oriented CTR", "bitsliced CTR", "bitsliced CMAC", "bitsliced CMAC x8 batch",
+        "bitsliced CBC x8 batch", "channel seal", "channel open"
+    };
+    aes_cost c;
+    double pass_cycles, mhz;
+    int k, op, li, fails, ni;
+
+    pass_cycles = 5700.0;
+    mhz = 60.0;
+    ni = 1;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-i") == 0) ni = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-c") == 0) pass_cycles = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-m") == 0) mhz = atof(argv[k + 1]);
+        else break;
+    }
+    if (k != argc || pass_cycles <= 0.0 || mhz <= 0.0) {
+        fprintf(stderr, "usage: aes [-i 0|1] [-c cycles_per_pass] [-m mhz]\n");
+        return 2;
+    }
+    aes_ref_init();
+#if defined(AES_HAVE_NI)
+    aes_ni_state = 0;
+#endif
+    fails = aes_selftest();
+    printf("bitsliced self-test: %s\n", fails ? "FAILED" : "ok");
+#if defined(AES_HAVE_NI)
+    aes_ni_state = -1;
+    if (ni && aes_ni_enabled()) {
+        k = aes_selftest();
+        printf("AES-NI self-test: %s\n", k ? "FAILED" : "ok");
+        fails += k;
+    }
+    aes_ni_state = 0;
+#endif
+    if (fails) return 1;
+
+    printf("\n%-26s %5s %10s %10s %8s %12s\n", "per frame", "bytes", "host ns", "host cyc/B", "passes",
+           "ARM7 est us");
+    for (op = AES_OP_REF_CTR; op <= AES_OP_OPEN; op++) {
+        for (li = 0; li < 3; li++) {
+            aes_measure(op, lens[li], &c);
+            printf("%-26s %5d %10.1f %10.2f %8.2f", names[op], lens[li], c.ns, c.cycles / lens[li], c.passes);
+            if (op == AES_OP_REF_CTR) printf(" %12s\n", "-");
+            else printf(" %12.0f\n", c.passes * pass_cycles / mhz);
+        }
+    }
+#if defined(AES_HAVE_NI)
+    aes_ni_state = -1;
+    if (ni && aes_ni_enabled()) {
+        for (op = AES_OP_CTR; op <= AES_OP_OPEN; op++) {
+            if (op != AES_OP_CTR && op != AES_OP_SEAL && op != AES_OP_OPEN) continue;
+            for (li = 0; li < 3; li++) {
+                aes_measure(op, lens[li], &c);
+                printf("AES-NI %-19s %5d %10.1f %10.2f %8.2f %12s\n", names[op] + (op == AES_OP_CTR ? 10 : 0),
+                       lens[li], c.ns, c.cycles / lens[li], c.passes, "-");
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+/* ---- tokens: signed credential checks, single vs batch, cache and gate queue ---- */
+
+/* development issuer: seed 00 01 .. 1f; its public key is token_dev_issuer */
+static void tokens_dev_seed(unsigned char *seed) {
+    int i;
+    for (i = 0; i < 32; i++) seed[i] = (unsigned char)i;
+}
+
+static int tokens_selftest(void) {
+    static const char *const rfc_seed[3] = {
+        "9d61b19deffd5a60ba844af492ec2cc44449c5697b326919703bac031cae7f60",
+        "4ccd089b28ff96da9db6c346ec114e0f5b8a319f35aba624da8cf6ed4fb8a6fb",
+        "c5aa8df43f9f837bedb7442f31dcb7b166d38535076f094b85ce3a2e0b4458f7"
+    };
+    static const char *const rfc_pub[3] = {
+        "d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a",
+        "3d4017c3e843895a92b70aa74d1b7ebc9c982ccf2ec4968cc0cd55f12af4660c",
+        "fc51cd8e6218a1a38da47ed00230f0580816ed13ba3303ac5deb911548908025"
+    };
+    static const char *const rfc_msg[3] = { "", "72", "af82" };
+    static const char *const rfc_sig[3] = {
+        "e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e065224901555fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b",
+        "92a009a9f0d4cab8720e820b5f642540a2b27b5416503f8fb3762223ebdb69da085ac1e43e15996e458f3613d0f11d8c387b2eaeb4302aeeb00d291612bb0c00",
+        "6291d657deec24024827e69c3abe01a30ce548a284743a445e3680d7db5ac3ac18ff9b538d16f290ae67f760984dc6594a7c15e9716ed28dc027beceea1ec40a"
+    };
+    static const char two_block[] = "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmno"
+                                    "ijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+    enum { NB = 12 };
+    unsigned char seed[32], pub[NB][ED_KEY], sig[NB][ED_SIG], msg[NB][40], h[SHA512_DIGEST], bad[ED_SIG];
+    unsigned char toks[NB][TOKEN_LEN];
+    const unsigned char *sp[NB], *mp[NB], *pp[NB], *tp[NB];
+    unsigned long lens[NB];
+    token_body body[NB];
+    int rc[NB];
+    sha512_ctx c;
+    sim_rng r;
+    int fails, i, j, n;
+
+    fails = 0;
+    sha512_init(&c);
+    sha512_final(&c, h);
+    aes_check("SHA-512 empty", h, "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
+              "47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e", &fails);
+    sha512_init(&c);
+    sha512_update(&c, (const unsigned char *)"abc", 3);
+    sha512_final(&c, h);
+    aes_check("SHA-512 abc", h, "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+              "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f", &fails);
+    sha512_init(&c);
+    for (i = 0; i < 112; i += 7) sha512_update(&c, (const unsigned char *)two_block + i, 7);
+    sha512_final(&c, h);
+    aes_check("SHA-512 two blocks", h, "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018"
+              "501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909", &fails);
+
+    /* RFC 8032 7.1 tests 1-3: key, signature, check, and a flipped bit anywhere fails */
+    for (i = 0; i < 3; i++) {
+        aes_hex(rfc_seed[i], seed);
+        n = aes_hex(rfc_msg[i], msg[0]);
+        if (n < 0) n = 0;
+        ed25519_public_key(pub[0], seed);
+        aes_check("RFC 8032 public key", pub[0], rfc_pub[i], &fails);
+        ed25519_sign(sig[0], msg[0], (unsigned long)n, seed, pub[0]);
+        aes_check("RFC 8032 signature", sig[0], rfc_sig[i], &fails);
+        if (!ed25519_verify(sig[0], msg[0], (unsigned long)n, pub[0])) {
+            printf("  FAIL RFC 8032 test %d does not verify\n", i + 1);
+            fails++;
+        }
+        for (j = 0; j < 8 * ED_SIG; j += 37) {
+            memcpy(bad, sig[0], ED_SIG);
+            bad[j / 8] ^= (unsigned char)(1 << (j % 8));
+            if (ed25519_verify(bad, msg[0], (unsigned long)n, pub[0])) {
+                printf("  FAIL RFC 8032 test %d accepts flipped signature bit %d\n", i + 1, j);
+                fails++;
+            }
+        }
+    }
+    /* S + L is the same point equation but not canonical */
+    memcpy(bad, sig[0], ED_SIG);
+    for (i = 0, j = 0; i < 32; i++) {
+        j += bad[32 + i] + ed_order[i];
+        bad[32 + i] = (unsigned char)j;
+        j >>= 8;
+    }
+    if (ed25519_verify(bad, msg[0], 2, pub[0])) {
+        printf("  FAIL accepts S + L\n");
+        fails++;
+    }
+
+    /* random keys: single and batch agree, and a batch with one bad signature fails */
+    sim_rng_seed(&r, 11);
+    for (i = 0; i < NB; i++) {
+        for (j = 0; j < 32; j++) seed[j] = (unsigned char)sim_rng_below(&r, 256);
+        for (j = 0; j < 40; j++) msg[i][j] = (unsigned char)sim_rng_below(&r, 256);
+        lens[i] = 1 + sim_rng_below(&r, 40);
+        ed25519_public_key(pub[i], seed);
+        ed25519_sign(sig[i], msg[i], lens[i], seed, pub[i]);
+        sp[i] = sig[i];
+        mp[i] = msg[i];
+        pp[i] = pub[i];
+        if (!ed25519_verify(sig[i], msg[i], lens[i], pub[i])) {
+            printf("  FAIL random signature %d\n", i);
+            fails++;
+        }
+    }
+    if (!ed25519_verify_batch(NB, sp, mp, lens, pp)) {
+        printf("  FAIL batch of valid signatures\n");
+        fails++;
+    }
+    msg[5][0] ^= 1;
+    if (ed25519_verify_batch(NB, sp, mp, lens, pp)) {
+        printf("  FAIL batch with a bad signature\n");
+        fails++;
+    }
+    msg[5][0] ^= 1;
+
+    /* tokens: expiry, zone, tampering, and the batch path finds exactly the bad ones */
+    tokens_dev_seed(seed);
+    ed25519_public_key(pub[0], seed);
+    if (memcmp(pub[0], token_dev_issuer, ED_KEY) != 0) {
+        printf("  FAIL development issuer key\n");
+        fails++;
+    }
+    token_set_issuer(0, pub[0]);
+    for (i = 0; i < NB; i++) {
+        body[i].issuer = 0;
+        body[i].user = i;
+        body[i].zones = 1u << (i % 3);
+        body[i].expires = 1000UL + (unsigned long)i;
+        body[i].serial = (unsigned long)i;
+        token_issue(toks[i], &body[i], seed, pub[0]);
+        tp[i] = toks[i];
+    }
+    toks[7][3] ^= 1;            /* tampered, but zone fails first */
+    token_cache_init(TOKEN_CACHE_DEFAULT);
+    token_check_batch(tp, NB, 0, 1003, body, rc);
+    for (i = 0; i < NB; i++) {
+        j = i < 3 ? TOKEN_EXPIRED : i % 3 ? TOKEN_WRONG_ZONE : TOKEN_OK;
+        if (rc[i] != j) {
+            printf("  FAIL token %d batch result %d, expected %d\n", i, rc[i], j);
+            fails++;
+        }
+    }
+    token_cache_init(TOKEN_CACHE_DEFAULT);
+    for (i = 0; i < NB; i++) body[i].zones = 0xFFFF;
+    for (i = 0; i < NB; i++) {
+        token_issue(toks[i], &body[i], seed, pub[0]);
+        if (i == 7) toks[7][3] ^= 1;
+    }
+    token_check_batch(tp, NB, 4, 0, body, rc);
+    for (i = 0; i < NB; i++) {
+        j = i == 7 ? TOKEN_BAD_SIGNATURE : TOKEN_OK;
+        if (rc[i] != j || token_check(toks[i], TOKEN_LEN, 4, 0, &body[i]) != j) {
+            printf("  FAIL token %d single/batch result %d, expected %d\n", i, rc[i], j);
+            fails++;
+        }
+    }
+    return fails;
+}
+
+/* One check at a time or batched; seconds per token */
+static double tokens_time_checks(const unsigned char *const *tp, int n, int batch) {
+    static const unsigned char *sp[ED_BATCH_MAX], *pp[ED_BATCH_MAX];
+    static unsigned long lens[ED_BATCH_MAX];
+    double t0;
+    int i, k, m, ok;
+
+    ok = 1;
+    t0 = bench_now_ns();
+    for (i = 0; i < n; i += batch) {
+        m = n - i < batch ? n - i : batch;
+        for (k = 0; k < m; k++) {
+            sp[k] = tp[i + k] + TOKEN_BODY;
+            pp[k] = token_issuer_key[0];
+            lens[k] = TOKEN_BODY;
+        }
+        if (batch == 1) ok &= ed25519_verify(sp[0], tp[i], TOKEN_BODY, pp[0]);
+        else ok &= ed25519_verify_batch(m, sp, tp + i, lens, pp);
+    }
+    if (!ok) fprintf(stderr, "tokens: valid tokens rejected\n");
+    return (bench_now_ns() - t0) / 1e9 / n;
+}
+
+/*
+ * FIFO gate queue fed by Poisson arrivals; the checker takes one token at
+ * a time (max_batch 1) or everything queued up to max_batch, paying
+ * cost[b] seconds for a batch of b. Latency is arrival to decision.
+ */
+static void tokens_gate(const double *cost, int max_batch, double rate, int arrivals, double *p50, double *p99) {
+    double *arr, *lat, t, busy_until;
+    sim_rng r;
+    int head, i, b;
+
+    arr = (double *)malloc(sizeof(double) * (size_t)arrivals);
+    lat = (double *)malloc(sizeof(double) * (size_t)arrivals);
+    if (!arr || !lat) {
+        free(arr);
+        free(lat);
+        *p50 = *p99 = -1.0;
+        return;
+    }
+    sim_rng_seed(&r, 5);
+    t = 0.0;
+    for (i = 0; i < arrivals; i++) {
+        t += sim_rng_exp(&r, rate);
+        arr[i] = t;
+    }
+    busy_until = 0.0;
+    head = 0;
+    while (head < arrivals) {
+        if (busy_until < arr[head]) busy_until = arr[head];
+        b = 0;
+        while (head + b < arrivals && b < max_batch && arr[head + b] <= busy_until) b++;
+        busy_until += cost[b];
+        for (i = 0; i < b; i++) lat[head + i] = busy_until - arr[head + i];
+        head += b;
+    }
+    qsort(lat, (size_t)arrivals, sizeof(double), bench_cmp_double);
+    *p50 = lat[arrivals / 2];
+    *p99 = lat[(int)(arrivals * 0.99)];
+    free(arr);
+    free(lat);
+}
+
+/*
+ * tokens [-n tokens] [-u users] [-p presentations] [-g user]
+ * Self-test (SHA-512, RFC 8032, tampering, batch vs single), then
+ * signature checks/s per batch size, verified-token cache hit rate on
+ * Zipf traffic, and gate latency at offered loads relative to the
+ * single-check capacity. -g prints a day-long, all-zone token from the
+ * development issuer as T<hex> for the card prompt or a replay trace;
+ * -k prints that issuer's public key in the form TOKEN_ISSUER_KEY takes,
+ * for bench doors that should accept those tokens.
+ */
+static int tool_tokens(int argc, char **argv) {
+    static const int batches[] = { 1, 2, 4, 8, 16, 32, 64 };
+    static const int cache_sizes[] = { 0, 8, 32 };
+    static const double loads[] = { 0.5, 0.9, 1.5, 3.0 };
+    unsigned char seed[32], pub[ED_KEY], *toks;
+    const unsigned char **tp;
+    double cost[ED_BATCH_MAX + 1], per, single, t0, p50, p99, bp50, bp99;
+    token_body b;
+    zipf_table z;
+    sim_rng r;
+    int k, i, n, users, pres, gen, hits, bi, show_key;
+    unsigned long now;
+
+    n = 256;
+    users = 400;
+    pres = 20000;
+    gen = -1;
+    show_key = 0;
+    for (k = 0; k < argc; k++) {
+        if (strcmp(argv[k], "-k") == 0) show_key = 1;
+        else if (k + 1 >= argc) break;
+        else if (strcmp(argv[k], "-n") == 0) n = atoi(argv[++k]);
+        else if (strcmp(argv[k], "-u") == 0) users = atoi(argv[++k]);
+        else if (strcmp(argv[k], "-p") == 0) pres = atoi(argv[++k]);
+        else if (strcmp(argv[k], "-g") == 0) gen = atoi(argv[++k]);
+        else break;
+    }
+    if (k != argc || n < ED_BATCH_MAX || users < 1 || users > 65535 || pres < 1 || gen > 65535) {
+        fprintf(stderr, "usage: tokens [-n tokens>=%d] [-u users] [-p presentations] [-g user] [-k]\n",
+                ED_BATCH_MAX);
+        return 2;
+    }
+    tokens_dev_seed(seed);
+    ed25519_public_key(pub, seed);
+    now = (unsigned long)time(0);
+    if (show_key) {
+        for (i = 0; i < ED_KEY; i++) printf("%s0x%02x", i ? "," : "", pub[i]);
+        printf("\n");
+        return 0;
+    }
+    if (gen >= 0) {
+        unsigned char tok[TOKEN_LEN];
+        b.issuer = 0;
+        b.user = gen;
+        b.zones = 0xFFFF;
+        b.expires = now + 86400UL;
+        b.serial = now;
+        token_issue(tok, &b, seed, pub);
+        printf("T");
+        for (i = 0; i < TOKEN_LEN; i++) printf("%02x", tok[i]);
+        printf("\n");
+        return 0;
+    }
+
+    k = tokens_selftest();
+    printf("self-test: %s\n", k ? "FAILED" : "ok");
+    if (k) return 1;
+
+    k = n > users ? n : users;
+    toks = (unsigned char *)malloc((size_t)k * TOKEN_LEN);
+    tp = (const unsigned char **)malloc(sizeof(*tp) * (size_t)k);
+    if (!toks || !tp || zipf_init(&z, users, 1.0) != 0) {
+        fprintf(stderr, "tokens: out of memory\n");
+        return 1;
+    }
+    token_set_issuer(0, pub);
+    t0 = bench_now_ns();
+    for (i = 0; i < k; i++) {
+        b.issuer = 0;
+        b.user = i;
+        b.zones = 1u | (unsigned int)(i & 0xFE);
+        b.expires = now + 3600UL;
+        b.serial = (unsigned long)i;
+        token_issue(toks + (size_t)i * TOKEN_LEN, &b, seed, pub);
+        tp[i] = toks + (size_t)i * TOKEN_LEN;
+    }
+    printf("issued %d tokens, %.0f us each\n\n", k, (bench_now_ns() - t0) / 1e3 / k);
+
+    printf("%6s  %12s  %10s  %8s\n", "batch", "us/token", "tokens/s", "speedup");
+    single = 0.0;
+    for (bi = 0; bi < (int)(sizeof(batches) / sizeof(batches[0])); bi++) {
+        per = tokens_time_checks(tp, n, batches[bi]);
+        if (bi == 0) single = per;
+        printf("%6d  %12.1f  %10.0f  %7.2fx\n", batches[bi], per * 1e6, 1.0 / per, single / per);
+        cost[batches[bi]] = per * batches[bi];
+    }
+    /* fill in the batch sizes between the measured ones */
+    for (i = 2; i <= ED_BATCH_MAX; i++) {
+        for (bi = 1; batches[bi] < i; bi++) {
+            /* find the measured size at or above i */
+        }
+        if (batches[bi] != i) {
+            per = cost[batches[bi - 1]] / batches[bi - 1] +
+                  (cost[batches[bi]] / batches[bi] - cost[batches[bi - 1]] / batches[bi - 1]) *
+                      (i - batches[bi - 1]) / (batches[bi] - batches[bi - 1]);
+            cost[i] = per * i;
+        }
+    }
+    cost[0] = 0.0;
+
+    printf("\n%d presentations, Zipf over %d users\n%8s  %8s  %12s\n", pres, users, "cache", "hit rate", "us/check");
+    for (bi = 0; bi < (int)(sizeof(cache_sizes) / sizeof(cache_sizes[0])); bi++) {
+        token_cache_init(cache_sizes[bi]);
+        sim_rng_seed(&r, 3);
+        hits = (int)metrics_sum_counter(MET_TOKEN_CACHE_HITS);
+        t0 = bench_now_ns();
+        for (i = 0; i < pres; i++) {
+            k = zipf_sample(&z, &r);
+            if (token_check(tp[k], TOKEN_LEN, 0, now, &b) != TOKEN_OK) fprintf(stderr, "tokens: rejected %d\n", k);
+        }
+        per = (bench_now_ns() - t0) / 1e3 / pres;
+        hits = (int)metrics_sum_counter(MET_TOKEN_CACHE_HITS) - hits;
+        printf("%8d  %7.1f%%  %12.1f\n", cache_sizes[bi], 100.0 * hits / pres, per);
+    }
+    token_cache_init(TOKEN_CACHE_DEFAULT);
+
+    printf("\ngate queue, no cache (capacity one at a time %.0f tokens/s)\n", 1.0 / single);
+    printf("%8s  %10s  %10s  %10s  %10s\n", "load", "single p50", "single p99", "batch p50", "batch p99");
+    for (bi = 0; bi < (int)(sizeof(loads) / sizeof(loads[0])); bi++) {
+        tokens_gate(cost, 1, loads[bi] / single, 20000, &p50, &p99);
+        tokens_gate(cost, ED_BATCH_MAX, loads[bi] / single, 20000, &bp50, &bp99);
+        printf("%7.1fx  ", loads[bi]);
+        if (loads[bi] >= 1.0) printf("%10s  %10s  ", "unstable", "unstable");
+        else printf("%8.1fms  %8.1fms  ", p50 * 1e3, p99 * 1e3);
+        printf("%8.1fms  %8.1fms\n", bp50 * 1e3, bp99 * 1e3);
+    }
+    free(z.cdf);
+    free(toks);
+    free(tp);
+    return 0;
+}
+
+/* ---- mgmt: management protocol self-test and throughput on a modelled UART ---- */
+
+#define MGMT_BENCH_QUEUE 8192
+
+static const unsigned char mgmt_test_key[AES_BLOCK] = {
+    0x6d, 0x67, 0x6d, 0x74, 0x2d, 0x74, 0x65, 0x73, 0x74, 0x2d, 0x6b, 0x65, 0x79, 0x2d, 0x30, 0x31
+};
+static const unsigned char mgmt_test_nonce[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+static void mgmt_test_send(sc_channel *c, int id, int op, const unsigned char *p, int n) {
+    unsigned char body[MGMT_BODY_MAX], frame[MGMT_FRAME_MAX];
+    int len, i;
+    body[0] = (unsigned char)id;
+    body[1] = (unsigned char)op;
+    body[2] = 0;
+    memcpy(body + MGMT_BODY_HEADER, p, (size_t)n);
+    len = mgmt_frame(c, body, MGMT_BODY_HEADER + n, frame);
+    for (i = 0; i < len; i++) mgmt_rx_isr(frame[i]);
+}
+
+/* Next reply off the transmit ring into body; its length, or -1 if none is complete */
+static int mgmt_test_recv(sc_channel *c, unsigned char *body) {
+    static unsigned char frame[MGMT_FRAME_MAX];
+    static int len;
+    int b, n;
+    while ((b = mgmt_tx_isr()) >= 0) {
+        n = mgmt_frame_byte(frame, &len, (unsigned char)b);
+        if (n == 0) continue;
+        if (c) return sc_open(c, frame + MGMT_HEADER, n - MGMT_HEADER - 2, body);
+        memcpy(body, frame + MGMT_HEADER, (size_t)(n - MGMT_HEADER - 2));
+        return n - MGMT_HEADER - 2;
+    }
+    return -1;
+}
+
+static void mgmt_check(const char *name, int ok, int *fails) {
+    if (ok) return;
+    printf("FAIL %s\n", name);
+    (*fails)++;
+}
+
+static int mgmt_selftest(void) {
+    static sc_channel dev, host;
+    unsigned char req[MGMT_PAYLOAD_MAX], body[MGMT_BODY_MAX], pw[PASSWORD_MAX_LEN];
+    unsigned long first, bad;
+    int fails, n, i, got;
+
+    fails = 0;
+    mgmt_init(0, 0);
+    mgmt_test_send(0, 7, MGMT_OP_PING, (const unsigned char *)"abc", 3);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(0, body);
+    mgmt_check("ping echo", n == 7 && body[0] == 7 && body[1] == (MGMT_OP_PING | MGMT_REPLY_BIT) &&
+                                body[3] == MGMT_OK && memcmp(body + 4, "abc", 3) == 0, &fails);
+
+    /* two good records around a short one for an unknown user, then a truncated one */
+    memcpy(req, "\003\0044321\002\0019\310\0011\005\011", 13);
+    mgmt_test_send(0, 8, MGMT_OP_SET_PASSWORD, req, 14);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(0, body);
+    mgmt_check("password statuses", n == 8 && body[4] == MGMT_OK && body[5] == MGMT_OK &&
+                                        body[6] == MGMT_ERR_USER && body[7] == MGMT_ERR_FORMAT, &fails);
+    eeprom_read_bytes(USER_SLOT_ADDR(3), pw, PASSWORD_MAX_LEN);
+    mgmt_check("password stored", memcmp(pw, "4321\0", 5) == 0, &fails);
+    eeprom_read_bytes(USER_SLOT_ADDR(2), pw, PASSWORD_MAX_LEN);
+    mgmt_check("short password stored", memcmp(pw, "9\0", 2) == 0, &fails);
+
+    /* an EEPROM write waits while a session is open; a ping does not */
+    memcpy(req, "\003\0021", 4);
+    door_session = 1;
+    mgmt_test_send(0, 13, MGMT_OP_SET_PASSWORD, req, 4);
+    mgmt_test_send(0, 14, MGMT_OP_PING, req, 0);
+    for (i = 0; i < 10; i++) mgmt_service(MGMT_BUDGET_SESSION);
+    n = mgmt_test_recv(0, body);
+    got = mgmt_test_recv(0, body + 8);
+    mgmt_check("write held in session", n == 4 && body[0] == 14 && got < 0, &fails);
+    door_session = 0;
+    mgmt_service(MGMT_BUDGET_SESSION);
+    mgmt_service(MGMT_BUDGET_SESSION);
+    n = mgmt_test_recv(0, body);
+    eeprom_read_bytes(USER_SLOT_ADDR(3), pw, PASSWORD_MAX_LEN);
+    mgmt_check("write after session", n == 5 && body[0] == 13 && body[4] == MGMT_OK && memcmp(pw, "1\0", 2) == 0,
+               &fails);
+
+    /* user 4 revoked, user 60 out of range */
+    memset(req, 0, 2 * MGMT_USER_RECORD);
+    req[0] = 4;
+    req[7] = 1;
+    req[MGMT_USER_RECORD] = 60;
+    mgmt_test_send(0, 10, MGMT_OP_SET_USER, req, 2 * MGMT_USER_RECORD);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(0, body);
+    mgmt_check("user records", n == 6 && body[4] == MGMT_OK && body[5] == MGMT_ERR_USER &&
+                                   user_admit(4, 0, 0) == USER_DENY_REVOKED && user_admit(5, 0, 0) == USER_OK, &fails);
+    user_revoke(4, 0);
+
+    mgmt_test_send(0, 9, 0x7E, req, 0);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(0, body);
+    mgmt_check("unknown op", n == 4 && body[3] == MGMT_ERR_OP, &fails);
+
+    /* the clock set a day back, and a short payload refused */
+    access_put32(req, (unsigned long)time(0) - 86400UL);
+    mgmt_test_send(0, 11, MGMT_OP_SET_TIME, req, 4);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(0, body);
+    mgmt_check("set time", n == 4 && body[0] == 11 && body[3] == MGMT_OK && rtc_is_set() &&
+                               (unsigned long)time(0) - rtc_now_seconds() - 86400UL <= 1UL, &fails);
+    mgmt_test_send(0, 12, MGMT_OP_SET_TIME, req, 3);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(0, body);
+    mgmt_check("short time", n == 4 && body[0] == 12 && body[3] == MGMT_ERR_FORMAT, &fails);
+    rtc_set_seconds((unsigned long)time(0));
+
+    /* a long batch and a ping in flight together: the ping is answered first */
+    for (i = 0; i < 100; i++) req[i] = (unsigned char)(i % MAX_USERS);
+    mgmt_test_send(0, 1, MGMT_OP_FP_ENROLL, req, 100);
+    mgmt_test_send(0, 2, MGMT_OP_PING, req, 0);
+    for (i = 0; i < 110; i++) mgmt_service(MGMT_BUDGET_SESSION);
+    n = mgmt_test_recv(0, body);
+    mgmt_check("ping overtakes batch", n == 4 && body[0] == 2, &fails);
+    n = mgmt_test_recv(0, body);
+    got = 0;
+    for (i = 4; i < n; i++) got += body[i] == MGMT_OK;
+    mgmt_check("batch of 100", n == 104 && body[0] == 1 && got == 100, &fails);
+
+    /* 40 decisions streamed back 16 per reply */
+    first = access_log_next;
+    for (i = 0; i < 40; i++) access_log_append(i, MET_GRANTS, ACCESS_SRC_CARD);
+    access_put32(req, first);
+    req[4] = 0;
+    req[5] = 200;
+    mgmt_test_send(0, 3, MGMT_OP_READ_LOG, req, 6);
+    got = 0;
+    for (i = 0; i < 4; i++) {
+        mgmt_service(MGMT_BUDGET_SESSION);
+        if ((n = mgmt_test_recv(0, body)) < 0) continue;
+        mgmt_check("log chunk", body[0] == 3 && n == 9 + body[8] * ACCESS_LOG_RECORD &&
+                                    (body[2] & MGMT_FLAG_MORE) == (got + body[8] < 40) &&
+                                    body[9 + 3] == (unsigned char)(first + got) && body[9 + 9] == got,
+                   &fails);
+        got += body[8];
+    }
+    mgmt_check("log records", got == 40, &fails);
+
+    /* sealed link: a good ping, then a flipped ciphertext bit is dropped */
+    sc_init(&dev, mgmt_test_key, mgmt_test_nonce, 0);
+    sc_init(&host, mgmt_test_key, mgmt_test_nonce, 1);
+    mgmt_init(&dev, mgmt_test_nonce);
+    mgmt_test_send(&host, 4, MGMT_OP_PING, (const unsigned char *)"xy", 2);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(&host, body);
+    mgmt_check("sealed ping", n == 6 && body[0] == 4 && memcmp(body + 4, "xy", 2) == 0, &fails);
+
+    /* plain frames on a sealed link: the nonce is given out, changes and the log are refused */
+    mgmt_test_send(0, 5, MGMT_OP_SESSION, req, 0);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(0, body);
+    mgmt_check("plain session", n == 12 && body[0] == 5 && body[3] == MGMT_OK &&
+                                    memcmp(body + 4, mgmt_test_nonce, 8) == 0, &fails);
+    access_put32(req, 1000UL);
+    mgmt_test_send(0, 6, MGMT_OP_SET_TIME, req, 4);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(0, body);
+    mgmt_check("plain set time refused", n == 4 && body[0] == 6 && body[3] == MGMT_ERR_AUTH &&
+                                             rtc_now_seconds() > 1000UL, &fails);
+    req[0] = 3;
+    mgmt_test_send(0, 7, MGMT_OP_FP_DELETE, req, 1);
+    mgmt_test_send(0, 8, MGMT_OP_READ_LOG, req, 6);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(0, body);
+    got = mgmt_test_recv(0, body + 8);
+    mgmt_check("plain delete and log refused", n == 4 && got == 4 && body[3] == MGMT_ERR_AUTH &&
+                                                   body[8 + 3] == MGMT_ERR_AUTH, &fails);
+    mgmt_test_send(&host, 9, MGMT_OP_FP_DELETE, req, 1);
+    mgmt_service(MGMT_BUDGET_IDLE);
+    n = mgmt_test_recv(&host, body);
+    mgmt_check("sealed delete", n == 5 && body[0] == 9 && body[3] == MGMT_OK && body[4] == MGMT_OK, &fails);
+    bad = metrics_sum_counter(MET_MGMT_BAD_FRAMES);
+    {
+        unsigned char b2[MGMT_BODY_MAX], frame[MGMT_FRAME_MAX];
+        unsigned int crc;
+        b2[0] = 5;
+        b2[1] = MGMT_OP_PING;
+        b2[2] = 0;
+        n = mgmt_frame(&host, b2, MGMT_BODY_HEADER, frame);
+        frame[MGMT_HEADER + SC_SEQ] ^= 1;
+        crc = osdp_crc16(frame, n - 2);
+        frame[n - 2] = (unsigned char)(crc & 0xFF);
+        frame[n - 1] = (unsigned char)(crc >> 8);
+        for (i = 0; i < n; i++) mgmt_rx_isr(frame[i]);
+    }
+    mgmt_service(MGMT_BUDGET_IDLE);
+    mgmt_check("tampered frame dropped", mgmt_test_recv(&host, body) < 0 &&
+                                             metrics_sum_counter(MET_MGMT_BAD_FRAMES) == bad + 1, &fails);
+    mgmt_init(0, 0);
+    return fails;
+}
+
+#define MGMT_SLICE_SAMPLES 262144
+
+typedef struct {
+    double secs;
+    unsigned long records;
+    unsigned long errors;
+} mgmt_run_result;
+
+/* Host time of every mgmt_service call that had work, across runs */
+static double mgmt_slice_us[MGMT_SLICE_SAMPLES];
+static int mgmt_slices;
+
+/*
+ * The controller side is the real code (rings, scheduler, ops). The wire
+ * moves baud/10 bytes a second each way, the controller gets one
+ * mgmt_service(budget) call per simulated millisecond, and the client
+ * keeps up to window requests of batch records in flight. READ_LOG asks
+ * for the whole log each time.
+ */
+static void mgmt_run(int op, int batch, int window, unsigned long baud, int budget, int sealed, unsigned long total,
+                     mgmt_run_result *res) {
+    static unsigned char up[MGMT_BENCH_QUEUE];
+    static sc_channel dev, host;
+    unsigned char req[MGMT_PAYLOAD_MAX], body[MGMT_BODY_MAX];
+    unsigned long sent, ms;
+    unsigned int busy;
+    double credit, t0, dt;
+    int up_len, up_pos, outstanding, id, n, i, p, wire;
+
+    sc_init(&dev, mgmt_test_key, mgmt_test_nonce, 0);
+    sc_init(&host, mgmt_test_key, mgmt_test_nonce, 1);
+    mgmt_init(sealed ? &dev : 0, mgmt_test_nonce);
+    memset(res, 0, sizeof(*res));
+    up_len = up_pos = outstanding = 0;
+    id = 0;
+    sent = 0;
+    credit = 0.0;
+    for (ms = 0; res->records < total && ms < 3600000UL; ms++) {
+        while (outstanding < window && sent < total && up_len + MGMT_FRAME_MAX <= MGMT_BENCH_QUEUE) {
+            p = 0;
+            if (op == MGMT_OP_READ_LOG) {
+                access_put32(req, 1);
+                req[4] = 0;
+                req[5] = ACCESS_LOG_LEN;
+                p = 6;
+                sent += ACCESS_LOG_LEN;
+            }
+            for (i = 0; op != MGMT_OP_READ_LOG && i < batch && sent < total; i++, sent++) {
+                req[p++] = (unsigned char)(sent % MAX_USERS);
+                if (op == MGMT_OP_SET_PASSWORD) {
+                    char digits[8];
+                    req[p++] = 6;
+                    sprintf(digits, "%06lu", sent % 1000000UL); /* the NUL stays out of req */
+                    memcpy(req + p, digits, 6);
+                    p += 6;
+                }
+            }
+            id = (id + 1) & 0xFF;
+            {
+                unsigned char b[MGMT_BODY_MAX];
+                b[0] = (unsigned char)id;
+                b[1] = (unsigned char)op;
+                b[2] = 0;
+                memcpy(b + MGMT_BODY_HEADER, req, (size_t)p);
+                up_len += mgmt_frame(sealed ? &host : 0, b, MGMT_BODY_HEADER + p, up + up_len);
+            }
+            outstanding++;
+        }
+        credit += baud / 10.0 / 1000.0;
+        wire = (int)credit;
+        credit -= wire;
+        for (i = 0; i < wire && up_pos < up_len; i++) mgmt_rx_isr(up[up_pos++]);
+        if (up_pos == up_len) up_len = up_pos = 0;
+
+        busy = mgmt.tx_head;
+        t0 = bench_now_ns();
+        mgmt_service(budget);
+        dt = (bench_now_ns() - t0) / 1e3;
+        if ((busy != mgmt.tx_head || up_pos > 0) && mgmt_slices < MGMT_SLICE_SAMPLES) mgmt_slice_us[mgmt_slices++] = dt;
+
+        /* the reply direction runs at the same rate: drain at most wire bytes */
+        for (i = 0; i < wire; i++) {
+            static unsigned char frame[MGMT_FRAME_MAX];
+            static int flen;
+            int b, f;
+            if ((b = mgmt_tx_isr()) < 0) break;
+            f = mgmt_frame_byte(frame, &flen, (unsigned char)b);
+            if (f == 0) continue;
+            if (sealed) {
+                n = sc_open(&host, frame + MGMT_HEADER, f - MGMT_HEADER - 2, body);
+            } else {
+                n = f - MGMT_HEADER - 2;
+                memcpy(body, frame + MGMT_HEADER, (size_t)n);
+            }
+            if (n < MGMT_BODY_HEADER + 1 || body[3] != MGMT_OK) {
+                res->errors++;
+                outstanding--;
+                continue;
+            }
+            if (op == MGMT_OP_READ_LOG) {
+                res->records += body[8];
+                if (!(body[2] & MGMT_FLAG_MORE)) outstanding--;
+                continue;
+            }
+            for (p = 4; p < n; p++) {
+                if (body[p] != MGMT_OK) res->errors++;
+            }
+            res->records += (unsigned long)(n - 4);
+            outstanding--;
+        }
+    }
+    res->secs = ms / 1000.0;
+    mgmt_init(0, 0);
+}
+
+static int tool_mgmt(int argc, char **argv) {
+    static const int ops[] = { MGMT_OP_FP_ENROLL, MGMT_OP_SET_PASSWORD, MGMT_OP_READ_LOG };
+    static const char *const op_names[] = { "fp-enroll", "set-password", "read-log" };
+    static const int batches[] = { 1, 10, 100 };
+    static const int windows[] = { 1, 4 };
+    mgmt_run_result res;
+    unsigned long total, bauds[2];
+    double rate[4];
+    int k, o, bi, wi, b, sealed, batch, max_batch, col;
+
+    total = 1000;
+    bauds[0] = 9600UL;
+    bauds[1] = 115200UL;
+    sealed = 0;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-n") == 0) total = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-b") == 0) bauds[1] = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-k") == 0) sealed = atoi(argv[k + 1]);
+        else break;
+    }
+    if (k != argc || total < 1 || bauds[1] < 300) {
+        fprintf(stderr, "usage: mgmt [-n records] [-b baud] [-k 0|1 sealed]\n");
+        return 2;
+    }
+    stub_quiet = 1;
+    k = mgmt_selftest();
+    printf("self-test: %s\n", k ? "FAILED" : "ok");
+    if (k) return 1;
+
+    for (k = 0; k < ACCESS_LOG_LEN; k++) access_log_append(k % MAX_USERS, MET_GRANTS, ACCESS_SRC_CARD);
+    printf("%lu records per run, %s frames; mgmt_service gets %d unit/ms in a session, %d when idle\n\n", total,
+           sealed ? "sealed" : "plain", MGMT_BUDGET_SESSION, MGMT_BUDGET_IDLE);
+    printf("records/s          %9lu baud        %9lu baud\n", bauds[0], bauds[1]);
+    printf("%-13s %5s %6s  %9s %9s  %9s %9s\n", "op", "batch", "window", "session", "idle", "session", "idle");
+    mgmt_slices = 0;
+    for (o = 0; o < (int)(sizeof(ops) / sizeof(ops[0])); o++) {
+        max_batch = ops[o] == MGMT_OP_SET_PASSWORD ? MGMT_PAYLOAD_MAX / (2 + 6) : MGMT_PAYLOAD_MAX;
+        for (bi = 0; bi < (int)(sizeof(batches) / sizeof(batches[0])); bi++) {
+            batch = batches[bi] < max_batch ? batches[bi] : max_batch;
+            if (ops[o] == MGMT_OP_READ_LOG) {
+                if (bi > 0) break;
+                batch = ACCESS_LOG_LEN;
+            }
+            for (wi = 0; wi < (int)(sizeof(windows) / sizeof(windows[0])); wi++) {
+                for (col = 0; col < 4; col++) {
+                    b = col & 1 ? MGMT_BUDGET_IDLE : MGMT_BUDGET_SESSION;
+                    mgmt_run(ops[o], batch, windows[wi], bauds[col >> 1], b, sealed, total, &res);
+                    if (res.errors) fprintf(stderr, "mgmt: %lu errors\n", res.errors);
+                    rate[col] = res.records / res.secs;
+                }
+                printf("%-13s %5d %6d  %9.0f %9.0f  %9.0f %9.0f\n", op_names[o], batch, windows[wi], rate[0],
+                       rate[1], rate[2], rate[3]);
+            }
+        }
+    }
+    qsort(mgmt_slice_us, (size_t)mgmt_slices, sizeof(double), bench_cmp_double);
+    printf("\nmgmt_service calls with work on this host: %d, p50 %.2f us, p99 %.2f us, max %.2f us\n", mgmt_slices,
+           mgmt_slice_us[mgmt_slices / 2], mgmt_slice_us[mgmt_slices * 99 / 100], mgmt_slice_us[mgmt_slices - 1]);
+    stub_quiet = 0;
+    return 0;
+}
+
+/* ---- fwupdate: delta firmware updates over the modelled management link ---- */
+
+#define FWU_FUNCS 1024
+#define FWU_WORDS ((int)(FW_BANK_SIZE / 4))
+#define FWU_CHUNK (MGMT_PAYLOAD_MAX - 4)
+#define FWU_WINDOW 4
+#define FWU_MIN_COPY 8
+#define FWU_MIN_SEEK 12
+#define FWU_HASH_BITS 16
+#define FWU_SESSION_MS 3000
+#define FWU_TIMEOUT_MS 1000
+#define FWU_POWER_CUT 0x100     /* fwu_result status when fwu_run stopped on purpose */
+
+/*
+ * Synthetic ARM image: functions of common instruction words with BL
+ * calls between them. BL offsets are PC-relative, so inserting a function
+ * changes every call that spans the insertion point, the usual worst part
+ * of a firmware diff.
+ */
+typedef struct {
+    unsigned long word[FWU_WORDS];
+    int target[FWU_WORDS];      /* callee of a BL, else -1 */
+    int start[FWU_FUNCS];
+    int len[FWU_FUNCS];
+    int order[FWU_FUNCS];       /* link order */
+    int funcs;
+    int words;
+} fwu_program;
+
+static const unsigned long fwu_vocab[16] = {
+    0xE59F0000UL, 0xE3A00000UL, 0xE1A00000UL, 0xE2800000UL, 0xE3500000UL, 0x1A000000UL, 0x0A000000UL, 0xE5900000UL,
+    0xE5800000UL, 0xE0800001UL, 0xE2400000UL, 0xE3100000UL, 0xE1D000B0UL, 0xE5D00000UL, 0xE1A00080UL, 0xE0000001UL
+};
+
+static fwu_program fwu_prog[2];
+static unsigned char fwu_img[2][FW_BANK_SIZE];
+static unsigned char fwu_delta[FW_BANK_SIZE + 16];
+static int fwu_head[1 << FWU_HASH_BITS];
+
+/* Append a function of n words to p; calls go to functions below calls */
+static int fwu_add_function(fwu_program *p, sim_rng *r, int n, int calls) {
+    int f, w, i;
+    f = p->funcs;
+    if (f == FWU_FUNCS || p->words + n > FWU_WORDS) return -1;
+    p->start[f] = p->words;
+    p->len[f] = n;
+    for (i = 0; i < n; i++) {
+        w = p->words + i;
+        p->target[w] = -1;
+        if (i == 0) {
+            p->word[w] = 0xE92D4010UL;
+        } else if (i == n - 1) {
+            p->word[w] = 0xE8BD8010UL;
+        } else if (calls > 0 && sim_rng_below(r, 8) == 0) {
+            p->target[w] = (int)sim_rng_below(r, (unsigned long)calls);
+        } else {
+            p->word[w] = fwu_vocab[sim_rng_below(r, 16)] | (sim_rng_below(r, 4) ? 0 : sim_rng_below(r, 256));
+        }
+    }
+    p->words += n;
+    p->order[p->funcs++] = f;
+    return f;
+}
+
+/* Lay the functions out in link order and resolve calls; image length in bytes */
+static unsigned long fwu_link(const fwu_program *p, unsigned char *img) {
+    static unsigned long addr[FWU_FUNCS];
+    unsigned long a, w, pc;
+    int k, f, i, x;
+
+    a = 0;
+    for (k = 0; k < p->funcs; k++) {
+        addr[p->order[k]] = a;
+        a += (unsigned long)p->len[p->order[k]] * 4;
+    }
+    for (k = 0; k < p->funcs; k++) {
+        f = p->order[k];
+        for (i = 0; i < p->len[f]; i++) {
+            x = p->start[f] + i;
+            pc = addr[f] + (unsigned long)i * 4;
+            w = p->word[x];
+            if (p->target[x] >= 0) w = 0xEB000000UL | (((addr[p->target[x]] - (pc + 8)) >> 2) & 0xFFFFFFUL);
+            img[pc] = (unsigned char)w;
+            img[pc + 1] = (unsigned char)(w >> 8);
+            img[pc + 2] = (unsigned char)(w >> 16);
+            img[pc + 3] = (unsigned char)(w >> 24);
+        }
+    }
+    return a;
+}
+
+/* The next release: one new function linked into the middle, two new calls to it, a few patched words */
+static void fwu_next_release(fwu_program *np, const fwu_program *op, sim_rng *r) {
+    int f, k, pos, x;
+    *np = *op;
+    f = fwu_add_function(np, r, 150, np->funcs);
+    if (f < 0) return;
+    pos = np->funcs * 2 / 5;
+    memmove(np->order + pos + 1, np->order + pos, (size_t)(np->funcs - 1 - pos) * sizeof(int));
+    np->order[pos] = f;
+    for (k = 0; k < 10; k++) {
+        x = (int)sim_rng_below(r, (unsigned long)op->funcs);
+        x = np->start[x] + 1 + (int)sim_rng_below(r, (unsigned long)(np->len[x] - 2));
+        if (k < 2) {
+            np->target[x] = f;
+        } else {
+            np->target[x] = -1;
+            np->word[x] = fwu_vocab[sim_rng_below(r, 16)] | (1 + sim_rng_below(r, 255));
+        }
+    }
+}
+
+static unsigned long fwu_match(const unsigned char *a, unsigned long an, const unsigned char *b, unsigned long bn) {
+    unsigned long n;
+    for (n = 0; n < an && n < bn && a[n] == b[n]; n++) {
+    }
+    return n;
+}
+
+static int fwu_hash(const unsigned char *p) {
+    unsigned long h;
+    int i;
+    h = 0;
+    for (i = 0; i < 8; i++) h = (h * 31 + p[i]) & 0xFFFFFFFFUL;
+    return (int)((h * 2654435761UL & 0xFFFFFFFFUL) >> (32 - FWU_HASH_BITS));
+}
+
+static void fwu_op(unsigned char *d, unsigned long *n, int type, unsigned long arg) {
+    if (arg < FW_OP_SHORT) {
+        d[(*n)++] = (unsigned char)((type << 6) | (int)arg);
+        return;
+    }
+    d[(*n)++] = (unsigned char)((type << 6) | FW_OP_SHORT);
+    arg -= FW_OP_SHORT;
+    while (arg >= 0x80) {
+        d[(*n)++] = (unsigned char)(arg | 0x80);
+        arg >>= 7;
+    }
+    d[(*n)++] = (unsigned char)arg;
+}
+
+static void fwu_literal(unsigned char *d, unsigned long *n, const unsigned char *p, unsigned long len) {
+    if (len == 0) return;
+    fwu_op(d, n, FW_OP_LIT, len);
+    memcpy(d + *n, p, (size_t)len);
+    *n += len;
+}
+
+/*
+ * Greedy delta: COPY while the image matches at the cursor, SEEK to a
+ * hashed 8-byte block of the old image when it does not, and LIT for the
+ * rest. Literals move the cursor too, so a changed BL offset costs its
+ * changed bytes and the copy resumes right after.
+ */
+static unsigned long fwu_diff(const unsigned char *o, unsigned long on, const unsigned char *nw, unsigned long nn,
+                              unsigned char *d) {
+    unsigned long n, i, c, lit, m, s, p;
+    long delta;
+
+    for (i = 0; i < (1UL << FWU_HASH_BITS); i++) fwu_head[i] = -1;
+    for (p = 0; p + 8 <= on; p += 4) {
+        if (fwu_head[fwu_hash(o + p)] < 0) fwu_head[fwu_hash(o + p)] = (int)p;
+    }
+    n = i = c = lit = 0;
+    while (i < nn) {
+        m = c < on ? fwu_match(o + c, on - c, nw + i, nn - i) : 0;
+        if (m < FWU_MIN_COPY && i + 8 <= nn && fwu_head[fwu_hash(nw + i)] >= 0) {
+            p = (unsigned long)fwu_head[fwu_hash(nw + i)];
+            s = fwu_match(o + p, on - p, nw + i, nn - i);
+            if (s >= FWU_MIN_SEEK) {
+                fwu_literal(d, &n, nw + i - lit, lit);
+                lit = 0;
+                delta = (long)p - (long)c;
+                fwu_op(d, &n, FW_OP_SEEK, delta >= 0 ? (unsigned long)delta * 2 : (unsigned long)(-delta - 1) * 2 + 1);
+                c = p;
+                m = s;
+            }
+        }
+        if (m >= FWU_MIN_COPY) {
+            fwu_literal(d, &n, nw + i - lit, lit);
+            lit = 0;
+            fwu_op(d, &n, FW_OP_COPY, m);
+            c += m;
+            i += m;
+            continue;
+        }
+        lit++;
+        i++;
+        c++;
+    }
+    fwu_literal(d, &n, nw + i - lit, lit);
+    return n;
+}
+
+static void fwu_digest(unsigned char *d, const unsigned char *p, unsigned long n) {
+    sha512_ctx c;
+    unsigned char h[SHA512_DIGEST];
+    sha512_init(&c);
+    sha512_update(&c, p, n);
+    sha512_final(&c, h);
+    memcpy(d, h, FW_DIGEST);
+}
+
+/* Signed manifest for moving from base to img, with the development key */
+static void fwu_manifest(unsigned char *m, unsigned long version, const unsigned char *base, unsigned long base_len,
+                         const unsigned char *img, unsigned long len) {
+    unsigned char seed[32], pub[ED_KEY];
+    int i;
+    for (i = 0; i < 32; i++) seed[i] = (unsigned char)(0x40 + i);
+    ed25519_public_key(pub, seed);
+    fw_put32(m, version);
+    fw_put32(m + 4, len);
+    fwu_digest(m + 8, base, base_len);
+    fwu_digest(m + 8 + FW_DIGEST, img, len);
+    ed25519_sign(m + FW_MANIFEST_BODY, m, FW_MANIFEST_BODY, seed, pub);
+}
+
+/* Blank part with img in bank A as the confirmed factory image */
+static void fwu_factory(const unsigned char *img, unsigned long len) {
+    unsigned char page[FLASH_PAGE];
+    fw_record r;
+    unsigned long a;
+    int s;
+
+    for (s = 0; s < FLASH_SECTORS; s++) flash_erase(s);
+    for (a = 0; a < len; a += FLASH_PAGE) {
+        memset(page, 0xFF, sizeof(page));
+        memcpy(page, img + a, (size_t)(len - a < FLASH_PAGE ? len - a : FLASH_PAGE));
+        flash_program(fw_bank_base[0] + a, page);
+    }
+    r.bank = 0;
+    r.state = FW_REC_CONFIRMED;
+    r.length = len;
+    r.version = 1;
+    fwu_digest(r.digest, img, len);
+    fw_append(&r);
+    fw_boot_select();
+    mgmt_init(0, 0);
+}
+
+typedef struct {
+    int status;                 /* MGMT_OK, or the status that stopped the update */
+    int code;                   /* its first data byte (-FW_ERR_* for MGMT_ERR_FIRMWARE) */
+    double erase_s;             /* FW_BEGIN sent to answered */
+    double total_s;             /* ... to FW_COMMIT answered */
+    unsigned long resent;       /* delta bytes sent again after a refused chunk */
+    unsigned long erases;
+    unsigned long pages;
+} fwu_result;
+
+/*
+ * Host side of an update on the modelled UART (see mgmt_run): BEGIN, then
+ * FWU_CHUNK-byte chunks with FWU_WINDOW in flight, then COMMIT. The
+ * controller loses the modelled IAP time (flash_busy_ms) to every erase
+ * and page program, with bytes still arriving into the receive ring
+ * meanwhile. Door sessions of FWU_SESSION_MS take duty percent of the
+ * time. A refused
+ * chunk, or FWU_TIMEOUT_MS without a reply, sends the host back to the
+ * last acknowledged offset; replies to chunks sent before that are
+ * ignored. corrupt >= 0 damages the chunk at that offset once on the wire;
+ * cut > 0 stops (a power cut) once that many delta bytes are acknowledged.
+ */
+static void fwu_run(const unsigned char *manifest, const unsigned char *delta, unsigned long dlen,
+                    unsigned long baud, int duty, long corrupt, unsigned long cut, fwu_result *res) {
+    static unsigned char up[MGMT_BENCH_QUEUE];
+    static unsigned long epoch_of[256], end_of[256];
+    unsigned char b[MGMT_BODY_MAX], body[MGMT_BODY_MAX];
+    unsigned long ms, heard, next, acked, epoch, erases0, pages0, period, stall;
+    double credit;
+    int up_len, up_pos, outstanding, phase, id, n, i, wire, p;
+
+    memset(res, 0, sizeof(*res));
+    erases0 = flash_erases;
+    pages0 = flash_pages;
+    period = duty > 0 ? FWU_SESSION_MS * 100UL / (unsigned long)duty : 0;
+    up_len = up_pos = outstanding = 0;
+    phase = 0;
+    id = 0;
+    next = acked = epoch = stall = heard = 0;
+    credit = 0.0;
+    res->status = -1;
+    for (ms = 0; res->status < 0 && ms < 3600000UL; ms++) {
+        /* host */
+        while (phase != 4 && up_len + MGMT_FRAME_MAX <= MGMT_BENCH_QUEUE) {
+            if (phase == 0) {
+                b[1] = MGMT_OP_FW_BEGIN;
+                memcpy(b + MGMT_BODY_HEADER, manifest, FW_MANIFEST_LEN);
+                n = FW_MANIFEST_LEN;
+                phase = 1;
+            } else if (phase == 2 && next < dlen && outstanding < FWU_WINDOW) {
+                b[1] = MGMT_OP_FW_DATA;
+                n = dlen - next < FWU_CHUNK ? (int)(dlen - next) : FWU_CHUNK;
+                fw_put32(b + MGMT_BODY_HEADER, next);
+                memcpy(b + MGMT_BODY_HEADER + 4, delta + next, (size_t)n);
+                next += (unsigned long)n;
+                n += 4;
+            } else if (phase == 2 && next == dlen && outstanding == 0) {
+                b[1] = MGMT_OP_FW_COMMIT;
+                n = 0;
+                phase = 3;
+            } else {
+                break;
+            }
+            id = (id + 1) & 0xFF;
+            epoch_of[id] = epoch;
+            end_of[id] = next;
+            b[0] = (unsigned char)id;
+            b[2] = 0;
+            p = mgmt_frame(0, b, MGMT_BODY_HEADER + n, up + up_len);
+            if (b[1] == MGMT_OP_FW_DATA && corrupt >= 0 && fw_be32(b + MGMT_BODY_HEADER) == (unsigned long)corrupt) {
+                up[up_len + p / 2] ^= 0x10;
+                corrupt = -1;
+            }
+            up_len += p;
+            outstanding++;
+            if (phase == 1) phase = 4;
+        }
+
+        /* wire, and the controller when IAP is not holding it */
+        credit += baud / 10.0 / 1000.0;
+        wire = (int)credit;
+        credit -= wire;
+        for (i = 0; i < wire && up_pos < up_len; i++) mgmt_rx_isr(up[up_pos++]);
+        if (up_pos == up_len) up_len = up_pos = 0;
+        door_session = period && ms % period < FWU_SESSION_MS;
+        if (stall > 0) {
+            stall--;
+        } else {
+            unsigned long busy;
+            busy = flash_busy_ms;
+            mgmt_service(door_session ? MGMT_BUDGET_SESSION : MGMT_BUDGET_IDLE);
+            stall = flash_busy_ms - busy;
+            if (stall > 0) stall--;
+        }
+        if (phase == 2 && outstanding > 0 && ms - heard > FWU_TIMEOUT_MS) {
+            res->resent += next - acked;
+            next = acked;
+            outstanding = 0;
+            epoch++;
+        }
+        for (i = 0; i < wire; i++) {
+            static unsigned char frame[MGMT_FRAME_MAX];
+            static int flen;
+            int c, f;
+            if ((c = mgmt_tx_isr()) < 0) break;
+            f = mgmt_frame_byte(frame, &flen, (unsigned char)c);
+            if (f == 0) continue;
+            n = f - MGMT_HEADER - 2;
+            memcpy(body, frame + MGMT_HEADER, (size_t)n);
+            heard = ms;
+            if (epoch_of[body[0]] != epoch) continue;
+            outstanding--;
+            if (body[1] == (MGMT_OP_FW_DATA | MGMT_REPLY_BIT) && body[3] == MGMT_ERR_ORDER && n >= 8) {
+                res->resent += next - fw_be32(body + 4);
+                next = fw_be32(body + 4);
+                outstanding = 0;
+                epoch++;
+                continue;
+            }
+            if (body[3] != MGMT_OK) {
+                res->status = body[3];
+                res->code = n > 4 ? body[4] : 0;
+            } else if (body[1] == (MGMT_OP_FW_BEGIN | MGMT_REPLY_BIT)) {
+                res->erase_s = (ms + 1) / 1000.0;
+                phase = 2;
+            } else if (body[1] == (MGMT_OP_FW_DATA | MGMT_REPLY_BIT)) {
+                acked = end_of[body[0]];
+                if (cut && acked >= cut) res->status = FWU_POWER_CUT;
+            } else if (body[1] == (MGMT_OP_FW_COMMIT | MGMT_REPLY_BIT)) {
+                res->status = MGMT_OK;
+            }
+        }
+    }
+    res->total_s = ms / 1000.0;
+    res->erases = flash_erases - erases0;
+    res->pages = flash_pages - pages0;
+    door_session = 0;
+}
+
+static void fwu_reset(void) {
+    mgmt_init(0, 0);
+    fw_boot_select();
+}
+
+static int fwu_bank_holds(int bank, const unsigned char *img, unsigned long len) {
+    return memcmp(flash_at(fw_bank_base[bank]), img, (size_t)len) == 0;
+}
+
+static int fwu_selftest(const unsigned char *old, unsigned long olen, const unsigned char *nw, unsigned long nlen,
+                        const unsigned char *delta, unsigned long dlen) {
+    static unsigned char bad[FW_BANK_SIZE + 16];
+    unsigned char m[FW_MANIFEST_LEN], back[FW_MANIFEST_LEN];
+    fwu_result res;
+    int fails;
+
+    fails = 0;
+    fwu_manifest(m, 2, old, olen, nw, nlen);
+    fwu_manifest(back, 1, nw, nlen, old, olen);
+
+    fwu_factory(old, olen);
+    m[FW_MANIFEST_LEN - 1] ^= 1;
+    fwu_run(m, delta, dlen, 115200UL, 0, -1, 0, &res);
+    mgmt_check("bad signature refused", res.status == MGMT_ERR_FIRMWARE && res.code == -FW_ERR_AUTH, &fails);
+    m[FW_MANIFEST_LEN - 1] ^= 1;
+    fwu_run(back, delta, dlen, 115200UL, 0, -1, 0, &res);
+    mgmt_check("wrong base refused", res.status == MGMT_ERR_FIRMWARE && res.code == -FW_ERR_BASE, &fails);
+
+    memcpy(bad, delta, (size_t)dlen);
+    bad[dlen - 1] ^= 0x40;
+    fwu_run(m, bad, dlen, 115200UL, 0, -1, 0, &res);
+    mgmt_check("damaged delta refused", res.status == MGMT_ERR_FIRMWARE, &fails);
+    fwu_reset();
+    mgmt_check("still on factory image", fw_running == 0, &fails);
+
+    fwu_run(m, delta, dlen, 115200UL, 0, (long)(dlen / FWU_CHUNK / 2) * FWU_CHUNK, dlen / 2, &res);
+    fwu_reset();
+    mgmt_check("power cut mid-stream keeps bank A", fw_running == 0 && res.resent > 0, &fails);
+
+    fwu_run(m, delta, dlen, 115200UL, 20, (long)FWU_CHUNK, 0, &res);
+    mgmt_check("update with a damaged frame", res.status == MGMT_OK && res.resent > 0, &fails);
+    mgmt_check("old image runs until reset", fw_running == 0, &fails);
+    fwu_reset();
+    mgmt_check("reset tries bank B", fw_running == 1 && fwu_bank_holds(1, nw, nlen), &fails);
+    fwu_reset();
+    mgmt_check("unconfirmed image rolled back", fw_running == 0, &fails);
+
+    fwu_run(m, delta, dlen, 115200UL, 0, -1, 0, &res);
+    fwu_reset();
+    fw_confirm();
+    fwu_reset();
+    mgmt_check("confirmed image kept", res.status == MGMT_OK && fw_running == 1, &fails);
+    fwu_run(back, fwu_delta, 0, 115200UL, 0, -1, 0, &res);
+    mgmt_check("empty delta refused", res.status == MGMT_ERR_FIRMWARE && res.code == -FW_ERR_STATE, &fails);
+    return fails;
+}
+
+static int tool_fwupdate(int argc, char **argv) {
+    static unsigned char full[FW_BANK_SIZE + 16];
+    unsigned char m[FW_MANIFEST_LEN];
+    unsigned long seed, bauds[2], olen, nlen, dlen, flen;
+    fwu_result res;
+    sim_rng r;
+    int k, kind, bi, duty, funcs;
+
+    seed = 1;
+    bauds[0] = 9600UL;
+    bauds[1] = 115200UL;
+    duty = 20;
+    funcs = 400;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-b") == 0) bauds[1] = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-d") == 0) duty = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-f") == 0) funcs = atoi(argv[k + 1]);
+        else break;
+    }
+    if (k != argc || bauds[1] < 300 || duty < 0 || duty > 90 || funcs < 8 || funcs > FWU_FUNCS / 2) {
+        fprintf(stderr, "usage: fwupdate [-s seed] [-b baud] [-d session_duty_pct] [-f functions]\n");
+        return 2;
+    }
+    stub_quiet = 1;
+    sim_rng_seed(&r, seed);
+    memset(&fwu_prog[0], 0, sizeof(fwu_prog[0]));
+    for (k = 0; k < funcs; k++) {
+        if (fwu_add_function(&fwu_prog[0], &r, 8 + (int)sim_rng_below(&r, 90), funcs) < 0) break;
+    }
+    fwu_next_release(&fwu_prog[1], &fwu_prog[0], &r);
+    olen = fwu_link(&fwu_prog[0], fwu_img[0]);
+    nlen = fwu_link(&fwu_prog[1], fwu_img[1]);
+    if (nlen > FW_BANK_SIZE) {
+        fprintf(stderr, "fwupdate: image larger than a bank\n");
+        return 2;
+    }
+    dlen = fwu_diff(fwu_img[0], olen, fwu_img[1], nlen, fwu_delta);
+    flen = 0;
+    fwu_literal(full, &flen, fwu_img[1], nlen);
+
+    k = fwu_selftest(fwu_img[0], olen, fwu_img[1], nlen, fwu_delta, dlen);
+    printf("self-test: %s\n", k ? "FAILED" : "ok");
+    if (k) return 1;
+
+    printf("image %lu -> %lu bytes (one function inserted, two calls to it, eight patched words)\n", olen, nlen);
+    printf("delta %lu bytes, %.1f%% of the %lu-byte full image\n", dlen, 100.0 * dlen / flen, flen);
+    printf("door sessions %d%% of the time; erase = FW_BEGIN until the bank is erased\n\n", duty);
+    printf("%-6s %9s %9s  %8s %8s  %6s %6s\n", "update", "baud", "bytes", "erase s", "total s", "erases", "pages");
+    fwu_manifest(m, 2, fwu_img[0], olen, fwu_img[1], nlen);
+    for (kind = 0; kind < 2; kind++) {
+        for (bi = 0; bi < 2; bi++) {
+            fwu_factory(fwu_img[0], olen);
+            fwu_run(m, kind ? full : fwu_delta, kind ? flen : dlen, bauds[bi], duty, -1, 0, &res);
+            if (res.status != MGMT_OK) {
+                fprintf(stderr, "fwupdate: status %d code %d\n", res.status, res.code);
+                return 1;
+            }
+            printf("%-6s %9lu %9lu  %8.2f %8.2f  %6lu %6lu\n", kind ? "full" : "delta", bauds[bi],
+                   kind ? flen : dlen, res.erase_s, res.total_s, res.erases, res.pages);
+        }
+    }
+    stub_quiet = 0;
+    return 0;
+}
+
+/* ---- ustore: user table in internal flash, IAP scheduling on generated traffic ---- */
+
+#define US_I2C_KHZ 400
+#define US_EEPROM_WRITE_MS 5.0  /* 24LC32 page write cycle */
+#define US_WRITE_THROUGH 0
+#define US_IDLE 1
+#define US_QUIET 2
+#define US_ALWAYS 0xFFFFFFFFUL  /* quiet time that allows any erase */
+
+typedef struct {
+    unsigned long erases;
+    unsigned long pages;
+    double in_session_ms;       /* IAP time while a session was open */
+    unsigned long delayed;      /* cards that found IAP running */
+    double max_delay_ms;
+    double *durable;            /* update staged to committed, ms */
+    int n_durable;
+} us_result;
+
+static void us_check(const char *name, int ok, int *fails) {
+    if (ok) return;
+    printf("FAIL %s\n", name);
+    (*fails)++;
+}
+
+static void us_slot(unsigned char *slot, const char *pw) {
+    memset(slot, 0, USTORE_SLOT);
+    memcpy(slot, pw, strlen(pw));
+}
+
+static void us_drain(unsigned long quiet_ms) {
+    while (ustore_service(quiet_ms) != USTORE_IDLE) {
+    }
+}
+
+static int us_selftest(void) {
+    unsigned char slot[USTORE_SLOT];
+    unsigned long erases;
+    int fails, k;
+
+    fails = 0;
+    flash_erase(USTORE_SECTOR);
+    flash_erase(USTORE_SECTOR + 1);
+    memset(eeprom_memory, 0xFF, EEPROM_SIZE);
+    us_slot(slot, "1234");
+    eeprom_write_bytes(USER_SLOT_ADDR(5), slot, USTORE_SLOT);
+    ustore_mount();
+    us_check("EEPROM contents staged on first start", ustore.pending == 1 && ustore_slot(5) == ustore.stage[5],
+             &fails);
+    us_drain(USTORE_QUIET_MS);
+    ustore_mount();
+    us_check("copy survives a restart", ustore.active == 0 && ustore.pending == 0 &&
+                                            memcmp(ustore_slot(5), "1234", 5) == 0 &&
+                                            ustore_slot(5) == flash_at(ustore.table + 5 * USTORE_SLOT), &fails);
+
+    us_slot(slot, "5678");
+    ustore_write(5, slot);
+    us_check("staged write visible at once", memcmp(ustore_slot(5), "5678", 5) == 0, &fails);
+    ustore_service(USTORE_QUIET_MS);
+    ustore_service(USTORE_QUIET_MS);
+    ustore_mount();
+    us_check("power cut mid-copy keeps the last copy", memcmp(ustore_slot(5), "1234", 5) == 0 && ustore.next[0] == 2,
+             &fails);
+    ustore_write(5, slot);
+    us_drain(USTORE_QUIET_MS);
+    ustore_mount();
+    us_check("next copy goes past the torn one", memcmp(ustore_slot(5), "5678", 5) == 0 && ustore.next[0] == 3,
+             &fails);
+
+    /* fill both sectors without quiet time: the second switch has to wait for an erase */
+    erases = flash_erases;
+    for (k = 0; k < 2 * ustore_copies(); k++) {
+        us_slot(slot, k % 2 ? "2468" : "1357");
+        ustore_write(k % MAX_USERS, slot);
+        us_drain(0);
+    }
+    us_check("no erase before the door is quiet", flash_erases == erases && ustore.pending > 0, &fails);
+    us_drain(USTORE_QUIET_MS);
+    us_check("erase and write once quiet", flash_erases == erases + 1 && ustore.pending == 0, &fails);
+    us_drain(USTORE_QUIET_AHEAD_MS);
+    us_check("sector just left erased in a long gap", flash_erases == erases + 2 && ustore.next[ustore.active ^ 1] == 0,
+             &fails);
+    ustore_mount();
+    k = 2 * ustore_copies() - 1;
+    us_check("contents after sector switches", memcmp(ustore_slot(k % MAX_USERS), k % 2 ? "2468" : "1357", 5) == 0,
+             &fails);
+    return fails;
+}
+
+static void us_record(us_result *res, const double *since, double now, unsigned long seq) {
+    int uid;
+    if (ustore.seq == seq) return;
+    for (uid = 0; uid < MAX_USERS; uid++) {
+        if (since[uid] >= 0.0 && ustore.state[uid] == USTORE_CLEAN) res->durable[res->n_durable++] = now - since[uid];
+    }
+}
+
+/*
+ * One door, a card event loop in model milliseconds. The workload's users
+ * only set the traffic; their cards map onto the table. Sessions last
+ * 1.5 s plus 2 s per PIN attempt and 1.5 s per finger. Admin updates arrive as
+ * batches of batch users. Write-through runs IAP as soon as an update
+ * lands, session or not. The idle policies run ustore_service only
+ * between sessions, with (US_QUIET) or without the quiet time before
+ * erasing. A card that arrives while IAP runs waits for it.
+ */
+static void us_run(const workload_config *cfg, int policy, double updates_per_h, int batch, us_result *res) {
+    static double since[MAX_USERS];
+    workload_gen g;
+    replay_event ev;
+    unsigned char slot[USTORE_SLOT];
+    char pw[PASSWORD_MAX_LEN + 1];
+    double t, te, start, session_from, session_end, quiet_from, iap_until, next_upd, cost, end_ms, *durable;
+    unsigned long seq;
+    int have, uid, k, r, max_durable;
+    sim_rng rng;
+
+    max_durable = res->n_durable;
+    durable = res->durable;
+    memset(res, 0, sizeof(*res));
+    res->durable = durable;
+    flash_erase(USTORE_SECTOR);
+    flash_erase(USTORE_SECTOR + 1);
+    memset(eeprom_memory, 0xFF, EEPROM_SIZE);
+    for (uid = 0; uid < MAX_USERS; uid++) {
+        wl_password(cfg->seed, uid, pw);
+        us_slot(slot, pw);
+        eeprom_write_bytes(USER_SLOT_ADDR(uid), slot, USTORE_SLOT);
+        since[uid] = -1.0;
+    }
+    ustore_mount();
+    us_drain(USTORE_QUIET_MS);
+    res->erases = flash_erases;
+    res->pages = flash_pages;
+
+    if (workload_init(&g, cfg) != 0) return;
+    sim_rng_seed(&rng, cfg->seed + 71);
+    end_ms = cfg->hours * 3600000.0;
+    t = session_from = session_end = quiet_from = iap_until = 0.0;
+    next_upd = sim_rng_exp(&rng, updates_per_h / 3600000.0);
+    have = workload_next(&g, &ev);
+    while (have || next_upd < end_ms) {
+        te = have && (double)ev.t_ms - cfg->start_hour * 3600000.0 < next_upd ?
+                 (double)ev.t_ms - cfg->start_hour * 3600000.0 : next_upd;
+        if (te >= end_ms) break;
+        while (policy != US_WRITE_THROUGH && t < te) {
+            if (t < session_end) {
+                t = session_end;
+                continue;
+            }
+            seq = ustore.seq;
+            cost = (double)flash_busy_ms;
+            r = ustore_service(policy == US_IDLE ? US_ALWAYS : (unsigned long)(t - quiet_from));
+            if (r == USTORE_IDLE) {
+                /* nothing until a quiet time is up, or the next event */
+                start = quiet_from + ustore_erase_quiet();
+                t = start > t && start < te ? start : te;
+                continue;
+            }
+            t += (double)flash_busy_ms - cost;
+            iap_until = t;
+            us_record(res, since, t, seq);
+            for (uid = 0; uid < MAX_USERS; uid++) {
+                if (ustore.state[uid] == USTORE_CLEAN) since[uid] = -1.0;
+            }
+        }
+        if (have && te == (double)ev.t_ms - cfg->start_hour * 3600000.0) {
+            start = te;
+            if (iap_until > start) {
+                res->delayed++;
+                if (iap_until - start > res->max_delay_ms) res->max_delay_ms = iap_until - start;
+                start = iap_until;
+            }
+            if (session_end > start) start = session_end;
+            uid = atoi(ev.card) % MAX_USERS;
+            bench_sink += ustore_slot(uid)[0];
+            session_from = start;
+            session_end = start + 1500.0 + 2000.0 * ev.n_pin + 1500.0 * ev.n_fp;
+            quiet_from = session_end;
+            have = workload_next(&g, &ev);
+            continue;
+        }
+        for (k = 0; k < batch; k++) {
+            uid = (int)sim_rng_below(&rng, MAX_USERS);
+            sprintf(pw, "%06lu", sim_rng_below(&rng, 1000000UL));
+            us_slot(slot, pw);
+            ustore_write(uid, slot);
+            if (since[uid] < 0.0) since[uid] = te;
+        }
+        if (policy == US_WRITE_THROUGH) {
+            t = te > iap_until ? te : iap_until;
+            for (;;) {
+                seq = ustore.seq;
+                cost = (double)flash_busy_ms;
+                if (ustore_service(US_ALWAYS) == USTORE_IDLE) break;
+                cost = (double)flash_busy_ms - cost;
+                if (t >= session_from && t < session_end) {
+                    res->in_session_ms += cost;
+                    session_end += cost;
+                    quiet_from = session_end;
                 }
+                t += cost;
+                us_record(res, since, t, seq);
+                for (uid = 0; uid < MAX_USERS; uid++) {
+                    if (ustore.state[uid] == USTORE_CLEAN) since[uid] = -1.0;
+                }
+            }
+            iap_until = t;
+        }
+        next_upd = te + sim_rng_exp(&rng, updates_per_h / 3600000.0);
+        if (res->n_durable + MAX_USERS > max_durable) break;
+    }
+    workload_free(&g);
+    res->erases = flash_erases - res->erases;
+    res->pages = flash_pages - res->pages;
+}
+
+static int tool_ustore(int argc, char **argv) {
+    static const char *const names[3] = { "write-through", "idle", "idle + quiet" };
+    workload_config cfg;
+    us_result res;
+    double updates_per_h, i2c_us;
+    int k, batch, p, cap;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.seed = 1;
+    cfg.users = 300;
+    cfg.doors = 1;
+    cfg.hours = 24.0 * 7;
+    cfg.zipf_s = 1.1;
+    cfg.pin_typo = 0.04;
+    cfg.fp_fail = 0.03;
+    updates_per_h = 4.0;
+    batch = 5;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) cfg.seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-H") == 0) cfg.hours = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-n") == 0) cfg.users = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-u") == 0) updates_per_h = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-b") == 0) batch = atoi(argv[k + 1]);
+        else break;
+    }
+    if (k != argc || cfg.hours <= 0.0 || cfg.users < 1 || updates_per_h <= 0.0 || batch < 1 || batch > MAX_USERS) {
+        fprintf(stderr, "usage: ustore [-s seed] [-H hours] [-n users] [-u update_batches_per_hour] [-b users_per_batch]\n");
+        return 2;
+    }
+    stub_quiet = 1;
+    k = us_selftest();
+    printf("self-test: %s\n", k ? "FAILED" : "ok");
+    if (k) return 1;
+
+    cap = (int)(cfg.hours * updates_per_h * 4.0) * batch + 64 * MAX_USERS;
+    res.durable = (double *)malloc(sizeof(double) * (size_t)cap);
+    if (!res.durable) return 1;
+    i2c_us = (4 + USTORE_SLOT) * 9 * 1000.0 / US_I2C_KHZ;
+    printf("%.0f h at one door used by %d people, %.1f update batches/h of %d users; %d copies of the %d-byte table "
+           "per sector\n", cfg.hours, cfg.users, updates_per_h, batch, ustore_copies(), USTORE_TABLE);
+    printf("lookup per session: EEPROM %.0f us over I2C at %d kHz, flash in place (pointer, no transfer)\n\n", i2c_us,
+           US_I2C_KHZ);
+    printf("%-14s %7s %7s %9s %8s %8s %10s %10s\n", "policy", "erases", "pages", "stall ms", "delayed", "max ms",
+           "durable50", "durable99");
+    printf("%-14s %7s %7s %9.0f %8d %8.0f %9.3fs %9.3fs\n", "EEPROM", "-", "-", 0.0, 0, 0.0, US_EEPROM_WRITE_MS / 1e3,
+           US_EEPROM_WRITE_MS / 1e3);
+    for (p = 0; p < 3; p++) {
+        res.n_durable = cap;
+        us_run(&cfg, p, updates_per_h, batch, &res);
+        qsort(res.durable, (size_t)res.n_durable, sizeof(double), bench_cmp_double);
+        printf("%-14s %7lu %7lu %9.0f %8lu %8.0f %9.3fs %9.3fs\n", names[p], res.erases, res.pages,
+               res.in_session_ms, res.delayed, res.max_delay_ms,
+               res.n_durable ? res.durable[res.n_durable / 2] / 1e3 : 0.0,
+               res.n_durable ? res.durable[res.n_durable * 99 / 100] / 1e3 : 0.0);
+    }
+    printf("\nstall ms = IAP time inside sessions; delayed = cards that arrived while IAP ran\n");
+    free(res.durable);
+    stub_quiet = 0;
+    return 0;
+}
+
+/* ---- storage: the same workloads on every storage backend ---- */
+
+#define SB_REC PASSWORD_EEPROM_SLOT_SIZE /* a password slot; audit records padded to the same */
+#define SB_USERS 128
+#define SB_LOG_MIN (SB_USERS * SB_REC)
+#define SB_BUF 4096
+
+/* Log ring after the slots, in its own erase unit where the device has them */
+static unsigned long sb_log_base(const store_dev *s) {
+    return s->erase_unit > SB_LOG_MIN ? s->erase_unit : SB_LOG_MIN;
+}
+
+static unsigned long sb_log_size(const store_dev *s) {
+    return s->erase_unit > SB_LOG_MIN ? s->erase_unit : SB_LOG_MIN;
+}
+
+/* Wall time plus modelled device time since t0/busy0, per op */
+static double sb_us(const store_dev *s, double t0, double busy0, int ops) {
+    return ((bench_now_ns() - t0) / 1e3 + (s->busy_us - busy0)) / ops;
+}
+
+static void sb_slot(unsigned char *rec, unsigned long v) {
+    memset(rec, 0, SB_REC);
+    sprintf((char *)rec, "%08lu", v % 100000000UL);
+}
+
+static double sb_auth(store_dev *s, sim_rng *r, int reads) {
+    unsigned char rec[SB_REC];
+    double t0, busy0;
+    int i;
+
+    t0 = bench_now_ns();
+    busy0 = s->busy_us;
+    for (i = 0; i < reads; i++) {
+        if (store_read(s, sim_rng_below(r, SB_USERS) * SB_REC, rec, PASSWORD_MAX_LEN) != STORE_OK) return -1.0;
+        bench_sink += rec[0];
+    }
+    return sb_us(s, t0, busy0, reads);
+}
+
+/*
+ * bursts of burst new users in consecutive slots (a department at a
+ * time), written k slots per call on k-aligned boundaries, each call
+ * synced. Per user.
+ */
+static double sb_enroll(store_dev *s, sim_rng *r, int bursts, int burst, int k, unsigned char (*shadow)[SB_REC]) {
+    unsigned char buf[SB_BUF];
+    double t0, busy0;
+    int b, first, u, n, i;
+
+    if (k > SB_BUF / SB_REC) k = SB_BUF / SB_REC;
+    t0 = bench_now_ns();
+    busy0 = s->busy_us;
+    for (b = 0; b < bursts; b++) {
+        first = (int)sim_rng_below(r, (unsigned long)(SB_USERS - burst + 1));
+        for (u = first; u < first + burst; u += n) {
+            n = k - u % k;
+            if (n > first + burst - u) n = first + burst - u;
+            for (i = 0; i < n; i++) {
+                sb_slot(shadow[u + i], sim_rng_below(r, 100000000UL));
+                memcpy(buf + i * SB_REC, shadow[u + i], SB_REC);
+            }
+            if (store_rewrite(s, (unsigned long)u * SB_REC, buf, (unsigned int)(n * SB_REC)) != STORE_OK ||
+                store_sync(s) != STORE_OK) {
+                return -1.0;
+            }
+        }
+    }
+    return sb_us(s, t0, busy0, bursts * burst);
+}
+
+/* Access log records appended round the ring, k per synced write; an erase unit is erased as the ring enters it */
+static double sb_audit(store_dev *s, int records, int k) {
+    unsigned char buf[SB_BUF];
+    unsigned long base, size, pos;
+    double t0, busy0;
+    int i, j, n;
+
+    if (k > SB_BUF / SB_REC) k = SB_BUF / SB_REC;
+    base = sb_log_base(s);
+    size = sb_log_size(s);
+    t0 = bench_now_ns();
+    busy0 = s->busy_us;
+    pos = 0;
+    for (i = 0; i < records; i += n) {
+        n = k - (int)(pos / SB_REC % (unsigned long)k);
+        if ((unsigned long)n > (size - pos) / SB_REC) n = (int)((size - pos) / SB_REC);
+        if (n > records - i) n = records - i;
+        memset(buf, 0, (size_t)n * SB_REC);
+        for (j = 0; j < n; j++) {
+            access_put32(buf + j * SB_REC, (unsigned long)(i + j + 1));
+            access_put32(buf + j * SB_REC + 4, 1700000000UL + (unsigned long)(i + j));
+        }
+        if ((s->erase_unit && pos % s->erase_unit == 0 && store_erase(s, base + pos) != STORE_OK) ||
+            store_write(s, base + pos, buf, (unsigned int)(n * SB_REC)) != STORE_OK || store_sync(s) != STORE_OK) {
+            return -1.0;
+        }
+        pos = (pos + (unsigned long)n * SB_REC) % size;
+    }
+    return sb_us(s, t0, busy0, records);
+}
+
+/* Blank the device and write the initial slots */
+static int sb_prepare(store_dev *s, unsigned char (*shadow)[SB_REC]) {
+    unsigned long a;
+    int u;
+    for (a = 0; s->erase_unit && a < s->size; a += s->erase_unit) {
+        if (store_erase(s, a) != STORE_OK) return -1;
+    }
+    for (u = 0; u < SB_USERS; u++) {
+        sb_slot(shadow[u], (unsigned long)u * 7919UL);
+        if (store_write(s, (unsigned long)u * SB_REC, shadow[u], SB_REC) != STORE_OK) return -1;
+    }
+    return store_sync(s);
+}
+
+static int sb_verify(store_dev *s, unsigned char (*shadow)[SB_REC]) {
+    unsigned char rec[SB_REC];
+    int u;
+    for (u = 0; u < SB_USERS; u++) {
+        if (store_read(s, (unsigned long)u * SB_REC, rec, SB_REC) != STORE_OK || memcmp(rec, shadow[u], SB_REC) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int tool_storage(int argc, char **argv) {
+    static const char *const classes[5] = { "ram", "bus", "flash", "disk", "net" };
+    static unsigned char shadow[SB_USERS][SB_REC];
+    char specs[6][300];
+    const char *path;
+    store_dev *s;
+    sim_rng r;
+    unsigned long seed, erases;
+    double auth, en1, enk, au1, auk;
+    int k, reads, bursts, burst, records, ke, ka, fails;
+
+    seed = 1;
+    reads = 20000;
+    bursts = 8;
+    burst = 32;
+    records = 2048;
+    path = "/tmp/mlsas-store.bin";
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-n") == 0) reads = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-b") == 0) bursts = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-e") == 0) burst = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-a") == 0) records = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-f") == 0) path = argv[k + 1];
+        else break;
+    }
+    if (k != argc || reads < 1 || bursts < 1 || burst < 1 || burst > SB_USERS || records < 1 ||
+        strlen(path) > sizeof(specs[0]) - 6) {
+        fprintf(stderr, "usage: storage [-s seed] [-n auth_reads] [-b bursts] [-e users_per_burst] [-a audit_records] "
+                        "[-f scratch_file]\n");
+        return 2;
+    }
+    strcpy(specs[0], "ram");
+    strcpy(specs[1], "eeprom");
+    strcpy(specs[2], "flash");
+    sprintf(specs[3], "file:%s", path);
+    strcpy(specs[4], "remote");
+    strcpy(specs[5], "fp-eeprom");
+
+    stub_quiet = 1;
+    memset(eeprom_memory, 0xFF, EEPROM_SIZE);
+    fp_eeprom_init();
+    printf("%d auth reads of %d users, %d enrollment bursts of %d users, %d audit appends; %d-byte records, every "
+           "write synced\n", reads, SB_USERS, bursts, burst, records, SB_REC);
+    printf("us per op, wall time plus modelled device time (I2C at %d kHz, 5 ms EEPROM write cycle, IAP)\n\n",
+           STORE_I2C_KHZ);
+    printf("%-9s %5s %6s %-5s %5s %5s  %9s  %10s %10s  %10s %10s %7s\n", "store", "page", "erase", "class", "rew/w",
+           "app/w", "auth", "enroll x1", "batched", "audit x1", "batched", "erases");
+    fails = 0;
+    for (k = 0; k < 6; k++) {
+        s = store_open(specs[k]);
+        if (!s) {
+            printf("%-9s unavailable\n", specs[k]);
+            continue;
+        }
+        s->busy_us = 0.0;
+        erases = flash_erases;
+        sim_rng_seed(&r, seed);
+        ke = (int)store_batch(s, SB_REC, 1);
+        ka = (int)store_batch(s, SB_REC, 0);
+        if (sb_prepare(s, shadow) != 0) {
+            auth = en1 = enk = au1 = auk = -1.0;
+        } else {
+            erases = flash_erases;
+            auth = sb_auth(s, &r, reads);
+            en1 = sb_enroll(s, &r, bursts, burst, 1, shadow);
+            enk = sb_enroll(s, &r, bursts, burst, ke, shadow);
+            au1 = sb_audit(s, records, 1);
+            auk = sb_audit(s, records, ka);
+        }
+        if (auth < 0.0 || en1 < 0.0 || enk < 0.0 || au1 < 0.0 || auk < 0.0 || sb_verify(s, shadow) != 0) {
+            printf("%-9s FAILED\n", s->name);
+            fails++;
+        } else {
+            printf("%-9s %5u %6lu %-5s %5d %5d  %9.2f  %10.1f %10.1f  %10.1f %10.1f %7lu\n", s->name, s->page,
+                   s->erase_unit, classes[s->latency], ke, ka, auth, en1, enk, au1, auk, flash_erases - erases);
+        }
+        if (s == &store_file || s == &store_remote) store_close(s);
+    }
+    printf("\nrew/w, app/w = records per write store_batch picks for rewrites and appends; x1 = one record per write\n");
+    stub_quiet = 0;
+    return fails ? 1 : 0;
+}
+
+/* ---- cardmph: offline card index, header generator and lookup benchmark ---- */
+
+#define CM_SEEDS 16
+#define CM_PROBES 200000
+#define CM_TARGET_ENTRY 8 /* card_entry on the ARM7: card (4), uid (2), padding */
+#define CM_BENCH_CARDS 20000
+
+typedef struct {
+    unsigned long card;
+    unsigned short uid;
+} cm_pair;
+
+static int cm_cmp_pair(const void *a, const void *b) {
+    unsigned long x = ((const cm_pair *)a)->card, y = ((const cm_pair *)b)->card;
+    return x < y ? -1 : x > y;
+}
+
+/* Build with the first seed that works */
+static int cm_build(card_mph *h, const unsigned long *cards, const unsigned short *uids, unsigned int n,
+                    unsigned long seed) {
+    int k;
+    for (k = 0; k < CM_SEEDS; k++) {
+        if (card_mph_build(h, cards, uids, n, seed + (unsigned long)k) == 0) return 0;
+    }
+    return -1;
+}
+
+static double cm_index_bits(const card_mph *h) {
+    return (h->buckets + (h->m - h->n)) * 16.0 / h->n;
+}
+
+static int cm_write_header(const char *path, const card_mph *h) {
+    FILE *f;
+    unsigned int i;
+
+    f = fopen(path, "w");
+    if (!f) return -1;
+    fprintf(f, "/* Card index for -DCARD_MPH: %u cards, written by ./mlsas cardmph. Do not edit. */\n", h->n);
+    fprintf(f, "static const unsigned short card_mph_pilot_data[%u] = {", h->buckets);
+    for (i = 0; i < h->buckets; i++) fprintf(f, "%s%u", i % 12 ? ", " : (i ? ",\n    " : "\n    "), h->pilot[i]);
+    fprintf(f, "\n};\nstatic const unsigned short card_mph_remap_data[%u] = {\n    ", h->m - h->n + 1);
+    for (i = 0; i < h->m - h->n; i++) fprintf(f, "%u, ", h->remap[i]);
+    fprintf(f, "0\n};\nstatic const card_entry card_mph_table_data[%u] = {", h->n);
+    for (i = 0; i < h->n; i++) {
+        fprintf(f, "%s{ %luUL, %u }", i % 6 ? ", " : (i ? ",\n    " : "\n    "), h->table[i].card, h->table[i].uid);
+    }
+    fprintf(f, "\n};\nstatic const card_mph card_mph_shipped = { %uU, %uU, %uU, 0x%08lXUL, card_mph_pilot_data,\n"
+               "                                          card_mph_remap_data, card_mph_table_data };\n",
+            h->n, h->m, h->buckets, h->seed);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/* "card uid" lines; returns the count, -1 on a bad line */
+static int cm_read_cards(const char *path, unsigned long **cards, unsigned short **uids) {
+    char line[128];
+    unsigned long c;
+    FILE *f;
+    int n, cap, u;
+
+    f = fopen(path, "r");
+    if (!f) return -1;
+    n = cap = 0;
+    *cards = 0;
+    *uids = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%lu %d", &c, &u) != 2) continue;
+        if (u < 0 || u >= MAX_USERS || c > 0xFFFFFFFFUL) {
+            n = -1;
+            break;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            *cards = (unsigned long *)realloc(*cards, sizeof(unsigned long) * (size_t)cap);
+            *uids = (unsigned short *)realloc(*uids, sizeof(unsigned short) * (size_t)cap);
+            if (!*cards || !*uids) {
+                n = -1;
+                break;
             }
-            if (!fingerprint_verified) continue;
+        }
+        (*cards)[n] = c;
+        (*uids)[n++] = (unsigned short)u;
+    }
+    fclose(f);
+    return n;
+}
+
+static void cm_check(const char *name, int ok, int *fails) {
+    if (ok) return;
+    printf("FAIL %s\n", name);
+    (*fails)++;
+}
+
+/* Overflow on top of a shipped index: add, move, withdraw, full, survives a restart */
+static int cm_selftest(const card_mph *h) {
+    unsigned long c;
+    int fails, k, full;
+
+    fails = 0;
+    memset(eeprom_memory, 0xFF, EEPROM_SIZE);
+    card_index_init(h);
+    cm_check("shipped cards found", card_lookup(h->table[0].card) == h->table[0].uid &&
+                                        card_lookup(h->table[h->n - 1].card) == h->table[h->n - 1].uid, &fails);
+    for (c = 1; card_mph_find(h, c) >= 0; c++) {
+    }
+    cm_check("unknown card refused", card_lookup(c) == -1, &fails);
+    cm_check("new card added", card_set(c, 7) == CARD_OK && card_lookup(c) == 7, &fails);
+    cm_check("shipped card moved", card_set(h->table[0].card, 9) == CARD_OK && card_lookup(h->table[0].card) == 9,
+             &fails);
+    cm_check("shipped card withdrawn", card_set(h->table[1].card, -1) == CARD_OK && card_lookup(h->table[1].card) == -1,
+             &fails);
+    cm_check("unchanged card takes no entry", card_set(h->table[2].card, h->table[2].uid) == CARD_OK &&
+                                                  card_overflow_n == 3, &fails);
+    full = 0;
+    for (k = 0; k < CARD_OVERFLOW_MAX; k++) {
+        do {
+            c++;
+        } while (card_mph_find(h, c) >= 0);
+        if (card_set(c, k % MAX_USERS) == CARD_ERR_FULL) full = 1;
+    }
+    cm_check("overflow fills up", full && card_overflow_n == CARD_OVERFLOW_MAX, &fails);
+    card_index_init(h);
+    cm_check("overflow survives a restart", card_overflow_n == CARD_OVERFLOW_MAX && card_lookup(h->table[0].card) == 9 &&
+                                                card_lookup(h->table[1].card) == -1, &fails);
+    memset(eeprom_memory, 0xFF, EEPROM_SIZE);
+    card_index_init(0);
+    return fails;
+}
+
+/* Open addressing at half load, what a RAM index would use */
+static int cm_probe_hash(const cm_pair *slots, unsigned int mask, unsigned long card) {
+    unsigned int i;
+    for (i = (unsigned int)card_mix(card) & mask; slots[i].uid != CARD_WITHDRAWN; i = (i + 1) & mask) {
+        if (slots[i].card == card) return slots[i].uid;
+    }
+    return -1;
+}
+
+static int cm_bsearch(const cm_pair *sorted, unsigned int n, unsigned long card) {
+    unsigned int lo, hi, mid;
+    lo = 0;
+    hi = n;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (sorted[mid].card < card) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n && sorted[lo].card == card ? sorted[lo].uid : -1;
+}
+
+/* bench case: shipped-index probes over 20000 cards, three enrolled to one unknown */
+static void bench_card_mph(unsigned long iters) {
+    static unsigned long cards[CM_BENCH_CARDS];
+    static unsigned short uids[CM_BENCH_CARDS];
+    static card_mph h;
+    static int ready;
+    unsigned long i;
+
+    if (!ready) {
+        /* an odd multiplier is a bijection, so the cards are distinct and later ones miss */
+        for (i = 0; i < CM_BENCH_CARDS; i++) {
+            cards[i] = (i * 0x9E3779B1UL) & 0xFFFFFFFFUL;
+            uids[i] = (unsigned short)(i % MAX_USERS);
+        }
+        cm_build(&h, cards, uids, CM_BENCH_CARDS, 1);
+        ready = 1;
+    }
+    for (i = 0; i < iters; i++) {
+        bench_sink += (unsigned long)card_mph_find(&h, ((i % (CM_BENCH_CARDS * 4 / 3)) * 0x9E3779B1UL) & 0xFFFFFFFFUL);
+    }
+}
+
+static int tool_cardmph(int argc, char **argv) {
+    static const char *const names[3] = { "mph (flash)", "binary search", "hash (RAM)" };
+    const char *in, *out;
+    unsigned long seed, *cards, *probes;
+    unsigned short *uids;
+    cm_pair *sorted, *slots;
+    card_mph h;
+    sim_rng r;
+    unsigned int n, mask, i, k;
+    double t0, build_ms, ns[3];
+    long identity;
+    int v, fails, m;
+
+    in = out = 0;
+    seed = 1;
+    n = 20000;
+    identity = -1;
+    for (k = 0; k + 1 < (unsigned int)argc; k += 2) {
+        if (strcmp(argv[k], "-i") == 0) in = argv[k + 1];
+        else if (strcmp(argv[k], "-o") == 0) out = argv[k + 1];
+        else if (strcmp(argv[k], "-u") == 0) identity = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-n") == 0) n = (unsigned int)atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else break;
+    }
+    if (k != (unsigned int)argc || (in && identity >= 0) || identity > MAX_USERS || n < 3 || n > 60000) {
+        fprintf(stderr, "usage: cardmph [-i cards.txt | -u users] [-o card_mph.h] [-n cards] [-s seed]\n"
+                        "  cards.txt lines: card uid; -u N (N <= %d) enrolls cards 0..N-1 as users 0..N-1\n",
+                MAX_USERS);
+        return 2;
+    }
+    stub_quiet = 1;
+    sim_rng_seed(&r, seed);
+    if (in) {
+        v = cm_read_cards(in, &cards, &uids);
+        if (v < 3) {
+            fprintf(stderr, "cardmph: %s: unreadable, a bad line, or fewer than 3 cards\n", in);
+            return 1;
+        }
+        n = (unsigned int)v;
+    } else {
+        if (identity >= 0) n = identity < 3 ? 3 : (unsigned int)identity;
+        cards = (unsigned long *)malloc(sizeof(unsigned long) * n);
+        uids = (unsigned short *)malloc(sizeof(unsigned short) * n);
+        if (!cards || !uids) return 1;
+        /* badge numbers: a few sequential batches from the card vendor, or the simulation's 0..N-1 */
+        for (i = 0; i < n; i++) {
+            cards[i] = identity >= 0 ? i : (i % 64 == 0 ? sim_rng_below(&r, 4000000000UL) : cards[i - 1] + 1);
+            uids[i] = (unsigned short)(i % MAX_USERS);
+        }
+    }
+    sorted = (cm_pair *)malloc(sizeof(cm_pair) * n);
+    if (!sorted) return 1;
+    for (i = 0; i < n; i++) {
+        sorted[i].card = cards[i];
+        sorted[i].uid = uids[i];
+    }
+    qsort(sorted, n, sizeof(cm_pair), cm_cmp_pair);
+    for (i = 1; i < n; i++) {
+        if (sorted[i].card == sorted[i - 1].card) {
+            fprintf(stderr, "cardmph: card %lu appears twice\n", sorted[i].card);
+            return 1;
+        }
+    }
+    t0 = bench_now_ns();
+    if (cm_build(&h, cards, uids, n, seed) != 0) {
+        fprintf(stderr, "cardmph: no index after %d seeds\n", CM_SEEDS);
+        return 1;
+    }
+    build_ms = (bench_now_ns() - t0) / 1e6;
+    printf("%u cards: %u buckets, %u slots, built in %.1f ms; index %.2f bits/card (%u bytes), table %lu bytes "
+           "of flash\n", h.n, h.buckets, h.m, build_ms, cm_index_bits(&h), (h.buckets + h.m - h.n) * 2,
+           (unsigned long)h.n * CM_TARGET_ENTRY);
+    fails = cm_selftest(&h);
+    for (i = 0; i < n; i++) {
+        v = card_mph_find(&h, cards[i]);
+        if (v < 0 || h.table[v].uid != uids[i]) fails++;
+    }
+    printf("self-test: %s\n", fails ? "FAILED" : "ok");
+    if (fails) return 1;
+    if (out) {
+        if (cm_write_header(out, &h) != 0) {
+            fprintf(stderr, "cardmph: cannot write %s\n", out);
+            return 1;
+        }
+        printf("wrote %s\n", out);
+        stub_quiet = 0;
+        return 0;
+    }
 
-            /* Access granted */
-            lcd_clear();
-            lcd_puts("All 3 Levels OK\nOpening Door");
-            door_open_sequence();
-            delay_ms(1000);
+    /* lookups: half enrolled cards, half strangers */
+    for (mask = 1; mask < 2 * n; mask <<= 1) {
+    }
+    slots = (cm_pair *)malloc(sizeof(cm_pair) * mask);
+    probes = (unsigned long *)malloc(sizeof(unsigned long) * CM_PROBES);
+    if (!slots || !probes) return 1;
+    for (i = 0; i < mask; i++) slots[i].uid = CARD_WITHDRAWN;
+    mask--;
+    for (i = 0; i < n; i++) {
+        for (k = (unsigned int)card_mix(cards[i]) & mask; slots[k].uid != CARD_WITHDRAWN; k = (k + 1) & mask) {
+        }
+        slots[k].card = cards[i];
+        slots[k].uid = uids[i];
+    }
+    for (i = 0; i < CM_PROBES; i++) {
+        probes[i] = i % 2 ? cards[sim_rng_below(&r, n)] : sim_rng_below(&r, 4000000000UL);
+    }
+    for (m = 0; m < 3; m++) {
+        t0 = bench_now_ns();
+        for (i = 0; i < CM_PROBES; i++) {
+            if (m == 0) v = card_mph_find(&h, probes[i]);
+            else if (m == 1) v = cm_bsearch(sorted, n, probes[i]);
+            else v = cm_probe_hash(slots, mask, probes[i]);
+            bench_sink += (unsigned long)v;
         }
+        ns[m] = (bench_now_ns() - t0) / CM_PROBES;
+    }
+    printf("\n%-14s %8s %10s %12s\n", "index", "ns/look", "reads", "RAM bytes");
+    printf("%-14s %8.1f %10.2f %12d\n", names[0], ns[0], 2.0 + (double)(h.m - h.n) / h.m, 0);
+    for (k = 1, v = 0; k < n; k <<= 1) v++;
+    printf("%-14s %8.1f %10d %12d\n", names[1], ns[1], v + 1, 0);
+    printf("%-14s %8.1f %10s %12lu\n", names[2], ns[2], "~1.5", (unsigned long)(mask + 1) * CM_TARGET_ENTRY);
+    printf("\nns on this host; reads and bytes as on the target. The overflow (%d cards, %d bytes of RAM) is scanned "
+           "before the index\n", CARD_OVERFLOW_MAX, CARD_OVERFLOW_MAX * CM_TARGET_ENTRY);
+    card_mph_free(&h);
+    free(cards);
+    free(uids);
+    free(sorted);
+    free(slots);
+    free(probes);
+    stub_quiet = 0;
+    return 0;
+}
 
-        delay_ms(500);
+/* ---- users: hot/cold user records vs one struct per user ---- */
+
+#define UR_SCANS 8
+#define UR_LINE 64
+
+/* every field of a user in one struct: the layout before the split */
+typedef struct {
+    unsigned long card;
+    unsigned char clearance;
+    unsigned char flags;
+    unsigned char schedule;
+    unsigned char spare;
+    char name[USER_NAME_LEN];
+    char department[USER_DEPT_LEN];
+    unsigned long valid_from;
+    unsigned long expires;
+    unsigned long last_seen;
+    unsigned short grants;
+    unsigned short denials;
+} ur_record;
+
+static int ur_admit_aos(const ur_record *t, int n, int uid, int clearance, unsigned long now_s) {
+    const ur_record *u;
+    if (uid < 0 || uid >= n) return USER_DENY_UNKNOWN;
+    u = &t[uid];
+    if (u->flags & USER_F_REVOKED) return USER_DENY_REVOKED;
+    if ((u->valid_from != 0 && now_s < u->valid_from) || (u->expires != 0 && now_s >= u->expires)) {
+        return USER_DENY_EXPIRED;
     }
+    if (u->clearance < clearance) return USER_DENY_CLEARANCE;
+    if (!((user_schedule_hours[u->schedule] >> (now_s / 3600UL % 24UL)) & 1UL)) return USER_DENY_SCHEDULE;
+    return USER_OK;
+}
 
-    /* unreachable */
-    return 0;
+static void ur_note_aos(ur_record *t, int uid, int granted, unsigned long now_s) {
+    t[uid].last_seen = now_s;
+    if (granted) t[uid].grants++;
+    else t[uid].denials++;
 }
 
-/* ========== helper functions ========== */
+static int ur_find_aos(const ur_record *t, int n, unsigned long card) {
+    int uid;
+    for (uid = 0; uid < n; uid++) {
+        if (t[uid].card == card) return uid;
+    }
+    return -1;
+}
 
-/* Read RFID framed packet and extract payload string */
-static int check_rfid_and_get_userid(char *card_buf) {
-    unsigned char raw[CARD_ID_LEN];
-    int rc;
-    int i, j;
+/* Cache lines a decision touches: bytes [0, span) of a record of size bytes, averaged over positions */
+static double ur_lines(unsigned long size, unsigned long span) {
+    unsigned long i, off, total;
+    total = 0;
+    for (i = 0; i < UR_LINE; i++) {
+        off = i * size;
+        total += (off + span - 1) / UR_LINE - off / UR_LINE + 1;
+    }
+    return (double)total / UR_LINE;
+}
 
-    rc = rfid_read_blocking(raw, CARD_ID_LEN, 20000);
-    if (rc != CARD_ID_LEN) return -1;
-    if (raw[0] != 0x02 || raw[CARD_ID_LEN - 1] != 0x03) return -1;
+/*
+ * users [-n users] [-l lookups] [-z zipf_s] [-s seed]
+ * Fills both layouts with the same synthetic staff (clearances, shift
+ * schedules, some revoked, some outside their validity window), checks
+ * that they decide alike, then times admission by user id (uniform and
+ * Zipf), admission plus the statistics update, a card scan and the
+ * expiry sweep.
+ */
+static int tool_users(int argc, char **argv) {
+    static const char *const depts[4] = { "Operations", "Research", "Facilities", "Security" };
+    static const char *const rows[5] = {
+        "admit, uniform ids", "admit, Zipf ids", "admit + statistics", "card scan, per scan", "expiry sweep"
+    };
+    ur_record *aos;
+    user_hot *hot;
+    user_cold *cold;
+    int *ids, *zids, *order;
+    unsigned long *scan;
+    unsigned long seed, lookups, now, i, start, until;
+    zipf_table z;
+    sim_rng r;
+    double zs, t0, ns[5][2];
+    long n;
+    int k, m, uid, a, b, j, tmp, fails;
+    char name[USER_NAME_LEN];
 
-    /* extract payload bytes 1 .. CARD_ID_LEN-2 */
-    j = 0;
-    for (i = 1; i < CARD_ID_LEN - 1 && j < CARD_ID_LEN - 2; i++, j++) {
-        card_buf[j] = (char)raw[i];
+    n = 1000000L;
+    lookups = 4000000UL;
+    zs = 1.0;
+    seed = 1;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-n") == 0) n = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-l") == 0) lookups = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-z") == 0) zs = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else break;
     }
-    card_buf[j] = '\0';
+    if (k != argc || n < 1000 || n > 4000000L || lookups < 1000 || zs <= 0.0) {
+        fprintf(stderr, "usage: users [-n users] [-l lookups] [-z zipf_s] [-s seed]\n");
+        return 2;
+    }
+    stub_quiet = 1;
+    aos = (ur_record *)malloc(sizeof(ur_record) * (size_t)n);
+    hot = (user_hot *)malloc(sizeof(user_hot) * (size_t)n);
+    cold = (user_cold *)malloc(sizeof(user_cold) * (size_t)n);
+    order = (int *)malloc(sizeof(int) * (size_t)n);
+    ids = (int *)malloc(sizeof(int) * lookups);
+    zids = (int *)malloc(sizeof(int) * lookups);
+    scan = (unsigned long *)malloc(sizeof(unsigned long) * UR_SCANS);
+    if (!aos || !hot || !cold || !order || !ids || !zids || !scan || zipf_init(&z, (int)n, zs) != 0) return 1;
+
+    /* staff: day shift, night shift or any hour; 2% revoked, 3% contractors with a validity window */
+    now = 1700000000UL;
+    user_set_schedule(1, 0x0FFF00UL);
+    user_set_schedule(2, 0xF000FFUL);
+    user_records_attach(hot, cold, (int)n);
+    memset(aos, 0, sizeof(ur_record) * (size_t)n);
+    sim_rng_seed(&r, seed);
+    for (uid = 0; uid < n; uid++) {
+        ur_record *u = &aos[uid];
+        u->card = (sim_rng_next(&r) << 1 | 1UL) & 0xFFFFFFFFUL;
+        u->clearance = (unsigned char)sim_rng_below(&r, 4);
+        u->schedule = (unsigned char)sim_rng_below(&r, 3);
+        u->flags = sim_rng_below(&r, 100) < 2 ? USER_F_REVOKED : 0;
+        sprintf(name, "User %d", uid);
+        strcpy(u->name, name);
+        strcpy(u->department, depts[uid % 4]);
+        if (sim_rng_below(&r, 100) < 3) {
+            start = now - 86400UL * (1 + sim_rng_below(&r, 60));
+            until = start + 86400UL * (1 + sim_rng_below(&r, 90));
+            u->valid_from = start;
+            u->expires = until;
+        }
+        user_set(uid, u->card, u->clearance, u->schedule);
+        user_set_name(uid, u->name, u->department);
+        user_revoke(uid, u->flags & USER_F_REVOKED);
+        user_set_validity(uid, u->valid_from, u->expires);
+        order[uid] = uid;
+    }
+    /* Zipf ranks land on scattered users, as badge frequency has nothing to do with enrollment order */
+    for (uid = (int)n - 1; uid > 0; uid--) {
+        j = (int)sim_rng_below(&r, (unsigned long)uid + 1);
+        tmp = order[uid];
+        order[uid] = order[j];
+        order[j] = tmp;
+    }
+    for (i = 0; i < lookups; i++) {
+        ids[i] = (int)sim_rng_below(&r, (unsigned long)n);
+        zids[i] = order[zipf_sample(&z, &r)];
+    }
+    for (k = 0; k < UR_SCANS; k++) scan[k] = aos[sim_rng_below(&r, (unsigned long)n)].card;
+
+    fails = 0;
+    for (i = 0; i < lookups; i += 97) {
+        a = ur_admit_aos(aos, (int)n, ids[i], 2, now + i);
+        b = user_admit(ids[i], 2, now + i);
+        if (a != b) fails++;
+    }
+    for (k = 0; k < UR_SCANS; k++) fails += ur_find_aos(aos, (int)n, scan[k]) != user_find_card(scan[k]);
+    printf("%ld users: one struct %lu bytes, hot %lu + cold %lu (on the target 8 + %lu); layouts agree: %s\n", n,
+           (unsigned long)sizeof(ur_record), (unsigned long)sizeof(user_hot), (unsigned long)sizeof(user_cold),
+           (unsigned long)(USER_NAME_LEN + USER_DEPT_LEN + 16), fails ? "NO" : "yes");
+    if (fails) return 1;
+
+    for (m = 0; m < 2; m++) {
+        user_sweep(now);
+        t0 = bench_now_ns();
+        for (i = 0; i < lookups; i++) {
+            bench_sink += (unsigned long)(m ? user_admit(ids[i], 2, now) : ur_admit_aos(aos, (int)n, ids[i], 2, now));
+        }
+        ns[0][m] = (bench_now_ns() - t0) / (double)lookups;
+        t0 = bench_now_ns();
+        for (i = 0; i < lookups; i++) {
+            bench_sink += (unsigned long)(m ? user_admit(zids[i], 2, now) : ur_admit_aos(aos, (int)n, zids[i], 2, now));
+        }
+        ns[1][m] = (bench_now_ns() - t0) / (double)lookups;
+        t0 = bench_now_ns();
+        for (i = 0; i < lookups; i++) {
+            if (m) {
+                a = user_admit(zids[i], 2, now);
+                user_note(zids[i], a == USER_OK, now);
+            } else {
+                a = ur_admit_aos(aos, (int)n, zids[i], 2, now);
+                ur_note_aos(aos, zids[i], a == USER_OK, now);
+            }
+        }
+        ns[2][m] = (bench_now_ns() - t0) / (double)lookups;
+        t0 = bench_now_ns();
+        for (k = 0; k < UR_SCANS; k++) {
+            bench_sink += (unsigned long)(m ? user_find_card(scan[k]) : ur_find_aos(aos, (int)n, scan[k]));
+        }
+        ns[3][m] = (bench_now_ns() - t0) / UR_SCANS;
+        t0 = bench_now_ns();
+        if (m) user_sweep(now);
+        ns[4][m] = m ? bench_now_ns() - t0 : -1.0;
+    }
+
+    printf("\n%-20s %12s %12s %8s\n", "", "one struct", "hot/cold", "ratio");
+    for (k = 0; k < 5; k++) {
+        const char *unit = k < 3 ? "ns" : "ms";
+        double scale = k < 3 ? 1.0 : 1e-6;
+        if (ns[k][0] < 0.0) {
+            printf("%-20s %12s %9.2f %s %8s\n", rows[k], "-", ns[k][1] * scale, unit, "-");
+            continue;
+        }
+        printf("%-20s %9.2f %s %9.2f %s %7.2fx\n", rows[k], ns[k][0] * scale, unit, ns[k][1] * scale, unit,
+               ns[k][0] / ns[k][1]);
+    }
+    printf("\ncache lines per admit: %.2f one struct, %.2f hot/cold; statistics add one cold line. The one-struct\n"
+           "layout checks validity inline; hot/cold sweeps only when a validity boundary passes\n",
+           ur_lines(sizeof(ur_record), (unsigned long)((char *)&aos[0].last_seen - (char *)aos)),
+           ur_lines(sizeof(user_hot), (unsigned long)((char *)&hot[0].gen - (char *)hot)));
+    user_records_attach(user_hot_store, user_cold_store, MAX_USERS);
+    free(z.cdf);
+    free(aos);
+    free(hot);
+    free(cold);
+    free(order);
+    free(ids);
+    free(zids);
+    free(scan);
+    stub_quiet = 0;
     return 0;
 }
 
-/* Verify password for user by reading EEPROM and comparing with keypad input */
-static int verify_password_for_user(unsigned char user_id) {
-    unsigned int eeprom_addr;
-    int res;
-    int k;
+/* ---- userdb: B+tree user directory, self-test and million-user benchmark ---- */
 
-    eeprom_addr = USER_SLOT_ADDR(user_id);
-    /* clear stored_password */
-    for (k = 0; k <= PASSWORD_MAX_LEN; k++) stored_password[k] = '\0';
+#define UDB_NOW 1700000000UL
+#define UDB_DAY 86400UL
+#define UDB_TEST_USERS 3000
+#define UDB_TEST_OPS 4000
+#define UDB_TEST_POOL 64
 
-    res = eeprom_read_bytes(eeprom_addr, (unsigned char *)stored_password, PASSWORD_MAX_LEN);
-    stored_password[PASSWORD_MAX_LEN] = '\0';
+static void udb_make(ud_user *u, unsigned long uid, unsigned long salt, sim_rng *r) {
+    static const char *const base[6] = { "Engineer", "Facility", "Finance", "Ops", "Research", "Security" };
+    int d;
+    memset(u, 0, sizeof(*u));
+    u->uid = uid;
+    u->card = card_mix((uid + salt) & 0xFFFFFFFFUL); /* a bijection, so cards stay unique */
+    sprintf(u->employee, "E%07lu", uid + 1);
+    sprintf(u->name, "User %lu", uid);
+    d = (int)sim_rng_below(r, 24);
+    sprintf(u->department, "%s-%c", base[d % 6], '1' + d / 6);
+    if (sim_rng_below(r, 4) == 0) u->expires = UDB_NOW - 30 * UDB_DAY + sim_rng_below(r, 395 * UDB_DAY);
+    u->clearance = (unsigned char)sim_rng_below(r, 4);
+    u->schedule = (unsigned char)sim_rng_below(r, 3);
+}
 
-    if (res != 0) {
-        lcd_puts("EEPROM Read Err");
-        delay_ms(1000);
-        return 0;
+static int udb_same(const ud_user *a, const ud_user *b) {
+    unsigned char x[UD_RECORD], y[UD_RECORD];
+    ud_pack(a, x);
+    ud_pack(b, y);
+    return memcmp(x, y, UD_RECORD) == 0;
+}
+
+/* Every user and every index of db against the shadow; returns the mismatches */
+static int udb_verify(ud_db *db, const ud_user *shadow, const unsigned char *present, int n) {
+    ud_user u;
+    long want, got;
+    int uid, fails, rc;
+
+    fails = 0;
+    want = 0;
+    for (uid = 0; uid < n; uid++) {
+        rc = ud_get(db, (unsigned long)uid, &u);
+        if (!present[uid]) {
+            fails += rc != UD_ERR_NOT_FOUND;
+            continue;
+        }
+        want++;
+        fails += rc != UD_OK || !udb_same(&u, &shadow[uid]);
+        fails += ud_find_card(db, shadow[uid].card, &u) != UD_OK || u.uid != (unsigned long)uid;
+        fails += ud_find_employee(db, shadow[uid].employee, &u) != UD_OK || u.uid != (unsigned long)uid;
+    }
+    fails += db->users != (unsigned long)want;
+    want = 0;
+    for (uid = 0; uid < n; uid++) {
+        want += present[uid] && shadow[uid].expires >= UDB_NOW && shadow[uid].expires < UDB_NOW + 30 * UDB_DAY;
     }
+    got = ud_scan_expiring(db, UDB_NOW, UDB_NOW + 30 * UDB_DAY, 0, 0);
+    fails += got != want;
+    want = 0;
+    for (uid = 0; uid < n; uid++) want += present[uid] && strcmp(shadow[uid].department, "Research-2") == 0;
+    fails += ud_scan_department(db, "Research-2", 0, 0) != want;
+    return fails;
+}
 
-    if ((unsigned char)stored_password[0] == 0xFF || stored_password[0] == '\0') {
-        lcd_puts("No Password Set\nContact Admin");
-        delay_ms(1500);
-        return 0;
+static void udb_unlink(const char *path) {
+    char j[512];
+    sprintf(j, "%.500s-journal", path);
+    unlink(path);
+    unlink(j);
+}
+
+static int udb_check(const char *what, int ok, int *fails) {
+    if (!ok) {
+        printf("self-test: %s FAILED\n", what);
+        (*fails)++;
     }
+    return ok;
+}
 
-    /* clear entered_password */
-    for (k = 0; k <= PASSWORD_MAX_LEN; k++) entered_password[k] = '\0';
+/*
+ * Bulk load, then random adds, changes, removals and duplicate cards
+ * against an in-memory shadow with a pool small enough to evict; a commit
+ * torn inside the journal and one cut off while writing pages home, each
+ * followed by a reopen; and a clean reopen.
+ */
+static int udb_selftest(const char *path, unsigned long seed) {
+    static ud_user shadow[UDB_TEST_USERS];
+    static unsigned char present[UDB_TEST_USERS];
+    ud_user u;
+    ud_db db;
+    sim_rng r;
+    int k, uid, other, rc, want, fails;
 
-    keypad_getstring_with_timeout(entered_password, PASSWORD_MAX_LEN, PASSWORD_ENTRY_TIMEOUT_MS);
+    fails = 0;
+    udb_unlink(path);
+    sim_rng_seed(&r, seed);
+    for (uid = 0; uid < UDB_TEST_USERS; uid++) udb_make(&shadow[uid], (unsigned long)uid, seed, &r);
+    memset(present, 0, sizeof(present));
+    for (uid = 0; uid < UDB_TEST_USERS * 2 / 3; uid++) present[uid] = 1;
+    if (!udb_check("open", ud_open(&db, path, UDB_TEST_POOL) == UD_OK, &fails)) return 1;
+    udb_check("bulk load", ud_bulk_load(&db, shadow, UDB_TEST_USERS * 2 / 3) == UD_OK, &fails);
+
+    for (k = 0; k < UDB_TEST_OPS && !fails; k++) {
+        uid = (int)sim_rng_below(&r, UDB_TEST_USERS);
+        switch (sim_rng_below(&r, 10)) {
+        case 0:
+        case 1:
+            rc = ud_remove(&db, (unsigned long)uid);
+            udb_check("remove", rc == (present[uid] ? UD_OK : UD_ERR_NOT_FOUND), &fails);
+            present[uid] = 0;
+            break;
+        case 2:
+            other = (int)sim_rng_below(&r, UDB_TEST_USERS);
+            if (!present[other] || other == uid) break;
+            u = shadow[uid];
+            u.card = shadow[other].card;
+            udb_check("duplicate card refused", ud_put(&db, &u) == UD_ERR_DUPLICATE, &fails);
+            break;
+        default:
+            /* add, or move to a new card, department and expiry */
+            udb_make(&u, (unsigned long)uid, seed + UDB_TEST_USERS * (unsigned long)(k + 1), &r);
+            if (present[uid]) strcpy(u.employee, shadow[uid].employee);
+            for (other = 0, want = UD_OK; other < UDB_TEST_USERS; other++) {
+                if (present[other] && other != uid && shadow[other].card == u.card) want = UD_ERR_DUPLICATE;
+            }
+            rc = ud_put(&db, &u);
+            udb_check("put", rc == want, &fails);
+            if (rc == UD_OK) {
+                shadow[uid] = u;
+                present[uid] = 1;
+            }
+        }
+    }
+    udb_check("indexes agree after updates", udb_verify(&db, shadow, present, UDB_TEST_USERS) == 0, &fails);
 
-    if (strncmp(entered_password, stored_password, PASSWORD_MAX_LEN) == 0) {
+    for (uid = 0; !present[uid]; uid++) {
+    }
+    udb_make(&u, (unsigned long)uid, seed + 0x55555555UL, &r);
+    strcpy(u.employee, shadow[uid].employee);
+    db.crash_torn = 1;
+    udb_check("torn commit fails", ud_put(&db, &u) != UD_OK, &fails);
+    ud_close(&db);
+    udb_check("reopen after torn journal", ud_open(&db, path, UDB_TEST_POOL) == UD_OK, &fails);
+    udb_check("torn change rolled back", udb_verify(&db, shadow, present, UDB_TEST_USERS) == 0, &fails);
+
+    db.crash_home = 2;
+    udb_check("cut-off commit fails", ud_put(&db, &u) != UD_OK, &fails);
+    ud_close(&db);
+    udb_check("reopen after cut-off commit", ud_open(&db, path, UDB_TEST_POOL) == UD_OK, &fails);
+    shadow[uid] = u;
+    udb_check("journal replayed", udb_verify(&db, shadow, present, UDB_TEST_USERS) == 0, &fails);
+
+    ud_close(&db);
+    udb_check("clean reopen", ud_open(&db, path, UDB_TEST_POOL) == UD_OK, &fails);
+    udb_check("state kept", udb_verify(&db, shadow, present, UDB_TEST_USERS) == 0, &fails);
+    ud_close(&db);
+    udb_unlink(path);
+    return fails;
+}
+
+/* Height, pages and prefix compression of one index, walking its leaves */
+static void udb_tree_stats(ud_db *db, int index, int *height, unsigned long *leaves, unsigned long *entries,
+                           unsigned long *stored, unsigned long *raw) {
+    const unsigned char *p, *c;
+    unsigned long page, next;
+    int f, i, n, plen;
+
+    *height = 1;
+    *leaves = *entries = *stored = *raw = 0;
+    for (page = db->root[index];; (*height)++) {
+        f = ud_pin(db, page, 0);
+        if (f < 0) return;
+        next = ud_get32(db->frames[f].data + 4);
+        n = db->frames[f].data[0];
+        ud_unpin(db, f, 0);
+        if (n == UD_LEAF) break;
+        page = next;
+    }
+    while (page != 0) {
+        f = ud_pin(db, page, 0);
+        if (f < 0) return;
+        p = db->frames[f].data;
+        n = UD_COUNT(p);
+        plen = UD_PLEN(p);
+        *stored += (unsigned long)plen;
+        for (i = 0; i < n; i++) {
+            c = UD_CELL(p, i);
+            *stored += c[0];
+            *raw += (unsigned long)(plen + c[0]);
+        }
+        *entries += (unsigned long)n;
+        (*leaves)++;
+        page = ud_get32(p + 4);
+        ud_unpin(db, f, 0);
+    }
+}
+
+static int udb_cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void udb_percentiles(double *ns, long n, double *p50, double *p99) {
+    qsort(ns, (size_t)n, sizeof(double), udb_cmp_double);
+    *p50 = ns[n / 2] / 1000.0;
+    *p99 = ns[n * 99 / 100] / 1000.0;
+}
+
+/*
+ * userdb [-n users] [-p pool_pages] [-q lookups] [-u updates] [-f path] [-s seed]
+ * Self-test, then bulk-loads n synthetic users (the file is removed at the
+ * end unless -f names it) and reports tree shape, warm point lookups by
+ * uid, card and employee number, the "expiring this week" and department
+ * range scans, and single-user update transactions.
+ */
+static int tool_userdb(int argc, char **argv) {
+    static const char *const kinds[3] = { "by uid", "by card", "by employee" };
+    static const char *const index_names[UD_INDEXES] = { "uid", "card", "employee", "department", "expiry" };
+    const char *path;
+    ud_user *users, u;
+    ud_db db;
+    sim_rng r;
+    double t0, t, *ns, p50, p99, mb;
+    unsigned long seed, leaves, entries, stored, raw, hits, misses, commits, journaled;
+    long n, q, updates, i, want, got;
+    int k, pool, height, keep, rc;
+
+    n = 1000000L;
+    pool = 32768;
+    q = 100000L;
+    updates = 2000L;
+    path = "/tmp/mlsas-users.db";
+    keep = 0;
+    seed = 1;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-n") == 0) n = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-p") == 0) pool = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-q") == 0) q = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-u") == 0) updates = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else if (strcmp(argv[k], "-f") == 0) {
+            path = argv[k + 1];
+            keep = 1;
+        } else break;
+    }
+    if (k != argc || n < 1000 || n > 20000000L || pool < 64 || q < 100 || updates < 0 || strlen(path) > 400) {
+        fprintf(stderr, "usage: userdb [-n users] [-p pool_pages] [-q lookups] [-u updates] [-f path] [-s seed]\n");
+        return 2;
+    }
+    stub_quiet = 1;
+    {
+        char tpath[512];
+        sprintf(tpath, "%s.test", path);
+        rc = udb_selftest(tpath, seed);
+        printf("self-test: %s\n", rc ? "FAILED" : "ok");
+        if (rc) return 1;
+    }
+
+    users = (ud_user *)malloc(sizeof(ud_user) * (size_t)n);
+    ns = (double *)malloc(sizeof(double) * (size_t)(q > updates ? q : updates));
+    if (!users || !ns) return 1;
+    sim_rng_seed(&r, seed);
+    for (i = 0; i < n; i++) udb_make(&users[i], (unsigned long)i, seed, &r);
+    udb_unlink(path);
+    if (ud_open(&db, path, pool) != UD_OK) {
+        fprintf(stderr, "userdb: cannot create %s\n", path);
         return 1;
-    } else {
-        return 0;
     }
+    t0 = bench_now_ns();
+    rc = ud_bulk_load(&db, users, n);
+    t = (bench_now_ns() - t0) / 1e9;
+    if (rc != UD_OK) {
+        fprintf(stderr, "userdb: bulk load failed (%d)\n", rc);
+        return 1;
+    }
+    mb = (double)db.pages * UD_PAGE / 1048576.0;
+    printf("bulk load of %ld users: %.2f s (sorted per index, built bottom-up), %lu pages, %.1f MB\n\n", n, t,
+           db.pages, mb);
+    printf("%-11s %6s %8s %8s %14s\n", "index", "height", "leaves", "per leaf", "key bytes kept");
+    for (k = 0; k < UD_INDEXES; k++) {
+        udb_tree_stats(&db, k, &height, &leaves, &entries, &stored, &raw);
+        printf("%-11s %6d %8lu %8.0f %13.0f%%\n", index_names[k], height, leaves, (double)entries / leaves,
+               100.0 * stored / raw);
+    }
+
+    /* warm the pool with one pass, then time each lookup */
+    printf("\npool %d pages (%.1f MB)\n%-12s %9s %9s %9s\n", pool, pool * (double)UD_PAGE / 1048576.0, "lookup",
+           "p50 us", "p99 us", "pool hit");
+    for (k = 0; k < 3; k++) {
+        long *ids = (long *)malloc(sizeof(long) * (size_t)q);
+        if (!ids) return 1;
+        for (i = 0; i < q; i++) ids[i] = (long)sim_rng_below(&r, (unsigned long)n);
+        for (i = 0; i < q; i++) {
+            if (k == 0) rc = ud_get(&db, (unsigned long)ids[i], &u);
+            else if (k == 1) rc = ud_find_card(&db, users[ids[i]].card, &u);
+            else rc = ud_find_employee(&db, users[ids[i]].employee, &u);
+        }
+        hits = db.hits;
+        misses = db.misses;
+        for (i = 0; i < q; i++) {
+            t0 = bench_now_ns();
+            if (k == 0) rc = ud_get(&db, (unsigned long)ids[i], &u);
+            else if (k == 1) rc = ud_find_card(&db, users[ids[i]].card, &u);
+            else rc = ud_find_employee(&db, users[ids[i]].employee, &u);
+            ns[i] = bench_now_ns() - t0;
+            if (rc != UD_OK || u.uid != (unsigned long)ids[i]) {
+                fprintf(stderr, "userdb: lookup %s of user %ld failed\n", kinds[k], ids[i]);
+                return 1;
+            }
+        }
+        hits = db.hits - hits;
+        misses = db.misses - misses;
+        udb_percentiles(ns, q, &p50, &p99);
+        printf("%-12s %9.2f %9.2f %8.1f%%\n", kinds[k], p50, p99, 100.0 * hits / (hits + misses));
+        free(ids);
+    }
+
+    want = 0;
+    for (i = 0; i < n; i++) want += users[i].expires >= UDB_NOW && users[i].expires < UDB_NOW + 7 * UDB_DAY;
+    t0 = bench_now_ns();
+    got = ud_scan_expiring(&db, UDB_NOW, UDB_NOW + 7 * UDB_DAY, 0, 0);
+    t = (bench_now_ns() - t0) / 1e6;
+    printf("\nexpiring this week: %ld users in %.2f ms (%s)\n", got, t, got == want ? "matches a full scan" : "WRONG");
+    want = 0;
+    for (i = 0; i < n; i++) want += strcmp(users[i].department, "Research-2") == 0;
+    t0 = bench_now_ns();
+    got = ud_scan_department(&db, "Research-2", 0, 0);
+    t = (bench_now_ns() - t0) / 1e6;
+    printf("department Research-2: %ld users in %.2f ms (%s)\n", got, t, got == want ? "matches a full scan" : "WRONG");
+
+    commits = db.commits;
+    journaled = db.journal_pages;
+    for (i = 0; i < updates; i++) {
+        long uid = (long)sim_rng_below(&r, (unsigned long)n);
+        udb_make(&u, (unsigned long)uid, seed + (unsigned long)n * (unsigned long)(i + 1), &r);
+        strcpy(u.employee, users[uid].employee);
+        t0 = bench_now_ns();
+        rc = ud_put(&db, &u);
+        ns[i] = bench_now_ns() - t0;
+        if (rc != UD_OK) {
+            fprintf(stderr, "userdb: update of user %ld failed (%d)\n", uid, rc);
+            return 1;
+        }
+        users[uid] = u;
+    }
+    if (updates > 0) {
+        udb_percentiles(ns, updates, &p50, &p99);
+        printf("%ld updates (card, department, expiry; one fsync'd transaction each): p50 %.0f us, p99 %.0f us, "
+               "%.1f pages journaled per update\n", updates, p50, p99,
+               (double)(db.journal_pages - journaled) / (double)(db.commits - commits));
+    }
+    ud_close(&db);
+    if (!keep) udb_unlink(path);
+    free(users);
+    free(ns);
+    stub_quiet = 0;
+    return 0;
 }
 
-/* Fingerprint search wrapper */
-static int do_fingerprint_search(unsigned char *matched_id) {
-    int res;
-    res = fp_search();
-    if (res >= 0) {
-        *matched_id = (unsigned char)res;
+/* ---- doorsets: compressed per-door user sets vs dense bitsets ---- */
+
+#define DS_DEPTS 100
+#define DS_SITES 4
+#define DS_ROLES 60
+#define DS_TRAINING 10          /* roles 0..9: certifications held by a good share of staff */
+#define DS_SECURITY 10          /* role 10: guards, allowed everywhere */
+#define DS_CLEANERS 11
+#define DS_TRAINED 40           /* derived: department members holding a certification */
+#define DS_G_ALL 0
+#define DS_G_SITE 1
+#define DS_G_DEPT (DS_G_SITE + DS_SITES)
+#define DS_G_ROLE (DS_G_DEPT + DS_DEPTS)
+#define DS_G_TRAINED (DS_G_ROLE + DS_ROLES)
+#define DS_GROUPS (DS_G_TRAINED + DS_TRAINED)
+#define DS_ADMIT_MAX 5
+
+typedef struct {
+    int n;
+    int admit[DS_ADMIT_MAX];    /* groups whose union the door admits */
+    int dept;                   /* department whose staff badge here most, or -1 */
+} ds_door;
+
+/* u joins group grp, in the dense copy too when there is one */
+static void ds_member(rb_set *g, unsigned long *dense, long words, int grp, unsigned long u) {
+    rb_add(&g[grp], u);
+    if (dense) dense[grp * words + (long)(u / RB_WORD_BITS)] |= 1UL << (u % RB_WORD_BITS);
+}
+
+static long ds_dense_count(const unsigned long *d, long words) {
+    long i, n;
+    for (n = 0, i = 0; i < words; i++) n += rb_popcount(d[i]);
+    return n;
+}
+
+/*
+ * The site: user ids are handed out in onboarding cohorts of 20-2000 to
+ * one department at a time, 4% of ids belong to people who have left,
+ * departments sit at one of four sites (10% of staff work at another).
+ * Groups are all staff, site staff, departments, and roles: ten
+ * certifications held by 20-50% of staff, security, cleaning, and fifty
+ * small scattered roles. Derived groups intersect a department with a
+ * certification (a lab's trained staff).
+ */
+static void ds_site(sim_rng *r, long n, rb_set *g, unsigned long *dense, long words, unsigned char *dept,
+                    double *role_p) {
+    unsigned long u;
+    long left;
+    int d, k, site;
+
+    d = 0;
+    left = 0;
+    for (k = 0; k < DS_ROLES; k++) {
+        if (k < DS_TRAINING) role_p[k] = 0.2 + 0.3 * sim_rng_uniform(r);
+        else if (k == DS_SECURITY) role_p[k] = 0.0005;
+        else if (k == DS_CLEANERS) role_p[k] = 0.003;
+        else role_p[k] = (50.0 * pow(100.0, sim_rng_uniform(r))) / (double)n;
+    }
+    for (u = 0; u < (unsigned long)n; u++) {
+        if (left == 0) {
+            d = (int)sim_rng_below(r, DS_DEPTS);
+            left = 20 + (long)sim_rng_below(r, 1981);
+        }
+        left--;
+        dept[u] = (unsigned char)d;
+        if (sim_rng_below(r, 100) < 4) continue;
+        site = sim_rng_below(r, 10) == 0 ? (int)sim_rng_below(r, DS_SITES) : d % DS_SITES;
+        ds_member(g, dense, words, DS_G_ALL, u);
+        ds_member(g, dense, words, DS_G_SITE + site, u);
+        ds_member(g, dense, words, DS_G_DEPT + d, u);
+        for (k = 0; k < DS_ROLES; k++) {
+            if (sim_rng_uniform(r) < role_p[k]) ds_member(g, dense, words, DS_G_ROLE + k, u);
+        }
+    }
+}
+
+/*
+ * Doors: 5% site entrances (site staff, security), 55% department floors
+ * (one to three departments, cleaners, security), 30% labs (the trained
+ * staff of one department, security) and 10% restricted rooms (one or
+ * two small roles).
+ */
+static void ds_doors(sim_rng *r, ds_door *door, int doors, int *trained_dept) {
+    int i, k;
+    for (i = 0; i < doors; i++) {
+        ds_door *d = &door[i];
+        k = (int)(i * 100L / doors);
+        d->n = 0;
+        d->dept = -1;
+        if (k < 5) {
+            d->admit[d->n++] = DS_G_SITE + i % DS_SITES;
+            d->admit[d->n++] = DS_G_ROLE + DS_SECURITY;
+        } else if (k < 60) {
+            d->dept = (int)sim_rng_below(r, DS_DEPTS);
+            d->admit[d->n++] = DS_G_DEPT + d->dept;
+            for (k = (int)sim_rng_below(r, 3); k > 0; k--) d->admit[d->n++] = DS_G_DEPT + (int)sim_rng_below(r, DS_DEPTS);
+            d->admit[d->n++] = DS_G_ROLE + DS_CLEANERS;
+            d->admit[d->n++] = DS_G_ROLE + DS_SECURITY;
+        } else if (k < 90) {
+            k = (int)sim_rng_below(r, DS_TRAINED);
+            d->dept = trained_dept[k];
+            d->admit[d->n++] = DS_G_TRAINED + k;
+            d->admit[d->n++] = DS_G_ROLE + DS_SECURITY;
+        } else {
+            d->admit[d->n++] = DS_G_ROLE + 12 + (int)sim_rng_below(r, DS_ROLES - 12);
+            if (sim_rng_below(r, 2)) d->admit[d->n++] = DS_G_ROLE + 12 + (int)sim_rng_below(r, DS_ROLES - 12);
+        }
+    }
+}
+
+/*
+ * doorsets [-n users] [-d doors] [-q checks] [-p pairs] [-s seed]
+ * Builds a synthetic site, resolves every door's set from its groups as
+ * compressed bitmaps and as dense bitsets, and compares memory, the time
+ * to resolve, a badge check (uniform pairs and badge traffic: Zipf users
+ * mostly at their department's doors) and door-pair intersections and
+ * unions. Every check and every door's member count is compared between
+ * the two.
+ */
+static int tool_doorsets(int argc, char **argv) {
+    static const char *const type_names[4] = { "", "array", "bitmap", "run" };
+    rb_set *g, *dset, tmp;
+    unsigned long *dense, *ddoor, *uid, seed, rb_bytes_total, grp_bytes, x, y, chain;
+    unsigned char *dept;
+    ds_door *door;
+    int *dq, *dept_doors, *dept_ndoors, trained_dept[DS_TRAINED], types[4];
+    double role_p[DS_ROLES], t0, t_rb, t_dense, ns_rb[2], ns_dense[2], and_rb, and_dense, or_rb, or_dense;
+    long n, words, q, pairs, i, j, wrong, a, b, card;
+    int doors, k, m;
+    zipf_table zu, zd;
+    sim_rng r;
+
+    n = 1000000L;
+    doors = 1000;
+    q = 1000000L;
+    pairs = 2000;
+    seed = 1;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-n") == 0) n = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-d") == 0) doors = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-q") == 0) q = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-p") == 0) pairs = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else break;
+    }
+    if (k != argc || n < 10000 || n > 16000000L || doors < 20 || doors > 100000 || q < 1000 || pairs < 10) {
+        fprintf(stderr, "usage: doorsets [-n users] [-d doors] [-q checks] [-p pairs] [-s seed]\n");
+        return 2;
+    }
+    words = (n + RB_WORD_BITS - 1) / RB_WORD_BITS;
+    g = (rb_set *)malloc(sizeof(rb_set) * DS_GROUPS);
+    dset = (rb_set *)malloc(sizeof(rb_set) * (size_t)doors);
+    dense = (unsigned long *)calloc((size_t)(DS_GROUPS * words), sizeof(unsigned long));
+    ddoor = (unsigned long *)calloc((size_t)((long)doors * words), sizeof(unsigned long));
+    dept = (unsigned char *)malloc((size_t)n);
+    door = (ds_door *)malloc(sizeof(ds_door) * (size_t)doors);
+    uid = (unsigned long *)malloc(sizeof(unsigned long) * (size_t)q);
+    dq = (int *)malloc(sizeof(int) * (size_t)q);
+    dept_doors = (int *)malloc(sizeof(int) * (size_t)doors);
+    dept_ndoors = (int *)calloc(DS_DEPTS + 1, sizeof(int));
+    if (!g || !dset || !dense || !ddoor || !dept || !door || !uid || !dq || !dept_doors || !dept_ndoors) {
+        fprintf(stderr, "doorsets: out of memory\n");
         return 1;
     }
+    stub_quiet = 1;
+    sim_rng_seed(&r, seed);
+    for (k = 0; k < DS_GROUPS; k++) rb_init(&g[k]);
+    ds_site(&r, n, g, dense, words, dept, role_p);
+    for (k = 0; k < DS_G_TRAINED; k++) rb_optimize(&g[k]);
+    for (k = 0; k < DS_TRAINED; k++) trained_dept[k] = (int)sim_rng_below(&r, DS_DEPTS);
+    ds_doors(&r, door, doors, trained_dept);
+
+    /* resolution: trained groups by intersection, then each door's union */
+    t0 = bench_now_ns();
+    for (k = 0; k < DS_TRAINED; k++) {
+        rb_init(&g[DS_G_TRAINED + k]);
+        if (rb_and(&g[DS_G_TRAINED + k], &g[DS_G_DEPT + trained_dept[k]], &g[DS_G_ROLE + k % DS_TRAINING]) != 0 ||
+            rb_optimize(&g[DS_G_TRAINED + k]) != 0) {
+            fprintf(stderr, "doorsets: out of memory\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < doors; i++) {
+        if (acl_resolve(&dset[i], g, door[i].admit, door[i].n) != 0) {
+            fprintf(stderr, "doorsets: out of memory\n");
+            return 1;
+        }
+    }
+    t_rb = (bench_now_ns() - t0) / 1e6;
+    t0 = bench_now_ns();
+    for (k = 0; k < DS_TRAINED; k++) {
+        unsigned long *o = dense + (long)(DS_G_TRAINED + k) * words;
+        const unsigned long *p1 = dense + (long)(DS_G_DEPT + trained_dept[k]) * words;
+        const unsigned long *p2 = dense + (long)(DS_G_ROLE + k % DS_TRAINING) * words;
+        for (j = 0; j < words; j++) o[j] = p1[j] & p2[j];
+    }
+    for (i = 0; i < doors; i++) {
+        unsigned long *o = ddoor + i * words;
+        for (m = 0; m < door[i].n; m++) {
+            const unsigned long *p1 = dense + (long)door[i].admit[m] * words;
+            for (j = 0; j < words; j++) o[j] |= p1[j];
+        }
+    }
+    t_dense = (bench_now_ns() - t0) / 1e6;
+
+    wrong = 0;
+    rb_bytes_total = grp_bytes = 0;
+    types[1] = types[2] = types[3] = 0;
+    for (i = 0; i < doors; i++) {
+        rb_bytes_total += rb_bytes(&dset[i]);
+        for (m = 0; m < dset[i].n; m++) types[dset[i].c[m].type]++;
+        wrong += rb_cardinality(&dset[i]) != ds_dense_count(ddoor + i * words, words);
+    }
+    for (k = 0; k < DS_GROUPS; k++) grp_bytes += rb_bytes(&g[k]);
+    printf("site: %ld users, %d departments, %d sites, %d groups (%d roles, %d trained-in-department), %d doors\n\n",
+           n, DS_DEPTS, DS_SITES, DS_GROUPS, DS_ROLES, DS_TRAINED, doors);
+    printf("%-12s %12s %10s %12s %12s\n", "door sets", "total", "per door", "groups", "resolve ms");
+    printf("%-12s %10.1f MB %7.1f KB %9.1f MB %12.1f\n", "dense", (double)doors * words * sizeof(unsigned long) / 1e6,
+           (double)words * sizeof(unsigned long) / 1e3, (double)DS_GROUPS * words * sizeof(unsigned long) / 1e6, t_dense);
+    printf("%-12s %10.1f MB %7.1f KB %9.1f MB %12.1f\n", "compressed", rb_bytes_total / 1e6,
+           rb_bytes_total / 1e3 / doors, grp_bytes / 1e6, t_rb);
+    printf("containers:");
+    for (k = 1; k <= 3; k++) printf(" %s %d", type_names[k], types[k]);
+    printf("\n\n");
+
+    /* checks: uniform pairs, then badge traffic */
+    if (zipf_init(&zu, (int)n, 0.9) != 0 || zipf_init(&zd, doors, 0.9) != 0) return 1;
+    for (i = 0; i < doors; i++) {
+        if (door[i].dept >= 0) dept_ndoors[door[i].dept + 1]++;
+    }
+    for (k = 0; k < DS_DEPTS; k++) dept_ndoors[k + 1] += dept_ndoors[k];
+    for (i = 0; i < doors; i++) {
+        if (door[i].dept >= 0) dept_doors[dept_ndoors[door[i].dept]++] = (int)i;
+    }
+    for (k = DS_DEPTS; k > 0; k--) dept_ndoors[k] = dept_ndoors[k - 1];
+    dept_ndoors[0] = 0;
+    /* each check waits for the previous answer, as at a door; chain is 0 but opaque to the compiler */
+    chain = bench_sink == 12345UL;
+    printf("%-12s %14s %14s\n", "check ns", "uniform", "badge traffic");
+    for (m = 0; m < 2; m++) {
+        for (i = 0; i < q; i++) {
+            if (m == 0) {
+                uid[i] = sim_rng_below(&r, (unsigned long)n);
+                dq[i] = (int)sim_rng_below(&r, (unsigned long)doors);
+                continue;
+            }
+            /* Zipf ranks scattered over the ids: popular people are not all early hires */
+            uid[i] = (unsigned long)zipf_sample(&zu, &r) * 2654435761UL % (unsigned long)n;
+            k = dept[uid[i]];
+            a = dept_ndoors[k + 1] - dept_ndoors[k];
+            dq[i] = a > 0 && sim_rng_below(&r, 10) < 8 ? dept_doors[dept_ndoors[k] + (long)sim_rng_below(&r, (unsigned long)a)]
+                                                        : zipf_sample(&zd, &r);
+        }
+        for (i = 0; i < q; i++) {
+            wrong += rb_contains(&dset[dq[i]], uid[i]) !=
+                     (int)((ddoor[dq[i] * words + (long)(uid[i] / RB_WORD_BITS)] >> (uid[i] % RB_WORD_BITS)) & 1UL);
+        }
+        x = 0;
+        t0 = bench_now_ns();
+        for (i = 0; i < q; i++) {
+            y = uid[i] ^ (x & chain);
+            x = (ddoor[dq[i] * words + (long)(y / RB_WORD_BITS)] >> (y % RB_WORD_BITS)) & 1UL;
+        }
+        ns_dense[m] = (bench_now_ns() - t0) / (double)q;
+        bench_sink += x;
+        x = 0;
+        t0 = bench_now_ns();
+        for (i = 0; i < q; i++) x = (unsigned long)rb_contains(&dset[dq[i]], uid[i] ^ (x & chain));
+        ns_rb[m] = (bench_now_ns() - t0) / (double)q;
+        bench_sink += x;
+    }
+    printf("%-12s %14.1f %14.1f\n", "dense", ns_dense[0], ns_dense[1]);
+    printf("%-12s %14.1f %14.1f\n\n", "compressed", ns_rb[0], ns_rb[1]);
+
+    /* "who can open both" and "who can open either" for random door pairs */
+    and_rb = and_dense = or_rb = or_dense = 0.0;
+    for (i = 0; i < pairs; i++) {
+        a = (long)sim_rng_below(&r, (unsigned long)doors);
+        b = (long)sim_rng_below(&r, (unsigned long)doors);
+        for (m = 0; m < 2; m++) {
+            rb_init(&tmp);
+            t0 = bench_now_ns();
+            if ((m ? rb_or(&tmp, &dset[a], &dset[b]) : rb_and(&tmp, &dset[a], &dset[b])) != 0) return 1;
+            card = rb_cardinality(&tmp);
+            if (m) or_rb += bench_now_ns() - t0;
+            else and_rb += bench_now_ns() - t0;
+            rb_free(&tmp);
+            t0 = bench_now_ns();
+            x = 0;
+            for (j = 0; j < words; j++) {
+                x += (unsigned long)rb_popcount(m ? ddoor[a * words + j] | ddoor[b * words + j]
+                                                  : ddoor[a * words + j] & ddoor[b * words + j]);
+            }
+            if (m) or_dense += bench_now_ns() - t0;
+            else and_dense += bench_now_ns() - t0;
+            wrong += (unsigned long)card != x;
+        }
+    }
+    printf("%-12s %14s %14s\n", "door pair us", "both (and)", "either (or)");
+    printf("%-12s %14.1f %14.1f\n", "dense", and_dense / 1e3 / pairs, or_dense / 1e3 / pairs);
+    printf("%-12s %14.1f %14.1f\n", "compressed", and_rb / 1e3 / pairs, or_rb / 1e3 / pairs);
+    printf("\nagreement: %s\n", wrong ? "MISMATCH between compressed and dense sets" :
+           "every check, door count and pair count matches the dense sets");
+
+    for (i = 0; i < doors; i++) rb_free(&dset[i]);
+    for (k = 0; k < DS_GROUPS; k++) rb_free(&g[k]);
+    free(zu.cdf);
+    free(zd.cdf);
+    free(g);
+    free(dset);
+    free(dense);
+    free(ddoor);
+    free(dept);
+    free(door);
+    free(uid);
+    free(dq);
+    free(dept_doors);
+    free(dept_ndoors);
+    stub_quiet = 0;
+    return wrong ? 1 : 0;
+}
+
+
+/* ---- decisions: per-door decision cache vs full evaluation ---- */
+
+#define DE_EPOCH 1767571200UL   /* Monday 5 January 2026, 00:00 UTC */
+#define DE_DENY_GROUP (-6)      /* none of the door's groups holds the user */
+#define DE_PRESENT 0
+#define DE_REVOKE 1             /* a user's revocation is toggled */
+#define DE_JOIN 2               /* a user joins a small role */
+#define DE_VALIDITY 3           /* a user's pass now ends at a later midnight */
+#define DE_DOOR 4               /* a door's clearance changes */
+#define DE_SCHEDULE 5           /* office hours are edited, once a day */
+#define DE_KINDS 6
+#define DE_SIZES 3
+
+typedef struct {
+    unsigned long now;
+    long uid;
+    int door;
+    unsigned char kind;
+    unsigned char arg;
+} de_event;
+
+typedef struct {
+    rb_set g[DS_GROUPS];
+    ds_door *door;
+    unsigned char *clearance;   /* per door */
+    user_hot *hot;
+    user_cold *cold;
+    long evals;
+    double extra_ns;            /* added to every evaluation */
+} de_site;
+
+/* Full evaluation: the user's record, then the door's groups */
+static int de_eval(void *arg, int door, int uid, unsigned long now_s) {
+    de_site *s = (de_site *)arg;
+    const ds_door *d = &s->door[door];
+    double t0;
+    int r, k;
+    s->evals++;
+    if (s->extra_ns > 0.0) {
+        for (t0 = bench_now_ns(); bench_now_ns() - t0 < s->extra_ns;) {
+        }
+    }
+    r = user_admit(uid, s->clearance[door], now_s);
+    if (r != USER_OK) return r;
+    for (k = 0; k < d->n; k++) {
+        if (rb_contains(&s->g[d->admit[k]], (unsigned long)uid)) return USER_OK;
+    }
+    return DE_DENY_GROUP;
+}
+
+static unsigned long de_office(int late) {
+    return ((1UL << (20 + late)) - 1UL) & ~((1UL << (6 + late)) - 1UL);
+}
+
+/*
+ * The doorsets site, plus user records: clearance 0-3 (most 0), office
+ * hours (60%), nights (10%) or any time, and 5% contractors whose passes
+ * expire at a midnight during the week (passes always end at midnight,
+ * so user_sweep runs over the big table once a day). Doors need clearance 0, labs 1, restricted 2.
+ */
+static int de_build(de_site *s, unsigned long seed, long n, int doors, unsigned char *dept) {
+    double role_p[DS_ROLES];
+    int trained_dept[DS_TRAINED];
+    unsigned long x, y;
+    sim_rng r;
+    long u;
+    int k;
+
+    sim_rng_seed(&r, seed);
+    for (k = 0; k < DS_GROUPS; k++) rb_init(&s->g[k]);
+    ds_site(&r, n, s->g, 0, 0, dept, role_p);
+    for (k = 0; k < DS_TRAINED; k++) trained_dept[k] = (int)sim_rng_below(&r, DS_DEPTS);
+    ds_doors(&r, s->door, doors, trained_dept);
+    for (k = 0; k < DS_TRAINED; k++) {
+        rb_set *t = &s->g[DS_G_TRAINED + k];
+        if (rb_and(t, &s->g[DS_G_DEPT + trained_dept[k]], &s->g[DS_G_ROLE + k % DS_TRAINING]) != 0) return -1;
+    }
+    for (k = 0; k < DS_GROUPS; k++) {
+        if (rb_optimize(&s->g[k]) != 0) return -1;
+    }
+    for (k = 0; k < doors; k++) {
+        x = (unsigned long)(k * 100L / doors);
+        s->clearance[k] = (unsigned char)(x < 60 ? 0 : x < 90 ? 1 : 2);
+    }
+    user_records_attach(s->hot, s->cold, (int)n);
+    user_set_schedule(1, de_office(0));
+    user_set_schedule(2, 0xFFFFFFUL & ~de_office(0));
+    for (u = 0; u < n; u++) {
+        x = sim_rng_below(&r, 100);
+        y = sim_rng_below(&r, 10);
+        user_set((int)u, (unsigned long)u + 1000UL, x < 60 ? 0 : x < 85 ? 1 : x < 95 ? 2 : 3,
+                 y < 6 ? 1 : y < 7 ? 2 : 0);
+        if (sim_rng_below(&r, 20) == 0) user_set_validity((int)u, 0, DE_EPOCH + 86400UL * (1 + sim_rng_below(&r, 7)));
+    }
+    s->evals = 0;
     return 0;
 }
 
-/* Motor open/close sequence */
-static void door_open_sequence(void) {
-    motor_open();
-    delay_ms(3000);
-    motor_close();
-    lcd_puts("Door Closed");
+static void de_drop(de_site *s) {
+    int k;
+    for (k = 0; k < DS_GROUPS; k++) rb_free(&s->g[k]);
+}
+
+/* Run the events, deciding through c or by full evaluation; ns taken */
+static double de_replay(de_site *s, const de_event *ev, long m, dc_cache *c, signed char *out) {
+    const de_event *e;
+    double t0;
+    long i;
+
+    t0 = bench_now_ns();
+    for (i = 0; i < m; i++) {
+        e = &ev[i];
+        switch (e->kind) {
+        case DE_PRESENT:
+            out[i] = (signed char)(c ? dc_decide(c, e->door, (int)e->uid, e->now, de_eval, s)
+                                     : de_eval(s, e->door, (int)e->uid, e->now));
+            break;
+        case DE_REVOKE:
+            user_revoke((int)e->uid, !(s->hot[e->uid].flags & USER_F_REVOKED));
+            break;
+        case DE_JOIN:
+            ds_member(s->g, 0, 0, DS_G_ROLE + e->arg, (unsigned long)e->uid);
+            user_touch((int)e->uid);
+            break;
+        case DE_VALIDITY:
+            user_set_validity((int)e->uid, 0, (e->now / 86400UL + 1 + e->arg) * 86400UL);
+            break;
+        case DE_DOOR:
+            s->clearance[e->door] = e->arg;
+            if (c) dc_door_changed(c, e->door);
+            break;
+        default:
+            user_set_schedule(1, de_office(e->arg));
+            break;
+        }
+    }
+    return bench_now_ns() - t0;
+}
+
+/*
+ * decisions [-n users] [-d doors] [-e presentations] [-H hours] [-c changes_per_hour] [-r repeat_pct]
+ *           [-x extra_eval_ns] [-s seed]
+ * Badge traffic over the doorsets site for a week: weekday arrival,
+ * lunch and departure peaks, Zipf users badging mostly at their own door,
+ * repeat_pct of badges the same card at the same door minutes after an
+ * earlier one, and admin changes through the day. Every decision is made
+ * by full evaluation, then again through per-door caches of three sizes.
+ * Reports ns per decision, hit rate, entries found stale, the time saved
+ * and the evaluation cost above which the cache pays, and checks that
+ * every cached decision matches full evaluation. extra_eval_ns models a
+ * dearer evaluation, such as reading the user from the directory.
+ */
+static int tool_decisions(int argc, char **argv) {
+    static const double shape[24] = { 1, 1, 1, 1, 1, 2, 6, 20, 30, 18, 10, 10,
+                                      18, 16, 10, 10, 12, 20, 10, 4, 2, 2, 1, 1 };
+    static const int sizes[DE_SIZES] = { 16, 64, 256 };
+    static const char *const kind_names[DE_KINDS] = { "", "revocations", "joins", "validity", "door", "schedule" };
+    de_site s;
+    de_event *ev;
+    char label[32];
+    dc_cache c;
+    signed char *want, *got;
+    unsigned char *dept;
+    int *dept_doors, *dept_ndoors;
+    double t_eval, t, t_hit, hit_rate, total_w, hw;
+    unsigned long seed, now;
+    long n, events, m, cap, i, cnt, per_hour, kinds[DE_KINDS], wrong, presented, a, *recent, nrecent, fresh, repeat;
+    int doors, hours, h, k, z;
+    zipf_table zu, zd;
+    sim_rng r;
+
+    n = 1000000L;
+    doors = 1000;
+    events = 2000000L;
+    hours = 168;
+    per_hour = 20;
+    repeat = 30;
+    s.extra_ns = 0.0;
+    seed = 1;
+    for (k = 0; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "-n") == 0) n = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-d") == 0) doors = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-e") == 0) events = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-H") == 0) hours = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "-c") == 0) per_hour = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-r") == 0) repeat = atol(argv[k + 1]);
+        else if (strcmp(argv[k], "-x") == 0) s.extra_ns = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "-s") == 0) seed = strtoul(argv[k + 1], 0, 10);
+        else break;
+    }
+    if (k != argc || n < 10000 || n > 4000000L || doors < 20 || doors > 100000 || events < 1000 || hours < 1 ||
+        hours > 24 * 366 || per_hour < 0 || per_hour > 100000L || repeat < 0 || repeat > 100 || s.extra_ns < 0.0) {
+        fprintf(stderr, "usage: decisions [-n users] [-d doors] [-e presentations] [-H hours] [-c changes_per_hour] "
+                        "[-r repeat_pct] [-x extra_eval_ns] [-s seed]\n");
+        return 2;
+    }
+    cap = events + (long)hours * (per_hour + 2) + 16;
+    /* repeats come from about the last ten minutes of fresh badges at the average rate */
+    nrecent = events / hours / 6 > 16 ? events / hours / 6 : 16;
+    recent = (long *)malloc(sizeof(long) * (size_t)nrecent);
+    ev = (de_event *)malloc(sizeof(de_event) * (size_t)cap);
+    want = (signed char *)malloc((size_t)cap);
+    got = (signed char *)malloc((size_t)cap);
+    dept = (unsigned char *)malloc((size_t)n);
+    s.door = (ds_door *)malloc(sizeof(ds_door) * (size_t)doors);
+    s.clearance = (unsigned char *)malloc((size_t)doors);
+    s.hot = (user_hot *)malloc(sizeof(user_hot) * (size_t)n);
+    s.cold = (user_cold *)malloc(sizeof(user_cold) * (size_t)n);
+    dept_doors = (int *)malloc(sizeof(int) * (size_t)doors);
+    dept_ndoors = (int *)calloc(DS_DEPTS + 1, sizeof(int));
+    if (!ev || !recent || !want || !got || !dept || !s.door || !s.clearance || !s.hot || !s.cold || !dept_doors ||
+        !dept_ndoors || zipf_init(&zu, (int)n, 0.9) != 0 || zipf_init(&zd, doors, 0.9) != 0) {
+        fprintf(stderr, "decisions: out of memory\n");
+        return 1;
+    }
+    stub_quiet = 1;
+    if (de_build(&s, seed, n, doors, dept) != 0) {
+        fprintf(stderr, "decisions: out of memory\n");
+        return 1;
+    }
+
+    /* doors by the department whose staff use them */
+    for (i = 0; i < doors; i++) {
+        if (s.door[i].dept >= 0) dept_ndoors[s.door[i].dept + 1]++;
+    }
+    for (k = 0; k < DS_DEPTS; k++) dept_ndoors[k + 1] += dept_ndoors[k];
+    for (i = 0; i < doors; i++) {
+        if (s.door[i].dept >= 0) dept_doors[dept_ndoors[s.door[i].dept]++] = (int)i;
+    }
+    for (k = DS_DEPTS; k > 0; k--) dept_ndoors[k] = dept_ndoors[k - 1];
+    dept_ndoors[0] = 0;
+
+    /* the week's events, in time order */
+    sim_rng_seed(&r, seed + 1);
+    total_w = 0.0;
+    for (h = 0; h < hours; h++) total_w += shape[h % 24] * (h / 24 % 7 < 5 ? 1.0 : 0.1);
+    memset(kinds, 0, sizeof(kinds));
+    m = 0;
+    presented = fresh = 0;
+    for (h = 0; h < hours; h++) {
+        hw = shape[h % 24] * (h / 24 % 7 < 5 ? 1.0 : 0.1);
+        cnt = (long)(events * hw / total_w) + per_hour;
+        for (i = 0; i < cnt && m < cap; i++) {
+            de_event *e = &ev[m++];
+            now = DE_EPOCH + (unsigned long)h * 3600UL + (unsigned long)(i * 3600L / cnt);
+            e->now = now;
+            e->arg = 0;
+            /* Zipf ranks scattered over the ids, as in doorsets */
+            e->uid = (long)((unsigned long)zipf_sample(&zu, &r) * 2654435761UL % (unsigned long)n);
+            e->door = zipf_sample(&zd, &r);
+            if (h % 24 == 5 && i == 0) {
+                e->kind = DE_SCHEDULE;
+                e->arg = (unsigned char)(h / 24 % 2);
+            } else if ((long)sim_rng_below(&r, (unsigned long)cnt) < per_hour) {
+                /* admin changes land on any user */
+                e->uid = (long)sim_rng_below(&r, (unsigned long)n);
+                a = (long)sim_rng_below(&r, 100);
+                e->kind = a < 35 ? DE_REVOKE : a < 65 ? DE_JOIN : a < 85 ? DE_VALIDITY : DE_DOOR;
+                if (e->kind == DE_JOIN) {
+                    e->arg = (unsigned char)(DS_CLEANERS + sim_rng_below(&r, DS_ROLES - DS_CLEANERS));
+                }
+                else if (e->kind == DE_VALIDITY) e->arg = (unsigned char)sim_rng_below(&r, 7);
+                else if (e->kind == DE_DOOR) e->arg = (unsigned char)sim_rng_below(&r, 3);
+            } else if (fresh >= nrecent && (long)sim_rng_below(&r, 100) < repeat) {
+                /* back through the same door minutes later */
+                a = recent[sim_rng_below(&r, (unsigned long)nrecent)];
+                e->kind = DE_PRESENT;
+                e->uid = ev[a].uid;
+                e->door = ev[a].door;
+                presented++;
+            } else {
+                /* most badges are at the user's own door, some at another of the department's */
+                e->kind = DE_PRESENT;
+                recent[fresh++ % nrecent] = m - 1;
+                k = dept[e->uid];
+                a = dept_ndoors[k + 1] - dept_ndoors[k];
+                z = (int)sim_rng_below(&r, 10);
+                if (a > 0 && z < 7) {
+                    e->door = dept_doors[dept_ndoors[k] + (long)(card_mix((unsigned long)e->uid) % (unsigned long)a)];
+                } else if (a > 0 && z < 9) {
+                    e->door = dept_doors[dept_ndoors[k] + (long)sim_rng_below(&r, (unsigned long)a)];
+                }
+                presented++;
+            }
+            kinds[e->kind]++;
+        }
+    }
+
+    t_eval = de_replay(&s, ev, m, 0, want);
+    printf("site: %ld users, %d doors, %ld presentations and %ld changes over %d hours\n(", n, doors, presented,
+           m - presented, hours);
+    for (k = 1; k < DE_KINDS; k++) printf("%s%s %ld", k > 1 ? ", " : "", kind_names[k], kinds[k]);
+    printf(")\n\n%-16s %12s %12s %9s %9s %9s\n", "decided by", "ns/decision", "evaluations", "hit rate", "stale",
+           "saved");
+    printf("%-16s %12.1f %12ld %9s %9s %9s\n", "full evaluation", t_eval / presented, s.evals, "-", "-", "-");
+    wrong = 0;
+    for (z = 0; z < DE_SIZES; z++) {
+        de_drop(&s);
+        if (de_build(&s, seed, n, doors, dept) != 0 || dc_init(&c, doors, sizes[z]) != 0) {
+            fprintf(stderr, "decisions: out of memory\n");
+            return 1;
+        }
+        t = de_replay(&s, ev, m, &c, got);
+        for (i = 0; i < m; i++) wrong += ev[i].kind == DE_PRESENT && got[i] != want[i];
+        sprintf(label, "cache %d/door", c.sets * DC_WAYS);
+        hit_rate = (double)c.hits / (double)(c.hits + c.misses);
+        printf("%-16s %12.1f %12ld %8.1f%% %9lu %8.1f%%\n", label, t / presented, s.evals, 100.0 * hit_rate, c.stale,
+               100.0 * (1.0 - t / t_eval));
+        dc_free(&c);
+    }
+    /*
+     * A cached decision costs a lookup plus an evaluation on a miss, so
+     * the largest cache's row gives the lookup, and the cache pays once an
+     * evaluation costs more than the lookup over the hit rate.
+     */
+    t_hit = t / presented - (1.0 - hit_rate) * t_eval / presented;
+    printf("\nlookup about %.0f ns against %.0f ns per evaluation: at a %.1f%% hit rate the cache pays once an\n"
+           "evaluation costs more than about %.0f ns (-x adds evaluation time, e.g. a user directory read)\n",
+           t_hit, t_eval / presented, 100.0 * hit_rate, t_hit / hit_rate);
+    printf("\nagreement: %s\n", wrong ? "MISMATCH between cached and evaluated decisions" :
+           "every cached decision matches full evaluation");
+
+    de_drop(&s);
+    user_records_attach(user_hot_store, user_cold_store, MAX_USERS);
+    free(zu.cdf);
+    free(zd.cdf);
+    free(ev);
+    free(recent);
+    free(want);
+    free(got);
+    free(dept);
+    free(s.door);
+    free(s.clearance);
+    free(s.hot);
+    free(s.cold);
+    free(dept_doors);
+    free(dept_ndoors);
+    stub_quiet = 0;
+    return wrong ? 1 : 0;
+}
+
+typedef struct {
+    const char *name;
+    int (*fn)(int argc, char **argv);
+    const char *help;
+} host_tool;
+
+static const host_tool host_tools[] = {
+    { "run", tool_run, "interactive door controller simulation" },
+    { "bench", tool_bench, "[-r reps] [-f filter] [-o out.json] [-p]  microbenchmarks as JSON" },
+    { "bench-compare", tool_bench_compare, "base.json new.json [threshold_pct]  flag regressions" },
+    { "workload", tool_workload, "[-s seed] [-H hours] [-o trace | -x] ...  badge traffic generator" },
+    { "fpgallery", tool_fpgallery, "[-s seed] [-n fingers] [-p probes] -o file  synthetic templates" },
+    { "fpeval", tool_fpeval, "[-s seed] [-n fingers] ...  FMR/FNMR, EER and 1:N throughput" },
+    { "fpcache", tool_fpcache, "[-s seed] [-n events]  sensor slot cache hit rates on generated traffic" },
+    { "factors", tool_factors, "[-s seed] [-H hours]  time to decision, PIN then finger vs concurrent" },
+    { "wiegand", tool_wiegand, "[-r readers] [-n frames] [-g glitch]  multi-reader edge streams through the decoder" },
+    { "fpzone", tool_fpzone, "[-s seed] [-n fingers] [-z zones]  zone-scoped vs whole-gallery 1:N search" },
+    { "fpdist", tool_fpdist, "[-n fingers] [-N max_nodes] [-x straggle]  sharded search on localhost nodes" },
+    { "fpstream", tool_fpstream, "[-s seed] [-b baud] [-k cpu_scale]  streamed vs batch minutiae extraction" },
+    { "osdp", tool_osdp, "[-r max_readers] [-b baud] [-d seconds]  card latency on an emulated RS-485 reader bus" },
+    { "aes", tool_aes, "[-i 0|1] [-c cycles_per_pass] [-m mhz]  AES/secure channel self-test and cost per frame" },
+    { "tokens", tool_tokens, "[-n tokens] [-u users] [-p presentations] [-g user] [-k]  signed tokens, batch checks, cache" },
+    { "mgmt", tool_mgmt, "[-n records] [-b baud] [-k 0|1]  management protocol self-test and records/s over UART" },
+    { "fwupdate", tool_fwupdate, "[-s seed] [-b baud] [-d duty] [-f functions]  delta firmware update into A/B banks" },
+    { "ustore", tool_ustore, "[-s seed] [-H hours] [-n users] [-u batches_per_h] [-b users]  user table in flash, IAP scheduling" },
+    { "storage", tool_storage, "[-n reads] [-b bursts] [-e users] [-a records] [-f file]  workloads on every storage backend" },
+    { "cardmph", tool_cardmph, "[-i cards.txt | -u users] [-o card_mph.h] [-n cards]  offline card index and lookups" },
+    { "users", tool_users, "[-n users] [-l lookups] [-z zipf_s]  hot/cold user records vs one struct per user" },
+    { "userdb", tool_userdb, "[-n users] [-p pool_pages] [-f path]  B+tree user directory with secondary indexes" },
+    { "doorsets", tool_doorsets, "[-n users] [-d doors] [-q checks]  compressed per-door user sets vs dense bitsets" },
+    { "decisions", tool_decisions, "[-n users] [-d doors] [-e presentations] [-c changes_per_h]  per-door decision cache" }
+};
+#define HOST_TOOL_COUNT ((int)(sizeof(host_tools) / sizeof(host_tools[0])))
+
+int main(int argc, char **argv) {
+    int i;
+    if (argc >= 2) {
+        for (i = 0; i < HOST_TOOL_COUNT; i++) {
+            if (strcmp(argv[1], host_tools[i].name) == 0) return host_tools[i].fn(argc - 2, argv + 2);
+        }
+    }
+    fprintf(stderr, "usage: %s <command> [args]\n", argc > 0 ? argv[0] : "mlsas");
+    for (i = 0; i < HOST_TOOL_COUNT; i++) fprintf(stderr, "  %-14s %s\n", host_tools[i].name, host_tools[i].help);
+    return 2;
 }
+#endif
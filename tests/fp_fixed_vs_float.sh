@@ -0,0 +1,26 @@
+#!/bin/sh
+# The FPU-free matcher must keep agreeing with the float reference:
+# fpeval exits 1 once identical scores, mean |diff| or decision flips
+# leave the tolerance in FPEVAL_MIN_SAME_PCT / FPEVAL_MAX_*.
+#   sh tests/fp_fixed_vs_float.sh [cc]
+CC=${1:-gcc}
+SRC="$(dirname "$0")/../multi_level_security_access_system.c"
+TMP=${TMPDIR:-/tmp}/mlsas_fp_fixed.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' 0
+
+if ! $CC -std=c89 -pedantic -Wall -Werror -O2 -DHOST_TOOLS -o "$TMP/mlsas" "$SRC" -lm; then
+    echo "FAIL build"
+    exit 1
+fi
+fail=0
+for seed in 1 2 3; do
+    if "$TMP/mlsas" fpeval -s $seed -n 500 -p 1 -i 1 -q 0 > "$TMP/out.txt"; then
+        echo "ok   seed $seed: $(grep '^fixed vs float' "$TMP/out.txt" | cut -d, -f1-4)"
+    else
+        echo "FAIL seed $seed"
+        grep '^fixed vs float' "$TMP/out.txt"
+        fail=1
+    fi
+done
+exit $fail
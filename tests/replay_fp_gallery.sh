@@ -0,0 +1,36 @@
+#!/bin/sh
+# Replay a provisioned user through every fingerprint build: the finger
+# enrolled at provisioning must open the door on the first touch, and an
+# unreadable finger must be refused three times.
+#   sh tests/replay_fp_gallery.sh [cc]
+CC=${1:-gcc}
+SRC="$(dirname "$0")/../multi_level_security_access_system.c"
+TMP=${TMPDIR:-/tmp}/mlsas_replay_fp.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' 0
+
+cat > "$TMP/trace.txt" <<EOF
+P 7 4711
+E 0 0 00000007 1 4711 1 1
+E 5000 0 00000007 1 4711 3 0 0 0
+EOF
+
+fail=0
+for flags in "" "-DFP_CONTROLLER_MATCH" "-DFP_SLOT_CACHE" "-DDOOR_POLICY=1 -DFP_CONTROLLER_MATCH"; do
+    # shellcheck disable=SC2086
+    if ! $CC -std=c89 -pedantic -Wall -Werror $flags -o "$TMP/door" "$SRC"; then
+        echo "FAIL build ${flags:-default}"
+        fail=1
+        continue
+    fi
+    MLSAS_REPLAY="$TMP/trace.txt" "$TMP/door" > "$TMP/out.txt" 2>&1
+    opened=$(grep -c 'Opening Door' "$TMP/out.txt")
+    fails=$(grep -c 'Fingerprint Fail' "$TMP/out.txt")
+    if [ "$opened" -eq 1 ] && [ "$fails" -eq 2 ]; then
+        echo "ok   ${flags:-default}"
+    else
+        echo "FAIL ${flags:-default}: $opened opened, $fails fingerprint fails (want 1, 2)"
+        fail=1
+    fi
+done
+exit $fail